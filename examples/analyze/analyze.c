@@ -0,0 +1,311 @@
+/*
+MIT License
+
+Copyright (c) 2023-2026 erysdren (it/its)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <qcvm/qcvm.h>
+
+/*
+ *
+ * utilities
+ *
+ */
+
+#define TEST_BIT(m, i) (((m)[(i) / 32] >> ((i) % 32)) & 1)
+
+/* print qcvm error and exit */
+static void die(int r)
+{
+	fprintf(stderr, "qcvm: \"%s\"\n", qcvm_result_string(r));
+	exit(EXIT_FAILURE);
+}
+
+/* load an entire file into memory */
+static void *load_file(const char *filename, size_t *sz)
+{
+	void *buffer;
+	size_t filesize;
+	FILE *file;
+
+	file = fopen(filename, "rb");
+	if (!file) return NULL;
+	fseek(file, 0L, SEEK_END);
+	filesize = ftell(file);
+	fseek(file, 0L, SEEK_SET);
+	buffer = calloc(1, filesize);
+	fread(buffer, 1, filesize, file);
+	fclose(file);
+
+	if (sz) *sz = filesize;
+
+	return buffer;
+}
+
+/* realloc() with free() folded in */
+static void *alloc(qcvm_t *qcvm, void *ptr, size_t size, void *user)
+{
+	(void)qcvm;
+	(void)user;
+
+	if (!size)
+	{
+		free(ptr);
+		return NULL;
+	}
+
+	return realloc(ptr, size);
+}
+
+static const char *lookup(qcvm_t *qcvm, int32_t ofs)
+{
+	const char *s;
+
+	if (qcvm_get_string(qcvm, ofs, &s, NULL) != QCVM_OK || !s || !*s)
+		return "?";
+
+	return s;
+}
+
+static const char *function_name(qcvm_t *qcvm, uint32_t function)
+{
+	return lookup(qcvm, qcvm->functions[function].ofs_name);
+}
+
+/* name of the global def covering ofs */
+static const char *global_name(qcvm_t *qcvm, uint32_t ofs)
+{
+	size_t i, n;
+
+	for (i = 0; i < qcvm->num_global_vars; i++)
+	{
+		n = (qcvm->global_vars[i].type & 0x7fff) == QCVM_TYPE_VECTOR ? 3 : 1;
+		if (ofs >= qcvm->global_vars[i].ofs && ofs < qcvm->global_vars[i].ofs + n)
+			return lookup(qcvm, qcvm->global_vars[i].name);
+	}
+
+	return "?";
+}
+
+/* whether a global belongs to some function's frame */
+static int is_local(qcvm_t *qcvm, uint32_t ofs)
+{
+	size_t i;
+
+	for (i = 1; i < qcvm->num_functions; i++)
+		if (qcvm->functions[i].first_statement > 0 && ofs >= (uint32_t)qcvm->functions[i].first_parm && ofs < (uint32_t)(qcvm->functions[i].first_parm + qcvm->functions[i].num_locals))
+			return 1;
+
+	return 0;
+}
+
+static const char *reasons[] = {
+	"safe",
+	"touches the fields of an entity other than self",
+	"stores through a pointer that may not point into self",
+	"writes a global other thinks can see",
+	"changes self",
+	"calls a function through a variable",
+	"calls a builtin that isn't thread-safe",
+	"uses a state function",
+	"calls an unsafe function",
+	"has code that couldn't be followed"
+};
+
+/* the dummy all builtins point at, since nothing is run */
+static int vm_builtin(qcvm_t *qcvm, void *user)
+{
+	(void)qcvm;
+	(void)user;
+	return QCVM_OK;
+}
+
+/* one entry per builtin the progs declares, named after it */
+static struct qcvm_builtin *make_builtins(qcvm_t *qcvm, int argc, char **argv, size_t *num_builtins)
+{
+	struct qcvm_builtin *builtins;
+	size_t i, n, max = 0;
+	int a;
+
+	for (i = 1; i < qcvm->num_functions; i++)
+		if (qcvm->functions[i].first_statement < 0 && (size_t)-qcvm->functions[i].first_statement > max)
+			max = (size_t)-qcvm->functions[i].first_statement;
+
+	n = max;
+	for (i = 1; i < qcvm->num_functions; i++)
+		if (qcvm->functions[i].first_statement == 0)
+			n++;
+
+	if ((builtins = calloc(n + 1, sizeof(struct qcvm_builtin))) == NULL)
+		return NULL;
+
+	for (i = 0; i < n; i++)
+	{
+		builtins[i].name = "";
+		builtins[i].func = vm_builtin;
+	}
+
+	n = max;
+	for (i = 1; i < qcvm->num_functions; i++)
+	{
+		if (qcvm->functions[i].first_statement < 0)
+			builtins[-qcvm->functions[i].first_statement - 1].name = function_name(qcvm, i);
+		else if (qcvm->functions[i].first_statement == 0)
+			builtins[n++].name = function_name(qcvm, i);
+	}
+
+	/* the ones named on the command line are taken as thread-safe */
+	for (i = 0; i < n; i++)
+		for (a = 2; a < argc; a++)
+			if (strcmp(builtins[i].name, argv[a]) == 0)
+				builtins[i].flags |= QCVM_BUILTIN_THREAD_SAFE;
+
+	*num_builtins = n;
+
+	return builtins;
+}
+
+/* print why a function is unsafe, following calls down to the cause */
+static void explain(qcvm_t *qcvm, uint32_t function)
+{
+	uint32_t statement, callee, depth;
+	int reason, r;
+
+	for (depth = 0; depth < 64; depth++)
+	{
+		if ((r = qcvm_query_function_safety(qcvm, function, &reason, &statement, &callee)) != QCVM_OK)
+			die(r);
+
+		if (reason != QCVM_UNSAFE_CALL)
+			break;
+
+		printf("  calls %s at statement %u\n", function_name(qcvm, callee), statement);
+		function = callee;
+	}
+
+	if (reason == QCVM_UNSAFE_BUILTIN)
+		printf("  %s: calls builtin %s, which isn't marked thread-safe, at statement %u\n", function_name(qcvm, function), function_name(qcvm, callee), statement);
+	else
+		printf("  %s: %s at statement %u\n", function_name(qcvm, function), reasons[reason], statement);
+}
+
+/*
+ *
+ * main
+ *
+ */
+
+int main(int argc, char **argv)
+{
+	qcvm_t *qcvm;
+	struct qcvm_builtin *builtins;
+	const uint32_t *writes, *calls;
+	size_t entity_size, num_builtins, num_safe, num_functions;
+	uint32_t i, j;
+	int r, reason;
+
+	if (argc < 2)
+	{
+		fprintf(stderr, "usage: %s progs.dat [thread-safe builtin...]\n", argv[0]);
+		return 1;
+	}
+
+	qcvm = calloc(1, sizeof(qcvm_t));
+	if (!qcvm)
+		return 1;
+
+	/* load progs */
+	qcvm->progs = load_file(argv[1], &qcvm->len_progs);
+	if (!qcvm->progs)
+	{
+		fprintf(stderr, "can't read %s\n", argv[1]);
+		return 1;
+	}
+
+	qcvm->alloc_callback = alloc;
+
+	/* one entity is enough, nothing runs */
+	qcvm_query_entity_info(qcvm, NULL, &entity_size);
+	qcvm->entities = calloc(1, entity_size);
+	qcvm->len_entities = entity_size;
+
+	if ((r = qcvm_init(qcvm)) != QCVM_OK)
+		die(r);
+
+	/* builtins can only be named once the progs is loaded */
+	if ((builtins = make_builtins(qcvm, argc, argv, &num_builtins)) == NULL)
+		return 1;
+
+	qcvm->builtins = builtins;
+	qcvm->num_builtins = num_builtins;
+
+	if ((r = qcvm_analyze_functions(qcvm)) != QCVM_OK)
+		die(r);
+
+	num_safe = num_functions = 0;
+	for (i = 1; i < qcvm->num_functions; i++)
+	{
+		if (qcvm->functions[i].first_statement < 1)
+			continue;
+
+		if ((r = qcvm_query_function_safety(qcvm, i, &reason, NULL, NULL)) != QCVM_OK)
+			die(r);
+		if ((r = qcvm_query_function_access(qcvm, i, NULL, &writes, &calls)) != QCVM_OK)
+			die(r);
+
+		num_functions++;
+
+		if (reason == QCVM_SAFE)
+		{
+			num_safe++;
+			printf("%s: safe\n", function_name(qcvm, i));
+		}
+		else
+		{
+			printf("%s: unsafe\n", function_name(qcvm, i));
+			explain(qcvm, i);
+		}
+
+		/* named globals it can write, leaving out parms, locals and temporaries */
+		for (j = 28; j < qcvm->num_globals; j++)
+			if (TEST_BIT(writes, j) && !is_local(qcvm, j) && strcmp(global_name(qcvm, j), "?") != 0)
+				printf("  writes %s\n", global_name(qcvm, j));
+
+		for (j = 1; j < qcvm->num_functions; j++)
+			if (TEST_BIT(calls, j) && qcvm->functions[j].first_statement < 1)
+				printf("  can call builtin %s\n", function_name(qcvm, j));
+	}
+
+	printf("%zu of %zu functions are safe to run in parallel\n", num_safe, num_functions);
+
+	/* free data */
+	qcvm_shutdown(qcvm);
+	free(builtins);
+	free(qcvm->entities);
+	free(qcvm->progs);
+	free(qcvm);
+
+	return 0;
+}
@@ -24,6 +24,8 @@ SOFTWARE.
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
 
 #include <qcvm/qcvm.h>
 
@@ -64,6 +66,21 @@ static void *load_file(const char *filename, size_t *sz)
 	return buffer;
 }
 
+/* realloc() with free() folded in */
+static void *alloc(qcvm_t *qcvm, void *ptr, size_t size, void *user)
+{
+	UNUSED(qcvm);
+	UNUSED(user);
+
+	if (!size)
+	{
+		free(ptr);
+		return NULL;
+	}
+
+	return realloc(ptr, size);
+}
+
 /*
  *
  * builtins
@@ -91,6 +108,7 @@ static int vm_printf(qcvm_t *qcvm, void *user)
 	float f;
 	float v[3];
 	const char *s;
+	size_t len;
 
 	if ((r = qcvm_query_argument_count(qcvm, &argc)) != QCVM_OK)
 		return r;
@@ -119,8 +137,8 @@ static int vm_printf(qcvm_t *qcvm, void *user)
 
 			/* string */
 			case 's':
-				qcvm_get_argument_string(qcvm, arg, &s);
-				fprintf(stdout, "%s", s);
+				qcvm_get_argument_string_len(qcvm, arg, &s, &len);
+				fwrite(s, 1, len, stdout);
 				arg++;
 				break;
 
@@ -152,29 +170,54 @@ static int vm_printf(qcvm_t *qcvm, void *user)
 	return QCVM_OK;
 }
 
-static int vm_sprintf(qcvm_t *qcvm, void *user)
+/* append formatted text to a reserved tempstring, clamping at the end */
+static char *append(char *bufptr, char *bufend, const char *fmt, ...)
 {
-	static char buffer[1024];
-	char *bufptr = buffer;
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(bufptr, bufend - bufptr + 1, fmt, ap);
+	va_end(ap);
+
+	if (n < 0)
+		return bufptr;
+
+	return n < bufend - bufptr ? bufptr + n : bufend;
+}
+
+/* a fast builtin, reading its arguments straight from the call */
+static int vm_sprintf(qcvm_t *qcvm, const struct qcvm_builtin_call *call, void *user)
+{
+	const size_t max_len = 1023;
+	char *buffer, *bufptr, *bufend;
 	const char *fmt;
+	const union qcvm_eval *parm;
 	char c;
 	int r;
-	int argc, arg;
-	int i;
-	float f;
-	float v[3];
+	int arg;
 	const char *s;
+	size_t len;
 
-	if ((r = qcvm_query_argument_count(qcvm, &argc)) != QCVM_OK)
+	UNUSED(user);
+
+	if (call->argc < 1)
+		return QCVM_ARGUMENT_OUT_OF_RANGE;
+
+	if ((r = qcvm_get_string(qcvm, call->parms[0].s, &fmt, NULL)) != QCVM_OK)
 		return r;
 
-	if ((r = qcvm_get_argument_string(qcvm, 0, &fmt)) != QCVM_OK)
+	/* format straight into tempstrings storage */
+	if ((r = qcvm_reserve_tempstring(qcvm, max_len, &buffer)) != QCVM_OK)
 		return r;
 
+	bufptr = buffer;
+	bufend = buffer + max_len;
+
 	arg = 1;
-	while ((c = *fmt++))
+	while ((c = *fmt++) && bufptr < bufend)
 	{
-		if (arg > argc)
+		if (arg > call->argc)
 			break;
 
 		if (c != '%')
@@ -183,6 +226,8 @@ static int vm_sprintf(qcvm_t *qcvm, void *user)
 			continue;
 		}
 
+		parm = &call->parms[arg];
+
 		switch ((c = *fmt++))
 		{
 			/* % */
@@ -192,45 +237,42 @@ static int vm_sprintf(qcvm_t *qcvm, void *user)
 
 			/* string */
 			case 's':
-				qcvm_get_argument_string(qcvm, arg, &s);
-				bufptr += sprintf(bufptr, "%s", s);
+				if ((r = qcvm_get_string(qcvm, parm->s, &s, &len)) != QCVM_OK)
+					return r;
+				if (len > (size_t)(bufend - bufptr))
+					len = bufend - bufptr;
+				memcpy(bufptr, s, len);
+				bufptr += len;
 				arg++;
 				break;
 
 			/* int */
 			case 'd':
-				qcvm_get_argument_int(qcvm, arg, &i);
-				bufptr += sprintf(bufptr, "%d", i);
+				bufptr = append(bufptr, bufend, "%d", parm->i);
 				arg++;
 				break;
 
 			/* float */
 			case 'f':
-				qcvm_get_argument_float(qcvm, arg, &f);
-				bufptr += sprintf(bufptr, "%g", f);
+				bufptr = append(bufptr, bufend, "%g", parm->f);
 				arg++;
 				break;
 
 			/* vector */
 			case 'v':
-				qcvm_get_argument_vector(qcvm, arg, &v[0], &v[1], &v[2]);
-				bufptr += sprintf(bufptr, "%g %g %g", v[0], v[1], v[2]);
+				bufptr = append(bufptr, bufend, "%g %g %g", parm->v[0], parm->v[1], parm->v[2]);
 				arg++;
 				break;
 		}
 	}
 
-	*bufptr++ = '\0';
-
-	qcvm_return_string(qcvm, buffer);
-
-	return QCVM_OK;
+	return qcvm_commit_tempstring(qcvm, bufptr - buffer);
 }
 
 struct qcvm_builtin builtins[] = {
-	{"spawn", vm_spawn, NULL},
-	{"printf", vm_printf, NULL},
-	{"sprintf", vm_sprintf, NULL}
+	{"spawn", vm_spawn, NULL, 0, NULL},
+	{"printf", vm_printf, NULL, 0, NULL},
+	{"sprintf", NULL, NULL, 0, vm_sprintf}
 };
 
 /*
@@ -242,6 +284,7 @@ struct qcvm_builtin builtins[] = {
 int main(int argc, char **argv)
 {
 	qcvm_t *qcvm;
+	size_t used, capacity;
 	int r;
 
 	UNUSED(argc);
@@ -258,9 +301,10 @@ int main(int argc, char **argv)
 	qcvm->num_builtins = ASIZE(builtins);
 	qcvm->builtins = builtins;
 
-	/* setup tempstrings buffer */
+	/* setup tempstrings buffer, more blocks are chained on through alloc */
 	qcvm->tempstrings = calloc(1, 1024);
 	qcvm->len_tempstrings = 1024;
+	qcvm->alloc_callback = alloc;
 
 	/* setup entities buffer */
 	qcvm_query_entity_info(qcvm, &entity_fields, &entity_size);
@@ -275,7 +319,13 @@ int main(int argc, char **argv)
 	if ((r = qcvm_run(qcvm, "main")) != QCVM_OK)
 		die(r);
 
+	/* sprintf reserves more than the first block holds, so blocks were chained on */
+	if ((r = qcvm_query_tempstrings_info(qcvm, &used, NULL, &capacity)) != QCVM_OK)
+		die(r);
+	printf("TEMPSTRINGS: used=%zu capacity=%zu\n", used, capacity);
+
 	/* free data */
+	qcvm_shutdown(qcvm);
 	free(qcvm->entities);
 	free(qcvm->tempstrings);
 	free(qcvm->progs);
@@ -81,11 +81,12 @@ static int _print(qcvm_t *qcvm, void *user)
 	for (i = 0; i < argc; i++)
 	{
 		const char *s = NULL;
+		size_t len = 0;
 
-		if ((r = qcvm_get_argument_string(qcvm, i, &s)) != QCVM_OK)
+		if ((r = qcvm_get_argument_string_len(qcvm, i, &s, &len)) != QCVM_OK)
 			return r;
 
-		fputs(s, stdout);
+		fwrite(s, 1, len, stdout);
 	}
 
 	fflush(stdout);
@@ -94,7 +95,7 @@ static int _print(qcvm_t *qcvm, void *user)
 }
 
 struct qcvm_builtin builtins[] = {
-	{"print", _print, NULL}
+	{"print", _print, NULL, 0, NULL}
 };
 
 /*
@@ -159,6 +160,7 @@ int main(int argc, char **argv)
 	printf("SIEVE: num_primes=%f start=%f end=%f elapsed=%f\n", num_primes, start, end, elapsed);
 
 	/* free data */
+	qcvm_shutdown(qcvm);
 	free(qcvm->entities);
 	free(qcvm->tempstrings);
 	free(qcvm->progs);
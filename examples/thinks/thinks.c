@@ -0,0 +1,271 @@
+/*
+MIT License
+
+Copyright (c) 2023-2026 erysdren (it/its)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <qcvm/qcvm.h>
+
+/*
+ *
+ * utilities
+ *
+ */
+
+#define MAX_WORKERS (64)
+#define NUM_ENTITIES (8192)
+#define NUM_ROUNDS (16)
+
+/* print qcvm error and exit */
+static void die(int r)
+{
+	fprintf(stderr, "qcvm: \"%s\"\n", qcvm_result_string(r));
+	exit(EXIT_FAILURE);
+}
+
+/* load an entire file into memory */
+static void *load_file(const char *filename, size_t *sz)
+{
+	void *buffer;
+	size_t filesize;
+	FILE *file;
+
+	file = fopen(filename, "rb");
+	if (!file) return NULL;
+	fseek(file, 0L, SEEK_END);
+	filesize = ftell(file);
+	fseek(file, 0L, SEEK_SET);
+	buffer = calloc(1, filesize);
+	fread(buffer, 1, filesize, file);
+	fclose(file);
+
+	if (sz) *sz = filesize;
+
+	return buffer;
+}
+
+/* realloc() with free() folded in */
+static void *alloc(qcvm_t *qcvm, void *ptr, size_t size, void *user)
+{
+	(void)qcvm;
+	(void)user;
+
+	if (!size)
+	{
+		free(ptr);
+		return NULL;
+	}
+
+	return realloc(ptr, size);
+}
+
+/* find a function by name */
+static uint32_t find_function(qcvm_t *qcvm, const char *name)
+{
+	uint32_t i;
+
+	for (i = 1; i < qcvm->num_functions; i++)
+		if (strcmp(qcvm->strings + qcvm->functions[i].ofs_name, name) == 0)
+			return i;
+
+	die(QCVM_FUNCTION_NOT_FOUND);
+	return 0;
+}
+
+/* monotonic time in seconds */
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/*
+ *
+ * workers
+ *
+ */
+
+static qcvm_t *workers[MAX_WORKERS];
+static struct qcvm_think thinks[NUM_ENTITIES];
+static int num_workers;
+
+static void *run_worker(void *user)
+{
+	int i, r;
+	uint32_t index = (uint32_t)(size_t)user;
+
+	for (i = 0; i < NUM_ROUNDS; i++)
+		if ((r = qcvm_run_thinks(workers[index], thinks, NUM_ENTITIES, index, (uint32_t)num_workers, QCVM_THINK_BY_ENTITY)) != QCVM_OK)
+			die(r);
+
+	return NULL;
+}
+
+static void *speculate_worker(void *user)
+{
+	int r;
+	uint32_t index = (uint32_t)(size_t)user;
+
+	if ((r = qcvm_run_thinks(workers[index], thinks, NUM_ENTITIES, index, (uint32_t)num_workers, QCVM_THINK_SPECULATE)) != QCVM_OK)
+		die(r);
+
+	return NULL;
+}
+
+/*
+ *
+ * main
+ *
+ */
+
+int main(int argc, char **argv)
+{
+	qcvm_t *qcvm;
+	pthread_t threads[MAX_WORKERS];
+	double start, elapsed, serial;
+	int r, i, max_workers, identical;
+	uint32_t think, count;
+	size_t entity_size = 0, num_rerun = 0, len_globals;
+	void *entities, *globals;
+
+	max_workers = argc > 1 ? atoi(argv[1]) : 8;
+	if (max_workers < 1 || max_workers > MAX_WORKERS)
+		max_workers = MAX_WORKERS;
+
+	qcvm = calloc(1, sizeof(qcvm_t));
+	if (!qcvm)
+		return 1;
+
+	/* load progs */
+	qcvm->progs = load_file("thinks.dat", &qcvm->len_progs);
+	qcvm->alloc_callback = alloc;
+
+	/* setup entities buffer */
+	qcvm_query_entity_info(qcvm, NULL, &entity_size);
+	qcvm->entities = calloc(NUM_ENTITIES, entity_size);
+	qcvm->len_entities = NUM_ENTITIES * entity_size;
+
+	/* init qcvm */
+	if ((r = qcvm_init(qcvm)) != QCVM_OK)
+		die(r);
+
+	/* find the think functions */
+	think = find_function(qcvm, "think");
+	count = find_function(qcvm, "count");
+
+	/* every entity thinks once per round, and a few of them are counted */
+	for (i = 0; i < NUM_ENTITIES; i++)
+	{
+		thinks[i].entity = (uint32_t)i;
+		thinks[i].function = (int32_t)(i % 64 ? think : count);
+	}
+
+	/* set up the workers */
+	for (i = 0; i < max_workers; i++)
+	{
+		workers[i] = calloc(1, sizeof(qcvm_t));
+		if (!workers[i] || (r = qcvm_init_worker(qcvm, workers[i])) != QCVM_OK)
+			die(workers[i] ? r : QCVM_OUT_OF_MEMORY);
+	}
+
+	/* time every worker count from 1 up */
+	serial = 0;
+	for (num_workers = 1; num_workers <= max_workers; num_workers++)
+	{
+		start = now();
+
+		for (i = 0; i < num_workers; i++)
+			pthread_create(&threads[i], NULL, run_worker, (void *)(size_t)i);
+		for (i = 0; i < num_workers; i++)
+			pthread_join(threads[i], NULL);
+
+		elapsed = now() - start;
+		if (num_workers == 1)
+			serial = elapsed;
+
+		for (i = 0; i < num_workers; i++)
+			qcvm_join_worker(workers[i]);
+
+		printf("THINKS: workers=%d thinks=%d elapsed=%f speedup=%.2fx\n", num_workers, NUM_ENTITIES * NUM_ROUNDS, elapsed, serial / elapsed);
+	}
+
+	/* run a round serially, keep what it left behind and put the vm back */
+	num_workers = max_workers;
+	len_globals = qcvm->num_globals * sizeof(union qcvm_global);
+	entities = malloc(qcvm->len_entities * 2);
+	globals = malloc(len_globals * 2);
+	if (!entities || !globals)
+		die(QCVM_OUT_OF_MEMORY);
+
+	memcpy(entities, qcvm->entities, qcvm->len_entities);
+	memcpy(globals, qcvm->globals, len_globals);
+
+	if ((r = qcvm_run_thinks(qcvm, thinks, NUM_ENTITIES, 0, 1, 0)) != QCVM_OK)
+		die(r);
+
+	memcpy((char *)entities + qcvm->len_entities, qcvm->entities, qcvm->len_entities);
+	memcpy((char *)globals + len_globals, qcvm->globals, len_globals);
+	memcpy(qcvm->entities, entities, qcvm->len_entities);
+	memcpy(qcvm->globals, globals, len_globals);
+
+	/* run the same round speculatively and commit it, which has to match */
+	for (i = 0; i < num_workers; i++)
+		pthread_create(&threads[i], NULL, speculate_worker, (void *)(size_t)i);
+	for (i = 0; i < num_workers; i++)
+		pthread_join(threads[i], NULL);
+
+	if ((r = qcvm_commit_thinks(qcvm, workers, (uint32_t)num_workers, thinks, NUM_ENTITIES, QCVM_THINK_SPECULATE, &num_rerun)) != QCVM_OK)
+		die(r);
+
+	for (i = 0; i < num_workers; i++)
+		qcvm_join_worker(workers[i]);
+
+	identical = memcmp((char *)entities + qcvm->len_entities, qcvm->entities, qcvm->len_entities) == 0 &&
+		memcmp((char *)globals + len_globals, qcvm->globals, len_globals) == 0;
+
+	printf("SPECULATE: workers=%d thinks=%d rerun=%zu identical=%s\n", num_workers, NUM_ENTITIES, num_rerun, identical ? "yes" : "no");
+
+	free(entities);
+	free(globals);
+
+	/* free data */
+	for (i = 0; i < max_workers; i++)
+	{
+		qcvm_shutdown(workers[i]);
+		free(workers[i]);
+	}
+	qcvm_shutdown(qcvm);
+	free(qcvm->entities);
+	free(qcvm->progs);
+	free(qcvm);
+
+	return identical ? 0 : 1;
+}
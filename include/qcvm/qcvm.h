@@ -56,6 +56,22 @@ enum {
 	QCVM_ARGUMENT_OUT_OF_RANGE,
 	QCVM_NO_TEMPSTRINGS,
 	QCVM_NO_ENTITIES,
+	QCVM_EXECUTION_IN_PROGRESS,
+	QCVM_OUT_OF_MEMORY,
+	QCVM_SNAPSHOT_NOT_FOUND,
+	QCVM_BUFFER_TOO_SMALL,
+	QCVM_CHECKPOINT_IN_PROGRESS,
+	QCVM_IMAGE_MISMATCH,
+	QCVM_WORKER_UNSUPPORTED,
+	QCVM_WORKER_BLOCKED,
+	QCVM_NOT_ANALYZED,
+	QCVM_NOT_PUBLISHING,
+	QCVM_PUBLISH_BLOCKED,
+	QCVM_POOL_EMPTY,
+	QCVM_FORK_CONFLICT,
+	QCVM_NOT_IN_CHANNEL,
+	QCVM_QUEUE_FULL,
+	QCVM_BUILTIN_FAILED,
 	QCVM_NUM_RESULT_CODES
 };
 
@@ -71,6 +87,59 @@ enum {
 	QCVM_TYPE_POINTER
 };
 
+/* strip_progs modes */
+enum {
+	QCVM_STRIP_NONE,
+	QCVM_STRIP_DEBUG,
+	QCVM_STRIP_KEEP_NAMES
+};
+
+/* builtin flags */
+enum {
+	QCVM_BUILTIN_THREAD_SAFE = 1 << 0
+};
+
+/* qcvm_run_thinks() flags */
+enum {
+	QCVM_THINK_BY_ENTITY = 1 << 0,
+	QCVM_THINK_SERIALIZE_BUILTINS = 1 << 1,
+	QCVM_THINK_SPECULATE = 1 << 2
+};
+
+/* why qcvm_query_function_safety() says a function can't run alongside others */
+enum {
+	QCVM_SAFE,
+	QCVM_UNSAFE_ENTITY,
+	QCVM_UNSAFE_POINTER,
+	QCVM_UNSAFE_GLOBAL,
+	QCVM_UNSAFE_SELF,
+	QCVM_UNSAFE_INDIRECT_CALL,
+	QCVM_UNSAFE_BUILTIN,
+	QCVM_UNSAFE_STATE,
+	QCVM_UNSAFE_CALL,
+	QCVM_UNSAFE_INVALID
+};
+
+/* a think for qcvm_run_thinks() to run */
+struct qcvm_think {
+	uint32_t entity;
+	int32_t function;
+};
+
+/* a value as qc sees it, declared out here so c++ sees it too */
+union qcvm_eval {
+	int32_t s;
+	float f;
+	float v[3];
+	int32_t func;
+	int32_t field;
+	int32_t i;
+	uint32_t e;
+};
+
+/* what a fast builtin is called with, see struct qcvm_builtin */
+struct qcvm_builtin_call;
+
 /* main container */
 typedef struct qcvm {
 
@@ -84,6 +153,65 @@ typedef struct qcvm {
 	size_t len_progs;
 	void *progs;
 
+	/** read-only progs
+	 *
+	 * normally qcvm uses the progs buffer in place, and writes to it both
+	 * while loading and while running. if this is nonzero, the progs buffer
+	 * is never written to, so it can be mapped read-only and shared between
+	 * processes. the globals and function table are copied out through
+	 * alloc_callback instead, and on big endian hosts the whole buffer is.
+	 * set this before calling qcvm_init().
+	 */
+	int readonly_progs;
+
+	/** program image
+	 *
+	 * an image written by qcvm_save_image() or qcvm_build_shared_image() for
+	 * this progs and builtin table. qcvm_init() loads the interned string
+	 * table and builtin bindings from it instead of building them from
+	 * scratch. it's copied from, so it can be freed or unmapped once
+	 * qcvm_init() returns. an image that doesn't match is ignored.
+	 */
+	size_t len_image;
+	const void *image;
+
+	/** shared program image
+	 *
+	 * an image written by qcvm_build_shared_image(), typically into memory
+	 * shared between processes. it's the same format as qcvm_save_image()
+	 * writes, with the progs laid out in place after the other sections. if
+	 * set, qcvm_init() runs straight from it instead of a progs buffer,
+	 * without loading anything. the code, defs, strings and interned string
+	 * table are read in place and never written to, and only the globals and
+	 * function table are copied. it has to stay mapped until qcvm_shutdown(),
+	 * and progs and len_progs are pointed into it. the builtin table must be
+	 * the one it was built with.
+	 */
+	size_t len_shared_image;
+	const void *shared_image;
+
+	/** strip-on-load
+	 *
+	 * with QCVM_STRIP_DEBUG, qcvm_init() rebuilds the progs in memory
+	 * requested through alloc_callback, keeping only what it takes to run
+	 * it, so the progs buffer can be freed once qcvm_init() returns. global
+	 * and field defs are cut down to the nameless string and entity defs
+	 * qcvm uses, function filenames are dropped, and so are strings nothing
+	 * refers to anymore. strings are only dropped when every global that
+	 * could hold one has a def, which compilers like fteqcc leave out for
+	 * constants at higher optimization levels; otherwise the string table is
+	 * kept whole. function names are kept, since qcvm_run() looks
+	 * functions up by name. without def names, saved states, checkpoints
+	 * and reloads have nothing to match values up by.
+	 *
+	 * QCVM_STRIP_KEEP_NAMES keeps every def and all names, for profiling and
+	 * debugging, and only drops unused strings.
+	 *
+	 * this has no effect on a read-only progs, which is better left shared.
+	 * use qcvm_query_strip_info() to see how much was saved.
+	 */
+	int strip_progs;
+
 	/** entities buffer
 	 *
 	 * allocate this to a suitably large size to store entity definitions and
@@ -110,12 +238,22 @@ typedef struct qcvm {
 	 * matching the function called from qc. NOTE: QCVM will update the opcode
 	 * in memory to point to the correct builtin array index. this will make
 	 * for slightly faster execution in further steps.
+	 *
+	 * set QCVM_BUILTIN_THREAD_SAFE in flags for builtins that can be called
+	 * from several workers at once. see qcvm_run_thinks().
+	 *
+	 * the value func returns is ignored. a builtin can instead set
+	 * fast_func, which is called in its place with the argument count and
+	 * direct pointers to the parameters and return value, and whose result
+	 * is returned from qcvm_run() if it isn't QCVM_OK.
 	 */
 	size_t num_builtins;
 	struct qcvm_builtin {
 		const char *name;
 		int (*func)(struct qcvm *qcvm, void *user);
 		void *user;
+		int flags;
+		int (*fast_func)(struct qcvm *qcvm, const struct qcvm_builtin_call *call, void *user);
 	} *builtins;
 
 	/** tempstring store
@@ -128,16 +266,45 @@ typedef struct qcvm {
 	 * memory. later quake engines have added enhancements like garbage
 	 * collection and reference counting.
 	 *
-	 * qcvm takes the current tempstrings buffer position and writes the new
-	 * strings after it, wrapping around to the start if it's reached the end
-	 * of the buffer.
+	 * qcvm appends new tempstrings after the current position and never wraps
+	 * around. every tempstring stays valid until the host starts a new frame
+	 * with qcvm_tempstrings_begin_frame(), which throws all of them away at
+	 * once, along with any host strings registered for the frame. when this
+	 * buffer is full, qcvm chains on additional blocks
+	 * requested through alloc_callback, each one at least twice as big as the
+	 * last. these blocks are kept around for the following frames.
 	 *
-	 * if this buffer is null, qcvm will not be able to return strings from
-	 * builtins.
+	 * if this buffer is null, qcvm will allocate the first block through
+	 * alloc_callback. if that is null too, qcvm will not be able to return
+	 * strings from builtins.
 	 */
 	size_t len_tempstrings;
 	char *tempstrings;
 
+	/** memory allocator callback
+	 *
+	 * qcvm never allocates memory on its own. features that need to grow
+	 * their storage at runtime request it through this callback, which must
+	 * behave like realloc(): ptr is null to allocate a new block, and size is
+	 * 0 to free ptr. call qcvm_shutdown() to release everything that was
+	 * allocated through it.
+	 *
+	 * if this is null, those features will return QCVM_OUT_OF_MEMORY.
+	 */
+	void *(*alloc_callback)(struct qcvm *qcvm, void *ptr, size_t size, void *user);
+	void *alloc_callback_user;
+
+	/** builtin lock callback
+	 *
+	 * qcvm doesn't own any threads or locks. when workers run thinks with
+	 * QCVM_THINK_SERIALIZE_BUILTINS, every builtin not marked thread-safe is
+	 * bracketed by a call to this with lock set to 1 and then 0, so the host
+	 * can hold a mutex around it. it's called with the worker running the
+	 * builtin, and taken from the vm when the worker is set up.
+	 */
+	void (*lock_callback)(struct qcvm *qcvm, int lock, void *user);
+	void *lock_callback_user;
+
 	/*
 	 *
 	 * "private" fields, don't mess with these.
@@ -207,6 +374,12 @@ typedef struct qcvm {
 		uint32_t ui;
 	} *globals;
 
+	/* copies of the progs made by qcvm, and how much stripping saved */
+	size_t strip_saved;
+	void *progs_copy;
+	struct qcvm_function *functions_copy;
+	union qcvm_global *globals_copy;
+
 	/*
 	 *
 	 * runtime stuff.
@@ -231,20 +404,320 @@ typedef struct qcvm {
 	int32_t current_builtin;
 	int32_t exit_depth;
 	int32_t current_argc;
-	char *tempstrings_ptr;
 
-	/* function evaluation */
-	union qcvm_eval {
+	/* tempstring blocks */
+	struct qcvm_tempstrings_block {
+		char *data;
+		size_t len;
+		size_t base;
+	} tempstrings_blocks[QCVM_TEMPSTRINGS_BLOCKS];
+	int32_t num_tempstrings_blocks;
+	int32_t current_tempstrings_block;
+	size_t tempstrings_used;
+	size_t tempstrings_reserved;
+	size_t tempstrings_high_water;
+	uint32_t tempstrings_epoch;
+
+	/* zone strings */
+	struct qcvm_zone_slab {
+		char *data;
+		uint32_t slot_size;
+		uint32_t num_slots;
+		uint32_t num_used;
+		uint32_t used[32];
+		uint32_t marked[32];
+		uint32_t interned[32];
+	} *zone_slabs;
+	uint32_t num_zone_slabs;
+	uint32_t max_zone_slabs;
+	uint32_t zone_slab_hints[12];
+	int32_t zone_gc_phase;
+	uint32_t zone_gc_cursor;
+
+	/* host-owned strings, permanent and per-frame */
+	struct qcvm_external_string {
+		struct qcvm_string_header {
+			uint32_t len;
+			uint32_t hash;
+		} header;
+		const char *s;
+		uint32_t next_free;
+	} *external_strings[2];
+	uint32_t num_external_strings[2];
+	uint32_t max_external_strings[2];
+	uint32_t free_external_string;
+
+	/* interned strings */
+	uint32_t *strings_canonical;
+	struct qcvm_intern {
 		int32_t s;
+		uint32_t hash;
+	} *intern_table;
+	uint32_t intern_table_size;
+	uint32_t num_interned;
+	uint32_t num_intern_tombstones;
+
+	/* snapshots, oldest first, with released ones kept past the end for reuse */
+	struct qcvm_snapshot {
+		uint32_t id;
+		union qcvm_global *globals;
+		uint32_t *pages;
+		uint8_t *page_data;
+		uint32_t num_pages;
+		uint32_t max_pages;
+		char *tempstrings;
+		size_t len_tempstrings;
+		size_t max_tempstrings;
+		int32_t tempstrings_block;
+		size_t tempstrings_used;
+		uint32_t tempstrings_epoch;
+		uint32_t num_frame_strings;
+	} *snapshots;
+	uint32_t num_snapshots;
+	uint32_t max_snapshots;
+	uint32_t next_snapshot_id;
+	uint32_t *snapshot_page_ids;
+	size_t num_snapshot_pages;
+
+	/* dirty field bitmaps, one row per entity, plus one bit per entity */
+	uint32_t *dirty_fields;
+	uint32_t *dirty_entities;
+	uint32_t dirty_field_words;
+	uint32_t max_dirty_entities;
+
+	/* checkpoint being written */
+	struct qcvm_checkpoint *checkpoint;
+
+	/* set if this is a worker of another vm */
+	struct qcvm_worker *worker;
+
+	/* what qcvm_analyze_functions() found */
+	struct qcvm_analysis *analysis;
+
+	/* copies of the entities handed out by qcvm_publish() */
+	struct qcvm_publisher *publisher;
+
+	/* statements run so far, for schedulers to charge */
+	uint64_t statements_run;
+
+	/* the state qcvm_reset() goes back to, the pages written since, and the next free vm in a pool */
+	struct qcvm_snapshot *pristine;
+	uint32_t *pristine_bits;
+	uint32_t *pristine_pages;
+	size_t num_pristine_pages;
+	struct qcvm *pool_next;
+
+	/* the channel this vm gets messages from, and its address there */
+	struct qcvm_channel *channel;
+	uint32_t channel_address;
+
+	/* function evaluation */
+	union qcvm_eval *eval[3];
+
+} qcvm_t;
+
+/* what a fast builtin is called with */
+struct qcvm_builtin_call {
+
+	/** number of arguments qc passed */
+	int argc;
+
+	/** arguments
+	 *
+	 * parms[i] is argument i, read as whatever type it has. string
+	 * arguments are handles, for qcvm_get_string().
+	 */
+	const union qcvm_eval *parms;
+
+	/** return value
+	 *
+	 * written as whatever type the builtin returns. the qcvm_return_*
+	 * functions can still be used instead.
+	 */
+	union qcvm_eval *ret;
+
+};
+
+/* a vm for a scheduler to tick */
+struct qcvm_sched_instance {
+
+	/** virtual machine, after qcvm_init() */
+	qcvm_t *qcvm;
+
+	/** time between ticks, in clock_callback units */
+	uint64_t period;
+
+	/** fairness budget
+	 *
+	 * how many statements a tick may run on average. a tick that runs more
+	 * puts the instance in debt, and it skips ticks until it's paid back, so
+	 * one busy instance can't starve the others. 0 means no limit.
+	 */
+	uint64_t budget;
+
+	/* "private" fields, don't mess with these */
+	uint64_t next_tick;
+	int64_t credit;
+	uint32_t core;
+	uint64_t ticks;
+	uint64_t skipped;
+	uint64_t statements;
+	uint64_t busy;
+};
+
+/* ticks many vms on a fixed number of host threads */
+typedef struct qcvm_sched {
+
+	/** instances
+	 *
+	 * every instance ticks at its own rate. they're spread evenly over the
+	 * cores by qcvm_sched_init(), and a core that runs out of due work takes
+	 * the most overdue due instance of any other core, so load evens out on
+	 * its own.
+	 */
+	size_t num_instances;
+	struct qcvm_sched_instance *instances;
+
+	/** number of cores
+	 *
+	 * one for every host thread that will call qcvm_sched_run(). starting
+	 * those threads and pinning them is up to the host.
+	 */
+	uint32_t num_cores;
+
+	/** tick callback
+	 *
+	 * called to tick an instance, by whichever thread picked it up, with no
+	 * lock held. it typically sets the time globals and runs a frame of qc.
+	 * an error returned from it is returned by qcvm_sched_run().
+	 */
+	int (*tick_callback)(qcvm_t *qcvm, uint64_t now, void *user);
+	void *tick_callback_user;
+
+	/** clock callback
+	 *
+	 * returns a monotonic time, in whatever units the instance periods use.
+	 */
+	uint64_t (*clock_callback)(void *user);
+	void *clock_callback_user;
+
+	/** lock callback
+	 *
+	 * every core's queue has a lock of its own, so the host keeps one mutex
+	 * per core. every look at a queue is bracketed by a call to this with
+	 * the core it belongs to and lock set to 1 and then 0. a core working
+	 * through its own queue only takes its own lock, picking the next
+	 * instance is all that's done under it, never a tick, and no more than
+	 * one is held at once except by the queries, which take them all in
+	 * order. required when num_cores is more than 1.
+	 */
+	void (*lock_callback)(struct qcvm_sched *sched, uint32_t core, int lock, void *user);
+	void *lock_callback_user;
+
+	/** memory allocator callback
+	 *
+	 * behaves like realloc(), same as the one in qcvm_t.
+	 */
+	void *(*alloc_callback)(struct qcvm_sched *sched, void *ptr, size_t size, void *user);
+	void *alloc_callback_user;
+
+	/* "private" fields, don't mess with these */
+	struct qcvm_sched_core *cores;
+
+} qcvm_sched_t;
+
+/* vms kept ready to hand out */
+typedef struct qcvm_pool {
+
+	/** instances
+	 *
+	 * each one after qcvm_init(), and after whatever setup every session
+	 * starts from, like spawning the world. qcvm_pool_init() records that
+	 * state, and every instance goes back to it when it's released.
+	 */
+	size_t num_instances;
+	qcvm_t **instances;
+
+	/* "private" fields, don't mess with these */
+	size_t num_free;
+	qcvm_t *free;
+
+} qcvm_pool_t;
+
+/* message payload types */
+enum {
+	QCVM_MESSAGE_FLOAT,
+	QCVM_MESSAGE_VECTOR,
+	QCVM_MESSAGE_STRING,
+	QCVM_MESSAGE_ENTITY
+};
+
+/* a message from one vm to another */
+struct qcvm_message {
+
+	/** address of the sending vm, filled in by the send builtins */
+	uint32_t from;
+
+	/** whatever the sender wants the receiver to know it by */
+	float tag;
+
+	/** QCVM_MESSAGE_* type of the value */
+	int type;
+
+	/** value
+	 *
+	 * strings are copied in, since a string handle means nothing to another
+	 * vm. they are handed to the receiver as a tempstring.
+	 */
+	union {
 		float f;
 		float v[3];
-		int32_t func;
-		int32_t field;
-		int32_t i;
 		uint32_t e;
-	} *eval[3];
+		char s[QCVM_MESSAGE_STRING_SIZE];
+	} value;
 
-} qcvm_t;
+};
+
+/* message queues between vms */
+typedef struct qcvm_channel {
+
+	/** instances
+	 *
+	 * each one after qcvm_init(). an instance's address is its index here,
+	 * and each gets a bounded queue of its own that any number of others can
+	 * send to at once.
+	 */
+	size_t num_instances;
+	qcvm_t **instances;
+
+	/** queue length
+	 *
+	 * how many messages can wait for each instance, rounded up to a power of
+	 * two. sending to a full queue fails rather than waiting.
+	 */
+	uint32_t queue_len;
+
+	/** lock callback
+	 *
+	 * queues are lock-free where the compiler has atomic builtins, and this
+	 * is never called. elsewhere, every send and receive is bracketed by a
+	 * call to this with lock set to 1 and then 0, and qcvm_channel_init()
+	 * fails without it.
+	 */
+	void (*lock_callback)(struct qcvm_channel *channel, int lock, void *user);
+	void *lock_callback_user;
+
+	/** memory allocator callback
+	 *
+	 * behaves like realloc(), same as the one in qcvm_t.
+	 */
+	void *(*alloc_callback)(struct qcvm_channel *channel, void *ptr, size_t size, void *user);
+	void *alloc_callback_user;
+
+	/* "private" fields, don't mess with these */
+	struct qcvm_mailbox *mailboxes;
+
+} qcvm_channel_t;
 
 /**
  * \brief initialize qcvm structure
@@ -258,6 +731,54 @@ typedef struct qcvm {
  */
 int qcvm_init(qcvm_t *qcvm);
 
+/**
+ * \brief query how much memory strip-on-load saved
+ * \param qcvm virtual machine to query, after qcvm_init()
+ * \param len_progs pointer to size_t to contain the size of the progs qcvm runs from
+ * \param bytes_saved pointer to size_t to contain how much smaller it is than the original
+ * \returns result code
+ */
+int qcvm_query_strip_info(qcvm_t *qcvm, size_t *len_progs, size_t *bytes_saved);
+
+/**
+ * \brief release memory allocated by qcvm
+ *
+ * frees everything qcvm requested through alloc_callback. buffers provided by
+ * the host, like progs, entities and tempstrings, are left alone.
+ *
+ * \param qcvm virtual machine to shut down
+ * \returns result code
+ */
+int qcvm_shutdown(qcvm_t *qcvm);
+
+/**
+ * \brief swap in a rebuilt progs without losing the running state
+ *
+ * globals marked for saving and entity fields are matched to the new progs
+ * by name and type. entities are moved to the new field layout in place, new
+ * fields start out zeroed, and values with nowhere to go are dropped.
+ * strings from the old string table and function references, like think and
+ * touch, are pointed at their counterparts in the new progs, or at an
+ * interned copy and the null function if there are none.
+ *
+ * the entities buffer must be large enough for num_entities in both the old
+ * and the new layout. the old progs buffer must stay valid until this
+ * returns, and can be freed afterwards. snapshots are released, and if field
+ * tracking is on, every entity is reported dirty. global and field offsets
+ * cached by the host have to be looked up again.
+ *
+ * this function must be called at a frame boundary, outside of qc execution
+ * and with no checkpoint pending. memory is requested through
+ * alloc_callback.
+ *
+ * \param qcvm virtual machine to reload
+ * \param progs new progs buffer, which takes the place of qcvm->progs
+ * \param len_progs size of the new progs buffer
+ * \param num_entities number of entity slots in use, including world
+ * \returns result code
+ */
+int qcvm_reload(qcvm_t *qcvm, void *progs, size_t len_progs, uint32_t num_entities);
+
 /**
  * \brief query qcvm for amount of memory needed for per-entity storage
  *
@@ -314,12 +835,215 @@ int qcvm_run(qcvm_t *qcvm, const char *name);
 
 /**
  * \brief return a string to the function that called this one
+ *
+ * the string is copied into tempstrings storage, and stays valid until the
+ * next call to qcvm_tempstrings_begin_frame().
+ *
  * \param qcvm virtual machine to use
  * \param s null-terminated string
  * \returns result code
  */
 int qcvm_return_string(qcvm_t *qcvm, const char *s);
 
+/**
+ * \brief return a string of known length to the function that called this one
+ *
+ * like qcvm_return_string(), but copies up to len bytes in one go instead
+ * of scanning s for its terminator. s doesn't need to be null-terminated,
+ * but qc strings end at the first null, so the string is cut short there
+ * if s has one within len bytes.
+ *
+ * \param qcvm virtual machine to use
+ * \param s string data
+ * \param len length of s in bytes
+ * \returns result code
+ */
+int qcvm_return_string_len(qcvm_t *qcvm, const char *s, size_t len);
+
+/**
+ * \brief reserve writable tempstrings storage for a builtin to fill in
+ *
+ * lets a string-producing builtin format its result directly into
+ * tempstrings storage instead of building it somewhere else and copying it
+ * over with qcvm_return_string(). buf will have room for max_len characters
+ * plus a null terminator. call qcvm_commit_tempstring() once the final
+ * length is known. the reservation is dropped by any other tempstring
+ * allocation in the meantime.
+ *
+ * \param qcvm virtual machine to use
+ * \param max_len maximum string length that will be written
+ * \param buf pointer to fill with the writable buffer
+ * \returns result code
+ */
+int qcvm_reserve_tempstring(qcvm_t *qcvm, size_t max_len, char **buf);
+
+/**
+ * \brief finish a reserved tempstring and return it to the calling function
+ *
+ * any reserved space past len becomes available to the next tempstring. if
+ * a null was written within len bytes, the string ends there.
+ *
+ * \param qcvm virtual machine to use
+ * \param len final length of the string, at most the reserved max_len
+ * \returns result code
+ */
+int qcvm_commit_tempstring(qcvm_t *qcvm, size_t len);
+
+/**
+ * \brief start a new tempstrings frame
+ *
+ * invalidates every tempstring returned since the last call and makes their
+ * storage available again. this takes constant time, and any blocks chained
+ * on during earlier frames are kept for reuse.
+ *
+ * \param qcvm virtual machine to use
+ * \returns result code
+ */
+int qcvm_tempstrings_begin_frame(qcvm_t *qcvm);
+
+/**
+ * \brief query tempstrings memory usage
+ * \param qcvm virtual machine to query
+ * \param used pointer to size_t to contain the bytes used in the current frame
+ * \param high_water pointer to size_t to contain the most bytes ever used in a single frame
+ * \param capacity pointer to size_t to contain the total size of all blocks
+ * \returns result code
+ */
+int qcvm_query_tempstrings_info(qcvm_t *qcvm, size_t *used, size_t *high_water, size_t *capacity);
+
+/**
+ * \brief copy a string into the zone string heap
+ *
+ * unlike tempstrings, zone strings persist across frames, so qc can keep them
+ * in globals and entity fields. they are reclaimed by
+ * qcvm_collect_zone_strings() once no string-typed global or entity field
+ * refers to them anymore. the host must not keep a zone string alive only in
+ * its own memory.
+ *
+ * zone strings are allocated from slabs of same-sized slots, requested
+ * through alloc_callback.
+ *
+ * \param qcvm virtual machine to use
+ * \param s null-terminated string
+ * \param handle pointer to fill with the string handle
+ * \returns result code
+ */
+int qcvm_alloc_zone_string(qcvm_t *qcvm, const char *s, int32_t *handle);
+
+/**
+ * \brief return a zone string to the function that called this one
+ * \param qcvm virtual machine to use
+ * \param s null-terminated string
+ * \returns result code
+ */
+int qcvm_return_zone_string(qcvm_t *qcvm, const char *s);
+
+/**
+ * \brief reclaim zone strings that are no longer referenced
+ *
+ * runs a mark and sweep collection over the zone string heap. the roots are
+ * every string-typed global and every string-typed field of the first
+ * num_entities entities. the work can be spread out over several frames by
+ * passing a nonzero budget, which limits how many entities are scanned or
+ * slabs are swept by a single call. a budget of 0 finishes the current cycle.
+ *
+ * while a cycle is in progress, the host must not store zone strings
+ * directly into entity memory, and must not call this function while qc is
+ * executing.
+ *
+ * \param qcvm virtual machine to use
+ * \param num_entities number of entity slots in use, including world
+ * \param budget maximum amount of work to do, or 0 for no limit
+ * \param finished pointer to int to contain nonzero if the cycle completed
+ * \returns result code
+ */
+int qcvm_collect_zone_strings(qcvm_t *qcvm, uint32_t num_entities, size_t budget, int *finished);
+
+/**
+ * \brief query zone string heap memory usage
+ * \param qcvm virtual machine to query
+ * \param num_strings pointer to size_t to contain the number of live zone strings
+ * \param size pointer to size_t to contain the total size of all slabs
+ * \returns result code
+ */
+int qcvm_query_zone_info(qcvm_t *qcvm, size_t *num_strings, size_t *size);
+
+/**
+ * \brief look up or add a string in the interned string table
+ *
+ * on init, qcvm interns every string in the progs string table and points
+ * string constants at the first copy of each one. a string interned at
+ * runtime is stored in the zone string heap, and is reclaimed like any other
+ * zone string when nothing refers to it anymore.
+ *
+ * comparing two interned strings is a single integer comparison, so builtins
+ * that return strings qc will compare against constants should return them
+ * interned.
+ *
+ * \param qcvm virtual machine to use
+ * \param s null-terminated string
+ * \param handle pointer to fill with the string handle
+ * \returns result code
+ */
+int qcvm_intern_string(qcvm_t *qcvm, const char *s, int32_t *handle);
+
+/**
+ * \brief return an interned string to the function that called this one
+ * \param qcvm virtual machine to use
+ * \param s null-terminated string
+ * \returns result code
+ */
+int qcvm_return_interned_string(qcvm_t *qcvm, const char *s);
+
+/**
+ * \brief give qc a handle to a string owned by the host, without copying it
+ *
+ * the host must keep s alive and unchanged for as long as the handle may be
+ * used. a permanent registration lasts until qcvm_unregister_string(). any
+ * other registration only lasts until the next call to
+ * qcvm_tempstrings_begin_frame(), and is the cheap way to hand qc text that
+ * changes every frame.
+ *
+ * the slots of unregistered permanent strings are reused by later
+ * registrations, so strings that change now and then, like config values
+ * or player names, can be unregistered and registered again without the
+ * table growing. a handle kept after qcvm_unregister_string() may then
+ * resolve to the newer string.
+ *
+ * \param qcvm virtual machine to use
+ * \param s string data, which must have a null terminator at s[len]
+ * \param len length of s in bytes, cut short at any earlier null
+ * \param permanent nonzero to keep the registration across frames
+ * \param handle pointer to fill with the string handle
+ * \returns result code
+ */
+int qcvm_register_string(qcvm_t *qcvm, const char *s, size_t len, int permanent, int32_t *handle);
+
+/**
+ * \brief drop a permanent host string registration
+ *
+ * the handle resolves to the null string afterwards, until its slot is
+ * reused by another permanent registration.
+ *
+ * \param qcvm virtual machine to use
+ * \param handle string handle returned by qcvm_register_string()
+ * \returns result code
+ */
+int qcvm_unregister_string(qcvm_t *qcvm, int32_t handle);
+
+/**
+ * \brief return a host-owned string to the function that called this one
+ *
+ * the string is registered for the current frame only, see
+ * qcvm_register_string().
+ *
+ * \param qcvm virtual machine to use
+ * \param s string data, which must have a null terminator at s[len]
+ * \param len length of s in bytes, cut short at any earlier null
+ * \returns result code
+ */
+int qcvm_return_external_string(qcvm_t *qcvm, const char *s, size_t len);
+
 /**
  * \brief return a float to the function that called this one
  * \param qcvm virtual machine to use
@@ -398,16 +1122,43 @@ int qcvm_get_return_entity(qcvm_t *qcvm, uint32_t *e);
 int qcvm_get_argument_string(qcvm_t *qcvm, int i, const char **s);
 
 /**
- * \brief retrieve float from function argument
+ * \brief retrieve string and its length from function argument
+ *
+ * tempstrings and zone strings carry their length with them, so this doesn't
+ * have to scan them.
+ *
  * \param qcvm virtual machine to use
  * \param i argument index
- * \param f float to fill
+ * \param s string pointer to fill
+ * \param len size_t to fill with the string length
  * \returns result code
  */
-int qcvm_get_argument_float(qcvm_t *qcvm, int i, float *f);
+int qcvm_get_argument_string_len(qcvm_t *qcvm, int i, const char **s, size_t *len);
 
 /**
- * \brief retrieve int from function argument
+ * \brief resolve a string handle
+ *
+ * use this to read string values the host finds in globals or entity fields.
+ *
+ * \param qcvm virtual machine to use
+ * \param handle string handle
+ * \param s string pointer to fill
+ * \param len size_t to fill with the string length
+ * \returns result code
+ */
+int qcvm_get_string(qcvm_t *qcvm, int32_t handle, const char **s, size_t *len);
+
+/**
+ * \brief retrieve float from function argument
+ * \param qcvm virtual machine to use
+ * \param i argument index
+ * \param f float to fill
+ * \returns result code
+ */
+int qcvm_get_argument_float(qcvm_t *qcvm, int i, float *f);
+
+/**
+ * \brief retrieve int from function argument
  * \param qcvm virtual machine to use
  * \param i argument index
  * \param i int to fill
@@ -435,6 +1186,865 @@ int qcvm_get_argument_vector(qcvm_t *qcvm, int i, float *x, float *y, float *z);
  */
 int qcvm_get_argument_entity(qcvm_t *qcvm, int i, uint32_t *e);
 
+/**
+ * \brief move live entities into a dense prefix of the entities buffer
+ *
+ * after a long uptime, live entities can end up scattered across a mostly
+ * empty entities buffer. this is a stop-the-world pass that slides every live
+ * entity down into the lowest free slot, zeroes the vacated tail, and rewrites
+ * every entity reference held in entity-typed globals and entity-typed fields
+ * of the surviving entities. references to dead entities become 0 (world).
+ * entity 0 is always considered live and never moves.
+ *
+ * remap must point to an array of num_entities entries. on return, each entry
+ * holds the new index of that entity, or 0 if it was dead. use it to fix up
+ * any entity handles held by the host.
+ *
+ * this function must not be called while qc is executing.
+ *
+ * \param qcvm virtual machine to use
+ * \param num_entities number of entity slots in use, including world
+ * \param is_live callback returning nonzero if entity e is in use
+ * \param user user data passed to is_live
+ * \param remap array of num_entities entries to fill
+ * \param new_num_entities pointer to fill with the number of slots in use after compaction
+ * \returns result code
+ */
+int qcvm_compact_entities(qcvm_t *qcvm, uint32_t num_entities, int (*is_live)(qcvm_t *qcvm, uint32_t e, void *user), void *user, uint32_t *remap, uint32_t *new_num_entities);
+
+/**
+ * \brief take a snapshot of the vm state
+ *
+ * captures globals, the entities buffer and the current tempstrings frame so
+ * they can be brought back later with qcvm_restore(). the entities buffer
+ * isn't copied up front. instead, it's split into pages of
+ * QCVM_SNAPSHOT_PAGE_SIZE bytes, and the first write to a page after a
+ * snapshot saves its old contents into that snapshot. taking a snapshot only
+ * copies the globals and the tempstrings used so far in this frame, and each
+ * one holds on to the pages written while it was the newest.
+ *
+ * qc stores are tracked automatically. the host must call
+ * qcvm_touch_entities() before writing to entity memory itself while any
+ * snapshot is retained. zone strings referenced by a retained snapshot are
+ * kept alive by the collector.
+ *
+ * snapshot memory is requested through alloc_callback, and is kept around
+ * for later snapshots when one is released.
+ *
+ * this function must not be called while qc is executing.
+ *
+ * \param qcvm virtual machine to use
+ * \param id pointer to fill with the snapshot id
+ * \returns result code
+ */
+int qcvm_snapshot(qcvm_t *qcvm, uint32_t *id);
+
+/**
+ * \brief roll the vm state back to a snapshot
+ *
+ * writes back every page saved since the snapshot was taken, so the cost
+ * depends on how much was written since then, not on the size of the
+ * entities buffer. every snapshot taken after this one is released. the
+ * snapshot itself is kept, so it can be restored again.
+ *
+ * tempstrings from the snapshot's frame are restored too. host strings
+ * registered for that frame are only kept if it's still the current frame.
+ *
+ * this function must not be called while qc is executing.
+ *
+ * \param qcvm virtual machine to use
+ * \param id snapshot id returned by qcvm_snapshot()
+ * \returns result code
+ */
+int qcvm_restore(qcvm_t *qcvm, uint32_t id);
+
+/**
+ * \brief release a snapshot and every snapshot taken before it
+ *
+ * restoring a snapshot also needs the pages saved by every snapshot taken
+ * after it, so snapshots can only be released oldest first. this is the
+ * usual way to slide a rollback window forward.
+ *
+ * \param qcvm virtual machine to use
+ * \param id snapshot id returned by qcvm_snapshot()
+ * \returns result code
+ */
+int qcvm_release_snapshot(qcvm_t *qcvm, uint32_t id);
+
+/**
+ * \brief query how much memory a snapshot holds on to
+ * \param qcvm virtual machine to query
+ * \param id snapshot id returned by qcvm_snapshot()
+ * \param num_pages pointer to size_t to contain the number of entity pages saved in the snapshot
+ * \param size pointer to size_t to contain the total bytes retained by the snapshot
+ * \returns result code
+ */
+int qcvm_query_snapshot_info(qcvm_t *qcvm, uint32_t id, size_t *num_pages, size_t *size);
+
+/**
+ * \brief tell qcvm that the host is about to write to some entities
+ *
+ * while a snapshot is retained or field tracking is on, call this before
+ * changing the fields of entities directly, so their old contents can be
+ * saved and the fields marked dirty. it does nothing otherwise.
+ *
+ * \param qcvm virtual machine to use
+ * \param e first entity index
+ * \param count number of entities
+ * \returns result code
+ */
+int qcvm_touch_entities(qcvm_t *qcvm, uint32_t e, uint32_t count);
+
+/**
+ * \brief tell qcvm that the host is about to write to some fields of an entity
+ *
+ * like qcvm_touch_entities(), for when only a few fields are changing.
+ *
+ * \param qcvm virtual machine to use
+ * \param e entity index
+ * \param ofs field offset
+ * \param count number of field values, 3 for a vector
+ * \returns result code
+ */
+int qcvm_touch_entity_fields(qcvm_t *qcvm, uint32_t e, uint32_t ofs, uint32_t count);
+
+/**
+ * \brief turn per-field dirty tracking of entities on or off
+ *
+ * while tracking is on, every entity field qc stores to is marked dirty in a
+ * per-entity bitmap, so the host can find what changed in a tick without
+ * diffing the whole entities buffer. the bitmaps are requested through
+ * alloc_callback, one bit per field value of every entity that fits in the
+ * entities buffer.
+ *
+ * host writes are only tracked when announced with qcvm_touch_entities() or
+ * qcvm_touch_entity_fields(). rolling back to a snapshot marks every field on
+ * the pages it restores.
+ *
+ * \param qcvm virtual machine to use
+ * \param enable nonzero to turn tracking on, 0 to turn it off and free the bitmaps
+ * \returns result code
+ */
+int qcvm_track_entity_fields(qcvm_t *qcvm, int enable);
+
+/**
+ * \brief find the next entity with dirty fields
+ *
+ * usage example:
+ *
+ * uint32_t e;
+ * const uint32_t *fields;
+ * int found;
+ * for (e = 0; qcvm_next_dirty_entity(&qcvm, &e, &fields, &found) == QCVM_OK && found; e++)
+ *     send_entity(e, fields);
+ *
+ * \param qcvm virtual machine to query
+ * \param e entity index to start searching from, filled with the dirty entity
+ * \param fields pointer to fill with the entity's dirty field bitmap, bit n being field offset n
+ * \param found pointer to int to contain nonzero if a dirty entity was found
+ * \returns result code
+ */
+int qcvm_next_dirty_entity(qcvm_t *qcvm, uint32_t *e, const uint32_t **fields, int *found);
+
+/**
+ * \brief clear every dirty field bitmap
+ *
+ * call this once the changes have been consumed, usually once per tick. the
+ * cost depends on the number of dirty entities, not the total.
+ *
+ * \param qcvm virtual machine to use
+ * \returns result code
+ */
+int qcvm_clear_dirty_fields(qcvm_t *qcvm);
+
+/**
+ * \brief encode the dirty entity fields as a compact binary delta
+ *
+ * only dirty fields are visited. if baseline is given, it must be laid out
+ * like the entities buffer and hold the state the receiver already has,
+ * for example the last one a client acknowledged. fields that match it are
+ * left out. without a baseline, every dirty field is encoded.
+ *
+ * values are stored as raw 32-bit words, so string and function fields hold
+ * handles that only mean something to the same progs.
+ *
+ * if buf is null, or too small, size is still filled with the number of
+ * bytes needed.
+ *
+ * \param qcvm virtual machine to use
+ * \param baseline previously acknowledged entity state, or null
+ * \param buf buffer to write the delta to, or null
+ * \param len size of buf in bytes
+ * \param size pointer to size_t to contain the size of the delta
+ * \returns result code
+ */
+int qcvm_encode_entity_delta(qcvm_t *qcvm, const void *baseline, void *buf, size_t len, size_t *size);
+
+/**
+ * \brief apply a delta from qcvm_encode_entity_delta()
+ *
+ * writes into entities if given, which must be laid out like the entities
+ * buffer. this is how a host keeps a per-client baseline up to date. if
+ * entities is null, the delta is applied to the vm itself, going through
+ * snapshot and field tracking like any other write.
+ *
+ * \param qcvm virtual machine to use
+ * \param entities entity state to update, or null for the vm's own
+ * \param buf delta data
+ * \param len size of buf in bytes
+ * \returns result code
+ */
+int qcvm_apply_entity_delta(qcvm_t *qcvm, void *entities, const void *buf, size_t len);
+
+/**
+ * \brief write the vm state to a stream
+ *
+ * saves every global flagged for saving by the compiler, and every field of
+ * the first num_entities entities. globals and fields are stored under their
+ * names, so the save can still be loaded after the progs are rebuilt. the
+ * names are written once at the start, and the rest is a compact binary body
+ * that leaves out zero values. strings are stored by content, and functions
+ * by name.
+ *
+ * the data is handed to write in small chunks as it's produced, so nothing
+ * close to the size of the world is buffered. write works like fwrite(), and
+ * must return the number of bytes it wrote. a little scratch memory for the
+ * list of saved defs is requested through alloc_callback.
+ *
+ * this function must not be called while qc is executing.
+ *
+ * \param qcvm virtual machine to use
+ * \param num_entities number of entity slots in use, including world
+ * \param write callback to write len bytes of data
+ * \param user user data passed to write
+ * \returns result code
+ */
+int qcvm_save_state(qcvm_t *qcvm, uint32_t num_entities, size_t (*write)(qcvm_t *qcvm, const void *data, size_t len, void *user), void *user);
+
+/**
+ * \brief read the vm state from a stream written by qcvm_save_state()
+ *
+ * names are matched against the current progs once, before the body is read.
+ * values for globals, fields or functions that no longer exist, or changed
+ * type, are skipped. the entities buffer is cleared before loading, and
+ * globals missing from the save keep their current values. strings are
+ * interned into the zone string heap.
+ *
+ * read works like fread(), and must return the number of bytes it read,
+ * which may be less than len, or 0 at the end of the stream. if loading
+ * fails partway through, the vm is left partially loaded.
+ *
+ * this function must not be called while qc is executing.
+ *
+ * \param qcvm virtual machine to use
+ * \param num_entities pointer to fill with the number of entity slots loaded
+ * \param read callback to read up to len bytes into data
+ * \param user user data passed to read
+ * \returns result code
+ */
+int qcvm_load_state(qcvm_t *qcvm, uint32_t *num_entities, size_t (*read)(qcvm_t *qcvm, void *data, size_t len, void *user), void *user);
+
+/**
+ * \brief start writing the vm state in the background
+ *
+ * produces the same stream as qcvm_save_state(), but spreads the work over
+ * calls to qcvm_step_checkpoint() so the vm can keep running in between. the
+ * state written is the one at the time of this call: globals and the current
+ * tempstrings are copied right away, and entity pages are only copied when
+ * qc or the host writes to one that hasn't been encoded yet. host writes to
+ * entities must be announced with qcvm_touch_entities() while a checkpoint is
+ * pending.
+ *
+ * write may hand the data off to another thread to do the actual i/o, but it
+ * has to take its own copy, since the buffer is reused as soon as it returns.
+ * progress is called after every step, and finished once when the
+ * checkpoint completes or fails. either may be null. memory is requested
+ * through alloc_callback.
+ *
+ * only one checkpoint can be pending at a time. this function must not be
+ * called while qc is executing.
+ *
+ * \param qcvm virtual machine to use
+ * \param num_entities number of entity slots in use, including world
+ * \param write callback to write len bytes of data
+ * \param progress callback reporting the number of entities written so far, or null
+ * \param finished callback receiving the final result code, or null
+ * \param user user data passed to the callbacks
+ * \returns result code
+ */
+int qcvm_begin_checkpoint(qcvm_t *qcvm, uint32_t num_entities, size_t (*write)(qcvm_t *qcvm, const void *data, size_t len, void *user), void (*progress)(qcvm_t *qcvm, uint32_t entities_done, uint32_t num_entities, void *user), void (*finished)(qcvm_t *qcvm, int result, void *user), void *user);
+
+/**
+ * \brief write part of a pending checkpoint
+ *
+ * call this once per frame, outside of qc execution. budget limits how many
+ * entities are encoded by a single call, which puts a bound on the time it
+ * takes. a budget of 0 writes the rest of the checkpoint.
+ *
+ * \param qcvm virtual machine to use
+ * \param budget maximum number of entities to write, or 0 for no limit
+ * \param finished pointer to int to contain nonzero if there's no checkpoint pending anymore
+ * \returns result code
+ */
+int qcvm_step_checkpoint(qcvm_t *qcvm, size_t budget, int *finished);
+
+/**
+ * \brief abandon a pending checkpoint
+ *
+ * the finished callback isn't called.
+ *
+ * \param qcvm virtual machine to use
+ * \returns result code
+ */
+int qcvm_cancel_checkpoint(qcvm_t *qcvm);
+
+/**
+ * \brief query the progress and cost of a pending checkpoint
+ * \param qcvm virtual machine to query
+ * \param entities_done pointer to uint32_t to contain the number of entities written so far
+ * \param bytes_written pointer to size_t to contain the number of bytes written so far
+ * \param num_pages pointer to size_t to contain the number of entity pages copied aside so far
+ * \returns result code
+ */
+int qcvm_query_checkpoint_info(qcvm_t *qcvm, uint32_t *entities_done, size_t *bytes_written, size_t *num_pages);
+
+/**
+ * \brief write a program image for faster startup
+ *
+ * the image holds the interned string table and the builtins that qc refers
+ * to by name, resolved against the current builtin table. it is keyed on the
+ * progs and the builtin names, in host byte order, and can be cached on disk
+ * and passed back in through qcvm->image.
+ *
+ * \param qcvm virtual machine to use, after qcvm_init()
+ * \param write callback to write len bytes of data
+ * \param user user data passed to write
+ * \returns result code
+ */
+int qcvm_save_image(qcvm_t *qcvm, size_t (*write)(qcvm_t *qcvm, const void *data, size_t len, void *user), void *user);
+
+/**
+ * \brief check whether a program image matches the loaded progs and builtins
+ *
+ * use this to tell whether a cached image is stale and should be written
+ * again. images from qcvm_build_shared_image() are checked the same way.
+ *
+ * \param qcvm virtual machine to use, after qcvm_init()
+ * \param image image data
+ * \param len size of the image data
+ * \returns QCVM_OK if it matches, QCVM_IMAGE_MISMATCH otherwise
+ */
+int qcvm_check_image(qcvm_t *qcvm, const void *image, size_t len);
+
+/**
+ * \brief build a shared program image
+ *
+ * this writes what qcvm_save_image() does, followed by the progs as qcvm
+ * has loaded it, so that vms in other processes can run from it in place
+ * through qcvm->shared_image. it also works as a plain image in
+ * qcvm->image. on linux, for example, one process
+ * can build it into a memfd, seal it, and hand it out to be mapped read-only.
+ * the image is specific to this build of qcvm and byte order. the globals go
+ * in as they are, so build it before running any qc.
+ *
+ * \param qcvm virtual machine to build it from, after qcvm_init()
+ * \param buf buffer to build it in, or null to only get its size
+ * \param len size of the buffer
+ * \param size pointer to size_t to contain the size of the image
+ * \returns result code
+ */
+int qcvm_build_shared_image(qcvm_t *qcvm, void *buf, size_t len, size_t *size);
+
+/**
+ * \brief set up a worker to run thinks alongside other workers
+ *
+ * a worker shares the progs, entities, builtins and string heaps of the vm,
+ * and has its own stacks, tempstrings and copy of the globals, so that
+ * several of them can run qc on separate threads at once. tempstrings
+ * returned on a worker are only valid on that worker, and creating any other
+ * kind of string there isn't supported. alloc_callback has to be safe to
+ * call from several threads.
+ *
+ * the vm must be left alone while its workers are running, and the workers
+ * shut down with qcvm_shutdown() before it is shut down or reloaded.
+ *
+ * \param qcvm virtual machine to share, after qcvm_init()
+ * \param worker zeroed virtual machine to set up as a worker
+ * \returns result code
+ */
+int qcvm_init_worker(qcvm_t *qcvm, qcvm_t *worker);
+
+/**
+ * \brief run a batch of entity thinks
+ *
+ * each think sets the self global to its entity and calls its function. the
+ * batch is meant to be shared out between num_workers workers, each calling
+ * this on its own thread with the same thinks and its own worker_index. by
+ * default a worker takes an even, contiguous slice of the batch. with
+ * QCVM_THINK_BY_ENTITY it takes every think whose entity maps to it instead,
+ * so all thinks of an entity run on the same worker, in batch order. with
+ * QCVM_THINK_SERIALIZE_BUILTINS, builtins not marked thread-safe are run
+ * under the lock callback, which the worker must have.
+ *
+ * the worker's globals are refreshed from the vm at the start of every
+ * batch, and whatever qc writes to them stays on the worker. entity writes
+ * go straight to the shared entities, so thinks on different workers should
+ * not touch the same fields. call qcvm_join_worker() once the batch is done.
+ *
+ * with QCVM_THINK_SPECULATE, nothing is written to the entities. every think
+ * runs against the state the batch started with, logging what it read and
+ * wrote, and qcvm_commit_thinks() is called afterwards to apply the logs. a
+ * think that calls a builtin not marked thread-safe, hits OPCODE_STATE or
+ * makes a tempstring is stopped and left to be run again on commit.
+ *
+ * this can also be called on the vm itself, to run a batch serially.
+ *
+ * \param worker worker to run on
+ * \param thinks thinks to run
+ * \param num_thinks number of thinks in the batch
+ * \param worker_index which share of the batch to run
+ * \param num_workers number of shares to split the batch into
+ * \param flags QCVM_THINK_* flags
+ * \returns result code
+ */
+int qcvm_run_thinks(qcvm_t *worker, const struct qcvm_think *thinks, size_t num_thinks, uint32_t worker_index, uint32_t num_workers, int flags);
+
+/**
+ * \brief commit a speculative batch of thinks
+ *
+ * this goes through the batch in order, and gives the same results as
+ * running it serially with qcvm_run_thinks() on the vm. a think is committed
+ * from its worker's log if nothing it read has been changed by an earlier
+ * think, and run again on the vm otherwise. thread-safe builtins must not
+ * touch anything but their arguments and return value for that to hold.
+ *
+ * call it from the thread that owns the vm, once every worker has run its
+ * share, with the same workers, thinks and flags. if the workers' logs
+ * don't cover exactly that batch, because one of them failed or was run
+ * with other flags, nothing is committed and QCVM_ARGUMENT_OUT_OF_RANGE is
+ * returned.
+ *
+ * \param qcvm virtual machine the workers share
+ * \param workers workers that ran the batch, in worker_index order
+ * \param num_workers number of workers
+ * \param thinks thinks that were run
+ * \param num_thinks number of thinks in the batch
+ * \param flags QCVM_THINK_* flags the batch was run with
+ * \param num_rerun pointer to size_t to contain the number of thinks that had to be run again
+ * \returns result code
+ */
+int qcvm_commit_thinks(qcvm_t *qcvm, qcvm_t **workers, uint32_t num_workers, const struct qcvm_think *thinks, size_t num_thinks, int flags, size_t *num_rerun);
+
+/**
+ * \brief merge what a worker did into the vm it shares
+ *
+ * this passes the entity writes of the last batches on to field tracking,
+ * published copies, qcvm_reset() and the zone string collector, and adds the worker's profile counts to the
+ * vm's. call it from the thread that owns the vm, after the batch is done
+ * and before either of them is used for anything else.
+ *
+ * \param worker worker to merge
+ * \returns result code
+ */
+int qcvm_join_worker(qcvm_t *worker);
+
+/**
+ * \brief query what a worker has done since it was set up
+ * \param worker worker to query
+ * \param num_thinks pointer to size_t to contain the number of thinks run
+ * \param num_serialized pointer to size_t to contain the number of builtin calls made under the lock
+ * \returns result code
+ */
+int qcvm_query_worker_info(qcvm_t *worker, size_t *num_thinks, size_t *num_serialized);
+
+/**
+ * \brief work out what every function can touch
+ *
+ * this goes over the code of every function once, and sums up which globals
+ * it reads and writes, which functions and builtins it can end up calling,
+ * and whether it's safe to run alongside other thinks. a safe function only
+ * touches fields of self, only writes globals that are its own locals or
+ * temporaries, doesn't change self, only calls safe functions and builtins
+ * marked thread-safe, and doesn't use OPCODE_STATE. thinks of safe functions
+ * on different entities can't see each other's writes, so they can run on
+ * workers in any order without speculation.
+ *
+ * builtins are looked up when this is called, so register them first. the
+ * results are dropped by qcvm_reload().
+ *
+ * \param qcvm virtual machine to use, after qcvm_init()
+ * \returns result code
+ */
+int qcvm_analyze_functions(qcvm_t *qcvm);
+
+/**
+ * \brief query whether a function is safe to run alongside other thinks
+ *
+ * when a function calls an unsafe one, reason is QCVM_UNSAFE_CALL, statement
+ * is the call and callee is the function called, which can be queried in
+ * turn. otherwise statement is where the problem is, and callee is the
+ * builtin for QCVM_UNSAFE_BUILTIN.
+ *
+ * \param qcvm virtual machine to use, after qcvm_analyze_functions()
+ * \param function function index
+ * \param reason pointer to int to contain QCVM_SAFE or a QCVM_UNSAFE_* reason
+ * \param statement pointer to uint32_t to contain the statement responsible
+ * \param callee pointer to uint32_t to contain the function called there
+ * \returns result code
+ */
+int qcvm_query_function_safety(qcvm_t *qcvm, uint32_t function, int *reason, uint32_t *statement, uint32_t *callee);
+
+/**
+ * \brief query what a function and everything it calls can touch
+ *
+ * reads and writes have one bit per global, and calls one bit per function,
+ * builtins included. they stay valid until the vm is reloaded or shut down.
+ *
+ * \param qcvm virtual machine to use, after qcvm_analyze_functions()
+ * \param function function index
+ * \param reads pointer to contain the bitmap of globals read
+ * \param writes pointer to contain the bitmap of globals written
+ * \param calls pointer to contain the bitmap of functions called
+ * \returns result code
+ */
+int qcvm_query_function_access(qcvm_t *qcvm, uint32_t function, const uint32_t **reads, const uint32_t **writes, const uint32_t **calls);
+
+/**
+ * \brief find the next batch of thinks that can run in parallel
+ *
+ * this takes thinks from the start of the list for as long as their functions
+ * are safe and their entities are all different. those can be run with
+ * qcvm_run_thinks() on workers, without speculation, and give the same
+ * results as running them serially. if the first think isn't safe, the batch
+ * is just that think, and it should be run on the vm itself. keep calling
+ * this on the rest of the list to run all of it in order.
+ *
+ * \param qcvm virtual machine to use, after qcvm_analyze_functions()
+ * \param thinks thinks to schedule
+ * \param num_thinks number of thinks
+ * \param batch_len pointer to size_t to contain the number of thinks in the batch
+ * \param parallel pointer to int to contain whether the batch can run on workers
+ * \returns result code
+ */
+int qcvm_schedule_thinks(qcvm_t *qcvm, const struct qcvm_think *thinks, size_t num_thinks, size_t *batch_len, int *parallel);
+
+/**
+ * \brief keep published copies of the entities for other threads to read
+ *
+ * this makes num_buffers copies of the entities, at least two, and from then
+ * on keeps track of which pages of entity memory get written. qc still runs
+ * on the vm's own entities, so nothing changes for it or for FIELD_PTR.
+ * entity writes made from c have to be reported with qcvm_touch_entities()
+ * or qcvm_touch_entity_fields() to be published. pass 0 to stop publishing
+ * and free the copies.
+ *
+ * \param qcvm virtual machine to use, after qcvm_init()
+ * \param num_buffers number of copies to keep, or 0 to stop
+ * \returns result code
+ */
+int qcvm_enable_publishing(qcvm_t *qcvm, uint32_t num_buffers);
+
+/**
+ * \brief publish the current state of the entities
+ *
+ * call this between frames, when no qc is running. it brings one of the
+ * copies up to date by copying only the pages written since that copy was
+ * last published, and hands it out with a new epoch. the copy stays as it
+ * is until a later call reuses it, which only happens once oldest_read is
+ * past its epoch. reader threads can use it with no locking for as long as
+ * they hold on to its epoch.
+ *
+ * handing the copy and its epoch to readers, and keeping track of the
+ * epochs they still hold, is up to the caller. pass the oldest epoch any
+ * reader still holds as oldest_read, or the last epoch published if none
+ * do. the copy published last is never reused by the next call.
+ *
+ * \param qcvm virtual machine to use
+ * \param oldest_read oldest epoch still being read
+ * \param entities pointer to contain the published entities
+ * \param epoch pointer to uint32_t to contain the epoch they were published with
+ * \returns QCVM_PUBLISH_BLOCKED if every other copy is still being read, result code otherwise
+ */
+int qcvm_publish(qcvm_t *qcvm, uint32_t oldest_read, const void **entities, uint32_t *epoch);
+
+/**
+ * \brief query the last publish
+ * \param qcvm virtual machine to use
+ * \param epoch pointer to uint32_t to contain the last epoch published
+ * \param num_pages pointer to size_t to contain the number of pages it copied
+ * \returns result code
+ */
+int qcvm_query_publish_info(qcvm_t *qcvm, uint32_t *epoch, size_t *num_pages);
+
+/**
+ * \brief set up a scheduler
+ *
+ * every instance gets its first tick right away. more than one core needs a
+ * lock_callback.
+ *
+ * \param sched scheduler to set up
+ * \returns result code
+ */
+int qcvm_sched_init(qcvm_sched_t *sched);
+
+/**
+ * \brief free everything a scheduler allocated
+ * \param sched scheduler to shut down
+ * \returns result code
+ */
+int qcvm_sched_shutdown(qcvm_sched_t *sched);
+
+/**
+ * \brief tick the next instance that's due on a core
+ *
+ * each host thread calls this in a loop with its own core index. it takes
+ * the most overdue instance from the core's queue, or the most overdue of any
+ * other core's if none on this one are due, and ticks it. an instance only
+ * ever runs on one thread at a time. when nothing is due anywhere, ran is set
+ * to 0 and next to when the next tick anywhere is due, so the thread can
+ * sleep until then.
+ *
+ * \param sched scheduler to use
+ * \param core index of the calling thread's core
+ * \param ran pointer to int to contain whether an instance was ticked
+ * \param next pointer to uint64_t to contain when the next tick is due
+ * \returns result code
+ */
+int qcvm_sched_run(qcvm_sched_t *sched, uint32_t core, int *ran, uint64_t *next);
+
+/**
+ * \brief query what an instance has been up to
+ * \param sched scheduler to use
+ * \param instance instance index
+ * \param ticks pointer to uint64_t to contain the number of ticks run
+ * \param skipped pointer to uint64_t to contain the number of ticks skipped to pay back the budget
+ * \param statements pointer to uint64_t to contain the number of statements run
+ * \param busy pointer to uint64_t to contain the time spent ticking
+ * \param core pointer to uint32_t to contain the core it's on
+ * \returns result code
+ */
+int qcvm_sched_query_instance(qcvm_sched_t *sched, size_t instance, uint64_t *ticks, uint64_t *skipped, uint64_t *statements, uint64_t *busy, uint32_t *core);
+
+/**
+ * \brief query what a core has been up to
+ *
+ * divide busy by the time elapsed to get the core's utilization.
+ *
+ * \param sched scheduler to use
+ * \param core core index
+ * \param ticks pointer to uint64_t to contain the number of ticks run
+ * \param statements pointer to uint64_t to contain the number of statements run
+ * \param busy pointer to uint64_t to contain the time spent ticking
+ * \param steals pointer to uint64_t to contain the number of instances taken from other cores
+ * \param num_instances pointer to size_t to contain the number of instances on the core
+ * \returns result code
+ */
+int qcvm_sched_query_core(qcvm_sched_t *sched, uint32_t core, uint64_t *ticks, uint64_t *statements, uint64_t *busy, uint64_t *steals, size_t *num_instances);
+
+/**
+ * \brief record the current state as the one qcvm_reset() goes back to
+ *
+ * this copies the entities, globals and tempstrings aside, replacing any
+ * state recorded before. the copy is kept apart from the snapshots, so
+ * taking, restoring and releasing those doesn't affect it. from then on the
+ * entity write barrier notes which pages get written, and workers' writes
+ * are noted when they're joined, so non-speculative workers can run on the
+ * vm as usual. that is also why the whole of entity memory is copied rather
+ * than each page as it's first written: a worker writes the shared entities
+ * directly, so there's no chance to save a page before it changes. host
+ * writes to entity memory have to be announced with qcvm_touch_entities()
+ * or qcvm_touch_entity_fields() to be undone. the copy is dropped by
+ * qcvm_reload().
+ *
+ * \param qcvm virtual machine to use
+ * \returns result code
+ */
+int qcvm_mark_pristine(qcvm_t *qcvm);
+
+/**
+ * \brief put a vm back the way it was when qcvm_mark_pristine() was called
+ *
+ * this drops whatever qc was running, any checkpoint and every snapshot,
+ * then rolls the entities, globals and tempstrings back. only the entity
+ * pages written since are copied back, so a reset costs what changed rather
+ * than the size of the world, and dirty field tracking and published copies
+ * only see those pages. it must not be called while workers of the vm are
+ * running a batch or before they've been joined. zone strings made since
+ * are left for the collector.
+ *
+ * \param qcvm virtual machine to use
+ * \returns result code
+ */
+int qcvm_reset(qcvm_t *qcvm);
+
+/**
+ * \brief set up a pool
+ *
+ * every instance is marked pristine and starts out free.
+ *
+ * \param pool pool to set up
+ * \returns result code
+ */
+int qcvm_pool_init(qcvm_pool_t *pool);
+
+/**
+ * \brief take a free vm from a pool
+ * \param pool pool to use
+ * \param qcvm pointer to contain the vm
+ * \returns QCVM_POOL_EMPTY if every vm is taken, result code otherwise
+ */
+int qcvm_pool_acquire(qcvm_pool_t *pool, qcvm_t **qcvm);
+
+/**
+ * \brief reset a vm and give it back to a pool
+ *
+ * the reset happens here, so that taking a vm is always quick.
+ *
+ * \param pool pool to use
+ * \param qcvm vm taken from it with qcvm_pool_acquire()
+ * \returns result code
+ */
+int qcvm_pool_release(qcvm_pool_t *pool, qcvm_t *qcvm);
+
+/**
+ * \brief query how many vms in a pool are free
+ * \param pool pool to use
+ * \param num_free pointer to size_t to contain the number of free vms
+ * \returns result code
+ */
+int qcvm_pool_query_info(qcvm_pool_t *pool, size_t *num_free);
+
+/**
+ * \brief fork a vm for a what-if run
+ *
+ * the fork shares the progs, entities and string heaps of the vm, and gets
+ * a copy of its globals. it runs qc with qcvm_run() like any other vm, but
+ * entity writes are kept on the fork, so the vm never sees them. the cost
+ * depends on the number of globals and functions, not on the size of the
+ * world. as with speculative thinks, a fork can only call builtins marked
+ * thread-safe, and stops on OPCODE_STATE.
+ *
+ * forks only ever read the vm, so any number of them can run at once on
+ * different threads, as long as the vm itself isn't changed meanwhile.
+ * forking a fork of the same vm again throws away what it did and starts it
+ * over from the vm as it is now, without allocating anything. to discard a
+ * fork for good, call qcvm_shutdown() on it.
+ *
+ * \param qcvm vm to fork
+ * \param fork zeroed vm, or a fork of qcvm, to set up as a fork
+ * \returns result code
+ */
+int qcvm_fork(qcvm_t *qcvm, qcvm_t *fork);
+
+/**
+ * \brief commit what a fork did to the vm it was forked from
+ *
+ * the globals and entity fields written by qc on the fork are written to
+ * the vm, if everything the fork read is still the same on the vm. globals
+ * set by the host on the fork are treated as its inputs and are not
+ * committed. a fork that made tempstrings can't be committed. either way
+ * the fork starts over from the vm afterwards, as if forked again.
+ *
+ * \param qcvm vm the fork was made from
+ * \param fork fork to commit
+ * \returns QCVM_FORK_CONFLICT if the vm has changed something the fork read, result code otherwise
+ */
+int qcvm_commit_fork(qcvm_t *qcvm, qcvm_t *fork);
+
+/**
+ * \brief read entity fields as a fork sees them
+ * \param fork fork to read
+ * \param e entity to read
+ * \param ofs first field to read
+ * \param count number of fields to read
+ * \param fields pointer to count fields to contain their values
+ * \returns result code
+ */
+int qcvm_get_fork_fields(qcvm_t *fork, uint32_t e, uint32_t ofs, uint32_t count, uint32_t *fields);
+
+/**
+ * \brief set up the queues of a channel
+ *
+ * where the compiler has no atomic builtins, this needs a lock_callback.
+ *
+ * \param channel channel to set up
+ * \returns result code
+ */
+int qcvm_channel_init(qcvm_channel_t *channel);
+
+/**
+ * \brief release memory allocated by a channel
+ *
+ * messages still queued are dropped, and the instances leave the channel.
+ *
+ * \param channel channel to shut down
+ * \returns result code
+ */
+int qcvm_channel_shutdown(qcvm_channel_t *channel);
+
+/**
+ * \brief send a message to an instance of a channel
+ *
+ * this can be called from any thread, and doesn't wait.
+ *
+ * \param channel channel to send on
+ * \param to address of the receiving instance
+ * \param message message to send, with from set by the caller
+ * \returns QCVM_QUEUE_FULL if the receiver has too many messages waiting, result code otherwise
+ */
+int qcvm_send_message(qcvm_channel_t *channel, uint32_t to, const struct qcvm_message *message);
+
+/**
+ * \brief dispatch messages waiting for a vm into a qc function
+ *
+ * call this at a frame boundary, from the thread that runs the vm. each
+ * message is one call to the handler, which is declared as
+ *
+ *     void(float from, float tag, float f, vector v, string s, entity e)
+ *
+ * with the value in the argument of its type and the others zero. messages
+ * sent while this runs, including by the handler, wait for the next call.
+ *
+ * \param qcvm vm to dispatch to
+ * \param handler name of the qc function to call
+ * \param max most messages to dispatch, or 0 for all of them
+ * \param num_dispatched pointer to size_t to contain the number of messages dispatched
+ * \returns result code
+ */
+int qcvm_dispatch_messages(qcvm_t *qcvm, const char *handler, size_t max, size_t *num_dispatched);
+
+/**
+ * \brief query the queue of an instance of a channel
+ * \param channel channel to query
+ * \param instance address of the instance
+ * \param num_queued pointer to size_t to contain the number of messages waiting
+ * \param num_dropped pointer to size_t to contain the number of sends that found the queue full
+ * \returns result code
+ */
+int qcvm_query_channel_info(qcvm_channel_t *channel, uint32_t instance, size_t *num_queued, size_t *num_dropped);
+
+/**
+ * \brief builtins for qc to send messages with
+ *
+ * add these to the builtin table of each instance under whatever names the
+ * progs uses. they are declared in qc as
+ *
+ *     float(float to, float tag, float f) send_float
+ *     float(float to, float tag, vector v) send_vector
+ *     float(float to, float tag, string s) send_string
+ *     float(float to, float tag, entity e) send_entity
+ *
+ * and return 1 if the message was queued, and 0 if the receiver's queue was
+ * full, the address was wrong, or the string was longer than
+ * QCVM_MESSAGE_STRING_SIZE allows. they never wait, so workers can call them
+ * without QCVM_THINK_SERIALIZE_BUILTINS, but they are not thread-safe in the
+ * QCVM_BUILTIN_THREAD_SAFE sense.
+ */
+int qcvm_builtin_send_float(qcvm_t *qcvm, void *user);
+int qcvm_builtin_send_vector(qcvm_t *qcvm, void *user);
+int qcvm_builtin_send_string(qcvm_t *qcvm, void *user);
+int qcvm_builtin_send_entity(qcvm_t *qcvm, void *user);
+
 #ifdef __cplusplus
 }
 #endif
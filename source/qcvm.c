@@ -24,7 +24,7 @@ SOFTWARE.
 
 #include <qcvm/qcvm.h>
 
-/* for strcmp and strlen */
+/* for strcmp, strlen and memcpy */
 #if QCVM_NO_STDLIB
 #ifdef QCVM_STRLEN
 extern size_t QCVM_STRLEN(const char *s);
@@ -53,10 +53,26 @@ static int QCVM_STRCMP(const char *a, const char *b)
 #endif
 }
 #endif
+#ifdef QCVM_MEMCPY
+extern void *QCVM_MEMCPY(void *dst, const void *src, size_t n);
+#else
+static void *QCVM_MEMCPY(void *dst, const void *src, size_t n)
+{
+#if defined(__has_builtin) && __has_builtin(__builtin_memcpy)
+	return __builtin_memcpy(dst, src, n);
+#else
+	uint8_t *d = (uint8_t *)dst;
+	const uint8_t *s = (const uint8_t *)src;
+	while (n--) *d++ = *s++;
+	return dst;
+#endif
+}
+#endif
 #else
 #include <string.h>
 #define QCVM_STRLEN(s) strlen(s)
 #define QCVM_STRCMP(a, b) strcmp(a, b)
+#define QCVM_MEMCPY(dst, src, n) memcpy(dst, src, n)
 #endif
 
 /* endian handling */
@@ -117,8 +133,70 @@ static const uint32_t progs_version_extended = 7;
 #define OFS_PARM7 (25)
 #define OFS_RESERVED (28)
 
+/*
+ * string handles
+ *
+ * non-negative handles are offsets into the progs string table. negative
+ * handles are negated 31-bit values, where the top 3 bits select the heap
+ * the string lives in and the rest is an offset into that heap.
+ */
+#define STRING_HEAP_SHIFT (28)
+#define STRING_OFS_MAX ((1 << STRING_HEAP_SHIFT) - 1)
+#define STRING_HEAP(h) ((h) >> STRING_HEAP_SHIFT)
+#define STRING_OFS(h) ((h) & STRING_OFS_MAX)
+#define STRING_HANDLE(heap, ofs) (-1 * (int32_t)(((uint32_t)(heap) << STRING_HEAP_SHIFT) | (uint32_t)(ofs)))
+
+enum {
+	STRING_HEAP_TEMPSTRINGS,
+	STRING_HEAP_ZONE,
+	STRING_HEAP_EXTERNAL,
+	STRING_HEAP_EXTERNAL_FRAME
+};
+
+/*
+ * zone strings
+ *
+ * the heap offset of a zone string is the slab index in the upper bits and
+ * the byte offset into the slab in the lower bits. small strings share slabs
+ * split into power-of-two slots, anything bigger gets a slab of its own.
+ */
+#define ZONE_SLAB_SIZE (16384)
+#define ZONE_MIN_SLOT (16)
+#define ZONE_SLAB_SHIFT (16)
+#define ZONE_MAX_STRING ((1 << ZONE_SLAB_SHIFT) - 1)
+#define ZONE_MAX_SLABS (1 << (STRING_HEAP_SHIFT - ZONE_SLAB_SHIFT))
+#define ZONE_LARGE_CLASS (11)
+
+/*
+ * every tempstring and zone string is stored right after a header caching
+ * its length and hash, so builtins don't have to walk it again. external
+ * strings keep theirs in the registration table.
+ */
+#define STRING_HEADER_SIZE (sizeof(struct qcvm_string_header))
+#define ALIGN4(n) (((n) + 3) & ~(size_t)3)
+
+/* whether memory belongs to the shared image a vm runs from */
+#define IN_SHARED_IMAGE(q, p) ((q)->shared_image && (const uint8_t *)(p) >= (const uint8_t *)(q)->shared_image && (const uint8_t *)(p) < (const uint8_t *)(q)->shared_image + (q)->len_shared_image)
+
+/* open addressing markers for the intern table */
+#define INTERN_EMPTY (INT32_MAX)
+#define INTERN_TOMBSTONE (INT32_MAX - 1)
+
+enum {
+	ZONE_GC_IDLE,
+	ZONE_GC_MARK,
+	ZONE_GC_SWEEP
+};
+
+/* set on global and field defs that should be saved to disk */
+#define DEF_SAVEGLOBAL (1 << 15)
+#define DEF_TYPE(v) ((v)->type & ~DEF_SAVEGLOBAL)
+
 #define FIELD_PTR(e, o) (&((uint32_t *)qcvm->entities + ((e) * qcvm->header.num_entity_fields))[(o)])
 
+/* nonzero if writes to entity memory have to go through entity_write_barrier() */
+#define HAS_WRITE_BARRIER(q) ((q)->num_snapshots || (q)->dirty_fields || (q)->checkpoint || (q)->worker || (q)->publisher || (q)->pristine_bits)
+
 /* opcodes */
 enum {
 	/* vanilla */
@@ -140,64 +218,476 @@ enum {
 	NUM_OPCODES
 };
 
-int qcvm_init(qcvm_t *qcvm)
+/* how an opcode uses the globals its operands point at */
+enum {
+	ACCESS_NONE,
+	ACCESS_READ,
+	ACCESS_READ_VECTOR,
+	ACCESS_WRITE,
+	ACCESS_WRITE_VECTOR
+};
+
+#define R ACCESS_READ
+#define RV ACCESS_READ_VECTOR
+#define W ACCESS_WRITE
+#define WV ACCESS_WRITE_VECTOR
+
+/* operand accesses per opcode. calls, returns and entity memory aren't covered */
+static const uint8_t opcode_access[NUM_OPCODES][3] = {
+	/* DONE */ {RV, 0, 0}, /* MUL_F */ {R, R, W}, /* MUL_V */ {RV, RV, W},
+	/* MUL_FV */ {R, RV, WV}, /* MUL_VF */ {RV, R, WV}, /* DIV_F */ {R, R, W},
+	/* ADD_F */ {R, R, W}, /* ADD_V */ {RV, RV, WV}, /* SUB_F */ {R, R, W},
+	/* SUB_V */ {RV, RV, WV}, /* EQ_F */ {R, R, W}, /* EQ_V */ {RV, RV, W},
+	/* EQ_S */ {R, R, W}, /* EQ_E */ {R, R, W}, /* EQ_FNC */ {R, R, W},
+	/* NE_F */ {R, R, W}, /* NE_V */ {RV, RV, W}, /* NE_S */ {R, R, W},
+	/* NE_E */ {R, R, W}, /* NE_FNC */ {R, R, W}, /* LE */ {R, R, W},
+	/* GE */ {R, R, W}, /* LT */ {R, R, W}, /* GT */ {R, R, W},
+	/* LOAD_F */ {R, R, W}, /* LOAD_V */ {R, R, WV}, /* LOAD_S */ {R, R, W},
+	/* LOAD_ENT */ {R, R, W}, /* LOAD_FLD */ {R, R, W}, /* LOAD_FNC */ {R, R, W},
+	/* ADDRESS */ {R, R, W}, /* STORE_F */ {R, W, 0}, /* STORE_V */ {RV, WV, 0},
+	/* STORE_S */ {R, W, 0}, /* STORE_ENT */ {R, W, 0}, /* STORE_FLD */ {R, W, 0},
+	/* STORE_FNC */ {R, W, 0}, /* STOREP_F */ {R, R, 0}, /* STOREP_V */ {RV, R, 0},
+	/* STOREP_S */ {R, R, 0}, /* STOREP_ENT */ {R, R, 0}, /* STOREP_FLD */ {R, R, 0},
+	/* STOREP_FNC */ {R, R, 0}, /* RETURN */ {RV, 0, 0}, /* NOT_F */ {R, 0, W},
+	/* NOT_V */ {RV, 0, W}, /* NOT_S */ {R, 0, W}, /* NOT_ENT */ {R, 0, W},
+	/* NOT_FNC */ {R, 0, W}, /* IF */ {R, 0, 0}, /* IFNOT */ {R, 0, 0},
+	/* CALL0 */ {R, 0, 0}, /* CALL1 */ {R, 0, 0}, /* CALL2 */ {R, 0, 0},
+	/* CALL3 */ {R, 0, 0}, /* CALL4 */ {R, 0, 0}, /* CALL5 */ {R, 0, 0},
+	/* CALL6 */ {R, 0, 0}, /* CALL7 */ {R, 0, 0}, /* CALL8 */ {R, 0, 0},
+	/* STATE */ {R, R, 0}, /* GOTO */ {0, 0, 0}, /* AND_F */ {R, R, W},
+	/* OR_F */ {R, R, W}, /* BITAND_F */ {R, R, W}, /* BITOR_F */ {R, R, W}
+};
+
+#undef R
+#undef RV
+#undef W
+#undef WV
+
+/* the speculative run of one think, and where its log starts */
+struct qcvm_spec_task {
+	uint32_t think;
+	int32_t result;
+	uint32_t log;
+	uint32_t num_reads;
+	uint32_t num_writes;
+};
+
+/* an entity word a speculative think has touched */
+struct qcvm_spec_word {
+	uint32_t word;
+	uint32_t slot;
+	uint32_t first;
+	uint32_t value;
+	uint32_t flags;
+};
+
+/* what a worker keeps on top of its own vm */
+struct qcvm_worker {
+	qcvm_t *parent;
+	int32_t self;
+	int flags;
+	uint32_t *writes;
+	size_t num_writes;
+	size_t max_writes;
+	size_t num_thinks;
+	size_t num_serialized;
+
+	/* speculation */
+	int fork;
+	int speculating;
+	union qcvm_global *base_globals;
+	uint8_t *global_flags;
+	uint32_t *touched_globals;
+	size_t num_touched_globals;
+	size_t max_touched_globals;
+	struct qcvm_spec_word *words;
+	size_t num_words;
+	size_t max_words;
+	uint32_t *word_slots;
+	uint32_t num_word_slots;
+	struct qcvm_spec_task *tasks;
+	size_t num_tasks;
+	size_t max_tasks;
+	size_t commit_cursor;
+	uint32_t *log;
+	size_t num_log;
+	size_t max_log;
+};
+
+#define SPECULATING(q) ((q)->worker && (q)->worker->speculating)
+
+/* why a function isn't safe, and where */
+struct qcvm_function_summary {
+	int reason;
+	uint32_t statement;
+	uint32_t callee;
+};
+
+/* what qcvm_analyze_functions() found, with a bitmap row per function */
+struct qcvm_analysis {
+	struct qcvm_function_summary *summaries;
+	uint32_t global_words;
+	uint32_t function_words;
+	uint32_t *reads;
+	uint32_t *writes;
+	uint32_t *calls;
+	uint32_t *entity_marks;
+	uint32_t num_entities;
+};
+
+static const char *str_ofs(qcvm_t *qcvm, int32_t s);
+static int entity_write_barrier(qcvm_t *qcvm, size_t ofs, size_t len);
+static void mark_snapshot_strings(qcvm_t *qcvm);
+static void free_snapshots(qcvm_t *qcvm);
+static void mark_dirty_fields(qcvm_t *qcvm, size_t ofs, size_t len);
+static void free_dirty_fields(qcvm_t *qcvm);
+static void mark_checkpoint_strings(qcvm_t *qcvm);
+static int preserve_checkpoint_pages(qcvm_t *qcvm, size_t ofs, size_t len);
+static void free_checkpoint(qcvm_t *qcvm);
+static int load_image(qcvm_t *qcvm);
+static int attach_shared_image(qcvm_t *qcvm);
+static const struct qcvm_header *shared_progs_header(qcvm_t *qcvm);
+static int worker_write_barrier(qcvm_t *qcvm, size_t ofs, size_t len);
+static void free_worker(qcvm_t *qcvm);
+static void spec_read_globals(qcvm_t *qcvm, uint32_t g, uint32_t n);
+static void spec_write_globals(qcvm_t *qcvm, uint32_t g, uint32_t n);
+static int speculate_statement(qcvm_t *qcvm, int *handled);
+static void free_analysis(qcvm_t *qcvm);
+static void mark_published_pages(qcvm_t *qcvm, size_t ofs, size_t len);
+static void free_publisher(qcvm_t *qcvm);
+static void mark_pristine_pages(qcvm_t *qcvm, size_t ofs, size_t len);
+
+/* 32-bit fnv-1a */
+static uint32_t hash_string(const char *s, size_t *len)
+{
+	uint32_t hash = 2166136261u;
+	const char *p;
+
+	for (p = s; *p; p++)
+	{
+		hash ^= (uint8_t)*p;
+		hash *= 16777619u;
+	}
+
+	if (len)
+		*len = (size_t)(p - s);
+
+	/* 0 is reserved for "not computed yet" */
+	return hash ? hash : 1;
+}
+
+/* rebuild intern table with the given power of two size */
+static int intern_resize(qcvm_t *qcvm, uint32_t size)
+{
+	struct qcvm_intern *table;
+	uint32_t i, x;
+
+	table = qcvm->alloc_callback(qcvm, NULL, size * sizeof(struct qcvm_intern), qcvm->alloc_callback_user);
+	if (!table)
+		return QCVM_OUT_OF_MEMORY;
+
+	for (i = 0; i < size; i++)
+		table[i].s = INTERN_EMPTY;
+
+	/* move over live entries, dropping tombstones */
+	for (i = 0; i < qcvm->intern_table_size; i++)
+	{
+		if (qcvm->intern_table[i].s == INTERN_EMPTY || qcvm->intern_table[i].s == INTERN_TOMBSTONE)
+			continue;
+
+		for (x = qcvm->intern_table[i].hash & (size - 1); table[x].s != INTERN_EMPTY; x = (x + 1) & (size - 1)) ;
+		table[x] = qcvm->intern_table[i];
+	}
+
+	if (qcvm->intern_table && !IN_SHARED_IMAGE(qcvm, qcvm->intern_table))
+		qcvm->alloc_callback(qcvm, qcvm->intern_table, 0, qcvm->alloc_callback_user);
+
+	qcvm->intern_table = table;
+	qcvm->intern_table_size = size;
+	qcvm->num_intern_tombstones = 0;
+
+	return QCVM_OK;
+}
+
+/* returns nonzero and fills out if an interned copy of s exists */
+static int intern_find(qcvm_t *qcvm, const char *s, uint32_t hash, int32_t *out)
+{
+	struct qcvm_intern *entry;
+	uint32_t i, mask;
+
+	if (!qcvm->intern_table)
+		return 0;
+
+	mask = qcvm->intern_table_size - 1;
+	for (i = hash & mask; qcvm->intern_table[i].s != INTERN_EMPTY; i = (i + 1) & mask)
+	{
+		entry = &qcvm->intern_table[i];
+		if (entry->s != INTERN_TOMBSTONE && entry->hash == hash && QCVM_STRCMP(str_ofs(qcvm, entry->s), s) == 0)
+		{
+			*out = entry->s;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static int intern_insert(qcvm_t *qcvm, int32_t handle, uint32_t hash)
+{
+	uint32_t i, mask, size;
+	int r;
+
+	/* a table read from a shared image is copied before it's first written */
+	if (IN_SHARED_IMAGE(qcvm, qcvm->intern_table) && (r = intern_resize(qcvm, qcvm->intern_table_size)) != QCVM_OK)
+		return r;
+
+	/* keep load factor under 3/4 */
+	if ((qcvm->num_interned + qcvm->num_intern_tombstones + 1) * 4 > qcvm->intern_table_size * 3)
+	{
+		for (size = 16; size * 3 < (qcvm->num_interned + 1) * 8; size *= 2) ;
+		if ((r = intern_resize(qcvm, size)) != QCVM_OK)
+			return r;
+	}
+
+	mask = qcvm->intern_table_size - 1;
+	for (i = hash & mask; qcvm->intern_table[i].s != INTERN_EMPTY && qcvm->intern_table[i].s != INTERN_TOMBSTONE; i = (i + 1) & mask) ;
+
+	if (qcvm->intern_table[i].s == INTERN_TOMBSTONE)
+		qcvm->num_intern_tombstones--;
+
+	qcvm->intern_table[i].s = handle;
+	qcvm->intern_table[i].hash = hash;
+	qcvm->num_interned++;
+
+	return QCVM_OK;
+}
+
+static void intern_remove(qcvm_t *qcvm, int32_t handle, uint32_t hash)
+{
+	uint32_t i, mask;
+
+	/* a shared table only holds progs strings, which are never removed */
+	if (!qcvm->intern_table || IN_SHARED_IMAGE(qcvm, qcvm->intern_table))
+		return;
+
+	mask = qcvm->intern_table_size - 1;
+	for (i = hash & mask; qcvm->intern_table[i].s != INTERN_EMPTY; i = (i + 1) & mask)
+	{
+		if (qcvm->intern_table[i].s == handle)
+		{
+			qcvm->intern_table[i].s = INTERN_TOMBSTONE;
+			qcvm->num_interned--;
+			qcvm->num_intern_tombstones++;
+			return;
+		}
+	}
+}
+
+static void free_interned(qcvm_t *qcvm)
+{
+	if (qcvm->intern_table && !IN_SHARED_IMAGE(qcvm, qcvm->intern_table))
+		qcvm->alloc_callback(qcvm, qcvm->intern_table, 0, qcvm->alloc_callback_user);
+	if (qcvm->strings_canonical && !IN_SHARED_IMAGE(qcvm, qcvm->strings_canonical))
+		qcvm->alloc_callback(qcvm, qcvm->strings_canonical, 0, qcvm->alloc_callback_user);
+
+	qcvm->intern_table = NULL;
+	qcvm->strings_canonical = NULL;
+	qcvm->intern_table_size = qcvm->num_interned = qcvm->num_intern_tombstones = 0;
+}
+
+/* point string constants at canonical copies */
+static void dedup_string_constants(qcvm_t *qcvm)
 {
-	struct qcvm_header *header;
+	int32_t found;
 	size_t i;
 
-	if (!qcvm)
-		return QCVM_NULL_POINTER;
-	if (!qcvm->progs || !qcvm->len_progs)
-		return QCVM_INVALID_PROGS;
+	for (i = 0; i < qcvm->num_global_vars; i++)
+	{
+		union qcvm_global *g = &qcvm->globals[qcvm->global_vars[i].ofs];
 
-	/* file header */
-	header = (struct qcvm_header *)qcvm->progs;
+		if (DEF_TYPE(&qcvm->global_vars[i]) != QCVM_TYPE_STRING)
+			continue;
+		if (g->i <= 0 || g->ui >= qcvm->len_strings || qcvm->strings_canonical[g->ui / 32] & (1u << (g->ui % 32)))
+			continue;
 
-	/* fixup endianness */
-	qcvm->header.version = LITTLE32(header->version);
-	qcvm->header.crc = LITTLE32(header->crc);
-	qcvm->header.ofs_statements = LITTLE32(header->ofs_statements);
-	qcvm->header.num_statements = LITTLE32(header->num_statements);
-	qcvm->header.ofs_global_vars = LITTLE32(header->ofs_global_vars);
-	qcvm->header.num_global_vars = LITTLE32(header->num_global_vars);
-	qcvm->header.ofs_field_vars = LITTLE32(header->ofs_field_vars);
-	qcvm->header.num_field_vars = LITTLE32(header->num_field_vars);
-	qcvm->header.ofs_functions = LITTLE32(header->ofs_functions);
-	qcvm->header.num_functions = LITTLE32(header->num_functions);
-	qcvm->header.ofs_strings = LITTLE32(header->ofs_strings);
-	qcvm->header.len_strings = LITTLE32(header->len_strings);
-	qcvm->header.ofs_globals = LITTLE32(header->ofs_globals);
-	qcvm->header.num_globals = LITTLE32(header->num_globals);
-	qcvm->header.num_entity_fields = LITTLE32(header->num_entity_fields);
+		if (intern_find(qcvm, &qcvm->strings[g->i], hash_string(&qcvm->strings[g->i], NULL), &found))
+			g->i = found;
+	}
+}
 
-	/* check recognized versions */
-	if (qcvm->header.version == progs_version_old)
+/* intern the progs string table and point string constants at canonical copies */
+static int intern_progs_strings(qcvm_t *qcvm)
+{
+	struct qcvm_zone_slab *slab;
+	size_t i, len, count;
+	uint32_t hash, size, x;
+	int32_t found;
+	int r;
+
+	free_interned(qcvm);
+
+	/* the table must be properly terminated for this to be safe */
+	if (!qcvm->alloc_callback || !qcvm->len_strings || qcvm->strings[qcvm->len_strings - 1] != '\0')
+		return QCVM_OK;
+
+	qcvm->strings_canonical = qcvm->alloc_callback(qcvm, NULL, ((qcvm->len_strings + 31) / 32) * 4, qcvm->alloc_callback_user);
+	if (!qcvm->strings_canonical)
+		return QCVM_OUT_OF_MEMORY;
+
+	for (i = 0; i < (qcvm->len_strings + 31) / 32; i++)
+		qcvm->strings_canonical[i] = 0;
+
+	/* size the table for every string up front */
+	for (i = 0, count = 0; i < qcvm->len_strings; i++)
+		if (qcvm->strings[i] == '\0')
+			count++;
+	for (size = 16; size * 3 < count * 8; size *= 2) ;
+	if ((r = intern_resize(qcvm, size)) != QCVM_OK)
+		return r;
+
+	/* zone strings interned before a reload stay canonical */
+	for (i = 0; i < qcvm->num_zone_slabs; i++)
+	{
+		slab = &qcvm->zone_slabs[i];
+		if (!slab->data)
+			continue;
+
+		for (x = 0; x < slab->num_slots; x++)
+		{
+			if (!(slab->interned[x / 32] & (1u << (x % 32))))
+				continue;
+
+			hash = ((struct qcvm_string_header *)&slab->data[x * slab->slot_size])->hash;
+			if ((r = intern_insert(qcvm, STRING_HANDLE(STRING_HEAP_ZONE, (i << ZONE_SLAB_SHIFT) | (x * slab->slot_size)), hash)) != QCVM_OK)
+				return r;
+		}
+	}
+
+	/* the first copy of each string is the canonical one */
+	for (i = 0; i < qcvm->len_strings; i += len + 1)
+	{
+		hash = hash_string(&qcvm->strings[i], &len);
+		if (intern_find(qcvm, &qcvm->strings[i], hash, &found))
+			continue;
+
+		if ((r = intern_insert(qcvm, (int32_t)i, hash)) != QCVM_OK)
+			return r;
+
+		qcvm->strings_canonical[i / 32] |= 1u << (i % 32);
+	}
+
+	dedup_string_constants(qcvm);
+
+	return QCVM_OK;
+}
+
+static int check_progs_version(uint32_t version)
+{
+	if (version == progs_version_old)
 		return QCVM_UNSUPPORTED_VERSION;
-	else if (qcvm->header.version == progs_version_extended)
+	else if (version == progs_version_extended)
 		return QCVM_UNSUPPORTED_VERSION;
-	else if (qcvm->header.version != progs_version_standard)
+	else if (version != progs_version_standard)
 		return QCVM_INVALID_PROGS;
 
-	/* other sanity checks */
-	if (!qcvm->entities)
-		return QCVM_NO_ENTITIES;
+	return QCVM_OK;
+}
 
-	/* tempstrings */
-	if (qcvm->tempstrings)
-	{
-		qcvm->tempstrings[0] = '\0';
-		qcvm->tempstrings_ptr = qcvm->tempstrings + 1;
-	}
-	else
+static void free_progs_copies(qcvm_t *qcvm)
+{
+	if (qcvm->progs_copy)
+		qcvm->alloc_callback(qcvm, qcvm->progs_copy, 0, qcvm->alloc_callback_user);
+	if (qcvm->functions_copy)
+		qcvm->alloc_callback(qcvm, qcvm->functions_copy, 0, qcvm->alloc_callback_user);
+	if (qcvm->globals_copy)
+		qcvm->alloc_callback(qcvm, qcvm->globals_copy, 0, qcvm->alloc_callback_user);
+
+	qcvm->progs_copy = NULL;
+	qcvm->functions_copy = NULL;
+	qcvm->globals_copy = NULL;
+}
+
+/* make a writable copy of part of a read-only progs */
+static void *copy_progs_section(qcvm_t *qcvm, const uint8_t *base, size_t ofs, size_t len)
+{
+	void *copy;
+
+	if (!qcvm->alloc_callback || ofs > qcvm->len_progs || len > qcvm->len_progs - ofs)
+		return NULL;
+
+	if ((copy = qcvm->alloc_callback(qcvm, NULL, len ? len : 1, qcvm->alloc_callback_user)) != NULL)
+		QCVM_MEMCPY(copy, base + ofs, len);
+
+	return copy;
+}
+
+/* parse the progs buffer and set up pointers into it */
+/* decode a header from file byte order */
+static void read_progs_header(const struct qcvm_header *in, struct qcvm_header *out)
+{
+	out->version = LITTLE32(in->version);
+	out->crc = LITTLE32(in->crc);
+	out->ofs_statements = LITTLE32(in->ofs_statements);
+	out->num_statements = LITTLE32(in->num_statements);
+	out->ofs_global_vars = LITTLE32(in->ofs_global_vars);
+	out->num_global_vars = LITTLE32(in->num_global_vars);
+	out->ofs_field_vars = LITTLE32(in->ofs_field_vars);
+	out->num_field_vars = LITTLE32(in->num_field_vars);
+	out->ofs_functions = LITTLE32(in->ofs_functions);
+	out->num_functions = LITTLE32(in->num_functions);
+	out->ofs_strings = LITTLE32(in->ofs_strings);
+	out->len_strings = LITTLE32(in->len_strings);
+	out->ofs_globals = LITTLE32(in->ofs_globals);
+	out->num_globals = LITTLE32(in->num_globals);
+	out->num_entity_fields = LITTLE32(in->num_entity_fields);
+}
+
+static int load_progs(qcvm_t *qcvm)
+{
+	uint8_t *base;
+#if QCVM_BIG_ENDIAN
+	size_t i;
+#endif
+	int r;
+
+	/* file header, with endianness fixed up */
+	read_progs_header((const struct qcvm_header *)qcvm->progs, &qcvm->header);
+
+	/* check recognized versions */
+	if ((r = check_progs_version(qcvm->header.version)) != QCVM_OK)
+		return r;
+
+	base = (uint8_t *)qcvm->progs;
+
+	/*
+	 * a read-only progs is never written to. the sections qcvm changes at
+	 * runtime are copied out instead, or all of it if it has to be swapped.
+	 */
+	qcvm->progs_copy = NULL;
+	qcvm->functions_copy = NULL;
+	qcvm->globals_copy = NULL;
+	if (qcvm->readonly_progs)
 	{
-		qcvm->tempstrings = qcvm->tempstrings_ptr = "";
-		qcvm->len_tempstrings = 1;
+#if QCVM_BIG_ENDIAN
+		if ((qcvm->progs_copy = copy_progs_section(qcvm, base, 0, qcvm->len_progs)) == NULL)
+			return QCVM_OUT_OF_MEMORY;
+		base = qcvm->progs_copy;
+#else
+		qcvm->functions_copy = copy_progs_section(qcvm, base, qcvm->header.ofs_functions, (size_t)qcvm->header.num_functions * sizeof(struct qcvm_function));
+		qcvm->globals_copy = copy_progs_section(qcvm, base, qcvm->header.ofs_globals, (size_t)qcvm->header.num_globals * sizeof(union qcvm_global));
+		if (!qcvm->functions_copy || !qcvm->globals_copy)
+		{
+			free_progs_copies(qcvm);
+			return QCVM_OUT_OF_MEMORY;
+		}
+#endif
 	}
 
 	/* statements */
 	qcvm->num_statements = qcvm->header.num_statements;
-	qcvm->statements = (struct qcvm_statement *)((uint8_t *)qcvm->progs + qcvm->header.ofs_statements);
+	qcvm->statements = (struct qcvm_statement *)(base + qcvm->header.ofs_statements);
 
+#if QCVM_BIG_ENDIAN
 	/* fixup endianness */
 	for (i = 0; i < qcvm->num_statements; i++)
 	{
@@ -206,11 +696,13 @@ int qcvm_init(qcvm_t *qcvm)
 		qcvm->statements[i].vars[1] = LITTLE16(qcvm->statements[i].vars[1]);
 		qcvm->statements[i].vars[2] = LITTLE16(qcvm->statements[i].vars[2]);
 	}
+#endif
 
 	/* functions */
 	qcvm->num_functions = qcvm->header.num_functions;
-	qcvm->functions = (struct qcvm_function *)((uint8_t *)qcvm->progs + qcvm->header.ofs_functions);
+	qcvm->functions = qcvm->functions_copy ? qcvm->functions_copy : (struct qcvm_function *)(base + qcvm->header.ofs_functions);
 
+#if QCVM_BIG_ENDIAN
 	/* fixup endianness */
 	for (i = 0; i < qcvm->num_functions; i++)
 	{
@@ -222,15 +714,17 @@ int qcvm_init(qcvm_t *qcvm)
 		qcvm->functions[i].ofs_filename = LITTLE32(qcvm->functions[i].ofs_filename);
 		qcvm->functions[i].num_parms = LITTLE32(qcvm->functions[i].num_parms);
 	}
+#endif
 
 	/* strings */
 	qcvm->len_strings = qcvm->header.len_strings;
-	qcvm->strings = (char *)((uint8_t *)qcvm->progs + qcvm->header.ofs_strings);
+	qcvm->strings = (char *)(base + qcvm->header.ofs_strings);
 
 	/* field vars */
 	qcvm->num_field_vars = qcvm->header.num_field_vars;
-	qcvm->field_vars = (struct qcvm_var *)((uint8_t *)qcvm->progs + qcvm->header.ofs_field_vars);
+	qcvm->field_vars = (struct qcvm_var *)(base + qcvm->header.ofs_field_vars);
 
+#if QCVM_BIG_ENDIAN
 	/* fixup endianness */
 	for (i = 0; i < qcvm->num_field_vars; i++)
 	{
@@ -238,11 +732,13 @@ int qcvm_init(qcvm_t *qcvm)
 		qcvm->field_vars[i].ofs = LITTLE16(qcvm->field_vars[i].ofs);
 		qcvm->field_vars[i].name = LITTLE32(qcvm->field_vars[i].name);
 	}
+#endif
 
 	/* global vars */
 	qcvm->num_global_vars = qcvm->header.num_global_vars;
-	qcvm->global_vars = (struct qcvm_var *)((uint8_t *)qcvm->progs + qcvm->header.ofs_global_vars);
+	qcvm->global_vars = (struct qcvm_var *)(base + qcvm->header.ofs_global_vars);
 
+#if QCVM_BIG_ENDIAN
 	/* fixup endianness */
 	for (i = 0; i < qcvm->num_global_vars; i++)
 	{
@@ -250,890 +746,8066 @@ int qcvm_init(qcvm_t *qcvm)
 		qcvm->global_vars[i].ofs = LITTLE16(qcvm->global_vars[i].ofs);
 		qcvm->global_vars[i].name = LITTLE32(qcvm->global_vars[i].name);
 	}
+#endif
 
 	/* globals */
 	qcvm->num_globals = qcvm->header.num_globals;
-	qcvm->globals = (union qcvm_global *)((uint8_t *)qcvm->progs + qcvm->header.ofs_globals);
+	qcvm->globals = qcvm->globals_copy ? qcvm->globals_copy : (union qcvm_global *)(base + qcvm->header.ofs_globals);
 
+#if QCVM_BIG_ENDIAN
 	/* fixup endianness */
 	for (i = 0; i < qcvm->num_globals; i++)
 	{
 		qcvm->globals[i].ui = LITTLE32(qcvm->globals[i].ui);
 	}
-
-	/* initialize other fields */
-	qcvm->stack_depth = qcvm->local_stack_used = 0;
+#endif
 
 	return QCVM_OK;
 }
 
-int qcvm_query_entity_info(qcvm_t *qcvm, size_t *num_fields, size_t *size)
+/* returns nonzero if qcvm needs a def to run, as opposed to just naming something */
+static int is_runtime_def(struct qcvm_var *var)
 {
-	struct qcvm_header *header;
-
-	if (!qcvm)
-		return QCVM_NULL_POINTER;
-
-	if (!qcvm->progs)
-		return QCVM_INVALID_PROGS;
-
-	header = (struct qcvm_header *)qcvm->progs;
-
-	if (num_fields)
-		*num_fields = (size_t)LITTLE32(header->num_entity_fields);
-
-	if (size)
-		*size = (size_t)LITTLE32(header->num_entity_fields) * 4;
-
-	return QCVM_OK;
+	return DEF_TYPE(var) == QCVM_TYPE_STRING || DEF_TYPE(var) == QCVM_TYPE_ENTITY;
 }
 
-const char *qcvm_result_string(int r)
+/* keep the string containing ofs */
+static void keep_string(qcvm_t *qcvm, uint32_t *keep, int32_t ofs)
 {
-	static const char *results[] = {
-		"Ok",
-		"Unknown error",
-		"Unexpected NULL pointer",
-		"Function not found",
-		"Invalid opcode",
-		"Invalid function",
-		"Invalid result code",
-		"Builtin call",
-		"State call",
-		"Builtin not found",
-		"Execution finished",
-		"Invalid progs data",
-		"Unsupported progs version",
-		"Unsupported opcode",
-		"Unsupported function",
-		"Stack overflow",
-		"Stack underflow",
-		"Argument index is out of range",
-		"No tempstrings buffer found",
-		"No entities buffer found"
-	};
+	if (ofs <= 0 || (size_t)ofs >= qcvm->len_strings)
+		return;
 
-	if (r < 0 || r >= QCVM_NUM_RESULT_CODES)
-		return results[QCVM_INVALID_RESULT_CODE];
+	while (ofs > 0 && qcvm->strings[ofs - 1] != '\0')
+		ofs--;
 
-	return results[r];
+	keep[ofs / 32] |= 1u << (ofs % 32);
 }
 
-static const char *str_ofs(qcvm_t *qcvm, int32_t s)
+/* new offset of something in a kept string */
+static int32_t strip_string(qcvm_t *qcvm, const uint32_t *map, int32_t ofs)
 {
-	if (s < 0)
-	{
-		/* invert it */
-		s = s * -1;
+	int32_t start;
 
-		/* if its out of range, return the "null" string */
-		if (s >= (int32_t)qcvm->len_tempstrings)
-			return &qcvm->tempstrings[0];
+	if (ofs <= 0 || (size_t)ofs >= qcvm->len_strings)
+		return 0;
 
-		return &qcvm->tempstrings[s];
-	}
-	else
-	{
-		/* if its out of range, return the "null" string */
-		if (s >= (int32_t)qcvm->len_strings)
-			return &qcvm->strings[0];
+	for (start = ofs; start > 0 && qcvm->strings[start - 1] != '\0'; start--) ;
 
-		return &qcvm->strings[s];
-	}
+	return (int32_t)map[start] + (ofs - start);
 }
 
-/* find function by name string */
-static int find_function(qcvm_t *qcvm, const char *name, uint32_t *out)
+static size_t strip_defs(qcvm_t *qcvm, struct qcvm_var *vars, size_t num_vars, const uint32_t *map, struct qcvm_var *out)
 {
-	uint32_t i;
-
-	if (!qcvm || !name)
-		return QCVM_NULL_POINTER;
+	size_t i, n;
 
-	for (i = 0; i < qcvm->num_functions; i++)
+	for (i = 0, n = 0; i < num_vars; i++)
 	{
-		if (QCVM_STRCMP(name, str_ofs(qcvm, qcvm->functions[i].ofs_name)) == 0)
+		if (qcvm->strip_progs != QCVM_STRIP_KEEP_NAMES && !is_runtime_def(&vars[i]))
+			continue;
+
+		if (out)
 		{
-			if (out) *out = i;
-			return QCVM_OK;
+			out[n] = vars[i];
+			out[n].name = qcvm->strip_progs == QCVM_STRIP_KEEP_NAMES ? strip_string(qcvm, map, vars[i].name) : 0;
 		}
+
+		n++;
 	}
 
-	return QCVM_FUNCTION_NOT_FOUND;
+	return n;
 }
 
-/* setup function for execution */
-static int setup_function(qcvm_t *qcvm, struct qcvm_function *func)
+/* write a decoded header out in file byte order */
+static void write_progs_header(const struct qcvm_header *in, struct qcvm_header *out)
 {
-	int i, x, p;
+	out->version = LITTLE32(in->version);
+	out->crc = LITTLE32(in->crc);
+	out->ofs_statements = LITTLE32(in->ofs_statements);
+	out->num_statements = LITTLE32(in->num_statements);
+	out->ofs_global_vars = LITTLE32(in->ofs_global_vars);
+	out->num_global_vars = LITTLE32(in->num_global_vars);
+	out->ofs_field_vars = LITTLE32(in->ofs_field_vars);
+	out->num_field_vars = LITTLE32(in->num_field_vars);
+	out->ofs_functions = LITTLE32(in->ofs_functions);
+	out->num_functions = LITTLE32(in->num_functions);
+	out->ofs_strings = LITTLE32(in->ofs_strings);
+	out->len_strings = LITTLE32(in->len_strings);
+	out->ofs_globals = LITTLE32(in->ofs_globals);
+	out->num_globals = LITTLE32(in->num_globals);
+	out->num_entity_fields = LITTLE32(in->num_entity_fields);
+}
 
-	if (!qcvm || !func)
-		return QCVM_NULL_POINTER;
+/* look for globals no def covers that hold what could be a string offset */
+static int find_unnamed_strings(qcvm_t *qcvm, int *found)
+{
+	uint32_t *named;
+	size_t words, i, n, ofs;
 
-	/* setup stack */
-	qcvm->stack[qcvm->stack_depth] = qcvm->xstack;
-	qcvm->stack_depth++;
-	if (qcvm->stack_depth >= QCVM_STACK_DEPTH)
-		return QCVM_STACK_OVERFLOW;
+	*found = 0;
 
-	/* setup current local stack */
-	for (i = 0; i < func->num_locals; i++)
-		qcvm->local_stack[qcvm->local_stack_used + i] = qcvm->globals[func->first_parm + i].i;
-	qcvm->local_stack_used += func->num_locals;
+	words = (qcvm->num_globals + 31) / 32;
+	if ((named = qcvm->alloc_callback(qcvm, NULL, (words + 1) * sizeof(uint32_t), qcvm->alloc_callback_user)) == NULL)
+		return QCVM_OUT_OF_MEMORY;
 
-	/* copy parameters */
-	p = func->first_parm;
-	for (i = 0; i < func->num_parms; i++)
+	for (i = 0; i < words; i++)
+		named[i] = 0;
+
+	for (i = 0; i < qcvm->num_global_vars; i++)
 	{
-		for (x = 0; x < func->parm_sizes[i]; x++)
-		{
-			qcvm->globals[p].i = qcvm->globals[OFS_PARM0 + i * 3 + x].i;
-			p++;
-		}
+		n = DEF_TYPE(&qcvm->global_vars[i]) == QCVM_TYPE_VECTOR ? 3 : 1;
+		for (ofs = qcvm->global_vars[i].ofs; n-- && ofs < qcvm->num_globals; ofs++)
+			named[ofs / 32] |= 1u << (ofs % 32);
 	}
 
-	/* finish setting up */
-	qcvm->current_function = func;
-	qcvm->xstack.function = func;
-	qcvm->current_statement_index = func->first_statement - 1;
+	for (i = 0; i < qcvm->num_globals && !*found; i++)
+		if (!(named[i / 32] & (1u << (i % 32))) && qcvm->globals[i].i > 0 && (size_t)qcvm->globals[i].i < qcvm->len_strings)
+			*found = 1;
+
+	qcvm->alloc_callback(qcvm, named, 0, qcvm->alloc_callback_user);
 
 	return QCVM_OK;
 }
 
-static int close_function(qcvm_t *qcvm)
+/*
+ * rebuild the progs in memory of our own with only what it takes to run it,
+ * so the host can free the original. string constants are found through
+ * their global defs. qcc can leave those out for constants, and then there's
+ * no telling which globals are strings, so if any global without a def could
+ * be one, the string table is kept as it is and only the defs are stripped.
+ */
+static int strip_progs(qcvm_t *qcvm)
 {
-	int i, num_locals;
-
-	/* check for stack underflow */
-	if (qcvm->stack_depth <= 0)
-		return QCVM_STACK_UNDERFLOW;
+	uint32_t *keep, *map, len, words;
+	size_t num_global_vars, num_field_vars, size, i, n;
+	uint8_t *buf, *p;
+	int names = qcvm->strip_progs == QCVM_STRIP_KEEP_NAMES;
+	int unnamed, r;
 
-	num_locals = qcvm->xstack.function->num_locals;
-	qcvm->local_stack_used -= num_locals;
+	qcvm->strip_saved = 0;
 
-	/* check for stack underflow */
-	if (qcvm->local_stack_used < 0)
-		return QCVM_STACK_UNDERFLOW;
+	if (!qcvm->strip_progs || qcvm->readonly_progs)
+		return QCVM_OK;
 
-	/* restore locals from the stack */
-	for (i = 0; i < num_locals; i++)
-		qcvm->globals[qcvm->xstack.function->first_parm + i].i = qcvm->local_stack[qcvm->local_stack_used + i];
+	if (!qcvm->alloc_callback)
+		return QCVM_OUT_OF_MEMORY;
 
-	/* move down the stack */
-	qcvm->stack_depth--;
-	qcvm->xstack.function = qcvm->stack[qcvm->stack_depth].function;
+	words = (uint32_t)((qcvm->len_strings + 31) / 32);
+	keep = qcvm->alloc_callback(qcvm, NULL, (words + 1) * sizeof(uint32_t), qcvm->alloc_callback_user);
+	map = qcvm->alloc_callback(qcvm, NULL, (qcvm->len_strings + 1) * sizeof(uint32_t), qcvm->alloc_callback_user);
+	if (!keep || !map)
+	{
+		if (keep)
+			qcvm->alloc_callback(qcvm, keep, 0, qcvm->alloc_callback_user);
+		if (map)
+			qcvm->alloc_callback(qcvm, map, 0, qcvm->alloc_callback_user);
+		return QCVM_OUT_OF_MEMORY;
+	}
 
-	/* set next statement */
-	qcvm->current_statement_index = qcvm->stack[qcvm->stack_depth].statement;
+	/* everything that can still be looked at by offset */
+	for (i = 0; i < words; i++)
+		keep[i] = 0;
+	if (qcvm->len_strings)
+		keep[0] |= 1;
 
-	return QCVM_OK;
-}
+	for (i = 0; i < qcvm->num_functions; i++)
+	{
+		keep_string(qcvm, keep, qcvm->functions[i].ofs_name);
+		if (names)
+			keep_string(qcvm, keep, qcvm->functions[i].ofs_filename);
+	}
 
-int qcvm_load(qcvm_t *qcvm, const char *name)
-{
-	int r;
-	uint32_t func;
+	for (i = 0; i < qcvm->num_global_vars; i++)
+	{
+		if (names)
+			keep_string(qcvm, keep, qcvm->global_vars[i].name);
+		if (DEF_TYPE(&qcvm->global_vars[i]) == QCVM_TYPE_STRING && qcvm->global_vars[i].ofs < qcvm->num_globals)
+			keep_string(qcvm, keep, qcvm->globals[qcvm->global_vars[i].ofs].i);
+	}
 
-	if (!qcvm || !name)
-		return QCVM_NULL_POINTER;
+	if (names)
+		for (i = 0; i < qcvm->num_field_vars; i++)
+			keep_string(qcvm, keep, qcvm->field_vars[i].name);
 
-	/* retrieve function id */
-	if ((r = find_function(qcvm, name, &func)) != QCVM_OK)
+	if ((r = find_unnamed_strings(qcvm, &unnamed)) != QCVM_OK)
+	{
+		qcvm->alloc_callback(qcvm, keep, 0, qcvm->alloc_callback_user);
+		qcvm->alloc_callback(qcvm, map, 0, qcvm->alloc_callback_user);
 		return r;
+	}
 
-	/* do actual setup */
-	return setup_function(qcvm, &qcvm->functions[func]);
+	if (unnamed || !qcvm->len_strings || qcvm->strings[qcvm->len_strings - 1] != '\0')
+		for (i = 0; i < words; i++)
+			keep[i] = 0xFFFFFFFF;
+
+	/* lay out the strings that are left */
+	for (i = 0, len = 0; i < qcvm->len_strings; i += n)
+	{
+		for (n = 0; i + n < qcvm->len_strings && qcvm->strings[i + n] != '\0'; n++) ;
+		if (i + n < qcvm->len_strings)
+			n++;
+
+		if (keep[i / 32] & (1u << (i % 32)))
+		{
+			map[i] = len;
+			len += (uint32_t)n;
+		}
+	}
+
+	num_global_vars = strip_defs(qcvm, qcvm->global_vars, qcvm->num_global_vars, map, NULL);
+	num_field_vars = strip_defs(qcvm, qcvm->field_vars, qcvm->num_field_vars, map, NULL);
+
+	size = sizeof(struct qcvm_header);
+	size += qcvm->num_statements * sizeof(struct qcvm_statement);
+	size += qcvm->num_functions * sizeof(struct qcvm_function);
+	size += (num_global_vars + num_field_vars) * sizeof(struct qcvm_var);
+	size += qcvm->num_globals * sizeof(union qcvm_global);
+	size += len;
+
+	if ((buf = qcvm->alloc_callback(qcvm, NULL, size, qcvm->alloc_callback_user)) == NULL)
+	{
+		qcvm->alloc_callback(qcvm, keep, 0, qcvm->alloc_callback_user);
+		qcvm->alloc_callback(qcvm, map, 0, qcvm->alloc_callback_user);
+		return QCVM_OUT_OF_MEMORY;
+	}
+
+	p = buf + sizeof(struct qcvm_header);
+
+	QCVM_MEMCPY(p, qcvm->statements, qcvm->num_statements * sizeof(struct qcvm_statement));
+	qcvm->header.ofs_statements = (uint32_t)(p - buf);
+	qcvm->statements = (struct qcvm_statement *)p;
+	p += qcvm->num_statements * sizeof(struct qcvm_statement);
+
+	QCVM_MEMCPY(p, qcvm->functions, qcvm->num_functions * sizeof(struct qcvm_function));
+	qcvm->header.ofs_functions = (uint32_t)(p - buf);
+	qcvm->functions = (struct qcvm_function *)p;
+	p += qcvm->num_functions * sizeof(struct qcvm_function);
+
+	for (i = 0; i < qcvm->num_functions; i++)
+	{
+		qcvm->functions[i].ofs_name = strip_string(qcvm, map, qcvm->functions[i].ofs_name);
+		qcvm->functions[i].ofs_filename = names ? strip_string(qcvm, map, qcvm->functions[i].ofs_filename) : 0;
+	}
+
+	strip_defs(qcvm, qcvm->global_vars, qcvm->num_global_vars, map, (struct qcvm_var *)p);
+	qcvm->header.ofs_global_vars = (uint32_t)(p - buf);
+	qcvm->header.num_global_vars = (uint32_t)num_global_vars;
+	qcvm->global_vars = (struct qcvm_var *)p;
+	p += num_global_vars * sizeof(struct qcvm_var);
+
+	strip_defs(qcvm, qcvm->field_vars, qcvm->num_field_vars, map, (struct qcvm_var *)p);
+	qcvm->header.ofs_field_vars = (uint32_t)(p - buf);
+	qcvm->header.num_field_vars = (uint32_t)num_field_vars;
+	qcvm->field_vars = (struct qcvm_var *)p;
+	p += num_field_vars * sizeof(struct qcvm_var);
+
+	/* the new defs are all that's left to say which globals are strings */
+	QCVM_MEMCPY(p, qcvm->globals, qcvm->num_globals * sizeof(union qcvm_global));
+	for (i = 0; i < num_global_vars; i++)
+		if (DEF_TYPE(&qcvm->global_vars[i]) == QCVM_TYPE_STRING && qcvm->global_vars[i].ofs < qcvm->num_globals)
+			((union qcvm_global *)p)[qcvm->global_vars[i].ofs].i = strip_string(qcvm, map, qcvm->globals[qcvm->global_vars[i].ofs].i);
+	qcvm->header.ofs_globals = (uint32_t)(p - buf);
+	qcvm->globals = (union qcvm_global *)p;
+	p += qcvm->num_globals * sizeof(union qcvm_global);
+
+	for (i = 0; i < qcvm->len_strings; i += n)
+	{
+		for (n = 0; i + n < qcvm->len_strings && qcvm->strings[i + n] != '\0'; n++) ;
+		if (i + n < qcvm->len_strings)
+			n++;
+
+		if (keep[i / 32] & (1u << (i % 32)))
+			QCVM_MEMCPY(&p[map[i]], &qcvm->strings[i], n);
+	}
+	qcvm->header.ofs_strings = (uint32_t)(p - buf);
+	qcvm->header.len_strings = len;
+	qcvm->strings = (char *)p;
+
+	qcvm->num_global_vars = num_global_vars;
+	qcvm->num_field_vars = num_field_vars;
+	qcvm->len_strings = len;
+
+	/* the header is kept in file byte order like any progs */
+	write_progs_header(&qcvm->header, (struct qcvm_header *)buf);
+
+	qcvm->strip_saved = qcvm->len_progs > size ? qcvm->len_progs - size : 0;
+	qcvm->progs = buf;
+	qcvm->len_progs = size;
+	qcvm->progs_copy = buf;
+
+	qcvm->alloc_callback(qcvm, keep, 0, qcvm->alloc_callback_user);
+	qcvm->alloc_callback(qcvm, map, 0, qcvm->alloc_callback_user);
+
+	return QCVM_OK;
 }
 
-int qcvm_step(qcvm_t *qcvm)
+int qcvm_init(qcvm_t *qcvm)
 {
 	int r;
-	uint16_t opcode;
 
 	if (!qcvm)
 		return QCVM_NULL_POINTER;
 
-	/* advance statement */
-	qcvm->current_statement_index++;
+	/* a shared image stands in for the progs, already loaded */
+	if (qcvm->shared_image)
+	{
+		free_progs_copies(qcvm);
 
-	/* get current statement and evaluators */
-	qcvm->current_statement = &qcvm->statements[qcvm->current_statement_index];
-	qcvm->eval[0] = (union qcvm_eval *)&qcvm->globals[qcvm->current_statement->vars[0]];
-	qcvm->eval[1] = (union qcvm_eval *)&qcvm->globals[qcvm->current_statement->vars[1]];
-	qcvm->eval[2] = (union qcvm_eval *)&qcvm->globals[qcvm->current_statement->vars[2]];
+		if ((r = attach_shared_image(qcvm)) != QCVM_OK)
+			return r;
+	}
+	else
+	{
+		if (!qcvm->progs || !qcvm->len_progs)
+			return QCVM_INVALID_PROGS;
 
-	/* update stack */
-	qcvm->xstack.function->profile++;
-	qcvm->xstack.statement = qcvm->current_statement_index;
+		free_progs_copies(qcvm);
 
-	/* parse opcode */
-	opcode = qcvm->current_statement->opcode;
-	switch (opcode)
-	{
-		/* function call */
-		case OPCODE_CALL0:
-		case OPCODE_CALL1:
-		case OPCODE_CALL2:
-		case OPCODE_CALL3:
-		case OPCODE_CALL4:
-		case OPCODE_CALL5:
-		case OPCODE_CALL6:
-		case OPCODE_CALL7:
-		case OPCODE_CALL8:
-		{
-			/* check for null function */
-			if (qcvm->eval[0]->func < 1)
-				return QCVM_INVALID_FUNCTION;
+		if ((r = load_progs(qcvm)) != QCVM_OK)
+			return r;
 
-			/* get function argc */
-			qcvm->current_argc = opcode - OPCODE_CALL0;
+		if ((r = strip_progs(qcvm)) != QCVM_OK)
+			return r;
+	}
 
-			/* assign next function value */
-			qcvm->next_function = &qcvm->functions[qcvm->eval[0]->func];
+	/* other sanity checks */
+	if (!qcvm->entities)
+		return QCVM_NO_ENTITIES;
 
-			/* setup state for builtin call */
-			if (qcvm->next_function->first_statement < 1)
-				return QCVM_BUILTIN_CALL;
+	/* tempstrings */
+	qcvm->num_tempstrings_blocks = 0;
+	if (qcvm->tempstrings && qcvm->len_tempstrings > 1)
+	{
+		qcvm->tempstrings_blocks[0].data = qcvm->tempstrings;
+		qcvm->tempstrings_blocks[0].len = qcvm->len_tempstrings;
+		qcvm->tempstrings_blocks[0].base = 0;
+		qcvm->num_tempstrings_blocks = 1;
+	}
+	qcvm->tempstrings_high_water = 0;
+	qcvm->tempstrings_epoch = 0;
+	qcvm_tempstrings_begin_frame(qcvm);
 
-			/* setup for execution */
-			if ((r = setup_function(qcvm, qcvm->next_function) != QCVM_OK))
-				return r;
+	/* initialize other fields */
+	qcvm->stack_depth = qcvm->local_stack_used = 0;
 
-			return QCVM_OK;
-		}
+	/* so does a shared image */
+	if (qcvm->shared_image)
+		return QCVM_OK;
 
-		/* function return */
-		case OPCODE_RETURN:
-		case OPCODE_DONE:
-		{
-			qcvm->globals[OFS_RETURN] = qcvm->globals[qcvm->current_statement->vars[0]];
-			qcvm->globals[OFS_RETURN + 1] = qcvm->globals[qcvm->current_statement->vars[0] + 1];
-			qcvm->globals[OFS_RETURN + 2] = qcvm->globals[qcvm->current_statement->vars[0] + 2];
+	/* a matching image saves redoing the work below */
+	if (qcvm->image && load_image(qcvm) == QCVM_OK)
+		return QCVM_OK;
 
-			if ((r = close_function(qcvm)) != QCVM_OK)
-				return r;
+	/* interned strings */
+	return intern_progs_strings(qcvm);
+}
 
-			if (qcvm->stack_depth == qcvm->exit_depth)
-				return QCVM_EXECUTION_FINISHED;
+int qcvm_query_strip_info(qcvm_t *qcvm, size_t *len_progs, size_t *bytes_saved)
+{
+	if (!qcvm)
+		return QCVM_NULL_POINTER;
 
-			return QCVM_OK;
-		}
+	if (len_progs)
+		*len_progs = qcvm->len_progs;
 
-		case OPCODE_MUL_F:
-		{
-			qcvm->eval[2]->f = qcvm->eval[0]->f * qcvm->eval[1]->f;
-			break;
-		}
+	if (bytes_saved)
+		*bytes_saved = qcvm->strip_saved;
 
-		case OPCODE_MUL_V:
-		{
-			qcvm->eval[2]->f =
-				qcvm->eval[0]->v[0] * qcvm->eval[1]->v[0] +
-				qcvm->eval[0]->v[1] * qcvm->eval[1]->v[1] +
-				qcvm->eval[0]->v[2] * qcvm->eval[1]->v[2];
-			break;
-		}
+	return QCVM_OK;
+}
 
-		case OPCODE_MUL_FV:
-		{
-			qcvm->eval[2]->v[0] = qcvm->eval[0]->f * qcvm->eval[1]->v[0];
-			qcvm->eval[2]->v[1] = qcvm->eval[0]->f * qcvm->eval[1]->v[1];
-			qcvm->eval[2]->v[2] = qcvm->eval[0]->f * qcvm->eval[1]->v[2];
-			break;
-		}
+int qcvm_shutdown(qcvm_t *qcvm)
+{
+	int32_t i;
 
-		case OPCODE_MUL_VF:
-		{
-			qcvm->eval[2]->v[0] = qcvm->eval[1]->f * qcvm->eval[0]->v[0];
-			qcvm->eval[2]->v[1] = qcvm->eval[1]->f * qcvm->eval[0]->v[1];
-			qcvm->eval[2]->v[2] = qcvm->eval[1]->f * qcvm->eval[0]->v[2];
-			break;
-		}
+	if (!qcvm)
+		return QCVM_NULL_POINTER;
 
-		case OPCODE_DIV_F:
-		{
-			qcvm->eval[2]->f = qcvm->eval[0]->f / qcvm->eval[1]->f;
-			break;
-		}
+	/* a worker lets go of what it shares first */
+	if (qcvm->worker)
+		free_worker(qcvm);
 
-		case OPCODE_ADD_F:
-		{
-			qcvm->eval[2]->f = qcvm->eval[0]->f + qcvm->eval[1]->f;
-			break;
-		}
+	/* chained tempstring blocks */
+	for (i = 0; i < qcvm->num_tempstrings_blocks; i++)
+	{
+		if (qcvm->tempstrings_blocks[i].data != qcvm->tempstrings)
+			qcvm->alloc_callback(qcvm, qcvm->tempstrings_blocks[i].data, 0, qcvm->alloc_callback_user);
+		qcvm->tempstrings_blocks[i].data = NULL;
+	}
+	qcvm->num_tempstrings_blocks = 0;
 
-		case OPCODE_ADD_V:
-		{
-			qcvm->eval[2]->v[0] = qcvm->eval[0]->v[0] + qcvm->eval[1]->v[0];
-			qcvm->eval[2]->v[1] = qcvm->eval[0]->v[1] + qcvm->eval[1]->v[1];
-			qcvm->eval[2]->v[2] = qcvm->eval[0]->v[2] + qcvm->eval[1]->v[2];
-			break;
-		}
+	/* zone string slabs */
+	for (i = 0; i < (int32_t)qcvm->num_zone_slabs; i++)
+		if (qcvm->zone_slabs[i].data)
+			qcvm->alloc_callback(qcvm, qcvm->zone_slabs[i].data, 0, qcvm->alloc_callback_user);
+	if (qcvm->zone_slabs)
+		qcvm->alloc_callback(qcvm, qcvm->zone_slabs, 0, qcvm->alloc_callback_user);
+	qcvm->zone_slabs = NULL;
+	qcvm->num_zone_slabs = qcvm->max_zone_slabs = 0;
+	qcvm->zone_gc_phase = ZONE_GC_IDLE;
 
-		case OPCODE_SUB_F:
-		{
-			qcvm->eval[2]->f = qcvm->eval[0]->f - qcvm->eval[1]->f;
-			break;
-		}
+	/* interned strings */
+	free_interned(qcvm);
 
-		case OPCODE_SUB_V:
-		{
-			qcvm->eval[2]->v[0] = qcvm->eval[0]->v[0] - qcvm->eval[1]->v[0];
-			qcvm->eval[2]->v[1] = qcvm->eval[0]->v[1] - qcvm->eval[1]->v[1];
-			qcvm->eval[2]->v[2] = qcvm->eval[0]->v[2] - qcvm->eval[1]->v[2];
-			break;
-		}
+	/* snapshots */
+	free_snapshots(qcvm);
 
-		case OPCODE_EQ_F:
-		{
-			qcvm->eval[2]->f = qcvm->eval[0]->f == qcvm->eval[1]->f;
-			break;
-		}
+	/* field tracking */
+	free_dirty_fields(qcvm);
 
-		case OPCODE_EQ_V:
-		{
-			qcvm->eval[2]->f =
-				(qcvm->eval[0]->v[0] == qcvm->eval[1]->v[0]) &&
-				(qcvm->eval[0]->v[1] == qcvm->eval[1]->v[1]) &&
-				(qcvm->eval[0]->v[2] == qcvm->eval[1]->v[2]);
-			break;
-		}
+	/* pending checkpoint */
+	free_checkpoint(qcvm);
 
-		case OPCODE_EQ_S:
-		{
-			qcvm->eval[2]->f = !QCVM_STRCMP(str_ofs(qcvm, qcvm->eval[0]->s), str_ofs(qcvm, qcvm->eval[1]->s));
-			break;
-		}
+	/* function analysis */
+	free_analysis(qcvm);
 
-		case OPCODE_EQ_E:
-		{
-			qcvm->eval[2]->f = qcvm->eval[0]->i == qcvm->eval[1]->i;
-			break;
-		}
+	/* published entities */
+	free_publisher(qcvm);
 
-		case OPCODE_EQ_FNC:
-		{
-			qcvm->eval[2]->f = qcvm->eval[0]->func == qcvm->eval[1]->func;
-			break;
-		}
+	/* copies of a read-only progs */
+	free_progs_copies(qcvm);
 
-		case OPCODE_NE_F:
-		{
-			qcvm->eval[2]->f = qcvm->eval[0]->f != qcvm->eval[1]->f;
-			break;
-		}
+	/* external strings */
+	for (i = 0; i < 2; i++)
+	{
+		if (qcvm->external_strings[i])
+			qcvm->alloc_callback(qcvm, qcvm->external_strings[i], 0, qcvm->alloc_callback_user);
+		qcvm->external_strings[i] = NULL;
+		qcvm->num_external_strings[i] = qcvm->max_external_strings[i] = 0;
+	}
+	qcvm->free_external_string = 0;
 
-		case OPCODE_NE_V:
-		{
-			qcvm->eval[2]->f =
-				(qcvm->eval[0]->v[0] != qcvm->eval[1]->v[0]) ||
-				(qcvm->eval[0]->v[1] != qcvm->eval[1]->v[1]) ||
-				(qcvm->eval[0]->v[2] != qcvm->eval[1]->v[2]);
-			break;
-		}
+	return QCVM_OK;
+}
 
-		case OPCODE_NE_S:
-		{
-			qcvm->eval[2]->f = QCVM_STRCMP(str_ofs(qcvm, qcvm->eval[0]->s), str_ofs(qcvm, qcvm->eval[1]->s));
-			break;
-		}
+int qcvm_query_entity_info(qcvm_t *qcvm, size_t *num_fields, size_t *size)
+{
+	const struct qcvm_header *header;
 
-		case OPCODE_NE_E:
-		{
-			qcvm->eval[2]->f = qcvm->eval[0]->i != qcvm->eval[1]->i;
-			break;
-		}
+	if (!qcvm)
+		return QCVM_NULL_POINTER;
 
-		case OPCODE_NE_FNC:
-		{
-			qcvm->eval[2]->f = qcvm->eval[0]->func != qcvm->eval[1]->func;
-			break;
-		}
+	/* before qcvm_init(), a shared image has the progs */
+	if (qcvm->progs)
+		header = (const struct qcvm_header *)qcvm->progs;
+	else if ((header = shared_progs_header(qcvm)) == NULL)
+		return QCVM_INVALID_PROGS;
 
-		case OPCODE_LE:
-		{
-			qcvm->eval[2]->f = qcvm->eval[0]->f <= qcvm->eval[1]->f;
-			break;
-		}
+	if (num_fields)
+		*num_fields = (size_t)LITTLE32(header->num_entity_fields);
 
-		case OPCODE_GE:
-		{
-			qcvm->eval[2]->f = qcvm->eval[0]->f >= qcvm->eval[1]->f;
-			break;
-		}
+	if (size)
+		*size = (size_t)LITTLE32(header->num_entity_fields) * 4;
 
-		case OPCODE_LT:
-		{
-			qcvm->eval[2]->f = qcvm->eval[0]->f < qcvm->eval[1]->f;
-			break;
-		}
+	return QCVM_OK;
+}
 
-		case OPCODE_GT:
-		{
-			qcvm->eval[2]->f = qcvm->eval[0]->f > qcvm->eval[1]->f;
-			break;
-		}
+const char *qcvm_result_string(int r)
+{
+	static const char *results[] = {
+		"Ok",
+		"Unknown error",
+		"Unexpected NULL pointer",
+		"Function not found",
+		"Invalid opcode",
+		"Invalid function",
+		"Invalid result code",
+		"Builtin call",
+		"State call",
+		"Builtin not found",
+		"Execution finished",
+		"Invalid progs data",
+		"Unsupported progs version",
+		"Unsupported opcode",
+		"Unsupported function",
+		"Stack overflow",
+		"Stack underflow",
+		"Argument index is out of range",
+		"No tempstrings buffer found",
+		"No entities buffer found",
+		"Execution in progress",
+		"Out of memory",
+		"Snapshot not found",
+		"Buffer too small",
+		"Checkpoint in progress",
+		"Program image doesn't match",
+		"Not supported on a worker",
+		"Workers can't write while snapshots or a checkpoint are held",
+		"Functions haven't been analyzed",
+		"Publishing isn't enabled",
+		"Every published buffer is still being read",
+		"No instances left in the pool",
+		"The vm changed under the fork",
+		"The vm isn't in a channel",
+		"The message queue is full",
+		"A builtin failed"
+	};
 
-		case OPCODE_LOAD_F:
-		case OPCODE_LOAD_S:
-		case OPCODE_LOAD_ENT:
-		case OPCODE_LOAD_FLD:
-		case OPCODE_LOAD_FNC:
-		{
-			/* get offset to field */
-			qcvm->eval[0] = (union qcvm_eval *)FIELD_PTR(qcvm->eval[0]->e, qcvm->eval[1]->i);
+	if (r < 0 || r >= QCVM_NUM_RESULT_CODES)
+		return results[QCVM_INVALID_RESULT_CODE];
 
-			/* load field value */
-			qcvm->eval[2]->i = qcvm->eval[0]->i;
+	return results[r];
+}
 
-			break;
-		}
+static const char *tempstring_ofs(qcvm_t *qcvm, uint32_t ofs, struct qcvm_string_header **header)
+{
+	struct qcvm_tempstrings_block *block;
+	int32_t i;
 
-		case OPCODE_LOAD_V:
+	/* find the block it lives in */
+	for (i = qcvm->num_tempstrings_blocks - 1; i >= 0; i--)
+	{
+		block = &qcvm->tempstrings_blocks[i];
+		if (ofs >= block->base)
 		{
-			/* get offset to field */
-			qcvm->eval[0] = (union qcvm_eval *)FIELD_PTR(qcvm->eval[0]->e, qcvm->eval[1]->i);
+			ofs -= block->base;
 
-			/* load field value */
-			qcvm->eval[2]->v[0] = qcvm->eval[0]->v[0];
-			qcvm->eval[2]->v[1] = qcvm->eval[0]->v[1];
-			qcvm->eval[2]->v[2] = qcvm->eval[0]->v[2];
+			/* if its out of range, return the "null" string */
+			if (ofs >= block->len)
+				break;
 
-			break;
+			/* only trust the header if it fits in the block */
+			if (header && ofs >= STRING_HEADER_SIZE && !(ofs & 3))
+			{
+				*header = (struct qcvm_string_header *)&block->data[ofs - STRING_HEADER_SIZE];
+				if ((*header)->len >= block->len - ofs)
+					*header = NULL;
+			}
+
+			return &block->data[ofs];
 		}
+	}
 
-		case OPCODE_ADDRESS:
-		{
-			/* get offset to entity field */
-			uint32_t *field_ptr = FIELD_PTR(qcvm->eval[0]->e, qcvm->eval[1]->i);
+	return &qcvm->strings[0];
+}
 
-			/* get offset from start of entities buffer */
-			qcvm->eval[2]->i = (int32_t)((uint8_t *)field_ptr - (uint8_t *)qcvm->entities);
-			break;
-		}
+/* returns the slab a zone string lives in, or null if the handle is bogus */
+static struct qcvm_zone_slab *zone_slab(qcvm_t *qcvm, uint32_t ofs, uint32_t *slot)
+{
+	struct qcvm_zone_slab *slab;
+	uint32_t i = ofs >> ZONE_SLAB_SHIFT;
 
-		case OPCODE_STORE_F:
-		case OPCODE_STORE_S:
-		case OPCODE_STORE_ENT:
-		case OPCODE_STORE_FLD:
-		case OPCODE_STORE_FNC:
-		{
-			qcvm->eval[1]->i = qcvm->eval[0]->i;
-			break;
-		}
+	ofs &= (1 << ZONE_SLAB_SHIFT) - 1;
 
-		case OPCODE_STORE_V:
-		{
-			qcvm->eval[1]->v[0] = qcvm->eval[0]->v[0];
-			qcvm->eval[1]->v[1] = qcvm->eval[0]->v[1];
-			qcvm->eval[1]->v[2] = qcvm->eval[0]->v[2];
-			break;
-		}
+	if (i >= qcvm->num_zone_slabs)
+		return NULL;
 
-		case OPCODE_STOREP_F:
-		case OPCODE_STOREP_S:
-		case OPCODE_STOREP_ENT:
-		case OPCODE_STOREP_FLD:
-		case OPCODE_STOREP_FNC:
-		{
-			union qcvm_eval *temp = (union qcvm_eval *)((uint8_t *)qcvm->entities + qcvm->eval[1]->i);
-			temp->i = qcvm->eval[0]->i;
-			break;
-		}
+	slab = &qcvm->zone_slabs[i];
+	if (!slab->data || ofs % slab->slot_size || ofs / slab->slot_size >= slab->num_slots)
+		return NULL;
 
-		case OPCODE_STOREP_V:
-		{
-			union qcvm_eval *temp = (union qcvm_eval *)((uint8_t *)qcvm->entities + qcvm->eval[1]->i);
-			temp->v[0] = qcvm->eval[0]->v[0];
-			temp->v[1] = qcvm->eval[0]->v[1];
-			temp->v[2] = qcvm->eval[0]->v[2];
-			break;
-		}
+	*slot = ofs / slab->slot_size;
 
-		case OPCODE_NOT_F:
-		{
-			qcvm->eval[2]->f = !qcvm->eval[0]->f;
-			break;
-		}
+	return slab;
+}
 
-		case OPCODE_NOT_V:
-		{
-			qcvm->eval[2]->f = !qcvm->eval[0]->v[0] && !qcvm->eval[0]->v[1] && !qcvm->eval[0]->v[2];
-			break;
-		}
+/* resolve a string handle, also returning its header if it has one */
+static const char *string_lookup(qcvm_t *qcvm, int32_t s, struct qcvm_string_header **header)
+{
+	if (header)
+		*header = NULL;
 
-		case OPCODE_NOT_S:
-		{
-			qcvm->eval[2]->f = !qcvm->eval[0]->s || !qcvm->strings[qcvm->eval[0]->s];
-			break;
-		}
+	if (s < 0)
+	{
+		struct qcvm_external_string *external;
+		struct qcvm_zone_slab *slab;
+		uint32_t slot;
+		char *data;
+		int kind;
 
-		case OPCODE_NOT_ENT:
-		{
-			qcvm->eval[2]->f = !qcvm->eval[0]->e;
-			break;
-		}
+		/* invert it */
+		s = s == INT32_MIN ? 0 : s * -1;
 
-		case OPCODE_NOT_FNC:
+		switch (STRING_HEAP(s))
 		{
-			qcvm->eval[2]->f = !qcvm->eval[0]->func;
-			break;
-		}
+			case STRING_HEAP_TEMPSTRINGS:
+				return tempstring_ofs(qcvm, STRING_OFS(s), header);
 
-		case OPCODE_IF:
-		{
-			if (qcvm->eval[0]->i)
-				qcvm->current_statement_index += qcvm->current_statement->vars[1] - 1;
-			break;
-		}
+			case STRING_HEAP_EXTERNAL:
+			case STRING_HEAP_EXTERNAL_FRAME:
+				kind = STRING_HEAP(s) - STRING_HEAP_EXTERNAL;
+				if ((uint32_t)STRING_OFS(s) < qcvm->num_external_strings[kind])
+				{
+					external = &qcvm->external_strings[kind][STRING_OFS(s)];
+					if (header)
+						*header = &external->header;
+					return external->s;
+				}
+				break;
 
-		case OPCODE_IFNOT:
-		{
-			if (!qcvm->eval[0]->i)
-				qcvm->current_statement_index += qcvm->current_statement->vars[1] - 1;
-			break;
+			case STRING_HEAP_ZONE:
+				if ((slab = zone_slab(qcvm, STRING_OFS(s), &slot)) != NULL)
+				{
+					data = &slab->data[slot * slab->slot_size];
+					if (header)
+						*header = (struct qcvm_string_header *)data;
+					return data + STRING_HEADER_SIZE;
+				}
+				break;
 		}
 
-		case OPCODE_STATE:
-		{
-			/* must be handled by user program... somehow */
-			return QCVM_STATE_CALL;
-		}
+		/* unknown heap, return the "null" string */
+		return &qcvm->strings[0];
+	}
+	else
+	{
+		/* if its out of range, return the "null" string */
+		if (s >= (int32_t)qcvm->len_strings)
+			return &qcvm->strings[0];
 
-		case OPCODE_GOTO:
-		{
-			qcvm->current_statement_index += qcvm->current_statement->vars[0] - 1;
-			break;
-		}
+		return &qcvm->strings[s];
+	}
+}
 
-		case OPCODE_AND_F:
-		{
-			qcvm->eval[2]->f = qcvm->eval[0]->f && qcvm->eval[1]->f;
-			break;
-		}
+static const char *str_ofs(qcvm_t *qcvm, int32_t s)
+{
+	return string_lookup(qcvm, s, NULL);
+}
 
-		case OPCODE_OR_F:
-		{
-			qcvm->eval[2]->f = qcvm->eval[0]->f || qcvm->eval[1]->f;
-			break;
-		}
+/* resolve a string handle along with its length */
+static const char *str_ofs_len(qcvm_t *qcvm, int32_t s, size_t *len)
+{
+	struct qcvm_string_header *header;
+	const char *str = string_lookup(qcvm, s, &header);
 
-		case OPCODE_BITAND_F:
-		{
-			qcvm->eval[2]->f = (int)qcvm->eval[0]->f & (int)qcvm->eval[1]->f;
-			break;
-		}
+	*len = header ? header->len : QCVM_STRLEN(str);
 
-		case OPCODE_BITOR_F:
-		{
-			qcvm->eval[2]->f = (int)qcvm->eval[0]->f | (int)qcvm->eval[1]->f;
-			break;
-		}
+	return str;
+}
+
+/* fill in the write-once header of a heap string */
+static void set_string_header(char *str, size_t len, uint32_t hash)
+{
+	struct qcvm_string_header *header = (struct qcvm_string_header *)(str - STRING_HEADER_SIZE);
+
+	header->len = (uint32_t)len;
+	header->hash = hash;
+}
+
+/* mark a zone string as reachable, ignoring any other kind of handle */
+static void mark_zone_string(qcvm_t *qcvm, int32_t s)
+{
+	struct qcvm_zone_slab *slab;
+	uint32_t slot;
+
+	if (s >= 0 || s == INT32_MIN || STRING_HEAP(-s) != STRING_HEAP_ZONE)
+		return;
+
+	if ((slab = zone_slab(qcvm, STRING_OFS(-s), &slot)) != NULL)
+		slab->marked[slot / 32] |= 1u << (slot % 32);
+}
+
+/* returns nonzero if s is the only handle to its contents */
+static int is_interned(qcvm_t *qcvm, int32_t s)
+{
+	struct qcvm_zone_slab *slab;
+	uint32_t slot;
+
+	if (s >= 0)
+		return qcvm->strings_canonical && (size_t)s < qcvm->len_strings && qcvm->strings_canonical[s / 32] & (1u << (s % 32));
+
+	if (s == INT32_MIN || STRING_HEAP(-s) != STRING_HEAP_ZONE)
+		return 0;
+
+	if ((slab = zone_slab(qcvm, STRING_OFS(-s), &slot)) == NULL)
+		return 0;
+
+	return (slab->interned[slot / 32] & (1u << (slot % 32))) != 0;
+}
+
+/* string equality, skipping the compare when both sides are interned */
+static int str_equal(qcvm_t *qcvm, int32_t a, int32_t b)
+{
+	struct qcvm_string_header *ha, *hb;
+	const char *sa, *sb;
+
+	if (a == b)
+		return 1;
+
+	if (is_interned(qcvm, a) && is_interned(qcvm, b))
+		return 0;
+
+	sa = string_lookup(qcvm, a, &ha);
+	sb = string_lookup(qcvm, b, &hb);
+
+	/* both sides have cached lengths and hashes to rule things out with */
+	if (ha && hb)
+	{
+		if (ha->len != hb->len)
+			return 0;
+
+		if (!ha->hash)
+			ha->hash = hash_string(sa, NULL);
+		if (!hb->hash)
+			hb->hash = hash_string(sb, NULL);
+
+		if (ha->hash != hb->hash)
+			return 0;
+	}
+
+	return !QCVM_STRCMP(sa, sb);
+}
+
+/* find function by name string */
+static int find_function(qcvm_t *qcvm, const char *name, uint32_t *out)
+{
+	uint32_t i;
+
+	if (!qcvm || !name)
+		return QCVM_NULL_POINTER;
+
+	for (i = 0; i < qcvm->num_functions; i++)
+	{
+		if (QCVM_STRCMP(name, str_ofs(qcvm, qcvm->functions[i].ofs_name)) == 0)
+		{
+			if (out) *out = i;
+			return QCVM_OK;
+		}
+	}
+
+	return QCVM_FUNCTION_NOT_FOUND;
+}
+
+/* setup function for execution */
+static int setup_function(qcvm_t *qcvm, struct qcvm_function *func)
+{
+	int i, x, p;
+
+	if (!qcvm || !func)
+		return QCVM_NULL_POINTER;
+
+	/* setup stack */
+	qcvm->stack[qcvm->stack_depth] = qcvm->xstack;
+	qcvm->stack_depth++;
+	if (qcvm->stack_depth >= QCVM_STACK_DEPTH)
+		return QCVM_STACK_OVERFLOW;
+
+	/* speculative workers log the locals and parameters they touch */
+	if (SPECULATING(qcvm))
+	{
+		spec_read_globals(qcvm, func->first_parm, func->num_locals);
+		for (i = 0, p = 0; i < func->num_parms; i++)
+		{
+			spec_read_globals(qcvm, OFS_PARM0 + i * 3, func->parm_sizes[i]);
+			p += func->parm_sizes[i];
+		}
+		spec_write_globals(qcvm, func->first_parm, p);
+	}
+
+	/* setup current local stack */
+	for (i = 0; i < func->num_locals; i++)
+		qcvm->local_stack[qcvm->local_stack_used + i] = qcvm->globals[func->first_parm + i].i;
+	qcvm->local_stack_used += func->num_locals;
+
+	/* copy parameters */
+	p = func->first_parm;
+	for (i = 0; i < func->num_parms; i++)
+	{
+		for (x = 0; x < func->parm_sizes[i]; x++)
+		{
+			qcvm->globals[p].i = qcvm->globals[OFS_PARM0 + i * 3 + x].i;
+			p++;
+		}
+	}
+
+	/* finish setting up */
+	qcvm->current_function = func;
+	qcvm->xstack.function = func;
+	qcvm->current_statement_index = func->first_statement - 1;
+
+	return QCVM_OK;
+}
+
+static int close_function(qcvm_t *qcvm)
+{
+	int i, num_locals;
+
+	/* check for stack underflow */
+	if (qcvm->stack_depth <= 0)
+		return QCVM_STACK_UNDERFLOW;
+
+	num_locals = qcvm->xstack.function->num_locals;
+	qcvm->local_stack_used -= num_locals;
+
+	if (SPECULATING(qcvm))
+		spec_write_globals(qcvm, qcvm->xstack.function->first_parm, num_locals);
+
+	/* check for stack underflow */
+	if (qcvm->local_stack_used < 0)
+		return QCVM_STACK_UNDERFLOW;
+
+	/* restore locals from the stack */
+	for (i = 0; i < num_locals; i++)
+		qcvm->globals[qcvm->xstack.function->first_parm + i].i = qcvm->local_stack[qcvm->local_stack_used + i];
+
+	/* move down the stack */
+	qcvm->stack_depth--;
+	qcvm->xstack.function = qcvm->stack[qcvm->stack_depth].function;
+
+	/* set next statement */
+	qcvm->current_statement_index = qcvm->stack[qcvm->stack_depth].statement;
+
+	return QCVM_OK;
+}
+
+int qcvm_load(qcvm_t *qcvm, const char *name)
+{
+	int r;
+	uint32_t func;
+
+	if (!qcvm || !name)
+		return QCVM_NULL_POINTER;
+
+	/* retrieve function id */
+	if ((r = find_function(qcvm, name, &func)) != QCVM_OK)
+		return r;
+
+	/* do actual setup */
+	return setup_function(qcvm, &qcvm->functions[func]);
+}
+
+int qcvm_step(qcvm_t *qcvm)
+{
+	int r;
+	uint16_t opcode;
+
+	if (!qcvm)
+		return QCVM_NULL_POINTER;
+
+	/* advance statement */
+	qcvm->current_statement_index++;
+
+	/* get current statement and evaluators */
+	qcvm->current_statement = &qcvm->statements[qcvm->current_statement_index];
+	qcvm->eval[0] = (union qcvm_eval *)&qcvm->globals[qcvm->current_statement->vars[0]];
+	qcvm->eval[1] = (union qcvm_eval *)&qcvm->globals[qcvm->current_statement->vars[1]];
+	qcvm->eval[2] = (union qcvm_eval *)&qcvm->globals[qcvm->current_statement->vars[2]];
+
+	/* update stack */
+	qcvm->xstack.function->profile++;
+	qcvm->statements_run++;
+	qcvm->xstack.statement = qcvm->current_statement_index;
+
+	/* speculative workers log what this statement touches, and do entity access themselves */
+	if (SPECULATING(qcvm))
+	{
+		int handled;
+
+		if ((r = speculate_statement(qcvm, &handled)) != QCVM_OK || handled)
+			return r;
+	}
+
+	/* parse opcode */
+	opcode = qcvm->current_statement->opcode;
+	switch (opcode)
+	{
+		/* function call */
+		case OPCODE_CALL0:
+		case OPCODE_CALL1:
+		case OPCODE_CALL2:
+		case OPCODE_CALL3:
+		case OPCODE_CALL4:
+		case OPCODE_CALL5:
+		case OPCODE_CALL6:
+		case OPCODE_CALL7:
+		case OPCODE_CALL8:
+		{
+			/* check for null function */
+			if (qcvm->eval[0]->func < 1)
+				return QCVM_INVALID_FUNCTION;
+
+			/* get function argc */
+			qcvm->current_argc = opcode - OPCODE_CALL0;
+
+			/* assign next function value */
+			qcvm->next_function = &qcvm->functions[qcvm->eval[0]->func];
+
+			/* setup state for builtin call */
+			if (qcvm->next_function->first_statement < 1)
+				return QCVM_BUILTIN_CALL;
+
+			/* setup for execution */
+			if ((r = setup_function(qcvm, qcvm->next_function) != QCVM_OK))
+				return r;
+
+			return QCVM_OK;
+		}
+
+		/* function return */
+		case OPCODE_RETURN:
+		case OPCODE_DONE:
+		{
+			qcvm->globals[OFS_RETURN] = qcvm->globals[qcvm->current_statement->vars[0]];
+			qcvm->globals[OFS_RETURN + 1] = qcvm->globals[qcvm->current_statement->vars[0] + 1];
+			qcvm->globals[OFS_RETURN + 2] = qcvm->globals[qcvm->current_statement->vars[0] + 2];
+
+			if ((r = close_function(qcvm)) != QCVM_OK)
+				return r;
+
+			if (qcvm->stack_depth == qcvm->exit_depth)
+				return QCVM_EXECUTION_FINISHED;
+
+			return QCVM_OK;
+		}
+
+		case OPCODE_MUL_F:
+		{
+			qcvm->eval[2]->f = qcvm->eval[0]->f * qcvm->eval[1]->f;
+			break;
+		}
+
+		case OPCODE_MUL_V:
+		{
+			qcvm->eval[2]->f =
+				qcvm->eval[0]->v[0] * qcvm->eval[1]->v[0] +
+				qcvm->eval[0]->v[1] * qcvm->eval[1]->v[1] +
+				qcvm->eval[0]->v[2] * qcvm->eval[1]->v[2];
+			break;
+		}
+
+		case OPCODE_MUL_FV:
+		{
+			qcvm->eval[2]->v[0] = qcvm->eval[0]->f * qcvm->eval[1]->v[0];
+			qcvm->eval[2]->v[1] = qcvm->eval[0]->f * qcvm->eval[1]->v[1];
+			qcvm->eval[2]->v[2] = qcvm->eval[0]->f * qcvm->eval[1]->v[2];
+			break;
+		}
+
+		case OPCODE_MUL_VF:
+		{
+			qcvm->eval[2]->v[0] = qcvm->eval[1]->f * qcvm->eval[0]->v[0];
+			qcvm->eval[2]->v[1] = qcvm->eval[1]->f * qcvm->eval[0]->v[1];
+			qcvm->eval[2]->v[2] = qcvm->eval[1]->f * qcvm->eval[0]->v[2];
+			break;
+		}
+
+		case OPCODE_DIV_F:
+		{
+			qcvm->eval[2]->f = qcvm->eval[0]->f / qcvm->eval[1]->f;
+			break;
+		}
+
+		case OPCODE_ADD_F:
+		{
+			qcvm->eval[2]->f = qcvm->eval[0]->f + qcvm->eval[1]->f;
+			break;
+		}
+
+		case OPCODE_ADD_V:
+		{
+			qcvm->eval[2]->v[0] = qcvm->eval[0]->v[0] + qcvm->eval[1]->v[0];
+			qcvm->eval[2]->v[1] = qcvm->eval[0]->v[1] + qcvm->eval[1]->v[1];
+			qcvm->eval[2]->v[2] = qcvm->eval[0]->v[2] + qcvm->eval[1]->v[2];
+			break;
+		}
+
+		case OPCODE_SUB_F:
+		{
+			qcvm->eval[2]->f = qcvm->eval[0]->f - qcvm->eval[1]->f;
+			break;
+		}
+
+		case OPCODE_SUB_V:
+		{
+			qcvm->eval[2]->v[0] = qcvm->eval[0]->v[0] - qcvm->eval[1]->v[0];
+			qcvm->eval[2]->v[1] = qcvm->eval[0]->v[1] - qcvm->eval[1]->v[1];
+			qcvm->eval[2]->v[2] = qcvm->eval[0]->v[2] - qcvm->eval[1]->v[2];
+			break;
+		}
+
+		case OPCODE_EQ_F:
+		{
+			qcvm->eval[2]->f = qcvm->eval[0]->f == qcvm->eval[1]->f;
+			break;
+		}
+
+		case OPCODE_EQ_V:
+		{
+			qcvm->eval[2]->f =
+				(qcvm->eval[0]->v[0] == qcvm->eval[1]->v[0]) &&
+				(qcvm->eval[0]->v[1] == qcvm->eval[1]->v[1]) &&
+				(qcvm->eval[0]->v[2] == qcvm->eval[1]->v[2]);
+			break;
+		}
+
+		case OPCODE_EQ_S:
+		{
+			qcvm->eval[2]->f = str_equal(qcvm, qcvm->eval[0]->s, qcvm->eval[1]->s);
+			break;
+		}
+
+		case OPCODE_EQ_E:
+		{
+			qcvm->eval[2]->f = qcvm->eval[0]->i == qcvm->eval[1]->i;
+			break;
+		}
+
+		case OPCODE_EQ_FNC:
+		{
+			qcvm->eval[2]->f = qcvm->eval[0]->func == qcvm->eval[1]->func;
+			break;
+		}
+
+		case OPCODE_NE_F:
+		{
+			qcvm->eval[2]->f = qcvm->eval[0]->f != qcvm->eval[1]->f;
+			break;
+		}
+
+		case OPCODE_NE_V:
+		{
+			qcvm->eval[2]->f =
+				(qcvm->eval[0]->v[0] != qcvm->eval[1]->v[0]) ||
+				(qcvm->eval[0]->v[1] != qcvm->eval[1]->v[1]) ||
+				(qcvm->eval[0]->v[2] != qcvm->eval[1]->v[2]);
+			break;
+		}
+
+		case OPCODE_NE_S:
+		{
+			qcvm->eval[2]->f = !str_equal(qcvm, qcvm->eval[0]->s, qcvm->eval[1]->s);
+			break;
+		}
+
+		case OPCODE_NE_E:
+		{
+			qcvm->eval[2]->f = qcvm->eval[0]->i != qcvm->eval[1]->i;
+			break;
+		}
+
+		case OPCODE_NE_FNC:
+		{
+			qcvm->eval[2]->f = qcvm->eval[0]->func != qcvm->eval[1]->func;
+			break;
+		}
+
+		case OPCODE_LE:
+		{
+			qcvm->eval[2]->f = qcvm->eval[0]->f <= qcvm->eval[1]->f;
+			break;
+		}
+
+		case OPCODE_GE:
+		{
+			qcvm->eval[2]->f = qcvm->eval[0]->f >= qcvm->eval[1]->f;
+			break;
+		}
+
+		case OPCODE_LT:
+		{
+			qcvm->eval[2]->f = qcvm->eval[0]->f < qcvm->eval[1]->f;
+			break;
+		}
+
+		case OPCODE_GT:
+		{
+			qcvm->eval[2]->f = qcvm->eval[0]->f > qcvm->eval[1]->f;
+			break;
+		}
+
+		case OPCODE_LOAD_F:
+		case OPCODE_LOAD_S:
+		case OPCODE_LOAD_ENT:
+		case OPCODE_LOAD_FLD:
+		case OPCODE_LOAD_FNC:
+		{
+			/* get offset to field */
+			qcvm->eval[0] = (union qcvm_eval *)FIELD_PTR(qcvm->eval[0]->e, qcvm->eval[1]->i);
+
+			/* load field value */
+			qcvm->eval[2]->i = qcvm->eval[0]->i;
+
+			break;
+		}
+
+		case OPCODE_LOAD_V:
+		{
+			/* get offset to field */
+			qcvm->eval[0] = (union qcvm_eval *)FIELD_PTR(qcvm->eval[0]->e, qcvm->eval[1]->i);
+
+			/* load field value */
+			qcvm->eval[2]->v[0] = qcvm->eval[0]->v[0];
+			qcvm->eval[2]->v[1] = qcvm->eval[0]->v[1];
+			qcvm->eval[2]->v[2] = qcvm->eval[0]->v[2];
+
+			break;
+		}
+
+		case OPCODE_ADDRESS:
+		{
+			/* get offset to entity field */
+			uint32_t *field_ptr = FIELD_PTR(qcvm->eval[0]->e, qcvm->eval[1]->i);
+
+			/* get offset from start of entities buffer */
+			qcvm->eval[2]->i = (int32_t)((uint8_t *)field_ptr - (uint8_t *)qcvm->entities);
+			break;
+		}
+
+		case OPCODE_STORE_F:
+		case OPCODE_STORE_S:
+		case OPCODE_STORE_ENT:
+		case OPCODE_STORE_FLD:
+		case OPCODE_STORE_FNC:
+		{
+			qcvm->eval[1]->i = qcvm->eval[0]->i;
+			break;
+		}
+
+		case OPCODE_STORE_V:
+		{
+			qcvm->eval[1]->v[0] = qcvm->eval[0]->v[0];
+			qcvm->eval[1]->v[1] = qcvm->eval[0]->v[1];
+			qcvm->eval[1]->v[2] = qcvm->eval[0]->v[2];
+			break;
+		}
+
+		case OPCODE_STOREP_S:
+		{
+			/* don't let a zone string hide behind the collector */
+			if (qcvm->zone_gc_phase == ZONE_GC_MARK)
+				mark_zone_string(qcvm, qcvm->eval[0]->s);
+		}
+		/* fallthrough */
+		case OPCODE_STOREP_F:
+		case OPCODE_STOREP_ENT:
+		case OPCODE_STOREP_FLD:
+		case OPCODE_STOREP_FNC:
+		{
+			union qcvm_eval *temp = (union qcvm_eval *)((uint8_t *)qcvm->entities + qcvm->eval[1]->i);
+
+			/* let snapshots and field tracking see the write first */
+			if (HAS_WRITE_BARRIER(qcvm) && (r = entity_write_barrier(qcvm, (size_t)qcvm->eval[1]->i, 4)) != QCVM_OK)
+				return r;
+
+			temp->i = qcvm->eval[0]->i;
+			break;
+		}
+
+		case OPCODE_STOREP_V:
+		{
+			union qcvm_eval *temp = (union qcvm_eval *)((uint8_t *)qcvm->entities + qcvm->eval[1]->i);
+
+			if (HAS_WRITE_BARRIER(qcvm) && (r = entity_write_barrier(qcvm, (size_t)qcvm->eval[1]->i, 12)) != QCVM_OK)
+				return r;
+
+			temp->v[0] = qcvm->eval[0]->v[0];
+			temp->v[1] = qcvm->eval[0]->v[1];
+			temp->v[2] = qcvm->eval[0]->v[2];
+			break;
+		}
+
+		case OPCODE_NOT_F:
+		{
+			qcvm->eval[2]->f = !qcvm->eval[0]->f;
+			break;
+		}
+
+		case OPCODE_NOT_V:
+		{
+			qcvm->eval[2]->f = !qcvm->eval[0]->v[0] && !qcvm->eval[0]->v[1] && !qcvm->eval[0]->v[2];
+			break;
+		}
+
+		case OPCODE_NOT_S:
+		{
+			qcvm->eval[2]->f = !qcvm->eval[0]->s || !*str_ofs(qcvm, qcvm->eval[0]->s);
+			break;
+		}
+
+		case OPCODE_NOT_ENT:
+		{
+			qcvm->eval[2]->f = !qcvm->eval[0]->e;
+			break;
+		}
+
+		case OPCODE_NOT_FNC:
+		{
+			qcvm->eval[2]->f = !qcvm->eval[0]->func;
+			break;
+		}
+
+		case OPCODE_IF:
+		{
+			if (qcvm->eval[0]->i)
+				qcvm->current_statement_index += qcvm->current_statement->vars[1] - 1;
+			break;
+		}
+
+		case OPCODE_IFNOT:
+		{
+			if (!qcvm->eval[0]->i)
+				qcvm->current_statement_index += qcvm->current_statement->vars[1] - 1;
+			break;
+		}
+
+		case OPCODE_STATE:
+		{
+			/* must be handled by user program... somehow */
+			return QCVM_STATE_CALL;
+		}
+
+		case OPCODE_GOTO:
+		{
+			qcvm->current_statement_index += qcvm->current_statement->vars[0] - 1;
+			break;
+		}
+
+		case OPCODE_AND_F:
+		{
+			qcvm->eval[2]->f = qcvm->eval[0]->f && qcvm->eval[1]->f;
+			break;
+		}
+
+		case OPCODE_OR_F:
+		{
+			qcvm->eval[2]->f = qcvm->eval[0]->f || qcvm->eval[1]->f;
+			break;
+		}
+
+		case OPCODE_BITAND_F:
+		{
+			qcvm->eval[2]->f = (int)qcvm->eval[0]->f & (int)qcvm->eval[1]->f;
+			break;
+		}
+
+		case OPCODE_BITOR_F:
+		{
+			qcvm->eval[2]->f = (int)qcvm->eval[0]->f | (int)qcvm->eval[1]->f;
+			break;
+		}
+
+		default:
+		{
+			return QCVM_INVALID_OPCODE;
+		}
+	}
+
+	return QCVM_OK;
+}
+
+/* call a builtin through whichever interface it has */
+static int invoke_builtin(qcvm_t *qcvm, struct qcvm_builtin *builtin)
+{
+	struct qcvm_builtin_call call;
+
+	if (!builtin->fast_func)
+	{
+		builtin->func(qcvm, builtin->user);
+		return QCVM_OK;
+	}
+
+	/* the parameters are laid out three words apart, just like the union */
+	call.argc = qcvm->current_argc;
+	call.parms = (const union qcvm_eval *)&qcvm->globals[OFS_PARM0];
+	call.ret = (union qcvm_eval *)&qcvm->globals[OFS_RETURN];
+
+	return builtin->fast_func(qcvm, &call, builtin->user);
+}
+
+/* call a builtin, under the host's lock if it has to be serialized */
+static int call_builtin(qcvm_t *qcvm, struct qcvm_builtin *builtin)
+{
+	int i, r;
+
+	/* only thread-safe builtins can run speculatively, as they only touch their arguments and return value */
+	if (SPECULATING(qcvm))
+	{
+		if (!(builtin->flags & QCVM_BUILTIN_THREAD_SAFE))
+			return QCVM_BUILTIN_CALL;
+
+		for (i = 0; i < qcvm->current_argc; i++)
+			spec_read_globals(qcvm, OFS_PARM0 + i * 3, 3);
+		r = invoke_builtin(qcvm, builtin);
+		spec_write_globals(qcvm, OFS_RETURN, 3);
+		return r;
+	}
+
+	if (qcvm->worker && (qcvm->worker->flags & QCVM_THINK_SERIALIZE_BUILTINS) && !(builtin->flags & QCVM_BUILTIN_THREAD_SAFE))
+	{
+		qcvm->lock_callback(qcvm, 1, qcvm->lock_callback_user);
+		r = invoke_builtin(qcvm, builtin);
+		qcvm->lock_callback(qcvm, 0, qcvm->lock_callback_user);
+		qcvm->worker->num_serialized++;
+		return r;
+	}
+
+	return invoke_builtin(qcvm, builtin);
+}
+
+/* run a function until it returns */
+static int run_function(qcvm_t *qcvm, struct qcvm_function *func)
+{
+	int r, running;
+	uint32_t i;
+
+	/* save exit depth */
+	qcvm->exit_depth = qcvm->stack_depth;
+
+	/* setup function */
+	if ((r = setup_function(qcvm, func)) != QCVM_OK)
+		return r;
+
+	/* start stepping through function */
+	r = QCVM_OK;
+	running = 1;
+	while (running)
+	{
+		r = qcvm_step(qcvm);
+
+		switch (r)
+		{
+			/* step went ok, proceed to next */
+			case QCVM_OK:
+				break;
+
+			/* parse builtin call */
+			case QCVM_BUILTIN_CALL:
+			{
+				if (qcvm->next_function->first_statement == 0)
+				{
+					const char *name = str_ofs(qcvm, qcvm->next_function->ofs_name);
+
+					/* search for named builtin */
+					for (i = 0; i < qcvm->num_builtins; i++)
+					{
+						if (QCVM_STRCMP(name, qcvm->builtins[i].name) == 0)
+						{
+							r = call_builtin(qcvm, &qcvm->builtins[i]);
+							qcvm->next_function->first_statement = -1 * (i + 1);
+							break;
+						}
+					}
+				}
+				else if (qcvm->next_function->first_statement < 0)
+				{
+					/* get builtin by index */
+					int builtin = (-1 * qcvm->next_function->first_statement) - 1;
+
+					/* check bounds */
+					if (builtin < 0 || builtin >= (int)qcvm->num_builtins)
+					{
+						r = QCVM_BUILTIN_NOT_FOUND;
+					}
+					else
+					{
+						r = call_builtin(qcvm, &qcvm->builtins[builtin]);
+					}
+				}
+
+				/* its error */
+				if (r != QCVM_OK)
+					return r;
+				else
+					break;
+			}
+
+			/* parse state call */
+			case QCVM_STATE_CALL:
+				if (SPECULATING(qcvm))
+					return r;
+				if (qcvm->state_callback)
+					if ((r = qcvm->state_callback(qcvm, qcvm->eval[0]->f, qcvm->eval[1]->func, qcvm->state_callback_user)) != QCVM_OK)
+						return r;
+				break;
+
+			/* execution finished */
+			case QCVM_EXECUTION_FINISHED:
+				return QCVM_OK;
+
+			/* something else happened */
+			default:
+				return r;
+		}
+	}
+
+	return r;
+}
+
+int qcvm_run(qcvm_t *qcvm, const char *name)
+{
+	int r;
+	uint32_t func;
+
+	if (!qcvm || !name)
+		return QCVM_NULL_POINTER;
+
+	/* retrieve function id */
+	if ((r = find_function(qcvm, name, &func)) != QCVM_OK)
+		return r;
+
+	return run_function(qcvm, &qcvm->functions[func]);
+}
+
+/* chain on a new tempstrings block with room for at least len bytes */
+static int grow_tempstrings(qcvm_t *qcvm, size_t len)
+{
+	struct qcvm_tempstrings_block *block;
+	size_t base, size;
+
+	if (!qcvm->alloc_callback)
+		return qcvm->num_tempstrings_blocks ? QCVM_OUT_OF_MEMORY : QCVM_NO_TEMPSTRINGS;
+
+	if (qcvm->num_tempstrings_blocks >= QCVM_TEMPSTRINGS_BLOCKS)
+		return QCVM_OUT_OF_MEMORY;
+
+	/* each block is at least twice as big as the one before it */
+	if (qcvm->num_tempstrings_blocks)
+	{
+		block = &qcvm->tempstrings_blocks[qcvm->num_tempstrings_blocks - 1];
+		base = block->base + block->len;
+		size = block->len * 2;
+	}
+	else
+	{
+		base = 0;
+		size = 4096;
+	}
+
+	/* leave room for the null string at the start of the first block */
+	if (size < len + 4)
+		size = len + 4;
+
+	/* make sure every offset fits in a string handle */
+	if (base + size > STRING_OFS_MAX)
+		size = STRING_OFS_MAX - base;
+	if (base >= STRING_OFS_MAX || size < len + 4)
+		return QCVM_OUT_OF_MEMORY;
+
+	block = &qcvm->tempstrings_blocks[qcvm->num_tempstrings_blocks];
+	block->data = qcvm->alloc_callback(qcvm, NULL, size, qcvm->alloc_callback_user);
+	if (!block->data)
+		return QCVM_OUT_OF_MEMORY;
+	block->len = size;
+	block->base = base;
+
+	qcvm->num_tempstrings_blocks++;
+
+	return QCVM_OK;
+}
+
+/* make sure the current block has room for a tempstring of len characters */
+static int tempstrings_make_room(qcvm_t *qcvm, size_t len, char **out)
+{
+	struct qcvm_tempstrings_block *block;
+	size_t need;
+	int r;
+
+	need = STRING_HEADER_SIZE + len + 1;
+	block = &qcvm->tempstrings_blocks[qcvm->current_tempstrings_block];
+
+	/* move on to the next block that's big enough, chaining on a new one if needed */
+	while (qcvm->current_tempstrings_block >= qcvm->num_tempstrings_blocks || ALIGN4(qcvm->tempstrings_used) + need > block->len)
+	{
+		if (qcvm->current_tempstrings_block + 1 >= qcvm->num_tempstrings_blocks)
+			if ((r = grow_tempstrings(qcvm, need)) != QCVM_OK)
+				return r;
+
+		if (qcvm->num_tempstrings_blocks == 1)
+		{
+			/* the very first block */
+			qcvm->current_tempstrings_block = 0;
+			qcvm->tempstrings_used = 1;
+			qcvm->tempstrings_blocks[0].data[0] = '\0';
+		}
+		else
+		{
+			qcvm->current_tempstrings_block++;
+			qcvm->tempstrings_used = 0;
+		}
+
+		block = &qcvm->tempstrings_blocks[qcvm->current_tempstrings_block];
+	}
+
+	*out = &block->data[ALIGN4(qcvm->tempstrings_used) + STRING_HEADER_SIZE];
+
+	return QCVM_OK;
+}
+
+/* length of s up to its first null, looking at no more than len bytes */
+static size_t null_clamp(const char *s, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len && s[i]; i++);
+
+	return i;
+}
+
+/* claim the tempstring of len characters at the current position */
+static int32_t tempstrings_claim(qcvm_t *qcvm, size_t len)
+{
+	struct qcvm_tempstrings_block *block;
+	size_t used;
+
+	block = &qcvm->tempstrings_blocks[qcvm->current_tempstrings_block];
+	used = ALIGN4(qcvm->tempstrings_used) + STRING_HEADER_SIZE;
+	qcvm->tempstrings_used = used + len + 1;
+
+	/* update high water mark */
+	if (block->base + qcvm->tempstrings_used > qcvm->tempstrings_high_water)
+		qcvm->tempstrings_high_water = block->base + qcvm->tempstrings_used;
+
+	set_string_header(&block->data[used], len, 0);
+	block->data[used + len] = '\0';
+
+	return STRING_HANDLE(STRING_HEAP_TEMPSTRINGS, block->base + used);
+}
+
+/* reserve room for a tempstring of len characters plus header and terminator */
+static int alloc_tempstring(qcvm_t *qcvm, size_t len, char **out, int32_t *handle)
+{
+	int r;
+
+	/* this would overwrite any pending reservation */
+	qcvm->tempstrings_reserved = 0;
+
+	if ((r = tempstrings_make_room(qcvm, len, out)) != QCVM_OK)
+		return r;
+
+	*handle = tempstrings_claim(qcvm, len);
+
+	return QCVM_OK;
+}
+
+int qcvm_reserve_tempstring(qcvm_t *qcvm, size_t max_len, char **buf)
+{
+	int r;
+
+	if (!qcvm || !buf)
+		return QCVM_NULL_POINTER;
+
+	qcvm->tempstrings_reserved = 0;
+
+	if ((r = tempstrings_make_room(qcvm, max_len, buf)) != QCVM_OK)
+		return r;
+
+	qcvm->tempstrings_reserved = max_len + 1;
+
+	return QCVM_OK;
+}
+
+int qcvm_commit_tempstring(qcvm_t *qcvm, size_t len)
+{
+	const char *buf;
+
+	if (!qcvm)
+		return QCVM_NULL_POINTER;
+
+	if (!qcvm->tempstrings_reserved)
+		return QCVM_NO_TEMPSTRINGS;
+
+	if (len >= qcvm->tempstrings_reserved)
+		return QCVM_ARGUMENT_OUT_OF_RANGE;
+
+	qcvm->tempstrings_reserved = 0;
+
+	/* the cached length has to agree with where the string ends */
+	buf = &qcvm->tempstrings_blocks[qcvm->current_tempstrings_block].data[ALIGN4(qcvm->tempstrings_used) + STRING_HEADER_SIZE];
+	len = null_clamp(buf, len);
+
+	/* return offset */
+	qcvm->globals[OFS_RETURN].i = tempstrings_claim(qcvm, len);
+	qcvm->globals[OFS_RETURN + 1].i = 0;
+	qcvm->globals[OFS_RETURN + 2].i = 0;
+
+	return QCVM_OK;
+}
+
+int qcvm_tempstrings_begin_frame(qcvm_t *qcvm)
+{
+	if (!qcvm)
+		return QCVM_NULL_POINTER;
+
+	/* rewind to the start of the first block, keeping the null string */
+	qcvm->current_tempstrings_block = 0;
+	qcvm->tempstrings_used = 1;
+	qcvm->tempstrings_reserved = 0;
+	if (qcvm->num_tempstrings_blocks)
+		qcvm->tempstrings_blocks[0].data[0] = '\0';
+
+	/* per-frame external strings go with them */
+	qcvm->num_external_strings[1] = 0;
+
+	qcvm->tempstrings_epoch++;
+
+	return QCVM_OK;
+}
+
+int qcvm_query_tempstrings_info(qcvm_t *qcvm, size_t *used, size_t *high_water, size_t *capacity)
+{
+	int32_t i;
+
+	if (!qcvm)
+		return QCVM_NULL_POINTER;
+
+	if (used)
+	{
+		if (qcvm->num_tempstrings_blocks)
+			*used = qcvm->tempstrings_blocks[qcvm->current_tempstrings_block].base + qcvm->tempstrings_used;
+		else
+			*used = 0;
+	}
+
+	if (high_water)
+		*high_water = qcvm->tempstrings_high_water;
+
+	if (capacity)
+	{
+		*capacity = 0;
+		for (i = 0; i < qcvm->num_tempstrings_blocks; i++)
+			*capacity += qcvm->tempstrings_blocks[i].len;
+	}
+
+	return QCVM_OK;
+}
+
+int qcvm_return_string(qcvm_t *qcvm, const char *s)
+{
+	if (!qcvm || !s)
+		return QCVM_NULL_POINTER;
+
+	return qcvm_return_string_len(qcvm, s, QCVM_STRLEN(s));
+}
+
+int qcvm_return_string_len(qcvm_t *qcvm, const char *s, size_t len)
+{
+	char *dst;
+	int32_t handle;
+	int r;
+
+	if (!qcvm || !s)
+		return QCVM_NULL_POINTER;
+
+	/* the cached length has to agree with where the string ends */
+	len = null_clamp(s, len);
+
+	/* hand back the null string if there's no room */
+	qcvm->globals[OFS_RETURN].i = 0;
+	qcvm->globals[OFS_RETURN + 1].i = 0;
+	qcvm->globals[OFS_RETURN + 2].i = 0;
+
+	if ((r = alloc_tempstring(qcvm, len, &dst, &handle)) != QCVM_OK)
+		return r;
+
+	/* return offset */
+	qcvm->globals[OFS_RETURN].i = handle;
+
+	QCVM_MEMCPY(dst, s, len);
+
+	return QCVM_OK;
+}
+
+int qcvm_return_float(qcvm_t *qcvm, float f)
+{
+	if (!qcvm)
+		return QCVM_NULL_POINTER;
+
+	qcvm->globals[OFS_RETURN].f = f;
+	qcvm->globals[OFS_RETURN + 1].f = 0;
+	qcvm->globals[OFS_RETURN + 2].f = 0;
+
+	return QCVM_OK;
+}
+
+int qcvm_return_vector(qcvm_t *qcvm, float x, float y, float z)
+{
+	if (!qcvm)
+		return QCVM_NULL_POINTER;
+
+	qcvm->globals[OFS_RETURN].f = x;
+	qcvm->globals[OFS_RETURN + 1].f = y;
+	qcvm->globals[OFS_RETURN + 2].f = z;
+
+	return QCVM_OK;
+}
+
+int qcvm_return_entity(qcvm_t *qcvm, uint32_t e)
+{
+	if (!qcvm)
+		return QCVM_NULL_POINTER;
+
+	qcvm->globals[OFS_RETURN].ui = e;
+	qcvm->globals[OFS_RETURN + 1].ui = 0;
+	qcvm->globals[OFS_RETURN + 2].ui = 0;
+
+	return QCVM_OK;
+}
+
+int qcvm_query_argument_count(qcvm_t *qcvm, int *argc)
+{
+	if (!qcvm)
+		return QCVM_NULL_POINTER;
+
+	if (argc)
+		*argc = qcvm->current_argc;
+
+	return QCVM_OK;
+}
+
+int qcvm_get_return_float(qcvm_t *qcvm, float *f)
+{
+	if (!qcvm)
+		return QCVM_NULL_POINTER;
+
+	if (f)
+		*f = qcvm->globals[OFS_RETURN].f;
+
+	return QCVM_OK;
+}
+
+int qcvm_get_return_vector(qcvm_t *qcvm, float *x, float *y, float *z)
+{
+	if (!qcvm)
+		return QCVM_NULL_POINTER;
+
+	if (x)
+		*x = qcvm->globals[OFS_RETURN].f;
+
+	if (y)
+		*y = qcvm->globals[OFS_RETURN + 1].f;
+
+	if (z)
+		*z = qcvm->globals[OFS_RETURN + 2].f;
+
+	return QCVM_OK;
+}
+
+int qcvm_get_return_int(qcvm_t *qcvm, int *i)
+{
+	if (!qcvm)
+		return QCVM_NULL_POINTER;
+
+	if (i)
+		*i = qcvm->globals[OFS_RETURN].i;
+
+	return QCVM_OK;
+}
+
+int qcvm_get_return_entity(qcvm_t *qcvm, uint32_t *e)
+{
+	if (!qcvm)
+		return QCVM_NULL_POINTER;
+
+	if (e)
+		*e = qcvm->globals[OFS_RETURN].ui;
+
+	return QCVM_OK;
+}
+
+int qcvm_get_argument_string(qcvm_t *qcvm, int i, const char **s)
+{
+	if (!qcvm)
+		return QCVM_NULL_POINTER;
+
+	if (i < 0 || i >= 8)
+		return QCVM_ARGUMENT_OUT_OF_RANGE;
+
+	if (s)
+		*s = str_ofs(qcvm, qcvm->globals[OFS_PARM0 + (i * 3)].i);
+
+	return QCVM_OK;
+}
+
+int qcvm_get_argument_string_len(qcvm_t *qcvm, int i, const char **s, size_t *len)
+{
+	const char *str;
+	size_t l;
+
+	if (!qcvm)
+		return QCVM_NULL_POINTER;
+
+	if (i < 0 || i >= 8)
+		return QCVM_ARGUMENT_OUT_OF_RANGE;
+
+	str = str_ofs_len(qcvm, qcvm->globals[OFS_PARM0 + (i * 3)].i, &l);
+
+	if (s)
+		*s = str;
+
+	if (len)
+		*len = l;
+
+	return QCVM_OK;
+}
+
+int qcvm_get_string(qcvm_t *qcvm, int32_t handle, const char **s, size_t *len)
+{
+	const char *str;
+	size_t l;
+
+	if (!qcvm)
+		return QCVM_NULL_POINTER;
+
+	str = str_ofs_len(qcvm, handle, &l);
+
+	if (s)
+		*s = str;
+
+	if (len)
+		*len = l;
+
+	return QCVM_OK;
+}
+
+int qcvm_get_argument_float(qcvm_t *qcvm, int i, float *f)
+{
+	if (!qcvm)
+		return QCVM_NULL_POINTER;
+
+	if (i < 0 || i >= 8)
+		return QCVM_ARGUMENT_OUT_OF_RANGE;
+
+	if (f)
+		*f = qcvm->globals[OFS_PARM0 + (i * 3)].f;
+
+	return QCVM_OK;
+}
+
+int qcvm_get_argument_int(qcvm_t *qcvm, int i, int *n)
+{
+	if (!qcvm)
+		return QCVM_NULL_POINTER;
+
+	if (i < 0 || i >= 8)
+		return QCVM_ARGUMENT_OUT_OF_RANGE;
+
+	if (n)
+		*n = qcvm->globals[OFS_PARM0 + (i * 3)].i;
+
+	return QCVM_OK;
+}
+
+int qcvm_get_argument_vector(qcvm_t *qcvm, int i, float *x, float *y, float *z)
+{
+	if (!qcvm)
+		return QCVM_NULL_POINTER;
+
+	if (i < 0 || i >= 8)
+		return QCVM_ARGUMENT_OUT_OF_RANGE;
+
+	if (x)
+		*x = qcvm->globals[OFS_PARM0 + (i * 3)].f;
+
+	if (y)
+		*y = qcvm->globals[OFS_PARM0 + (i * 3) + 1].f;
+
+	if (z)
+		*z = qcvm->globals[OFS_PARM0 + (i * 3) + 2].f;
+
+	return QCVM_OK;
+}
+
+int qcvm_get_argument_entity(qcvm_t *qcvm, int i, uint32_t *e)
+{
+	if (!qcvm)
+		return QCVM_NULL_POINTER;
+
+	if (i < 0 || i >= 8)
+		return QCVM_ARGUMENT_OUT_OF_RANGE;
+
+	if (e)
+		*e = qcvm->globals[OFS_PARM0 + (i * 3)].ui;
+
+	return QCVM_OK;
+}
+
+/* returns nonzero if var is the first def of the given type at its offset */
+static int is_first_def(struct qcvm_var *vars, size_t i, uint16_t type)
+{
+	size_t j;
+
+	if (DEF_TYPE(&vars[i]) != type)
+		return 0;
+
+	/* don't touch the same slot twice if it has more than one def */
+	for (j = 0; j < i; j++)
+		if (vars[j].ofs == vars[i].ofs && DEF_TYPE(&vars[j]) == type)
+			return 0;
+
+	return 1;
+}
+
+int qcvm_compact_entities(qcvm_t *qcvm, uint32_t num_entities, int (*is_live)(qcvm_t *qcvm, uint32_t e, void *user), void *user, uint32_t *remap, uint32_t *new_num_entities)
+{
+	uint32_t e, n, x;
+	uint32_t *src, *dst;
+	size_t i;
+	int r;
+
+	if (!qcvm || !is_live || !remap)
+		return QCVM_NULL_POINTER;
+
+	if (qcvm->worker)
+		return QCVM_WORKER_UNSUPPORTED;
+
+	if (!qcvm->entities)
+		return QCVM_NO_ENTITIES;
+
+	if (qcvm->stack_depth > 0)
+		return QCVM_EXECUTION_IN_PROGRESS;
+
+	if (!num_entities || (size_t)num_entities * qcvm->header.num_entity_fields * 4 > qcvm->len_entities)
+		return QCVM_ARGUMENT_OUT_OF_RANGE;
+
+	/* any of them might be written to */
+	if ((r = entity_write_barrier(qcvm, 0, (size_t)num_entities * qcvm->header.num_entity_fields * 4)) != QCVM_OK)
+		return r;
+
+	/* entities are about to move under the zone string collector */
+	if (qcvm->zone_gc_phase == ZONE_GC_MARK)
+		qcvm->zone_gc_phase = ZONE_GC_IDLE;
+
+	/* build remap table, world always stays put */
+	remap[0] = 0;
+	for (e = 1, n = 1; e < num_entities; e++)
+		remap[e] = is_live(qcvm, e, user) ? n++ : 0;
+
+	/* slide live entities down, destination is always below the source */
+	for (e = 1; e < num_entities; e++)
+	{
+		if (!remap[e] || remap[e] == e)
+			continue;
+
+		src = FIELD_PTR(e, 0);
+		dst = FIELD_PTR(remap[e], 0);
+		for (x = 0; x < qcvm->header.num_entity_fields; x++)
+			dst[x] = src[x];
+	}
+
+	/* clear vacated slots */
+	for (e = n; e < num_entities; e++)
+	{
+		dst = FIELD_PTR(e, 0);
+		for (x = 0; x < qcvm->header.num_entity_fields; x++)
+			dst[x] = 0;
+	}
+
+	/* rewrite entity globals */
+	for (i = 0; i < qcvm->num_global_vars; i++)
+	{
+		union qcvm_global *g;
+
+		if (!is_first_def(qcvm->global_vars, i, QCVM_TYPE_ENTITY))
+			continue;
+
+		g = &qcvm->globals[qcvm->global_vars[i].ofs];
+		if (g->ui < num_entities)
+			g->ui = remap[g->ui];
+	}
+
+	/* rewrite entity fields of the survivors */
+	for (i = 0; i < qcvm->num_field_vars; i++)
+	{
+		if (!is_first_def(qcvm->field_vars, i, QCVM_TYPE_ENTITY))
+			continue;
+
+		for (e = 0; e < n; e++)
+		{
+			uint32_t *field = FIELD_PTR(e, qcvm->field_vars[i].ofs);
+			if (*field < num_entities)
+				*field = remap[*field];
+		}
+	}
+
+	if (new_num_entities)
+		*new_num_entities = n;
+
+	return QCVM_OK;
+}
+
+/* index of the lowest set bit, x must not be 0 */
+static uint32_t lowest_bit(uint32_t x)
+{
+#ifdef __GNUC__
+	return (uint32_t)__builtin_ctz(x);
+#else
+	uint32_t i;
+	for (i = 0; !(x & 1); i++)
+		x >>= 1;
+	return i;
+#endif
+}
+
+/* find a free slot in a zone slab, or return -1 if it's full */
+static int32_t zone_free_slot(struct qcvm_zone_slab *slab)
+{
+	uint32_t i, x;
+
+	if (slab->num_used >= slab->num_slots)
+		return -1;
+
+	for (i = 0; i < slab->num_slots; i += 32)
+	{
+		if (slab->used[i / 32] == 0xFFFFFFFF)
+			continue;
+
+		x = i + lowest_bit(~slab->used[i / 32]);
+		if (x < slab->num_slots)
+			return (int32_t)x;
+	}
+
+	return -1;
+}
+
+/* set up a fresh slab for the given slot size */
+static int new_zone_slab(qcvm_t *qcvm, uint32_t slot_size, uint32_t num_slots, uint32_t *out)
+{
+	struct qcvm_zone_slab *slab;
+	uint32_t i;
+
+	if (!qcvm->alloc_callback)
+		return QCVM_OUT_OF_MEMORY;
+
+	/* reuse an empty entry if there is one */
+	for (i = 0; i < qcvm->num_zone_slabs; i++)
+		if (!qcvm->zone_slabs[i].data)
+			break;
+
+	if (i >= qcvm->num_zone_slabs)
+	{
+		if (qcvm->num_zone_slabs >= ZONE_MAX_SLABS)
+			return QCVM_OUT_OF_MEMORY;
+
+		/* grow slab array */
+		if (qcvm->num_zone_slabs >= qcvm->max_zone_slabs)
+		{
+			uint32_t max = qcvm->max_zone_slabs ? qcvm->max_zone_slabs * 2 : 16;
+			void *slabs = qcvm->alloc_callback(qcvm, qcvm->zone_slabs, max * sizeof(struct qcvm_zone_slab), qcvm->alloc_callback_user);
+			if (!slabs)
+				return QCVM_OUT_OF_MEMORY;
+			qcvm->zone_slabs = slabs;
+			qcvm->max_zone_slabs = max;
+		}
+
+		i = qcvm->num_zone_slabs++;
+		qcvm->zone_slabs[i].data = NULL;
+	}
+
+	slab = &qcvm->zone_slabs[i];
+	slab->data = qcvm->alloc_callback(qcvm, NULL, slot_size * num_slots, qcvm->alloc_callback_user);
+	if (!slab->data)
+		return QCVM_OUT_OF_MEMORY;
+	slab->slot_size = slot_size;
+	slab->num_slots = num_slots;
+	slab->num_used = 0;
+	for (i = 0; i < 32; i++)
+		slab->used[i] = slab->marked[i] = slab->interned[i] = 0;
+
+	*out = (uint32_t)(slab - qcvm->zone_slabs);
+
+	return QCVM_OK;
+}
+
+/* reserve a zone string slot for len characters plus terminator */
+static int alloc_zone_string(qcvm_t *qcvm, size_t len, char **out, int32_t *handle)
+{
+	struct qcvm_zone_slab *slab;
+	uint32_t cls, size, i;
+	int32_t slot;
+	int r;
+
+	if (len > ZONE_MAX_STRING - STRING_HEADER_SIZE - 1)
+		return QCVM_OUT_OF_MEMORY;
+
+	/* pick size class */
+	for (cls = 0, size = ZONE_MIN_SLOT; size < STRING_HEADER_SIZE + len + 1; cls++)
+		size <<= 1;
+
+	if (size > ZONE_SLAB_SIZE)
+	{
+		/* big strings get a slab to themselves */
+		if ((r = new_zone_slab(qcvm, (uint32_t)((STRING_HEADER_SIZE + len + ZONE_MIN_SLOT) & ~(ZONE_MIN_SLOT - 1)), 1, &i)) != QCVM_OK)
+			return r;
+		cls = ZONE_LARGE_CLASS;
+	}
+	else
+	{
+		/* look for room in an existing slab of this size */
+		for (i = qcvm->zone_slab_hints[cls]; i < qcvm->num_zone_slabs; i++)
+		{
+			slab = &qcvm->zone_slabs[i];
+			if (slab->data && slab->num_slots > 1 && slab->slot_size == size && slab->num_used < slab->num_slots)
+				break;
+		}
+
+		if (i >= qcvm->num_zone_slabs)
+			if ((r = new_zone_slab(qcvm, size, ZONE_SLAB_SIZE / size, &i)) != QCVM_OK)
+				return r;
+
+		qcvm->zone_slab_hints[cls] = i;
+	}
+
+	slab = &qcvm->zone_slabs[i];
+	slot = zone_free_slot(slab);
+
+	/* new strings survive the collection cycle they were born in */
+	slab->used[slot / 32] |= 1u << (slot % 32);
+	slab->marked[slot / 32] |= 1u << (slot % 32);
+	slab->num_used++;
+
+	*out = &slab->data[slot * slab->slot_size + STRING_HEADER_SIZE];
+	*handle = STRING_HANDLE(STRING_HEAP_ZONE, (i << ZONE_SLAB_SHIFT) | (slot * slab->slot_size));
+
+	set_string_header(*out, len, 0);
+
+	return QCVM_OK;
+}
+
+/* copy len bytes into a new zone string */
+static int copy_zone_string(qcvm_t *qcvm, const char *s, size_t len, uint32_t hash, int32_t *handle)
+{
+	char *dst;
+	int r;
+
+	if ((r = alloc_zone_string(qcvm, len, &dst, handle)) != QCVM_OK)
+		return r;
+
+	QCVM_MEMCPY(dst, s, len);
+	dst[len] = '\0';
+
+	set_string_header(dst, len, hash);
+
+	return QCVM_OK;
+}
+
+int qcvm_alloc_zone_string(qcvm_t *qcvm, const char *s, int32_t *handle)
+{
+	int32_t h;
+	int r;
+
+	if (!qcvm || !s)
+		return QCVM_NULL_POINTER;
+
+	if (qcvm->worker)
+		return QCVM_WORKER_UNSUPPORTED;
+
+	if ((r = copy_zone_string(qcvm, s, QCVM_STRLEN(s), 0, &h)) != QCVM_OK)
+		return r;
+
+	if (handle)
+		*handle = h;
+
+	return QCVM_OK;
+}
+
+int qcvm_return_zone_string(qcvm_t *qcvm, const char *s)
+{
+	int32_t handle = 0;
+	int r;
+
+	if (!qcvm)
+		return QCVM_NULL_POINTER;
+
+	/* hands back the null string on failure */
+	r = qcvm_alloc_zone_string(qcvm, s, &handle);
+
+	qcvm->globals[OFS_RETURN].i = handle;
+	qcvm->globals[OFS_RETURN + 1].i = 0;
+	qcvm->globals[OFS_RETURN + 2].i = 0;
+
+	return r;
+}
+
+/* mark every zone string held in a string-typed global */
+static void mark_zone_globals(qcvm_t *qcvm)
+{
+	size_t i;
+
+	for (i = 0; i < qcvm->num_global_vars; i++)
+		if (DEF_TYPE(&qcvm->global_vars[i]) == QCVM_TYPE_STRING)
+			mark_zone_string(qcvm, qcvm->globals[qcvm->global_vars[i].ofs].i);
+}
+
+int qcvm_collect_zone_strings(qcvm_t *qcvm, uint32_t num_entities, size_t budget, int *finished)
+{
+	struct qcvm_zone_slab *slab;
+	size_t work, i;
+	uint32_t x;
+
+	if (!qcvm)
+		return QCVM_NULL_POINTER;
+
+	if (qcvm->worker)
+		return QCVM_WORKER_UNSUPPORTED;
+
+	if (qcvm->stack_depth > 0)
+		return QCVM_EXECUTION_IN_PROGRESS;
+
+	if ((size_t)num_entities * qcvm->header.num_entity_fields * 4 > qcvm->len_entities)
+		return QCVM_ARGUMENT_OUT_OF_RANGE;
+
+	if (finished)
+		*finished = 0;
+
+	/* start a new cycle */
+	if (qcvm->zone_gc_phase == ZONE_GC_IDLE)
+	{
+		for (x = 0; x < qcvm->num_zone_slabs; x++)
+			for (i = 0; i < 32; i++)
+				qcvm->zone_slabs[x].marked[i] = 0;
+
+		mark_zone_globals(qcvm);
+
+		qcvm->zone_gc_phase = ZONE_GC_MARK;
+		qcvm->zone_gc_cursor = 0;
+	}
+
+	work = 0;
+
+	/* mark strings held by entity fields */
+	while (qcvm->zone_gc_phase == ZONE_GC_MARK)
+	{
+		if (qcvm->zone_gc_cursor >= num_entities)
+		{
+			/* globals are cheap, so catch any that changed during the cycle */
+			mark_zone_globals(qcvm);
+
+			/* so is anything saved away by snapshots and checkpoints */
+			mark_snapshot_strings(qcvm);
+			mark_checkpoint_strings(qcvm);
+
+			qcvm->zone_gc_phase = ZONE_GC_SWEEP;
+			qcvm->zone_gc_cursor = 0;
+			break;
+		}
+
+		if (budget && work++ >= budget)
+			return QCVM_OK;
+
+		for (i = 0; i < qcvm->num_field_vars; i++)
+			if (DEF_TYPE(&qcvm->field_vars[i]) == QCVM_TYPE_STRING)
+				mark_zone_string(qcvm, *(int32_t *)FIELD_PTR(qcvm->zone_gc_cursor, qcvm->field_vars[i].ofs));
+
+		qcvm->zone_gc_cursor++;
+	}
+
+	/* free everything that wasn't marked */
+	while (qcvm->zone_gc_cursor < qcvm->num_zone_slabs)
+	{
+		if (budget && work++ >= budget)
+			return QCVM_OK;
+
+		slab = &qcvm->zone_slabs[qcvm->zone_gc_cursor++];
+		if (!slab->data)
+			continue;
+
+		slab->num_used = 0;
+		for (i = 0; i < 32; i++)
+		{
+			/* dead interned strings have to leave the intern table */
+			for (x = slab->used[i] & slab->interned[i] & ~slab->marked[i]; x; x &= x - 1)
+			{
+				uint32_t slot = (uint32_t)i * 32 + lowest_bit(x);
+				intern_remove(qcvm, STRING_HANDLE(STRING_HEAP_ZONE, ((uint32_t)(slab - qcvm->zone_slabs) << ZONE_SLAB_SHIFT) | (slot * slab->slot_size)), ((struct qcvm_string_header *)&slab->data[slot * slab->slot_size])->hash);
+			}
+
+			slab->used[i] &= slab->marked[i];
+			slab->interned[i] &= slab->marked[i];
+			for (x = slab->used[i]; x; x &= x - 1)
+				slab->num_used++;
+		}
+
+		/* give empty slabs back */
+		if (!slab->num_used)
+		{
+			qcvm->alloc_callback(qcvm, slab->data, 0, qcvm->alloc_callback_user);
+			slab->data = NULL;
+		}
+	}
+
+	/* start looking for free slots from the beginning again */
+	for (i = 0; i < sizeof(qcvm->zone_slab_hints) / sizeof(qcvm->zone_slab_hints[0]); i++)
+		qcvm->zone_slab_hints[i] = 0;
+
+	qcvm->zone_gc_phase = ZONE_GC_IDLE;
+
+	if (finished)
+		*finished = 1;
+
+	return QCVM_OK;
+}
+
+int qcvm_query_zone_info(qcvm_t *qcvm, size_t *num_strings, size_t *size)
+{
+	uint32_t i;
+
+	if (!qcvm)
+		return QCVM_NULL_POINTER;
+
+	if (num_strings)
+		*num_strings = 0;
+	if (size)
+		*size = 0;
+
+	for (i = 0; i < qcvm->num_zone_slabs; i++)
+	{
+		if (!qcvm->zone_slabs[i].data)
+			continue;
+
+		if (num_strings)
+			*num_strings += qcvm->zone_slabs[i].num_used;
+		if (size)
+			*size += (size_t)qcvm->zone_slabs[i].slot_size * qcvm->zone_slabs[i].num_slots;
+	}
+
+	return QCVM_OK;
+}
+
+int qcvm_intern_string(qcvm_t *qcvm, const char *s, int32_t *handle)
+{
+	struct qcvm_zone_slab *slab;
+	uint32_t hash, slot;
+	size_t len;
+	int32_t h;
+	int r;
+
+	if (!qcvm || !s)
+		return QCVM_NULL_POINTER;
+
+	if (qcvm->worker)
+		return QCVM_WORKER_UNSUPPORTED;
+
+	/* already interned */
+	hash = hash_string(s, &len);
+	if (intern_find(qcvm, s, hash, &h))
+	{
+		if (handle)
+			*handle = h;
+		return QCVM_OK;
+	}
+
+	/* make a zone copy and intern that */
+	if ((r = copy_zone_string(qcvm, s, len, hash, &h)) != QCVM_OK)
+		return r;
+
+	if ((r = intern_insert(qcvm, h, hash)) != QCVM_OK)
+		return r;
+
+	if ((slab = zone_slab(qcvm, STRING_OFS(-h), &slot)) != NULL)
+		slab->interned[slot / 32] |= 1u << (slot % 32);
+
+	if (handle)
+		*handle = h;
+
+	return QCVM_OK;
+}
+
+int qcvm_return_interned_string(qcvm_t *qcvm, const char *s)
+{
+	int32_t handle = 0;
+	int r;
+
+	if (!qcvm)
+		return QCVM_NULL_POINTER;
+
+	/* hands back the null string on failure */
+	r = qcvm_intern_string(qcvm, s, &handle);
+
+	qcvm->globals[OFS_RETURN].i = handle;
+	qcvm->globals[OFS_RETURN + 1].i = 0;
+	qcvm->globals[OFS_RETURN + 2].i = 0;
+
+	return r;
+}
+
+int qcvm_register_string(qcvm_t *qcvm, const char *s, size_t len, int permanent, int32_t *handle)
+{
+	struct qcvm_external_string *external;
+	uint32_t slot;
+	int kind;
+
+	if (!qcvm || !s || !handle)
+		return QCVM_NULL_POINTER;
+
+	if (qcvm->worker)
+		return QCVM_WORKER_UNSUPPORTED;
+
+	kind = permanent ? 0 : 1;
+
+	/* reuse an unregistered permanent slot */
+	if (permanent && qcvm->free_external_string)
+	{
+		slot = qcvm->free_external_string - 1;
+		external = &qcvm->external_strings[0][slot];
+		qcvm->free_external_string = external->next_free == UINT32_MAX ? 0 : external->next_free;
+
+		external->s = s;
+		external->header.len = (uint32_t)null_clamp(s, len);
+		external->header.hash = 0;
+		external->next_free = 0;
+
+		*handle = STRING_HANDLE(STRING_HEAP_EXTERNAL, slot);
+
+		return QCVM_OK;
+	}
+
+	/* grow table */
+	if (qcvm->num_external_strings[kind] >= qcvm->max_external_strings[kind])
+	{
+		uint32_t max = qcvm->max_external_strings[kind] ? qcvm->max_external_strings[kind] * 2 : 64;
+
+		if (!qcvm->alloc_callback || max > STRING_OFS_MAX)
+			return QCVM_OUT_OF_MEMORY;
+
+		external = qcvm->alloc_callback(qcvm, qcvm->external_strings[kind], max * sizeof(struct qcvm_external_string), qcvm->alloc_callback_user);
+		if (!external)
+			return QCVM_OUT_OF_MEMORY;
+
+		qcvm->external_strings[kind] = external;
+		qcvm->max_external_strings[kind] = max;
+	}
+
+	external = &qcvm->external_strings[kind][qcvm->num_external_strings[kind]];
+	external->s = s;
+	external->header.len = (uint32_t)null_clamp(s, len);
+	external->header.hash = 0;
+	external->next_free = 0;
+
+	*handle = STRING_HANDLE(STRING_HEAP_EXTERNAL + kind, qcvm->num_external_strings[kind]);
+
+	qcvm->num_external_strings[kind]++;
+
+	return QCVM_OK;
+}
+
+int qcvm_unregister_string(qcvm_t *qcvm, int32_t handle)
+{
+	struct qcvm_external_string *external;
+
+	if (!qcvm)
+		return QCVM_NULL_POINTER;
+
+	if (qcvm->worker)
+		return QCVM_WORKER_UNSUPPORTED;
+
+	if (handle >= 0 || handle == INT32_MIN || STRING_HEAP(-handle) != STRING_HEAP_EXTERNAL)
+		return QCVM_ARGUMENT_OUT_OF_RANGE;
+
+	if ((uint32_t)STRING_OFS(-handle) >= qcvm->num_external_strings[0])
+		return QCVM_ARGUMENT_OUT_OF_RANGE;
+
+	external = &qcvm->external_strings[0][STRING_OFS(-handle)];
+	if (external->next_free)
+		return QCVM_ARGUMENT_OUT_OF_RANGE;
+
+	/* anything still holding the handle gets the null string */
+	external->s = &qcvm->strings[0];
+	external->header.len = 0;
+	external->header.hash = 0;
+
+	/* and the slot goes on the free list, which ends with UINT32_MAX */
+	external->next_free = qcvm->free_external_string ? qcvm->free_external_string : UINT32_MAX;
+	qcvm->free_external_string = (uint32_t)STRING_OFS(-handle) + 1;
+
+	return QCVM_OK;
+}
+
+int qcvm_return_external_string(qcvm_t *qcvm, const char *s, size_t len)
+{
+	int32_t handle = 0;
+	int r;
+
+	if (!qcvm)
+		return QCVM_NULL_POINTER;
+
+	/* hands back the null string on failure */
+	r = qcvm_register_string(qcvm, s, len, 0, &handle);
+
+	qcvm->globals[OFS_RETURN].i = handle;
+	qcvm->globals[OFS_RETURN + 1].i = 0;
+	qcvm->globals[OFS_RETURN + 2].i = 0;
+
+	return r;
+}
+
+/*
+ * snapshots
+ *
+ * the entities buffer is split into pages. each page remembers the id of the
+ * newest snapshot that has saved it, and the first store to a page after a
+ * snapshot copies its old contents into that snapshot's log. rolling back
+ * means applying the logs from the newest snapshot down to the target one.
+ */
+#define SNAPSHOT_PAGE_SIZE ((size_t)QCVM_SNAPSHOT_PAGE_SIZE)
+
+/* grow a buffer owned by the vm to hold at least num elements */
+static int grow_buffer(qcvm_t *qcvm, void **ptr, size_t *max, size_t num, size_t size)
+{
+	size_t n;
+	void *p;
+
+	if (num <= *max)
+		return QCVM_OK;
+
+	if (!qcvm->alloc_callback)
+		return QCVM_OUT_OF_MEMORY;
+
+	for (n = *max ? *max * 2 : 16; n < num; n *= 2);
+
+	if ((p = qcvm->alloc_callback(qcvm, *ptr, n * size, qcvm->alloc_callback_user)) == NULL)
+		return QCVM_OUT_OF_MEMORY;
+
+	*ptr = p;
+	*max = n;
+
+	return QCVM_OK;
+}
+
+/* append a copy of an entity page to a snapshot's log */
+static int save_page(qcvm_t *qcvm, struct qcvm_snapshot *snap, size_t page)
+{
+	size_t max, valid;
+	uint8_t *data;
+	int r;
+
+	/* grow the log, both arrays always have the same capacity */
+	if (snap->num_pages >= snap->max_pages)
+	{
+		max = snap->max_pages;
+		if ((r = grow_buffer(qcvm, (void **)&snap->pages, &max, snap->num_pages + 1, sizeof(uint32_t))) != QCVM_OK)
+			return r;
+		max = snap->max_pages;
+		if ((r = grow_buffer(qcvm, (void **)&snap->page_data, &max, snap->num_pages + 1, SNAPSHOT_PAGE_SIZE)) != QCVM_OK)
+			return r;
+		snap->max_pages = (uint32_t)max;
+	}
+
+	/* the last page might run past the end of the buffer */
+	valid = qcvm->len_entities - page * SNAPSHOT_PAGE_SIZE;
+	if (valid > SNAPSHOT_PAGE_SIZE)
+		valid = SNAPSHOT_PAGE_SIZE;
+
+	data = &snap->page_data[snap->num_pages * SNAPSHOT_PAGE_SIZE];
+	QCVM_MEMCPY(data, (uint8_t *)qcvm->entities + page * SNAPSHOT_PAGE_SIZE, valid);
+	for (; valid < SNAPSHOT_PAGE_SIZE; valid++)
+		data[valid] = 0;
+
+	snap->pages[snap->num_pages++] = (uint32_t)page;
+
+	return QCVM_OK;
+}
+
+/* save the pages in a range of entity memory before it gets written to */
+static int touch_entity_memory(qcvm_t *qcvm, size_t ofs, size_t len)
+{
+	struct qcvm_snapshot *snap;
+	size_t page, last;
+	int r;
+
+	if (!qcvm->num_snapshots || !len)
+		return QCVM_OK;
+
+	snap = &qcvm->snapshots[qcvm->num_snapshots - 1];
+
+	page = ofs / SNAPSHOT_PAGE_SIZE;
+	last = (ofs + len - 1) / SNAPSHOT_PAGE_SIZE;
+	if (ofs + len < ofs || last >= qcvm->num_snapshot_pages)
+		return QCVM_ARGUMENT_OUT_OF_RANGE;
+
+	for (; page <= last; page++)
+	{
+		if (qcvm->snapshot_page_ids[page] == snap->id)
+			continue;
+
+		if ((r = save_page(qcvm, snap, page)) != QCVM_OK)
+			return r;
+
+		qcvm->snapshot_page_ids[page] = snap->id;
+	}
+
+	return QCVM_OK;
+}
+
+/* write a snapshot's saved pages back, oldest copy last so it wins */
+static void apply_snapshot_pages(qcvm_t *qcvm, struct qcvm_snapshot *snap)
+{
+	size_t page, valid;
+	uint32_t i;
+
+	for (i = snap->num_pages; i-- > 0;)
+	{
+		page = snap->pages[i];
+
+		valid = qcvm->len_entities - page * SNAPSHOT_PAGE_SIZE;
+		if (valid > SNAPSHOT_PAGE_SIZE)
+			valid = SNAPSHOT_PAGE_SIZE;
+
+		QCVM_MEMCPY((uint8_t *)qcvm->entities + page * SNAPSHOT_PAGE_SIZE, &snap->page_data[(size_t)i * SNAPSHOT_PAGE_SIZE], valid);
+
+		/* rolling back is a change like any other */
+		if (qcvm->dirty_fields)
+			mark_dirty_fields(qcvm, page * SNAPSHOT_PAGE_SIZE, valid);
+		if (qcvm->publisher)
+			mark_published_pages(qcvm, page * SNAPSHOT_PAGE_SIZE, valid);
+		if (qcvm->pristine_bits)
+			mark_pristine_pages(qcvm, page * SNAPSHOT_PAGE_SIZE, valid);
+	}
+}
+
+/* mark every zone string held in the globals and saved pages of a snapshot */
+static void mark_saved_strings(qcvm_t *qcvm, struct qcvm_snapshot *snap)
+{
+	size_t words, first, e, w, i;
+	uint32_t p;
+
+	for (i = 0; i < qcvm->num_global_vars; i++)
+		if (DEF_TYPE(&qcvm->global_vars[i]) == QCVM_TYPE_STRING)
+			mark_zone_string(qcvm, snap->globals[qcvm->global_vars[i].ofs].i);
+
+	if (!qcvm->header.num_entity_fields)
+		return;
+
+	words = SNAPSHOT_PAGE_SIZE / 4;
+
+	/* visit the string fields of every entity overlapping each page */
+	for (p = 0; p < snap->num_pages; p++)
+	{
+		int32_t *data = (int32_t *)&snap->page_data[(size_t)p * SNAPSHOT_PAGE_SIZE];
+
+		first = (size_t)snap->pages[p] * words;
+		for (e = first / qcvm->header.num_entity_fields; e * qcvm->header.num_entity_fields < first + words; e++)
+		{
+			for (i = 0; i < qcvm->num_field_vars; i++)
+			{
+				if (DEF_TYPE(&qcvm->field_vars[i]) != QCVM_TYPE_STRING)
+					continue;
+
+				w = e * qcvm->header.num_entity_fields + qcvm->field_vars[i].ofs;
+				if (w >= first && w < first + words)
+					mark_zone_string(qcvm, data[w - first]);
+			}
+		}
+	}
+}
+
+/* mark every zone string held by snapshots */
+static void mark_snapshot_strings(qcvm_t *qcvm)
+{
+	uint32_t i;
+
+	for (i = 0; i < qcvm->num_snapshots; i++)
+		mark_saved_strings(qcvm, &qcvm->snapshots[i]);
+
+	if (qcvm->pristine && qcvm->pristine->id)
+		mark_saved_strings(qcvm, qcvm->pristine);
+}
+
+/* free the buffers owned by a snapshot */
+static void free_snapshot(qcvm_t *qcvm, struct qcvm_snapshot *snap)
+{
+	if (snap->globals)
+		qcvm->alloc_callback(qcvm, snap->globals, 0, qcvm->alloc_callback_user);
+	if (snap->pages)
+		qcvm->alloc_callback(qcvm, snap->pages, 0, qcvm->alloc_callback_user);
+	if (snap->page_data)
+		qcvm->alloc_callback(qcvm, snap->page_data, 0, qcvm->alloc_callback_user);
+	if (snap->tempstrings)
+		qcvm->alloc_callback(qcvm, snap->tempstrings, 0, qcvm->alloc_callback_user);
+}
+
+static void free_snapshots(qcvm_t *qcvm)
+{
+	uint32_t i;
+
+	for (i = 0; i < qcvm->max_snapshots; i++)
+		free_snapshot(qcvm, &qcvm->snapshots[i]);
+
+	if (qcvm->snapshots)
+		qcvm->alloc_callback(qcvm, qcvm->snapshots, 0, qcvm->alloc_callback_user);
+	if (qcvm->snapshot_page_ids)
+		qcvm->alloc_callback(qcvm, qcvm->snapshot_page_ids, 0, qcvm->alloc_callback_user);
+
+	qcvm->snapshots = NULL;
+	qcvm->num_snapshots = qcvm->max_snapshots = 0;
+	qcvm->snapshot_page_ids = NULL;
+	qcvm->num_snapshot_pages = 0;
+
+	if (qcvm->pristine)
+	{
+		free_snapshot(qcvm, qcvm->pristine);
+		qcvm->alloc_callback(qcvm, qcvm->pristine, 0, qcvm->alloc_callback_user);
+		qcvm->pristine = NULL;
+	}
+	if (qcvm->pristine_bits)
+		qcvm->alloc_callback(qcvm, qcvm->pristine_bits, 0, qcvm->alloc_callback_user);
+	if (qcvm->pristine_pages)
+		qcvm->alloc_callback(qcvm, qcvm->pristine_pages, 0, qcvm->alloc_callback_user);
+	qcvm->pristine_bits = qcvm->pristine_pages = NULL;
+	qcvm->num_pristine_pages = 0;
+}
+
+/* returns the index of a retained snapshot, or -1 */
+static int32_t find_snapshot(qcvm_t *qcvm, uint32_t id)
+{
+	uint32_t i;
+
+	for (i = 0; i < qcvm->num_snapshots; i++)
+		if (qcvm->snapshots[i].id == id)
+			return (int32_t)i;
+
+	return -1;
+}
+
+/* copy the tempstrings used so far this frame into a snapshot */
+static int save_snapshot_tempstrings(qcvm_t *qcvm, struct qcvm_snapshot *snap)
+{
+	size_t len, n;
+	int32_t i;
+	int r;
+
+	snap->tempstrings_block = qcvm->current_tempstrings_block;
+	snap->tempstrings_used = qcvm->tempstrings_used;
+	snap->tempstrings_epoch = qcvm->tempstrings_epoch;
+	snap->num_frame_strings = qcvm->num_external_strings[1];
+	snap->len_tempstrings = 0;
+
+	if (!qcvm->num_tempstrings_blocks)
+		return QCVM_OK;
+
+	/* earlier blocks are copied whole, the current one up to the position */
+	len = 0;
+	for (i = 0; i < qcvm->current_tempstrings_block; i++)
+		len += qcvm->tempstrings_blocks[i].len;
+	len += qcvm->tempstrings_used;
+
+	if ((r = grow_buffer(qcvm, (void **)&snap->tempstrings, &snap->max_tempstrings, len, 1)) != QCVM_OK)
+		return r;
+
+	for (i = 0; i <= qcvm->current_tempstrings_block; i++)
+	{
+		n = i < qcvm->current_tempstrings_block ? qcvm->tempstrings_blocks[i].len : qcvm->tempstrings_used;
+		QCVM_MEMCPY(&snap->tempstrings[snap->len_tempstrings], qcvm->tempstrings_blocks[i].data, n);
+		snap->len_tempstrings += n;
+	}
+
+	return QCVM_OK;
+}
+
+/* bring back the tempstrings frame a snapshot was taken in */
+static void restore_snapshot_tempstrings(qcvm_t *qcvm, struct qcvm_snapshot *snap)
+{
+	size_t ofs, n;
+	int32_t i;
+
+	/* tempstrings are append-only within a frame, so rewinding is enough */
+	if (snap->tempstrings_epoch != qcvm->tempstrings_epoch)
+	{
+		/* blocks are never given back, so they're all still there */
+		for (i = 0, ofs = 0; i <= snap->tempstrings_block && ofs < snap->len_tempstrings; i++)
+		{
+			n = i < snap->tempstrings_block ? qcvm->tempstrings_blocks[i].len : snap->tempstrings_used;
+			QCVM_MEMCPY(qcvm->tempstrings_blocks[i].data, &snap->tempstrings[ofs], n);
+			ofs += n;
+		}
+
+		/* host strings from that frame are long gone */
+		qcvm->num_external_strings[1] = 0;
+		qcvm->tempstrings_epoch = snap->tempstrings_epoch;
+	}
+	else
+	{
+		qcvm->num_external_strings[1] = snap->num_frame_strings;
+	}
+
+	qcvm->current_tempstrings_block = snap->tempstrings_block;
+	qcvm->tempstrings_used = snap->tempstrings_used;
+	qcvm->tempstrings_reserved = 0;
+}
+
+int qcvm_snapshot(qcvm_t *qcvm, uint32_t *id)
+{
+	struct qcvm_snapshot *snap;
+	size_t max, i;
+	int r;
+
+	if (!qcvm || !id)
+		return QCVM_NULL_POINTER;
+
+	if (qcvm->worker)
+		return QCVM_WORKER_UNSUPPORTED;
+
+	if (!qcvm->entities)
+		return QCVM_NO_ENTITIES;
+
+	if (qcvm->stack_depth > 0)
+		return QCVM_EXECUTION_IN_PROGRESS;
+
+	/* page table for the entities buffer */
+	if (!qcvm->snapshot_page_ids)
+	{
+		max = 0;
+		if ((r = grow_buffer(qcvm, (void **)&qcvm->snapshot_page_ids, &max, (qcvm->len_entities + SNAPSHOT_PAGE_SIZE - 1) / SNAPSHOT_PAGE_SIZE, sizeof(uint32_t))) != QCVM_OK)
+			return r;
+		qcvm->num_snapshot_pages = (qcvm->len_entities + SNAPSHOT_PAGE_SIZE - 1) / SNAPSHOT_PAGE_SIZE;
+		for (i = 0; i < max; i++)
+			qcvm->snapshot_page_ids[i] = 0;
+	}
+
+	/* grow snapshot array, new entries start out empty */
+	if (qcvm->num_snapshots >= qcvm->max_snapshots)
+	{
+		max = qcvm->max_snapshots;
+		if ((r = grow_buffer(qcvm, (void **)&qcvm->snapshots, &max, qcvm->num_snapshots + 1, sizeof(struct qcvm_snapshot))) != QCVM_OK)
+			return r;
+		for (i = qcvm->max_snapshots; i < max; i++)
+		{
+			qcvm->snapshots[i].globals = NULL;
+			qcvm->snapshots[i].pages = NULL;
+			qcvm->snapshots[i].page_data = NULL;
+			qcvm->snapshots[i].max_pages = 0;
+			qcvm->snapshots[i].tempstrings = NULL;
+			qcvm->snapshots[i].max_tempstrings = 0;
+		}
+		qcvm->max_snapshots = (uint32_t)max;
+	}
+
+	snap = &qcvm->snapshots[qcvm->num_snapshots];
+
+	/* globals are small and written all the time, so just copy them */
+	if (!snap->globals)
+	{
+		snap->globals = qcvm->alloc_callback(qcvm, NULL, qcvm->num_globals * sizeof(union qcvm_global), qcvm->alloc_callback_user);
+		if (!snap->globals)
+			return QCVM_OUT_OF_MEMORY;
+	}
+
+	QCVM_MEMCPY(snap->globals, qcvm->globals, qcvm->num_globals * sizeof(union qcvm_global));
+
+	if ((r = save_snapshot_tempstrings(qcvm, snap)) != QCVM_OK)
+		return r;
+
+	/* a fresh id invalidates every page saved so far, in one go */
+	if (++qcvm->next_snapshot_id == 0)
+	{
+		for (i = 0; i < qcvm->num_snapshot_pages; i++)
+			qcvm->snapshot_page_ids[i] = 0;
+		qcvm->next_snapshot_id = 1;
+	}
+
+	snap->id = qcvm->next_snapshot_id;
+	snap->num_pages = 0;
+
+	qcvm->num_snapshots++;
+
+	*id = snap->id;
+
+	return QCVM_OK;
+}
+
+int qcvm_restore(qcvm_t *qcvm, uint32_t id)
+{
+	struct qcvm_snapshot *snap;
+	int32_t i, target;
+	uint32_t p;
+	int r;
+
+	if (!qcvm)
+		return QCVM_NULL_POINTER;
+
+	if (qcvm->worker)
+		return QCVM_WORKER_UNSUPPORTED;
+
+	if (qcvm->stack_depth > 0)
+		return QCVM_EXECUTION_IN_PROGRESS;
+
+	if ((target = find_snapshot(qcvm, id)) < 0)
+		return QCVM_SNAPSHOT_NOT_FOUND;
+
+	/* a pending checkpoint has to keep what's about to be overwritten */
+	if (qcvm->checkpoint)
+		for (i = (int32_t)qcvm->num_snapshots - 1; i >= target; i--)
+			for (p = 0; p < qcvm->snapshots[i].num_pages; p++)
+				if ((r = preserve_checkpoint_pages(qcvm, (size_t)qcvm->snapshots[i].pages[p] * SNAPSHOT_PAGE_SIZE, 1)) != QCVM_OK)
+					return r;
+
+	/* undo the newest writes first */
+	for (i = (int32_t)qcvm->num_snapshots - 1; i >= target; i--)
+		apply_snapshot_pages(qcvm, &qcvm->snapshots[i]);
+
+	/* the target starts over with an empty log */
+	snap = &qcvm->snapshots[target];
+	for (p = 0; p < snap->num_pages; p++)
+		qcvm->snapshot_page_ids[snap->pages[p]] = 0;
+	snap->num_pages = 0;
+
+	/* newer snapshots are gone, but keep their memory */
+	qcvm->num_snapshots = (uint32_t)target + 1;
+
+	QCVM_MEMCPY(qcvm->globals, snap->globals, qcvm->num_globals * sizeof(union qcvm_global));
+
+	restore_snapshot_tempstrings(qcvm, snap);
+
+	/* entity memory just changed under the zone string collector */
+	if (qcvm->zone_gc_phase == ZONE_GC_MARK)
+		qcvm->zone_gc_phase = ZONE_GC_IDLE;
+
+	return QCVM_OK;
+}
+
+int qcvm_release_snapshot(qcvm_t *qcvm, uint32_t id)
+{
+	struct qcvm_snapshot temp;
+	int32_t target, i;
+	uint32_t x;
+
+	if (!qcvm)
+		return QCVM_NULL_POINTER;
+
+	if ((target = find_snapshot(qcvm, id)) < 0)
+		return QCVM_SNAPSHOT_NOT_FOUND;
+
+	/* rotate the released entries past the end, where they can be reused */
+	for (i = 0; i <= target; i++)
+	{
+		temp = qcvm->snapshots[0];
+		for (x = 1; x < qcvm->num_snapshots; x++)
+			qcvm->snapshots[x - 1] = qcvm->snapshots[x];
+		qcvm->snapshots[qcvm->num_snapshots - 1] = temp;
+	}
+
+	qcvm->num_snapshots -= (uint32_t)target + 1;
+
+	return QCVM_OK;
+}
+
+int qcvm_query_snapshot_info(qcvm_t *qcvm, uint32_t id, size_t *num_pages, size_t *size)
+{
+	struct qcvm_snapshot *snap;
+	int32_t i;
+
+	if (!qcvm)
+		return QCVM_NULL_POINTER;
+
+	if ((i = find_snapshot(qcvm, id)) < 0)
+		return QCVM_SNAPSHOT_NOT_FOUND;
+
+	snap = &qcvm->snapshots[i];
+
+	if (num_pages)
+		*num_pages = snap->num_pages;
+
+	if (size)
+		*size = (size_t)snap->num_pages * (SNAPSHOT_PAGE_SIZE + sizeof(uint32_t)) + qcvm->num_globals * sizeof(union qcvm_global) + snap->len_tempstrings;
+
+	return QCVM_OK;
+}
+
+int qcvm_touch_entities(qcvm_t *qcvm, uint32_t e, uint32_t count)
+{
+	size_t size;
+
+	if (!qcvm)
+		return QCVM_NULL_POINTER;
+
+	if (!qcvm->entities)
+		return QCVM_NO_ENTITIES;
+
+	size = (size_t)qcvm->header.num_entity_fields * 4;
+	if (((size_t)e + count) * size > qcvm->len_entities)
+		return QCVM_ARGUMENT_OUT_OF_RANGE;
+
+	return entity_write_barrier(qcvm, (size_t)e * size, (size_t)count * size);
+}
+
+/*
+ * field tracking
+ *
+ * every entity gets a bitmap with one bit per field word, and a second bitmap
+ * has one bit per entity with any field set, so clearing and walking the
+ * dirty set only visits what changed.
+ */
+
+/* bitmap of dirty fields for an entity */
+#define DIRTY_FIELDS(e) (&qcvm->dirty_fields[(size_t)(e) * qcvm->dirty_field_words])
+
+/* common path for every write to entity memory */
+static int entity_write_barrier(qcvm_t *qcvm, size_t ofs, size_t len)
+{
+	int r;
+
+	/* workers leave it to qcvm_join_worker() */
+	if (qcvm->worker)
+		return worker_write_barrier(qcvm, ofs, len);
+
+	if ((r = touch_entity_memory(qcvm, ofs, len)) != QCVM_OK)
+		return r;
+
+	if (qcvm->checkpoint && (r = preserve_checkpoint_pages(qcvm, ofs, len)) != QCVM_OK)
+		return r;
+
+	if (qcvm->dirty_fields)
+		mark_dirty_fields(qcvm, ofs, len);
+
+	if (qcvm->publisher)
+		mark_published_pages(qcvm, ofs, len);
+
+	if (qcvm->pristine_bits)
+		mark_pristine_pages(qcvm, ofs, len);
+
+	return QCVM_OK;
+}
+
+/* set the dirty bits for a range of entity memory */
+static void mark_dirty_fields(qcvm_t *qcvm, size_t ofs, size_t len)
+{
+	size_t w, last, e, f;
+
+	if (!len || !qcvm->header.num_entity_fields)
+		return;
+
+	last = (ofs + len - 1) / 4;
+	for (w = ofs / 4; w <= last; w++)
+	{
+		e = w / qcvm->header.num_entity_fields;
+		f = w % qcvm->header.num_entity_fields;
+
+		if (e >= qcvm->max_dirty_entities)
+			return;
+
+		DIRTY_FIELDS(e)[f / 32] |= 1u << (f % 32);
+		qcvm->dirty_entities[e / 32] |= 1u << (e % 32);
+	}
+}
+
+static void free_dirty_fields(qcvm_t *qcvm)
+{
+	if (qcvm->dirty_fields)
+		qcvm->alloc_callback(qcvm, qcvm->dirty_fields, 0, qcvm->alloc_callback_user);
+	if (qcvm->dirty_entities)
+		qcvm->alloc_callback(qcvm, qcvm->dirty_entities, 0, qcvm->alloc_callback_user);
+
+	qcvm->dirty_fields = NULL;
+	qcvm->dirty_entities = NULL;
+	qcvm->dirty_field_words = 0;
+	qcvm->max_dirty_entities = 0;
+}
+
+int qcvm_track_entity_fields(qcvm_t *qcvm, int enable)
+{
+	size_t entities, i;
+
+	if (!qcvm)
+		return QCVM_NULL_POINTER;
+
+	if (qcvm->worker)
+		return QCVM_WORKER_UNSUPPORTED;
+
+	if (!enable)
+	{
+		free_dirty_fields(qcvm);
+		return QCVM_OK;
+	}
+
+	if (qcvm->dirty_fields)
+		return QCVM_OK;
+
+	if (!qcvm->entities)
+		return QCVM_NO_ENTITIES;
+
+	if (!qcvm->alloc_callback)
+		return QCVM_OUT_OF_MEMORY;
+
+	if (!qcvm->header.num_entity_fields)
+		return QCVM_OK;
+
+	entities = qcvm->len_entities / ((size_t)qcvm->header.num_entity_fields * 4);
+	if (entities > UINT32_MAX)
+		entities = UINT32_MAX;
+
+	qcvm->dirty_field_words = (qcvm->header.num_entity_fields + 31) / 32;
+	qcvm->max_dirty_entities = (uint32_t)entities;
+
+	qcvm->dirty_fields = qcvm->alloc_callback(qcvm, NULL, entities * qcvm->dirty_field_words * sizeof(uint32_t), qcvm->alloc_callback_user);
+	qcvm->dirty_entities = qcvm->alloc_callback(qcvm, NULL, (entities + 31) / 32 * sizeof(uint32_t), qcvm->alloc_callback_user);
+	if (!qcvm->dirty_fields || !qcvm->dirty_entities)
+	{
+		free_dirty_fields(qcvm);
+		return QCVM_OUT_OF_MEMORY;
+	}
+
+	for (i = 0; i < entities * qcvm->dirty_field_words; i++)
+		qcvm->dirty_fields[i] = 0;
+	for (i = 0; i < (entities + 31) / 32; i++)
+		qcvm->dirty_entities[i] = 0;
+
+	return QCVM_OK;
+}
+
+int qcvm_touch_entity_fields(qcvm_t *qcvm, uint32_t e, uint32_t ofs, uint32_t count)
+{
+	size_t size;
+
+	if (!qcvm)
+		return QCVM_NULL_POINTER;
+
+	if (!qcvm->entities)
+		return QCVM_NO_ENTITIES;
+
+	size = (size_t)qcvm->header.num_entity_fields * 4;
+	if ((size_t)ofs + count > qcvm->header.num_entity_fields || ((size_t)e + 1) * size > qcvm->len_entities)
+		return QCVM_ARGUMENT_OUT_OF_RANGE;
+
+	return entity_write_barrier(qcvm, (size_t)e * size + (size_t)ofs * 4, (size_t)count * 4);
+}
+
+int qcvm_next_dirty_entity(qcvm_t *qcvm, uint32_t *e, const uint32_t **fields, int *found)
+{
+	uint32_t i, bits;
+
+	if (!qcvm || !e || !found)
+		return QCVM_NULL_POINTER;
+
+	*found = 0;
+
+	if (!qcvm->dirty_fields)
+		return QCVM_OK;
+
+	/* skip over clean entities a word at a time */
+	for (i = *e / 32; i < (qcvm->max_dirty_entities + 31) / 32; i++)
+	{
+		bits = qcvm->dirty_entities[i];
+		if (i == *e / 32)
+			bits &= ~0u << (*e % 32);
+
+		if (bits)
+		{
+			*e = i * 32 + lowest_bit(bits);
+			if (fields)
+				*fields = DIRTY_FIELDS(*e);
+			*found = 1;
+			break;
+		}
+	}
+
+	return QCVM_OK;
+}
+
+int qcvm_clear_dirty_fields(qcvm_t *qcvm)
+{
+	uint32_t i, x, bits;
+
+	if (!qcvm)
+		return QCVM_NULL_POINTER;
+
+	if (!qcvm->dirty_fields)
+		return QCVM_OK;
+
+	for (i = 0; i < (qcvm->max_dirty_entities + 31) / 32; i++)
+	{
+		for (bits = qcvm->dirty_entities[i]; bits; bits &= bits - 1)
+			for (x = 0; x < qcvm->dirty_field_words; x++)
+				DIRTY_FIELDS(i * 32 + lowest_bit(bits))[x] = 0;
+
+		qcvm->dirty_entities[i] = 0;
+	}
+
+	return QCVM_OK;
+}
+
+/*
+ * delta encoding
+ *
+ * a delta is a list of entities, each one a varint holding the distance from
+ * the previous entity (starting from -1), a varint field count, and then for
+ * every field a varint distance from the previous field (starting from -1)
+ * followed by the 32-bit little endian value. a distance of 0 ends the list.
+ */
+
+/* write a varint, only counting bytes once the buffer runs out */
+static size_t put_varint(uint8_t *buf, size_t pos, size_t len, uint32_t v)
+{
+	do
+	{
+		if (buf && pos < len)
+			buf[pos] = (uint8_t)((v & 0x7f) | (v > 0x7f ? 0x80 : 0));
+		pos++;
+		v >>= 7;
+	} while (v);
+
+	return pos;
+}
+
+static size_t put_word(uint8_t *buf, size_t pos, size_t len, uint32_t v)
+{
+	int i;
+
+	for (i = 0; i < 4; i++, pos++)
+		if (buf && pos < len)
+			buf[pos] = (uint8_t)(v >> (i * 8));
+
+	return pos;
+}
+
+static int get_varint(const uint8_t *buf, size_t *pos, size_t len, uint32_t *v)
+{
+	int shift;
+
+	*v = 0;
+	for (shift = 0; shift < 35; shift += 7)
+	{
+		if (*pos >= len)
+			return QCVM_ARGUMENT_OUT_OF_RANGE;
+
+		*v |= (uint32_t)(buf[*pos] & 0x7f) << shift;
+		if (!(buf[(*pos)++] & 0x80))
+			return QCVM_OK;
+	}
+
+	return QCVM_ARGUMENT_OUT_OF_RANGE;
+}
+
+/* true if field f of entity e differs from the baseline */
+static int field_changed(qcvm_t *qcvm, const void *baseline, uint32_t e, uint32_t f)
+{
+	size_t w = (size_t)e * qcvm->header.num_entity_fields + f;
+
+	return !baseline || ((const uint32_t *)baseline)[w] != ((const uint32_t *)qcvm->entities)[w];
+}
+
+int qcvm_encode_entity_delta(qcvm_t *qcvm, const void *baseline, void *buf, size_t len, size_t *size)
+{
+	uint8_t *out = buf;
+	uint32_t e, f, n, prev_e, prev_f, bits, x;
+	const uint32_t *fields;
+	size_t pos;
+	int found;
+
+	if (!qcvm || !size)
+		return QCVM_NULL_POINTER;
+
+	pos = 0;
+	prev_e = UINT32_MAX;
+
+	for (e = 0; qcvm_next_dirty_entity(qcvm, &e, &fields, &found) == QCVM_OK && found; e++)
+	{
+		/* count the fields that actually changed */
+		for (x = 0, n = 0; x < qcvm->dirty_field_words; x++)
+			for (bits = fields[x]; bits; bits &= bits - 1)
+				if (field_changed(qcvm, baseline, e, x * 32 + lowest_bit(bits)))
+					n++;
+
+		if (!n)
+			continue;
+
+		pos = put_varint(out, pos, len, e - prev_e);
+		pos = put_varint(out, pos, len, n);
+		prev_e = e;
+
+		prev_f = UINT32_MAX;
+		for (x = 0; x < qcvm->dirty_field_words; x++)
+		{
+			for (bits = fields[x]; bits; bits &= bits - 1)
+			{
+				f = x * 32 + lowest_bit(bits);
+				if (!field_changed(qcvm, baseline, e, f))
+					continue;
+
+				pos = put_varint(out, pos, len, f - prev_f);
+				pos = put_word(out, pos, len, *FIELD_PTR(e, f));
+				prev_f = f;
+			}
+		}
+	}
+
+	pos = put_varint(out, pos, len, 0);
+
+	*size = pos;
+
+	if (out && pos > len)
+		return QCVM_BUFFER_TOO_SMALL;
+
+	return QCVM_OK;
+}
+
+int qcvm_apply_entity_delta(qcvm_t *qcvm, void *entities, const void *buf, size_t len)
+{
+	const uint8_t *in = buf;
+	uint32_t delta, n, e, f, v;
+	size_t pos, max;
+	int r;
+
+	if (!qcvm || !buf)
+		return QCVM_NULL_POINTER;
+
+	if (!entities && !qcvm->entities)
+		return QCVM_NO_ENTITIES;
+
+	if (!qcvm->header.num_entity_fields)
+		return QCVM_ARGUMENT_OUT_OF_RANGE;
+
+	max = qcvm->len_entities / ((size_t)qcvm->header.num_entity_fields * 4);
+
+	pos = 0;
+	e = UINT32_MAX;
+
+	while (1)
+	{
+		if ((r = get_varint(in, &pos, len, &delta)) != QCVM_OK)
+			return r;
+		if (!delta)
+			return QCVM_OK;
+
+		e += delta;
+		if (e >= max)
+			return QCVM_ARGUMENT_OUT_OF_RANGE;
+
+		if ((r = get_varint(in, &pos, len, &n)) != QCVM_OK)
+			return r;
+
+		f = UINT32_MAX;
+		while (n--)
+		{
+			if ((r = get_varint(in, &pos, len, &delta)) != QCVM_OK)
+				return r;
+
+			f += delta;
+			if (!delta || f >= qcvm->header.num_entity_fields || pos + 4 > len)
+				return QCVM_ARGUMENT_OUT_OF_RANGE;
+
+			v = (uint32_t)in[pos] | (uint32_t)in[pos + 1] << 8 | (uint32_t)in[pos + 2] << 16 | (uint32_t)in[pos + 3] << 24;
+			pos += 4;
+
+			if (entities)
+			{
+				((uint32_t *)entities)[(size_t)e * qcvm->header.num_entity_fields + f] = v;
+			}
+			else
+			{
+				if ((r = entity_write_barrier(qcvm, ((size_t)e * qcvm->header.num_entity_fields + f) * 4, 4)) != QCVM_OK)
+					return r;
+				*FIELD_PTR(e, f) = v;
+			}
+		}
+	}
+}
+
+/*
+ * saved state
+ *
+ * a save starts with a schema naming every function, saved global and saved
+ * field, so the body can refer to them by index and a loader only has to
+ * match names once. the body holds the saved globals, then every entity, each
+ * one a varint count of nonzero values followed by (varint def index
+ * distance, value) pairs. strings are stored by content, functions by their
+ * index in the schema, and entities by index.
+ *
+ * the header also records the crc of the progs that wrote the save. it is
+ * informational only: loading matches everything by name, so a save from
+ * different progs loads fine and the crc is never checked.
+ */
+#define SAVE_MAGIC (0x53564351) /* "QCVS" */
+#define SAVE_VERSION (1)
+#define SAVE_MAX_NAME (256)
+
+/* buffered stream over the host's read or write callback */
+struct qcvm_stream {
+	qcvm_t *qcvm;
+	size_t (*write)(qcvm_t *qcvm, const void *data, size_t len, void *user);
+	size_t (*read)(qcvm_t *qcvm, void *data, size_t len, void *user);
+	void *user;
+	uint8_t buf[1024];
+	size_t pos;
+	size_t len;
+	size_t total;
+	int error;
+	struct qcvm_snapshot *capture;
+};
+
+static void stream_flush(struct qcvm_stream *st)
+{
+	if (st->pos && !st->error && st->write(st->qcvm, st->buf, st->pos, st->user) != st->pos)
+		st->error = QCVM_UNKNOWN_ERROR;
+
+	st->total += st->pos;
+	st->pos = 0;
+}
+
+static void stream_put(struct qcvm_stream *st, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	size_t n;
+
+	while (len && !st->error)
+	{
+		if (st->pos == sizeof(st->buf))
+			stream_flush(st);
+
+		n = sizeof(st->buf) - st->pos;
+		if (n > len)
+			n = len;
+
+		QCVM_MEMCPY(&st->buf[st->pos], p, n);
+		st->pos += n;
+		p += n;
+		len -= n;
+	}
+}
+
+static void stream_put_varint(struct qcvm_stream *st, uint32_t v)
+{
+	uint8_t b[5];
+
+	stream_put(st, b, put_varint(b, 0, sizeof(b), v));
+}
+
+static void stream_put_word(struct qcvm_stream *st, uint32_t v)
+{
+	uint8_t b[4];
+
+	stream_put(st, b, put_word(b, 0, sizeof(b), v));
+}
+
+static void stream_put_string(struct qcvm_stream *st, const char *s, size_t len)
+{
+	stream_put_varint(st, (uint32_t)len);
+	stream_put(st, s, len);
+}
+
+static int stream_get(struct qcvm_stream *st, void *data, size_t len)
+{
+	uint8_t *p = data;
+	size_t n;
+
+	while (len)
+	{
+		if (st->pos == st->len)
+		{
+			st->pos = 0;
+			st->len = st->read(st->qcvm, st->buf, sizeof(st->buf), st->user);
+			if (!st->len || st->len > sizeof(st->buf))
+				return QCVM_INVALID_PROGS;
+		}
+
+		n = st->len - st->pos;
+		if (n > len)
+			n = len;
+
+		if (p)
+		{
+			QCVM_MEMCPY(p, &st->buf[st->pos], n);
+			p += n;
+		}
+		st->pos += n;
+		len -= n;
+	}
+
+	return QCVM_OK;
+}
+
+static int stream_get_varint(struct qcvm_stream *st, uint32_t *v)
+{
+	uint8_t b;
+	int shift, r;
+
+	*v = 0;
+	for (shift = 0; shift < 35; shift += 7)
+	{
+		if ((r = stream_get(st, &b, 1)) != QCVM_OK)
+			return r;
+
+		*v |= (uint32_t)(b & 0x7f) << shift;
+		if (!(b & 0x80))
+			return QCVM_OK;
+	}
+
+	return QCVM_INVALID_PROGS;
+}
+
+static int stream_get_word(struct qcvm_stream *st, uint32_t *v)
+{
+	uint8_t b[4];
+	int r;
+
+	if ((r = stream_get(st, b, 4)) != QCVM_OK)
+		return r;
+
+	*v = (uint32_t)b[0] | (uint32_t)b[1] << 8 | (uint32_t)b[2] << 16 | (uint32_t)b[3] << 24;
+
+	return QCVM_OK;
+}
+
+/* size of a value of a saveable type, 0 if it isn't one */
+static uint32_t save_type_size(uint16_t type)
+{
+	switch (type)
+	{
+		case QCVM_TYPE_STRING:
+		case QCVM_TYPE_FLOAT:
+		case QCVM_TYPE_ENTITY:
+		case QCVM_TYPE_FUNCTION:
+			return 1;
+		case QCVM_TYPE_VECTOR:
+			return 3;
+		default:
+			return 0;
+	}
+}
+
+/* returns nonzero if def i should be saved, skipping aliases like origin_x */
+static int is_saved_def(struct qcvm_var *vars, size_t num_vars, size_t i)
+{
+	size_t j;
+
+	if (!save_type_size(DEF_TYPE(&vars[i])))
+		return 0;
+
+	for (j = 0; j < num_vars; j++)
+	{
+		if (j == i || !save_type_size(DEF_TYPE(&vars[j])))
+			continue;
+
+		/* an earlier def of the same slot, or a vector containing it */
+		if (vars[j].ofs == vars[i].ofs ? j < i : DEF_TYPE(&vars[j]) == QCVM_TYPE_VECTOR && vars[i].ofs > vars[j].ofs && vars[i].ofs < vars[j].ofs + 3)
+			return 0;
+	}
+
+	return 1;
+}
+
+static int is_saved_global(qcvm_t *qcvm, size_t i)
+{
+	return qcvm->global_vars[i].type & DEF_SAVEGLOBAL && qcvm->global_vars[i].ofs >= OFS_RESERVED && is_saved_def(qcvm->global_vars, qcvm->num_global_vars, i);
+}
+
+/* resolve a string as it was when the state being saved was captured */
+static const char *save_string(struct qcvm_stream *st, int32_t s, size_t *len)
+{
+	struct qcvm_snapshot *capture = st->capture;
+	struct qcvm_string_header *header;
+	uint32_t ofs;
+
+	/* the frame is still going, so everything is where it was */
+	if (!capture || s >= 0 || s == INT32_MIN || capture->tempstrings_epoch == st->qcvm->tempstrings_epoch)
+		return str_ofs_len(st->qcvm, s, len);
+
+	/* tempstrings come from the copy, same offsets as the blocks they were in */
+	switch (STRING_HEAP(-s))
+	{
+		case STRING_HEAP_TEMPSTRINGS:
+			ofs = STRING_OFS(-s);
+			if (ofs >= STRING_HEADER_SIZE && ofs < capture->len_tempstrings)
+			{
+				header = (struct qcvm_string_header *)&capture->tempstrings[ofs - STRING_HEADER_SIZE];
+				if ((size_t)ofs + header->len < capture->len_tempstrings)
+				{
+					*len = header->len;
+					return &capture->tempstrings[ofs];
+				}
+			}
+		/* fallthrough */
+		case STRING_HEAP_EXTERNAL_FRAME:
+			*len = 0;
+			return &st->qcvm->strings[0];
+
+		default:
+			return str_ofs_len(st->qcvm, s, len);
+	}
+}
+
+static void save_value(struct qcvm_stream *st, uint16_t type, const uint32_t *v)
+{
+	const char *s;
+	size_t len;
+
+	switch (type)
+	{
+		case QCVM_TYPE_STRING:
+			s = save_string(st, (int32_t)v[0], &len);
+			stream_put_string(st, s, len);
+			break;
+
+		case QCVM_TYPE_ENTITY:
+		case QCVM_TYPE_FUNCTION:
+			stream_put_varint(st, v[0]);
+			break;
+
+		case QCVM_TYPE_VECTOR:
+			stream_put_word(st, v[1]);
+			stream_put_word(st, v[2]);
+		/* fallthrough */
+		default:
+			stream_put_word(st, v[0]);
+			break;
+	}
+}
+
+/* returns nonzero if the def has a value other than all zeroes */
+static int has_value(struct qcvm_var *var, const uint32_t *base)
+{
+	uint32_t i;
+
+	for (i = 0; i < save_type_size(DEF_TYPE(var)); i++)
+		if (base[var->ofs + i])
+			return 1;
+
+	return 0;
+}
+
+/* write a record of the nonzero values of a set of defs */
+static void save_record(struct qcvm_stream *st, struct qcvm_var *vars, const uint32_t *saved, uint32_t num_saved, const uint32_t *base)
+{
+	uint32_t i, n, prev;
+
+	for (i = 0, n = 0; i < num_saved; i++)
+		if (has_value(&vars[saved[i]], base))
+			n++;
+
+	stream_put_varint(st, n);
+
+	for (i = 0, prev = UINT32_MAX; i < num_saved && n; i++)
+	{
+		if (!has_value(&vars[saved[i]], base))
+			continue;
+
+		stream_put_varint(st, i - prev);
+		save_value(st, DEF_TYPE(&vars[saved[i]]), &base[vars[saved[i]].ofs]);
+		prev = i;
+		n--;
+	}
+}
+
+/* write the names of the saved defs, collecting their indices */
+static int save_schema(struct qcvm_stream *st, struct qcvm_var *vars, size_t num_vars, int globals, uint32_t **saved, uint32_t *num_saved)
+{
+	qcvm_t *qcvm = st->qcvm;
+	size_t i, max;
+	uint32_t n;
+	const char *s;
+	size_t len;
+	int r;
+
+	for (i = 0, n = 0; i < num_vars; i++)
+		if (globals ? is_saved_global(qcvm, i) : is_saved_def(vars, num_vars, i))
+			n++;
+
+	max = 0;
+	*saved = NULL;
+	if (n && (r = grow_buffer(qcvm, (void **)saved, &max, n, sizeof(uint32_t))) != QCVM_OK)
+		return r;
+
+	stream_put_varint(st, n);
+
+	for (i = 0, n = 0; i < num_vars; i++)
+	{
+		if (!(globals ? is_saved_global(qcvm, i) : is_saved_def(vars, num_vars, i)))
+			continue;
+
+		(*saved)[n++] = (uint32_t)i;
+		s = str_ofs_len(qcvm, vars[i].name, &len);
+		stream_put_varint(st, DEF_TYPE(&vars[i]));
+		stream_put_string(st, s, len);
+	}
+
+	*num_saved = n;
+
+	return QCVM_OK;
+}
+
+/* write everything up to the entities, keeping the lists of saved defs */
+static int save_prologue(struct qcvm_stream *st, const union qcvm_global *globals, uint32_t num_entities, uint32_t **saved_globals, uint32_t *num_saved_globals, uint32_t **saved_fields, uint32_t *num_saved_fields)
+{
+	qcvm_t *qcvm = st->qcvm;
+	const char *s;
+	size_t len, i;
+	int r;
+
+	stream_put_word(st, SAVE_MAGIC);
+	stream_put_word(st, SAVE_VERSION);
+	stream_put_word(st, qcvm->header.crc);
+
+	/* schema */
+	stream_put_varint(st, (uint32_t)qcvm->num_functions);
+	for (i = 0; i < qcvm->num_functions; i++)
+	{
+		s = str_ofs_len(qcvm, qcvm->functions[i].ofs_name, &len);
+		stream_put_string(st, s, len);
+	}
+
+	if ((r = save_schema(st, qcvm->global_vars, qcvm->num_global_vars, 1, saved_globals, num_saved_globals)) != QCVM_OK)
+		return r;
+	if ((r = save_schema(st, qcvm->field_vars, qcvm->num_field_vars, 0, saved_fields, num_saved_fields)) != QCVM_OK)
+		return r;
+
+	/* body */
+	save_record(st, qcvm->global_vars, *saved_globals, *num_saved_globals, (const uint32_t *)globals);
+
+	stream_put_varint(st, num_entities);
+
+	return st->error;
+}
+
+int qcvm_save_state(qcvm_t *qcvm, uint32_t num_entities, size_t (*write)(qcvm_t *qcvm, const void *data, size_t len, void *user), void *user)
+{
+	struct qcvm_stream st;
+	uint32_t *saved_globals = NULL, *saved_fields = NULL;
+	uint32_t num_saved_globals = 0, num_saved_fields = 0;
+	uint32_t e;
+	int r;
+
+	if (!qcvm || !write)
+		return QCVM_NULL_POINTER;
+
+	if (!qcvm->entities)
+		return QCVM_NO_ENTITIES;
+
+	if (qcvm->stack_depth > 0)
+		return QCVM_EXECUTION_IN_PROGRESS;
+
+	if ((size_t)num_entities * qcvm->header.num_entity_fields * 4 > qcvm->len_entities)
+		return QCVM_ARGUMENT_OUT_OF_RANGE;
+
+	st.qcvm = qcvm;
+	st.write = write;
+	st.read = NULL;
+	st.user = user;
+	st.pos = st.len = st.total = 0;
+	st.error = QCVM_OK;
+	st.capture = NULL;
+
+	if ((r = save_prologue(&st, qcvm->globals, num_entities, &saved_globals, &num_saved_globals, &saved_fields, &num_saved_fields)) != QCVM_OK)
+		goto done;
+
+	for (e = 0; e < num_entities; e++)
+		save_record(&st, qcvm->field_vars, saved_fields, num_saved_fields, FIELD_PTR(e, 0));
+
+	stream_flush(&st);
+	r = st.error;
+
+done:
+	if (saved_globals)
+		qcvm->alloc_callback(qcvm, saved_globals, 0, qcvm->alloc_callback_user);
+	if (saved_fields)
+		qcvm->alloc_callback(qcvm, saved_fields, 0, qcvm->alloc_callback_user);
+
+	return r;
+}
+
+/* where a def from the save ended up in the current progs, ofs is -1 if nowhere */
+struct qcvm_load_def {
+	int32_t ofs;
+	uint16_t type;
+};
+
+/*
+ * find a def by name. saved defs come in the same order as the progs they
+ * were saved from, so the search starts right after the last match and an
+ * unchanged progs never has to look further than the next few defs.
+ */
+static int32_t find_def(qcvm_t *qcvm, struct qcvm_var *vars, size_t num_vars, size_t *hint, const char *name, uint16_t type)
+{
+	size_t i, n;
+
+	for (n = 0, i = *hint; n < num_vars; n++, i = i + 1 < num_vars ? i + 1 : 0)
+	{
+		if (DEF_TYPE(&vars[i]) == type && QCVM_STRCMP(str_ofs(qcvm, vars[i].name), name) == 0)
+		{
+			*hint = i + 1 < num_vars ? i + 1 : 0;
+			return vars[i].ofs;
+		}
+	}
+
+	return -1;
+}
+
+/* read a name into a fixed buffer, leaving it empty if it doesn't fit */
+static int load_name(struct qcvm_stream *st, char *name)
+{
+	uint32_t len;
+	int r;
+
+	if ((r = stream_get_varint(st, &len)) != QCVM_OK)
+		return r;
+
+	if (len >= SAVE_MAX_NAME)
+	{
+		name[0] = '\0';
+		return stream_get(st, NULL, len);
+	}
+
+	name[len] = '\0';
+	return stream_get(st, name, len);
+}
+
+static int load_schema(struct qcvm_stream *st, struct qcvm_var *vars, size_t num_vars, struct qcvm_load_def **defs, uint32_t *num_defs)
+{
+	char name[SAVE_MAX_NAME];
+	uint32_t i, type;
+	size_t max, hint;
+	int r;
+
+	if ((r = stream_get_varint(st, num_defs)) != QCVM_OK)
+		return r;
+
+	max = 0;
+	*defs = NULL;
+	if (*num_defs && (r = grow_buffer(st->qcvm, (void **)defs, &max, *num_defs, sizeof(struct qcvm_load_def))) != QCVM_OK)
+		return r;
+
+	for (i = 0, hint = 0; i < *num_defs; i++)
+	{
+		if ((r = stream_get_varint(st, &type)) != QCVM_OK)
+			return r;
+		if ((r = load_name(st, name)) != QCVM_OK)
+			return r;
+
+		if (!save_type_size((uint16_t)type))
+			return QCVM_INVALID_PROGS;
+
+		(*defs)[i].type = (uint16_t)type;
+		(*defs)[i].ofs = name[0] ? find_def(st->qcvm, vars, num_vars, &hint, name, (uint16_t)type) : -1;
+	}
+
+	return QCVM_OK;
+}
+
+/* scratch space for strings while they're being read */
+struct qcvm_load_scratch {
+	char *s;
+	size_t max;
+};
+
+static int load_value(struct qcvm_stream *st, uint16_t type, const uint32_t *functions, uint32_t num_functions, struct qcvm_load_scratch *scratch, uint32_t *v)
+{
+	uint32_t len;
+	int32_t h;
+	int r;
+
+	switch (type)
+	{
+		case QCVM_TYPE_STRING:
+			if ((r = stream_get_varint(st, &len)) != QCVM_OK)
+				return r;
+			if ((r = grow_buffer(st->qcvm, (void **)&scratch->s, &scratch->max, (size_t)len + 1, 1)) != QCVM_OK)
+				return r;
+			if ((r = stream_get(st, scratch->s, len)) != QCVM_OK)
+				return r;
+			scratch->s[len] = '\0';
+			h = 0;
+			if (len && (r = qcvm_intern_string(st->qcvm, scratch->s, &h)) != QCVM_OK)
+				return r;
+			v[0] = (uint32_t)h;
+			return QCVM_OK;
+
+		case QCVM_TYPE_FUNCTION:
+			if ((r = stream_get_varint(st, &v[0])) != QCVM_OK)
+				return r;
+			v[0] = v[0] < num_functions ? functions[v[0]] : 0;
+			return QCVM_OK;
+
+		case QCVM_TYPE_ENTITY:
+			return stream_get_varint(st, &v[0]);
+
+		case QCVM_TYPE_VECTOR:
+			if ((r = stream_get_word(st, &v[1])) != QCVM_OK || (r = stream_get_word(st, &v[2])) != QCVM_OK)
+				return r;
+		/* fallthrough */
+		default:
+			return stream_get_word(st, &v[0]);
+	}
+}
+
+static int load_record(struct qcvm_stream *st, const struct qcvm_load_def *defs, uint32_t num_defs, const uint32_t *functions, uint32_t num_functions, struct qcvm_load_scratch *scratch, uint32_t *base, size_t num_words)
+{
+	uint32_t n, delta, i, v[3] = {0, 0, 0};
+	int r;
+
+	if ((r = stream_get_varint(st, &n)) != QCVM_OK)
+		return r;
+
+	for (i = UINT32_MAX; n--;)
+	{
+		if ((r = stream_get_varint(st, &delta)) != QCVM_OK)
+			return r;
+
+		i += delta;
+		if (!delta || i >= num_defs)
+			return QCVM_INVALID_PROGS;
+
+		if ((r = load_value(st, defs[i].type, functions, num_functions, scratch, v)) != QCVM_OK)
+			return r;
+
+		/* drop values that have nowhere to go */
+		if (defs[i].ofs < 0 || (size_t)defs[i].ofs + save_type_size(defs[i].type) > num_words)
+			continue;
+
+		base[defs[i].ofs] = v[0];
+		if (defs[i].type == QCVM_TYPE_VECTOR)
+		{
+			base[defs[i].ofs + 1] = v[1];
+			base[defs[i].ofs + 2] = v[2];
+		}
+	}
+
+	return QCVM_OK;
+}
+
+int qcvm_load_state(qcvm_t *qcvm, uint32_t *num_entities, size_t (*read)(qcvm_t *qcvm, void *data, size_t len, void *user), void *user)
+{
+	struct qcvm_stream st;
+	struct qcvm_load_def *globals = NULL, *fields = NULL;
+	struct qcvm_load_scratch scratch;
+	uint32_t num_globals = 0, num_fields = 0, num_functions = 0, *functions = NULL;
+	char name[SAVE_MAX_NAME];
+	uint32_t i, v, n;
+	size_t max, w;
+	int r;
+
+	if (!qcvm || !read)
+		return QCVM_NULL_POINTER;
+
+	if (qcvm->worker)
+		return QCVM_WORKER_UNSUPPORTED;
+
+	if (!qcvm->entities)
+		return QCVM_NO_ENTITIES;
+
+	if (qcvm->stack_depth > 0)
+		return QCVM_EXECUTION_IN_PROGRESS;
+
+	st.qcvm = qcvm;
+	st.write = NULL;
+	st.read = read;
+	st.user = user;
+	st.pos = st.len = st.total = 0;
+	st.error = QCVM_OK;
+	st.capture = NULL;
+
+	scratch.s = NULL;
+	scratch.max = 0;
+
+	if ((r = stream_get_word(&st, &v)) != QCVM_OK)
+		goto done;
+	if (v != SAVE_MAGIC)
+	{
+		r = QCVM_INVALID_PROGS;
+		goto done;
+	}
+	if ((r = stream_get_word(&st, &v)) != QCVM_OK)
+		goto done;
+	if (v != SAVE_VERSION)
+	{
+		r = QCVM_UNSUPPORTED_VERSION;
+		goto done;
+	}
+
+	/* progs crc, informational only */
+	if ((r = stream_get_word(&st, &v)) != QCVM_OK)
+		goto done;
+
+	/* map saved functions to current ones */
+	if ((r = stream_get_varint(&st, &num_functions)) != QCVM_OK)
+		goto done;
+	max = 0;
+	if (num_functions && (r = grow_buffer(qcvm, (void **)&functions, &max, num_functions, sizeof(uint32_t))) != QCVM_OK)
+		goto done;
+	for (i = 0; i < num_functions; i++)
+	{
+		if ((r = load_name(&st, name)) != QCVM_OK)
+			goto done;
+
+		if (i < qcvm->num_functions && QCVM_STRCMP(str_ofs(qcvm, qcvm->functions[i].ofs_name), name) == 0)
+			functions[i] = i;
+		else if (!name[0] || find_function(qcvm, name, &functions[i]) != QCVM_OK)
+			functions[i] = 0;
+	}
+
+	if ((r = load_schema(&st, qcvm->global_vars, qcvm->num_global_vars, &globals, &num_globals)) != QCVM_OK)
+		goto done;
+	if ((r = load_schema(&st, qcvm->field_vars, qcvm->num_field_vars, &fields, &num_fields)) != QCVM_OK)
+		goto done;
+
+	/* the saved state replaces whatever was there */
+	if ((r = entity_write_barrier(qcvm, 0, qcvm->len_entities)) != QCVM_OK)
+		goto done;
+	for (w = 0; w < qcvm->len_entities / 4; w++)
+		((uint32_t *)qcvm->entities)[w] = 0;
+
+	if (qcvm->zone_gc_phase == ZONE_GC_MARK)
+		qcvm->zone_gc_phase = ZONE_GC_IDLE;
+
+	if ((r = load_record(&st, globals, num_globals, functions, num_functions, &scratch, (uint32_t *)qcvm->globals, qcvm->num_globals)) != QCVM_OK)
+		goto done;
+
+	if ((r = stream_get_varint(&st, &n)) != QCVM_OK)
+		goto done;
+	if ((size_t)n * qcvm->header.num_entity_fields * 4 > qcvm->len_entities)
+	{
+		r = QCVM_ARGUMENT_OUT_OF_RANGE;
+		goto done;
+	}
+
+	for (i = 0; i < n; i++)
+		if ((r = load_record(&st, fields, num_fields, functions, num_functions, &scratch, FIELD_PTR(i, 0), qcvm->header.num_entity_fields)) != QCVM_OK)
+			goto done;
+
+	if (num_entities)
+		*num_entities = n;
+
+done:
+	if (functions)
+		qcvm->alloc_callback(qcvm, functions, 0, qcvm->alloc_callback_user);
+	if (globals)
+		qcvm->alloc_callback(qcvm, globals, 0, qcvm->alloc_callback_user);
+	if (fields)
+		qcvm->alloc_callback(qcvm, fields, 0, qcvm->alloc_callback_user);
+	if (scratch.s)
+		qcvm->alloc_callback(qcvm, scratch.s, 0, qcvm->alloc_callback_user);
+
+	return r;
+}
+
+/*
+ * checkpoints
+ *
+ * a checkpoint writes the same stream as qcvm_save_state(), a few entities
+ * at a time, while the vm keeps running. globals and tempstrings are copied
+ * when it starts. entity pages are left alone until something writes to one
+ * that hasn't been encoded yet, and only then is the old page copied aside.
+ */
+struct qcvm_checkpoint {
+	struct qcvm_stream st;
+	struct qcvm_snapshot capture;
+	uint32_t *page_map;
+	uint32_t *entity;
+	uint32_t *saved_globals;
+	uint32_t *saved_fields;
+	uint32_t num_saved_globals;
+	uint32_t num_saved_fields;
+	uint32_t num_entities;
+	uint32_t cursor;
+	int started;
+	void (*progress)(qcvm_t *qcvm, uint32_t entities_done, uint32_t num_entities, void *user);
+	void (*finished)(qcvm_t *qcvm, int result, void *user);
+};
+
+static void free_checkpoint(qcvm_t *qcvm)
+{
+	struct qcvm_checkpoint *cp = qcvm->checkpoint;
+
+	if (!cp)
+		return;
+
+	free_snapshot(qcvm, &cp->capture);
+	if (cp->page_map)
+		qcvm->alloc_callback(qcvm, cp->page_map, 0, qcvm->alloc_callback_user);
+	if (cp->entity)
+		qcvm->alloc_callback(qcvm, cp->entity, 0, qcvm->alloc_callback_user);
+	if (cp->saved_globals)
+		qcvm->alloc_callback(qcvm, cp->saved_globals, 0, qcvm->alloc_callback_user);
+	if (cp->saved_fields)
+		qcvm->alloc_callback(qcvm, cp->saved_fields, 0, qcvm->alloc_callback_user);
+	qcvm->alloc_callback(qcvm, cp, 0, qcvm->alloc_callback_user);
+
+	qcvm->checkpoint = NULL;
+}
+
+static void mark_checkpoint_strings(qcvm_t *qcvm)
+{
+	if (qcvm->checkpoint)
+		mark_saved_strings(qcvm, &qcvm->checkpoint->capture);
+}
+
+/* copy aside the pages in a range that still have to be encoded */
+static int preserve_checkpoint_pages(qcvm_t *qcvm, size_t ofs, size_t len)
+{
+	struct qcvm_checkpoint *cp = qcvm->checkpoint;
+	size_t page, last, done, end, size;
+	int r;
+
+	if (!len)
+		return QCVM_OK;
+
+	/* only pages between the cursor and the last entity matter */
+	size = (size_t)qcvm->header.num_entity_fields * 4;
+	done = (size_t)cp->cursor * size;
+	end = (size_t)cp->num_entities * size;
+
+	if (ofs + len <= done || ofs >= end)
+		return QCVM_OK;
+
+	page = ofs / SNAPSHOT_PAGE_SIZE;
+	last = (ofs + len - 1) / SNAPSHOT_PAGE_SIZE;
+	if (ofs + len < ofs || ofs + len > qcvm->len_entities)
+		return QCVM_ARGUMENT_OUT_OF_RANGE;
+
+	for (; page <= last; page++)
+	{
+		if (cp->page_map[page] || (page + 1) * SNAPSHOT_PAGE_SIZE <= done)
+			continue;
+
+		if ((r = save_page(qcvm, &cp->capture, page)) != QCVM_OK)
+			return r;
+
+		cp->page_map[page] = cp->capture.num_pages;
+	}
+
+	return QCVM_OK;
+}
+
+/* gather an entity as it was when the checkpoint started */
+static const uint32_t *checkpoint_entity(qcvm_t *qcvm, uint32_t e)
+{
+	struct qcvm_checkpoint *cp = qcvm->checkpoint;
+	size_t ofs, end, page, n;
+	uint8_t *dst = (uint8_t *)cp->entity;
+	const uint8_t *src;
+
+	ofs = (size_t)e * qcvm->header.num_entity_fields * 4;
+	end = ofs + (size_t)qcvm->header.num_entity_fields * 4;
+
+	for (; ofs < end; ofs += n, dst += n)
+	{
+		page = ofs / SNAPSHOT_PAGE_SIZE;
+
+		n = (page + 1) * SNAPSHOT_PAGE_SIZE - ofs;
+		if (n > end - ofs)
+			n = end - ofs;
+
+		if (cp->page_map[page])
+			src = &cp->capture.page_data[(size_t)(cp->page_map[page] - 1) * SNAPSHOT_PAGE_SIZE + ofs % SNAPSHOT_PAGE_SIZE];
+		else
+			src = (const uint8_t *)qcvm->entities + ofs;
+
+		QCVM_MEMCPY(dst, src, n);
+	}
+
+	return cp->entity;
+}
+
+int qcvm_begin_checkpoint(qcvm_t *qcvm, uint32_t num_entities, size_t (*write)(qcvm_t *qcvm, const void *data, size_t len, void *user), void (*progress)(qcvm_t *qcvm, uint32_t entities_done, uint32_t num_entities, void *user), void (*finished)(qcvm_t *qcvm, int result, void *user), void *user)
+{
+	struct qcvm_checkpoint *cp;
+	size_t pages, i;
+	int r;
+
+	if (!qcvm || !write)
+		return QCVM_NULL_POINTER;
+
+	if (qcvm->worker)
+		return QCVM_WORKER_UNSUPPORTED;
+
+	if (!qcvm->entities)
+		return QCVM_NO_ENTITIES;
+
+	if (qcvm->stack_depth > 0)
+		return QCVM_EXECUTION_IN_PROGRESS;
+
+	if (qcvm->checkpoint)
+		return QCVM_CHECKPOINT_IN_PROGRESS;
+
+	if ((size_t)num_entities * qcvm->header.num_entity_fields * 4 > qcvm->len_entities)
+		return QCVM_ARGUMENT_OUT_OF_RANGE;
+
+	if (!qcvm->alloc_callback)
+		return QCVM_OUT_OF_MEMORY;
+
+	if ((cp = qcvm->alloc_callback(qcvm, NULL, sizeof(*cp), qcvm->alloc_callback_user)) == NULL)
+		return QCVM_OUT_OF_MEMORY;
+
+	cp->st.qcvm = qcvm;
+	cp->st.write = write;
+	cp->st.read = NULL;
+	cp->st.user = user;
+	cp->st.pos = cp->st.len = cp->st.total = 0;
+	cp->st.error = QCVM_OK;
+	cp->st.capture = &cp->capture;
+	cp->capture.globals = NULL;
+	cp->capture.pages = NULL;
+	cp->capture.page_data = NULL;
+	cp->capture.num_pages = cp->capture.max_pages = 0;
+	cp->capture.tempstrings = NULL;
+	cp->capture.max_tempstrings = 0;
+	cp->saved_globals = cp->saved_fields = NULL;
+	cp->num_saved_globals = cp->num_saved_fields = 0;
+	cp->num_entities = num_entities;
+	cp->cursor = 0;
+	cp->started = 0;
+	cp->progress = progress;
+	cp->finished = finished;
+
+	qcvm->checkpoint = cp;
+
+	pages = (qcvm->len_entities + SNAPSHOT_PAGE_SIZE - 1) / SNAPSHOT_PAGE_SIZE;
+	cp->page_map = qcvm->alloc_callback(qcvm, NULL, (pages ? pages : 1) * sizeof(uint32_t), qcvm->alloc_callback_user);
+	cp->entity = qcvm->alloc_callback(qcvm, NULL, (qcvm->header.num_entity_fields + 1) * sizeof(uint32_t), qcvm->alloc_callback_user);
+	cp->capture.globals = qcvm->alloc_callback(qcvm, NULL, qcvm->num_globals * sizeof(union qcvm_global), qcvm->alloc_callback_user);
+	if (!cp->page_map || !cp->entity || !cp->capture.globals)
+	{
+		free_checkpoint(qcvm);
+		return QCVM_OUT_OF_MEMORY;
+	}
+
+	for (i = 0; i < pages; i++)
+		cp->page_map[i] = 0;
+
+	/* everything but the entities is captured right away */
+	QCVM_MEMCPY(cp->capture.globals, qcvm->globals, qcvm->num_globals * sizeof(union qcvm_global));
+
+	if ((r = save_snapshot_tempstrings(qcvm, &cp->capture)) != QCVM_OK)
+	{
+		free_checkpoint(qcvm);
+		return r;
+	}
+
+	return QCVM_OK;
+}
+
+int qcvm_step_checkpoint(qcvm_t *qcvm, size_t budget, int *finished)
+{
+	struct qcvm_checkpoint *cp;
+	size_t work;
+	int r;
+
+	if (!qcvm)
+		return QCVM_NULL_POINTER;
+
+	if (finished)
+		*finished = 0;
+
+	if ((cp = qcvm->checkpoint) == NULL)
+	{
+		if (finished)
+			*finished = 1;
+		return QCVM_OK;
+	}
+
+	if (qcvm->stack_depth > 0)
+		return QCVM_EXECUTION_IN_PROGRESS;
+
+	r = QCVM_OK;
+
+	/* the schema and globals go out with the first step */
+	if (!cp->started)
+	{
+		r = save_prologue(&cp->st, cp->capture.globals, cp->num_entities, &cp->saved_globals, &cp->num_saved_globals, &cp->saved_fields, &cp->num_saved_fields);
+		cp->started = 1;
+	}
+
+	for (work = 0; r == QCVM_OK && cp->cursor < cp->num_entities; work++)
+	{
+		if (budget && work >= budget)
+			break;
+
+		save_record(&cp->st, qcvm->field_vars, cp->saved_fields, cp->num_saved_fields, checkpoint_entity(qcvm, cp->cursor));
+		cp->cursor++;
+		r = cp->st.error;
+	}
+
+	if (r == QCVM_OK && cp->cursor >= cp->num_entities)
+	{
+		stream_flush(&cp->st);
+		r = cp->st.error;
+	}
+
+	if (cp->progress)
+		cp->progress(qcvm, cp->cursor, cp->num_entities, cp->st.user);
+
+	/* done, one way or the other */
+	if (r != QCVM_OK || cp->cursor >= cp->num_entities)
+	{
+		if (cp->finished)
+			cp->finished(qcvm, r, cp->st.user);
+
+		free_checkpoint(qcvm);
+
+		if (finished)
+			*finished = 1;
+	}
+
+	return r;
+}
+
+int qcvm_cancel_checkpoint(qcvm_t *qcvm)
+{
+	if (!qcvm)
+		return QCVM_NULL_POINTER;
+
+	free_checkpoint(qcvm);
+
+	return QCVM_OK;
+}
+
+int qcvm_query_checkpoint_info(qcvm_t *qcvm, uint32_t *entities_done, size_t *bytes_written, size_t *num_pages)
+{
+	struct qcvm_checkpoint *cp;
+
+	if (!qcvm)
+		return QCVM_NULL_POINTER;
+
+	if ((cp = qcvm->checkpoint) == NULL)
+		return QCVM_ARGUMENT_OUT_OF_RANGE;
+
+	if (entities_done)
+		*entities_done = cp->cursor;
+
+	if (bytes_written)
+		*bytes_written = cp->st.total + cp->st.pos;
+
+	if (num_pages)
+		*num_pages = cp->capture.num_pages;
+
+	return QCVM_OK;
+}
+
+/*
+ * hot reload
+ */
+
+/* the parts of the old progs that are still needed while moving state over */
+struct qcvm_reload_progs {
+	void *progs;
+	size_t len_progs;
+	struct qcvm_header header;
+	size_t num_statements;
+	struct qcvm_statement *statements;
+	void *progs_copy;
+	struct qcvm_function *functions_copy;
+	union qcvm_global *globals_copy;
+	uint32_t num_entity_fields;
+	struct qcvm_function *functions;
+	size_t num_functions;
+	char *strings;
+	size_t len_strings;
+	struct qcvm_var *field_vars;
+	size_t num_field_vars;
+	struct qcvm_var *global_vars;
+	size_t num_global_vars;
+	union qcvm_global *globals;
+	size_t num_globals;
+};
+
+/* a def that exists in both the old and the new progs */
+struct qcvm_reload_def {
+	uint32_t old_ofs;
+	uint32_t new_ofs;
+	uint16_t type;
+};
+
+/* match defs by name and type, skipping aliases and values that don't outlive a reload */
+static uint32_t map_reload_defs(qcvm_t *qcvm, const struct qcvm_reload_progs *old, struct qcvm_var *old_vars, size_t num_old_vars, size_t num_old_words, struct qcvm_var *vars, size_t num_vars, size_t num_words, int globals, struct qcvm_reload_def *defs)
+{
+	uint32_t num_defs = 0;
+	size_t i, hint = 0;
+	uint16_t type;
+	int32_t ofs;
+
+	for (i = 0; i < num_old_vars; i++)
+	{
+		type = DEF_TYPE(&old_vars[i]);
+
+		if (globals && (!(old_vars[i].type & DEF_SAVEGLOBAL) || old_vars[i].ofs < OFS_RESERVED))
+			continue;
+		if (old_vars[i].name <= 0 || (size_t)old_vars[i].name >= old->len_strings)
+			continue;
+		if ((size_t)old_vars[i].ofs + save_type_size(type) > num_old_words || !is_saved_def(old_vars, num_old_vars, i))
+			continue;
+
+		ofs = find_def(qcvm, vars, num_vars, &hint, &old->strings[old_vars[i].name], type);
+		if (ofs < 0 || (size_t)ofs + save_type_size(type) > num_words)
+			continue;
+
+		defs[num_defs].old_ofs = old_vars[i].ofs;
+		defs[num_defs].new_ofs = (uint32_t)ofs;
+		defs[num_defs].type = type;
+		num_defs++;
+	}
+
+	return num_defs;
+}
+
+/* move a value over, pointing strings and functions at their new homes */
+static int reload_value(qcvm_t *qcvm, const struct qcvm_reload_progs *old, const uint32_t *functions, uint16_t type, const uint32_t *src, uint32_t *dst)
+{
+	const char *s;
+	int32_t h;
+	int r;
+
+	switch (type)
+	{
+		case QCVM_TYPE_STRING:
+			/* only handles into the old string table move */
+			if ((int32_t)src[0] <= 0 || src[0] >= old->len_strings)
+			{
+				dst[0] = src[0];
+				return QCVM_OK;
+			}
+			s = &old->strings[src[0]];
+			h = 0;
+			r = QCVM_OK;
+			if (*s && !intern_find(qcvm, s, hash_string(s, NULL), &h))
+				r = qcvm_intern_string(qcvm, s, &h);
+			dst[0] = (uint32_t)h;
+			return r;
+
+		case QCVM_TYPE_FUNCTION:
+			dst[0] = src[0] < old->num_functions ? functions[src[0]] : 0;
+			return QCVM_OK;
+
+		case QCVM_TYPE_VECTOR:
+			dst[1] = src[1];
+			dst[2] = src[2];
+		/* fallthrough */
+		default:
+			dst[0] = src[0];
+			return QCVM_OK;
+	}
+}
+
+int qcvm_reload(qcvm_t *qcvm, void *progs, size_t len_progs, uint32_t num_entities)
+{
+	struct qcvm_reload_progs old;
+	struct qcvm_reload_def *fields = NULL, *globals = NULL;
+	uint32_t num_fields, num_globals, *functions = NULL, *entity = NULL, *row;
+	uint32_t i, e, x, num_entity_fields;
+	const char *name;
+	int r, r2;
+
+	if (!qcvm || !progs)
+		return QCVM_NULL_POINTER;
+
+	if (qcvm->worker)
+		return QCVM_WORKER_UNSUPPORTED;
+
+	if (!qcvm->entities)
+		return QCVM_NO_ENTITIES;
+
+	if (qcvm->stack_depth > 0)
+		return QCVM_EXECUTION_IN_PROGRESS;
+
+	if (qcvm->checkpoint)
+		return QCVM_CHECKPOINT_IN_PROGRESS;
+
+	if (len_progs < sizeof(struct qcvm_header))
+		return QCVM_INVALID_PROGS;
+
+	if ((r = check_progs_version(LITTLE32(((struct qcvm_header *)progs)->version))) != QCVM_OK)
+		return r;
+
+	/* both layouts have to fit */
+	num_entity_fields = LITTLE32(((struct qcvm_header *)progs)->num_entity_fields);
+	if ((size_t)num_entities * qcvm->header.num_entity_fields * 4 > qcvm->len_entities || (size_t)num_entities * num_entity_fields * 4 > qcvm->len_entities)
+		return QCVM_ARGUMENT_OUT_OF_RANGE;
+
+	if (!qcvm->alloc_callback)
+		return QCVM_OUT_OF_MEMORY;
+
+	/* get all the memory up front so nothing can fail halfway through */
+	functions = qcvm->alloc_callback(qcvm, NULL, (qcvm->num_functions + 1) * sizeof(uint32_t), qcvm->alloc_callback_user);
+	entity = qcvm->alloc_callback(qcvm, NULL, (qcvm->header.num_entity_fields + 1) * sizeof(uint32_t), qcvm->alloc_callback_user);
+	fields = qcvm->alloc_callback(qcvm, NULL, (qcvm->num_field_vars + 1) * sizeof(struct qcvm_reload_def), qcvm->alloc_callback_user);
+	globals = qcvm->alloc_callback(qcvm, NULL, (qcvm->num_global_vars + 1) * sizeof(struct qcvm_reload_def), qcvm->alloc_callback_user);
+	if (!functions || !entity || !fields || !globals)
+	{
+		r = QCVM_OUT_OF_MEMORY;
+		goto done;
+	}
+
+	/* function indices and code are about to change */
+	free_analysis(qcvm);
+
+	/* the old progs stays around until this returns */
+	old.progs = qcvm->progs;
+	old.len_progs = qcvm->len_progs;
+	old.header = qcvm->header;
+	old.num_statements = qcvm->num_statements;
+	old.statements = qcvm->statements;
+	old.progs_copy = qcvm->progs_copy;
+	old.functions_copy = qcvm->functions_copy;
+	old.globals_copy = qcvm->globals_copy;
+	old.num_entity_fields = qcvm->header.num_entity_fields;
+	old.functions = qcvm->functions;
+	old.num_functions = qcvm->num_functions;
+	old.strings = qcvm->strings;
+	old.len_strings = qcvm->len_strings;
+	old.field_vars = qcvm->field_vars;
+	old.num_field_vars = qcvm->num_field_vars;
+	old.global_vars = qcvm->global_vars;
+	old.num_global_vars = qcvm->num_global_vars;
+	old.globals = qcvm->globals;
+	old.num_globals = qcvm->num_globals;
+
+	qcvm->progs = progs;
+	qcvm->len_progs = len_progs;
+	if ((r = load_progs(qcvm)) != QCVM_OK)
+	{
+		/* put the old progs back as if nothing happened */
+		qcvm->progs = old.progs;
+		qcvm->len_progs = old.len_progs;
+		qcvm->header = old.header;
+		qcvm->num_statements = old.num_statements;
+		qcvm->statements = old.statements;
+		qcvm->num_functions = old.num_functions;
+		qcvm->functions = old.functions;
+		qcvm->len_strings = old.len_strings;
+		qcvm->strings = old.strings;
+		qcvm->num_field_vars = old.num_field_vars;
+		qcvm->field_vars = old.field_vars;
+		qcvm->num_global_vars = old.num_global_vars;
+		qcvm->global_vars = old.global_vars;
+		qcvm->num_globals = old.num_globals;
+		qcvm->globals = old.globals;
+		qcvm->progs_copy = old.progs_copy;
+		qcvm->functions_copy = old.functions_copy;
+		qcvm->globals_copy = old.globals_copy;
+		goto done;
+	}
+
+	/* undo logs and collection progress describe the old layout */
+	free_snapshots(qcvm);
+	if (qcvm->zone_gc_phase == ZONE_GC_MARK)
+		qcvm->zone_gc_phase = ZONE_GC_IDLE;
+
+	/* from here on, keep going and report the first failure at the end */
+	r = intern_progs_strings(qcvm);
+
+	for (i = 0; i < old.num_functions; i++)
+	{
+		name = old.functions[i].ofs_name >= 0 && (size_t)old.functions[i].ofs_name < old.len_strings ? &old.strings[old.functions[i].ofs_name] : "";
+
+		if (i < qcvm->num_functions && QCVM_STRCMP(str_ofs(qcvm, qcvm->functions[i].ofs_name), name) == 0)
+			functions[i] = i;
+		else if (!name[0] || find_function(qcvm, name, &functions[i]) != QCVM_OK)
+			functions[i] = 0;
+	}
+
+	num_globals = map_reload_defs(qcvm, &old, old.global_vars, old.num_global_vars, old.num_globals, qcvm->global_vars, qcvm->num_global_vars, qcvm->num_globals, 1, globals);
+	num_fields = map_reload_defs(qcvm, &old, old.field_vars, old.num_field_vars, old.num_entity_fields, qcvm->field_vars, qcvm->num_field_vars, qcvm->header.num_entity_fields, 0, fields);
+
+	/* globals the new progs starts with are kept unless the old one had a value */
+	for (i = 0; i < num_globals; i++)
+		if ((r2 = reload_value(qcvm, &old, functions, globals[i].type, &old.globals[globals[i].old_ofs].ui, &qcvm->globals[globals[i].new_ofs].ui)) != QCVM_OK && r == QCVM_OK)
+			r = r2;
+
+	/*
+	 * relayout entities in place. when they grow, walking backwards means a
+	 * row only ever lands on old rows that were already moved, and the other
+	 * way around when they shrink.
+	 */
+	for (x = 0; x < num_entities; x++)
+	{
+		e = num_entity_fields > old.num_entity_fields ? num_entities - 1 - x : x;
+
+		row = (uint32_t *)qcvm->entities + (size_t)e * old.num_entity_fields;
+		for (i = 0; i < old.num_entity_fields; i++)
+			entity[i] = row[i];
+
+		row = FIELD_PTR(e, 0);
+		for (i = 0; i < num_entity_fields; i++)
+			row[i] = 0;
+
+		for (i = 0; i < num_fields; i++)
+			if ((r2 = reload_value(qcvm, &old, functions, fields[i].type, &entity[fields[i].old_ofs], &row[fields[i].new_ofs])) != QCVM_OK && r == QCVM_OK)
+				r = r2;
+	}
+
+	/* the bitmaps are sized for the old layout, so everything comes back dirty */
+	if (qcvm->dirty_fields)
+	{
+		free_dirty_fields(qcvm);
+		if ((r2 = qcvm_track_entity_fields(qcvm, 1)) != QCVM_OK && r == QCVM_OK)
+			r = r2;
+		if (qcvm->dirty_fields)
+			mark_dirty_fields(qcvm, 0, (size_t)num_entities * num_entity_fields * 4);
+	}
+
+	/* and every published copy is out of date */
+	if (qcvm->publisher)
+		mark_published_pages(qcvm, 0, qcvm->len_entities);
+
+	/* copies of the old progs aren't needed anymore */
+	if (old.progs_copy)
+		qcvm->alloc_callback(qcvm, old.progs_copy, 0, qcvm->alloc_callback_user);
+	if (old.functions_copy)
+		qcvm->alloc_callback(qcvm, old.functions_copy, 0, qcvm->alloc_callback_user);
+	if (old.globals_copy)
+		qcvm->alloc_callback(qcvm, old.globals_copy, 0, qcvm->alloc_callback_user);
+
+done:
+	if (functions)
+		qcvm->alloc_callback(qcvm, functions, 0, qcvm->alloc_callback_user);
+	if (entity)
+		qcvm->alloc_callback(qcvm, entity, 0, qcvm->alloc_callback_user);
+	if (fields)
+		qcvm->alloc_callback(qcvm, fields, 0, qcvm->alloc_callback_user);
+	if (globals)
+		qcvm->alloc_callback(qcvm, globals, 0, qcvm->alloc_callback_user);
+
+	return r;
+}
+
+/*
+ * program images
+ *
+ * an image holds the results of the work qcvm_init() does on a progs, in
+ * host byte order: the interned string table, which strings are canonical,
+ * and the builtins qc refers to by name. a plain image is keyed on the progs
+ * it was made from, only used with them, and copied from. an in place image
+ * carries the progs itself after those sections, rebuilt the way qcvm keeps
+ * it in memory, so a vm can run from it directly, reading every section
+ * where it lies. the table is only copied out if zone strings get interned,
+ * so vms that don't intern any share all of it. both layouts have the same
+ * header and sections and go through the same checks.
+ */
+#define IMAGE_MAGIC (0x49564351) /* "QCVI" */
+#define IMAGE_VERSION (2)
+
+/* image flags */
+#define IMAGE_IN_PLACE (1)
+
+/* the sizes of everything in the image, so a different build can't use it */
+#define IMAGE_LAYOUT ((uint32_t)(sizeof(struct qcvm_statement) | sizeof(struct qcvm_function) << 8 | sizeof(struct qcvm_var) << 16 | sizeof(struct qcvm_intern) << 24))
+
+struct qcvm_image_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t layout;
+	uint32_t flags;
+	uint32_t key;
+	uint32_t builtins_key;
+	uint32_t size;
+	uint32_t len_strings;
+	uint32_t num_functions;
+	uint32_t intern_table_size;
+	uint32_t num_interned;
+	uint32_t num_intern_tombstones;
+	uint32_t num_bindings;
+	uint32_t ofs_progs;
+	uint32_t len_progs;
+};
+
+/* a named builtin resolved ahead of time */
+struct qcvm_image_binding {
+	uint32_t function;
+	uint32_t builtin;
+};
+
+static uint32_t hash_bytes(uint32_t hash, const void *data, size_t len)
+{
+	const uint8_t *p = (const uint8_t *)data;
+
+	while (len--)
+	{
+		hash ^= *p++;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+/* identifies the builtin table, which bindings in the image index into */
+static uint32_t builtins_key(qcvm_t *qcvm)
+{
+	uint32_t hash = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < qcvm->num_builtins; i++)
+		hash = hash_bytes(hash, qcvm->builtins[i].name ? qcvm->builtins[i].name : "", qcvm->builtins[i].name ? QCVM_STRLEN(qcvm->builtins[i].name) + 1 : 1);
+
+	return hash;
+}
+
+/* identifies the progs, only covering what loading never changes */
+static uint32_t image_key(qcvm_t *qcvm)
+{
+	uint32_t hash = 2166136261u, v[6];
+	size_t i;
+
+	hash = hash_bytes(hash, qcvm->statements, qcvm->num_statements * sizeof(struct qcvm_statement));
+	hash = hash_bytes(hash, qcvm->field_vars, qcvm->num_field_vars * sizeof(struct qcvm_var));
+	hash = hash_bytes(hash, qcvm->global_vars, qcvm->num_global_vars * sizeof(struct qcvm_var));
+	hash = hash_bytes(hash, qcvm->strings, qcvm->len_strings);
+
+	/* builtins get their first statement filled in as they're called */
+	for (i = 0; i < qcvm->num_functions; i++)
+	{
+		v[0] = qcvm->functions[i].first_statement > 0 ? (uint32_t)qcvm->functions[i].first_statement : 0;
+		v[1] = (uint32_t)qcvm->functions[i].first_parm;
+		v[2] = (uint32_t)qcvm->functions[i].num_locals;
+		v[3] = (uint32_t)qcvm->functions[i].ofs_name;
+		v[4] = (uint32_t)qcvm->functions[i].num_parms;
+		v[5] = (uint32_t)qcvm->functions[i].ofs_filename;
+		hash = hash_bytes(hash, v, sizeof(v));
+	}
+
+	return hash;
+}
+
+/* returns the builtin a function resolves to by name, or -1 */
+static int32_t image_binding(qcvm_t *qcvm, uint32_t function)
+{
+	const char *name;
+	size_t i;
+
+	if (qcvm->functions[function].first_statement < 0)
+		return -1 * qcvm->functions[function].first_statement - 1;
+
+	if (qcvm->functions[function].first_statement > 0)
+		return -1;
+
+	name = str_ofs(qcvm, qcvm->functions[function].ofs_name);
+	for (i = 0; i < qcvm->num_builtins; i++)
+		if (qcvm->builtins[i].name && QCVM_STRCMP(name, qcvm->builtins[i].name) == 0)
+			return (int32_t)i;
+
+	return -1;
+}
+
+/* returns nonzero if a section lies within a buffer */
+static int section_fits(size_t ofs, size_t len, size_t size)
+{
+	return ofs <= size && len <= size - ofs;
+}
+
+/* size of the header and the sections every image has */
+static size_t image_sections_size(const struct qcvm_image_header *header)
+{
+	size_t size;
+
+	size = sizeof(*header);
+	size += (size_t)header->intern_table_size * sizeof(struct qcvm_intern);
+	size += ((size_t)header->len_strings + 31) / 32 * 4;
+	size += (size_t)header->num_bindings * sizeof(struct qcvm_image_binding);
+
+	return size;
+}
+
+/* validate an image on its own, and the progs in it if it has one */
+static int parse_image(const void *image, size_t len, struct qcvm_image_header *header)
+{
+	struct qcvm_header h;
+
+	if (!image || len < sizeof(*header))
+		return QCVM_IMAGE_MISMATCH;
+
+	QCVM_MEMCPY(header, image, sizeof(*header));
+
+	if (header->magic != IMAGE_MAGIC || header->version != IMAGE_VERSION || header->layout != IMAGE_LAYOUT)
+		return QCVM_IMAGE_MISMATCH;
+
+	if (header->size != len)
+		return QCVM_IMAGE_MISMATCH;
+
+	/* the table size must be a power of two that fits all the entries */
+	if (header->intern_table_size < 16 || header->intern_table_size & (header->intern_table_size - 1))
+		return QCVM_IMAGE_MISMATCH;
+	if ((size_t)header->num_interned + header->num_intern_tombstones >= header->intern_table_size)
+		return QCVM_IMAGE_MISMATCH;
+	if (header->num_bindings > header->num_functions)
+		return QCVM_IMAGE_MISMATCH;
+
+	if (!(header->flags & IMAGE_IN_PLACE))
+		return header->ofs_progs == 0 && header->len_progs == 0 && image_sections_size(header) == len ? QCVM_OK : QCVM_IMAGE_MISMATCH;
+
+	/* the progs comes last and has to agree with the sections before it */
+	if (header->ofs_progs != image_sections_size(header) || !section_fits(header->ofs_progs, header->len_progs, len) || header->ofs_progs + header->len_progs != len)
+		return QCVM_IMAGE_MISMATCH;
+	if (header->len_progs < sizeof(struct qcvm_header))
+		return QCVM_IMAGE_MISMATCH;
+
+	read_progs_header((const struct qcvm_header *)((const uint8_t *)image + header->ofs_progs), &h);
+
+	if (h.len_strings != header->len_strings || h.num_functions != header->num_functions)
+		return QCVM_IMAGE_MISMATCH;
+
+	if (!section_fits(h.ofs_statements, (size_t)h.num_statements * sizeof(struct qcvm_statement), header->len_progs) ||
+		!section_fits(h.ofs_functions, (size_t)h.num_functions * sizeof(struct qcvm_function), header->len_progs) ||
+		!section_fits(h.ofs_global_vars, (size_t)h.num_global_vars * sizeof(struct qcvm_var), header->len_progs) ||
+		!section_fits(h.ofs_field_vars, (size_t)h.num_field_vars * sizeof(struct qcvm_var), header->len_progs) ||
+		!section_fits(h.ofs_globals, (size_t)h.num_globals * sizeof(union qcvm_global), header->len_progs) ||
+		!section_fits(h.ofs_strings, h.len_strings, header->len_progs))
+		return QCVM_IMAGE_MISMATCH;
+
+	return QCVM_OK;
+}
+
+/* validate an image against the loaded progs and builtins */
+static int match_image(qcvm_t *qcvm, const void *image, size_t len, struct qcvm_image_header *header)
+{
+	int r;
+
+	if ((r = parse_image(image, len, header)) != QCVM_OK)
+		return r;
+
+	if (header->builtins_key != builtins_key(qcvm))
+		return QCVM_IMAGE_MISMATCH;
+
+	if (header->len_strings != qcvm->len_strings || header->num_functions != qcvm->num_functions)
+		return QCVM_IMAGE_MISMATCH;
+
+	if (header->key != image_key(qcvm))
+		return QCVM_IMAGE_MISMATCH;
+
+	return QCVM_OK;
+}
+
+/* returns nonzero if an interned string table only points into the strings */
+static int image_table_fits(const struct qcvm_intern *table, uint32_t size, size_t len_strings)
+{
+	uint32_t i;
+
+	for (i = 0; i < size; i++)
+		if (table[i].s != INTERN_EMPTY && table[i].s != INTERN_TOMBSTONE && (table[i].s < 0 || (size_t)table[i].s >= len_strings))
+			return 0;
+
+	return 1;
+}
+
+/* only bind builtins that would otherwise be looked up by name */
+static void apply_image_bindings(qcvm_t *qcvm, const uint8_t *p, uint32_t num_bindings)
+{
+	struct qcvm_image_binding binding;
+	uint32_t i;
+
+	for (i = 0; i < num_bindings; i++, p += sizeof(binding))
+	{
+		QCVM_MEMCPY(&binding, p, sizeof(binding));
+		if (binding.function < qcvm->num_functions && binding.builtin < qcvm->num_builtins && qcvm->functions[binding.function].first_statement == 0)
+			qcvm->functions[binding.function].first_statement = -1 * (int32_t)(binding.builtin + 1);
+	}
+}
+
+static int load_image(qcvm_t *qcvm)
+{
+	struct qcvm_image_header header;
+	const uint8_t *p;
+	size_t words;
+	int r;
+
+	/* zone strings interned earlier would have to be merged in */
+	if (!qcvm->alloc_callback || qcvm->num_zone_slabs)
+		return QCVM_IMAGE_MISMATCH;
+
+	if ((r = match_image(qcvm, qcvm->image, qcvm->len_image, &header)) != QCVM_OK)
+		return r;
+
+	free_interned(qcvm);
+
+	words = (qcvm->len_strings + 31) / 32;
+	qcvm->intern_table = qcvm->alloc_callback(qcvm, NULL, header.intern_table_size * sizeof(struct qcvm_intern), qcvm->alloc_callback_user);
+	qcvm->strings_canonical = qcvm->alloc_callback(qcvm, NULL, words ? words * 4 : 4, qcvm->alloc_callback_user);
+	if (!qcvm->intern_table || !qcvm->strings_canonical)
+	{
+		free_interned(qcvm);
+		return QCVM_OUT_OF_MEMORY;
+	}
+
+	p = (const uint8_t *)qcvm->image + sizeof(header);
+
+	QCVM_MEMCPY(qcvm->intern_table, p, header.intern_table_size * sizeof(struct qcvm_intern));
+	p += header.intern_table_size * sizeof(struct qcvm_intern);
+	qcvm->intern_table_size = header.intern_table_size;
+	qcvm->num_interned = header.num_interned;
+	qcvm->num_intern_tombstones = header.num_intern_tombstones;
+
+	if (!image_table_fits(qcvm->intern_table, header.intern_table_size, qcvm->len_strings))
+	{
+		free_interned(qcvm);
+		return QCVM_IMAGE_MISMATCH;
+	}
+
+	QCVM_MEMCPY(qcvm->strings_canonical, p, words * 4);
+	p += words * 4;
+
+	apply_image_bindings(qcvm, p, header.num_bindings);
+
+	dedup_string_constants(qcvm);
+
+	return QCVM_OK;
+}
+
+/* the progs header of an in place image, or null if it isn't one this build can use */
+static const struct qcvm_header *shared_progs_header(qcvm_t *qcvm)
+{
+	struct qcvm_image_header header;
+
+	if (parse_image(qcvm->shared_image, qcvm->len_shared_image, &header) != QCVM_OK || !(header.flags & IMAGE_IN_PLACE))
+		return NULL;
+
+	return (const struct qcvm_header *)((const uint8_t *)qcvm->shared_image + header.ofs_progs);
+}
+
+static int attach_shared_image(qcvm_t *qcvm)
+{
+	struct qcvm_image_header header;
+	struct qcvm_header h;
+	uint8_t *base;
+
+	/* there's no progs to fall back on, so it has to carry one */
+	if (parse_image(qcvm->shared_image, qcvm->len_shared_image, &header) != QCVM_OK || !(header.flags & IMAGE_IN_PLACE))
+		return QCVM_IMAGE_MISMATCH;
+
+	/* and the builtins have to be the ones it was bound against */
+	if (header.builtins_key != builtins_key(qcvm))
+		return QCVM_IMAGE_MISMATCH;
+
+	/* zone strings interned earlier would have to be merged in */
+	if (qcvm->num_zone_slabs)
+		return QCVM_IMAGE_MISMATCH;
+
+	/* the image is never written to, so it's only cast to fit the fields */
+	base = (uint8_t *)qcvm->shared_image;
+
+	if (!image_table_fits((const struct qcvm_intern *)(base + sizeof(header)), header.intern_table_size, header.len_strings))
+		return QCVM_IMAGE_MISMATCH;
+
+	read_progs_header((const struct qcvm_header *)(base + header.ofs_progs), &h);
+
+	qcvm->progs = base + header.ofs_progs;
+	qcvm->len_progs = header.len_progs;
+	qcvm->readonly_progs = 1;
+	qcvm->strip_saved = 0;
+	qcvm->header = h;
+
+	/* only these are written to while running */
+	qcvm->functions_copy = copy_progs_section(qcvm, qcvm->progs, h.ofs_functions, (size_t)h.num_functions * sizeof(struct qcvm_function));
+	qcvm->globals_copy = copy_progs_section(qcvm, qcvm->progs, h.ofs_globals, (size_t)h.num_globals * sizeof(union qcvm_global));
+	if (!qcvm->functions_copy || !qcvm->globals_copy)
+	{
+		free_progs_copies(qcvm);
+		return QCVM_OUT_OF_MEMORY;
+	}
+
+	base = (uint8_t *)qcvm->progs;
+	qcvm->num_statements = h.num_statements;
+	qcvm->statements = (struct qcvm_statement *)(base + h.ofs_statements);
+	qcvm->num_functions = h.num_functions;
+	qcvm->functions = qcvm->functions_copy;
+	qcvm->len_strings = h.len_strings;
+	qcvm->strings = (char *)(base + h.ofs_strings);
+	qcvm->num_field_vars = h.num_field_vars;
+	qcvm->field_vars = (struct qcvm_var *)(base + h.ofs_field_vars);
+	qcvm->num_global_vars = h.num_global_vars;
+	qcvm->global_vars = (struct qcvm_var *)(base + h.ofs_global_vars);
+	qcvm->num_globals = h.num_globals;
+	qcvm->globals = qcvm->globals_copy;
+
+	free_interned(qcvm);
+
+	base = (uint8_t *)qcvm->shared_image + sizeof(header);
+	qcvm->intern_table = (struct qcvm_intern *)base;
+	qcvm->intern_table_size = header.intern_table_size;
+	qcvm->num_interned = header.num_interned;
+	qcvm->num_intern_tombstones = header.num_intern_tombstones;
+	base += header.intern_table_size * sizeof(struct qcvm_intern);
+	qcvm->strings_canonical = (uint32_t *)base;
+	base += (h.len_strings + 31) / 32 * 4;
+
+	/* the function table is a copy, so builtins are bound in it like any image */
+	apply_image_bindings(qcvm, base, header.num_bindings);
+
+	return QCVM_OK;
+}
+
+int qcvm_check_image(qcvm_t *qcvm, const void *image, size_t len)
+{
+	struct qcvm_image_header header;
+
+	if (!qcvm || !image)
+		return QCVM_NULL_POINTER;
+
+	return match_image(qcvm, image, len, &header);
+}
+
+/* fill in an image header for the loaded progs, with no progs of its own */
+static void init_image_header(qcvm_t *qcvm, struct qcvm_image_header *header)
+{
+	uint32_t i;
+
+	header->magic = IMAGE_MAGIC;
+	header->version = IMAGE_VERSION;
+	header->layout = IMAGE_LAYOUT;
+	header->flags = 0;
+	header->key = image_key(qcvm);
+	header->builtins_key = builtins_key(qcvm);
+	header->len_strings = (uint32_t)qcvm->len_strings;
+	header->num_functions = (uint32_t)qcvm->num_functions;
+	header->intern_table_size = qcvm->intern_table_size;
+	header->num_interned = 0;
+	header->num_intern_tombstones = 0;
+	header->num_bindings = 0;
+	header->ofs_progs = 0;
+	header->len_progs = 0;
+
+	/* zone strings don't outlive the vm, so they're left behind as tombstones */
+	for (i = 0; i < qcvm->intern_table_size; i++)
+	{
+		if (qcvm->intern_table[i].s == INTERN_EMPTY)
+			continue;
+		else if (qcvm->intern_table[i].s >= 0 && qcvm->intern_table[i].s != INTERN_TOMBSTONE)
+			header->num_interned++;
+		else
+			header->num_intern_tombstones++;
+	}
+
+	for (i = 0; i < qcvm->num_functions; i++)
+		if (image_binding(qcvm, i) >= 0)
+			header->num_bindings++;
+
+	header->size = (uint32_t)image_sections_size(header);
+}
+
+/* write the sections every image has, after its header */
+static void put_image_sections(qcvm_t *qcvm, struct qcvm_stream *st)
+{
+	struct qcvm_image_binding binding;
+	struct qcvm_intern entry;
+	uint32_t i;
+
+	for (i = 0; i < qcvm->intern_table_size; i++)
+	{
+		entry = qcvm->intern_table[i];
+		if (entry.s != INTERN_EMPTY && entry.s < 0)
+			entry.s = INTERN_TOMBSTONE;
+		stream_put(st, &entry, sizeof(entry));
+	}
+
+	stream_put(st, qcvm->strings_canonical, (qcvm->len_strings + 31) / 32 * 4);
+
+	for (i = 0; i < qcvm->num_functions; i++)
+	{
+		if (image_binding(qcvm, i) < 0)
+			continue;
+
+		binding.function = i;
+		binding.builtin = (uint32_t)image_binding(qcvm, i);
+		stream_put(st, &binding, sizeof(binding));
+	}
+}
+
+static void init_image_stream(qcvm_t *qcvm, struct qcvm_stream *st, size_t (*write)(qcvm_t *qcvm, const void *data, size_t len, void *user), void *user)
+{
+	st->qcvm = qcvm;
+	st->write = write;
+	st->read = NULL;
+	st->user = user;
+	st->pos = st->len = st->total = 0;
+	st->error = QCVM_OK;
+	st->capture = NULL;
+}
+
+int qcvm_save_image(qcvm_t *qcvm, size_t (*write)(qcvm_t *qcvm, const void *data, size_t len, void *user), void *user)
+{
+	struct qcvm_stream st;
+	struct qcvm_image_header header;
+
+	if (!qcvm || !write)
+		return QCVM_NULL_POINTER;
+
+	if (!qcvm->intern_table || !qcvm->strings_canonical)
+		return QCVM_INVALID_PROGS;
+
+	init_image_stream(qcvm, &st, write, user);
+
+	init_image_header(qcvm, &header);
+
+	stream_put(&st, &header, sizeof(header));
+	put_image_sections(qcvm, &st);
+
+	stream_flush(&st);
+
+	return st.error;
+}
+
+/* stream callback that writes an image into memory, user points at the cursor */
+static size_t write_image_buffer(qcvm_t *qcvm, const void *data, size_t len, void *user)
+{
+	uint8_t **p = (uint8_t **)user;
+
+	(void)qcvm;
+
+	QCVM_MEMCPY(*p, data, len);
+	*p += len;
+
+	return len;
+}
+
+int qcvm_build_shared_image(qcvm_t *qcvm, void *buf, size_t len, size_t *size)
+{
+	struct qcvm_stream st;
+	struct qcvm_image_header header;
+	struct qcvm_function *functions;
+	struct qcvm_header h;
+	size_t total, len_progs, i;
+	uint8_t *progs, *p;
+
+	if (!qcvm)
+		return QCVM_NULL_POINTER;
+
+	if (!qcvm->statements || !qcvm->intern_table || !qcvm->strings_canonical)
+		return QCVM_INVALID_PROGS;
+
+	init_image_header(qcvm, &header);
+
+	/* a plain image with the progs after it */
+	len_progs = sizeof(struct qcvm_header);
+	len_progs += qcvm->num_statements * sizeof(struct qcvm_statement);
+	len_progs += qcvm->num_functions * sizeof(struct qcvm_function);
+	len_progs += (qcvm->num_global_vars + qcvm->num_field_vars) * sizeof(struct qcvm_var);
+	len_progs += qcvm->num_globals * sizeof(union qcvm_global);
+	len_progs += ALIGN4(qcvm->len_strings);
+	total = header.size + len_progs;
+
+	if (size)
+		*size = total;
+
+	if (!buf)
+		return QCVM_OK;
+
+	if (len < total || total > UINT32_MAX)
+		return QCVM_ARGUMENT_OUT_OF_RANGE;
+
+	header.flags |= IMAGE_IN_PLACE;
+	header.ofs_progs = header.size;
+	header.len_progs = (uint32_t)len_progs;
+	header.size = (uint32_t)total;
+
+	p = (uint8_t *)buf;
+	init_image_stream(qcvm, &st, write_image_buffer, &p);
+	stream_put(&st, &header, sizeof(header));
+	put_image_sections(qcvm, &st);
+	stream_flush(&st);
+
+	progs = (uint8_t *)buf + header.ofs_progs;
+	p = progs + sizeof(struct qcvm_header);
+	h = qcvm->header;
+
+	QCVM_MEMCPY(p, qcvm->statements, qcvm->num_statements * sizeof(struct qcvm_statement));
+	h.ofs_statements = (uint32_t)(p - progs);
+	h.num_statements = (uint32_t)qcvm->num_statements;
+	p += qcvm->num_statements * sizeof(struct qcvm_statement);
+
+	/* builtins are bound from the bindings section, like in any image */
+	functions = (struct qcvm_function *)p;
+	QCVM_MEMCPY(functions, qcvm->functions, qcvm->num_functions * sizeof(struct qcvm_function));
+	for (i = 0; i < qcvm->num_functions; i++)
+	{
+		functions[i].profile = 0;
+		if (image_binding(qcvm, (uint32_t)i) >= 0)
+			functions[i].first_statement = 0;
+	}
+	h.ofs_functions = (uint32_t)(p - progs);
+	h.num_functions = (uint32_t)qcvm->num_functions;
+	p += qcvm->num_functions * sizeof(struct qcvm_function);
+
+	QCVM_MEMCPY(p, qcvm->global_vars, qcvm->num_global_vars * sizeof(struct qcvm_var));
+	h.ofs_global_vars = (uint32_t)(p - progs);
+	h.num_global_vars = (uint32_t)qcvm->num_global_vars;
+	p += qcvm->num_global_vars * sizeof(struct qcvm_var);
+
+	QCVM_MEMCPY(p, qcvm->field_vars, qcvm->num_field_vars * sizeof(struct qcvm_var));
+	h.ofs_field_vars = (uint32_t)(p - progs);
+	h.num_field_vars = (uint32_t)qcvm->num_field_vars;
+	p += qcvm->num_field_vars * sizeof(struct qcvm_var);
+
+	QCVM_MEMCPY(p, qcvm->globals, qcvm->num_globals * sizeof(union qcvm_global));
+	h.ofs_globals = (uint32_t)(p - progs);
+	h.num_globals = (uint32_t)qcvm->num_globals;
+	p += qcvm->num_globals * sizeof(union qcvm_global);
+
+	QCVM_MEMCPY(p, qcvm->strings, qcvm->len_strings);
+	h.ofs_strings = (uint32_t)(p - progs);
+	h.len_strings = (uint32_t)qcvm->len_strings;
+	p += qcvm->len_strings;
+	while ((size_t)(p - progs) & 3)
+		*p++ = '\0';
+
+	write_progs_header(&h, (struct qcvm_header *)progs);
+
+	return QCVM_OK;
+}
+
+/*
+ * workers
+ *
+ * a worker is a vm of its own that borrows everything from another vm except
+ * its stacks, tempstrings, globals and function table, so that several can
+ * run qc on separate threads. nothing a worker does touches another worker's
+ * memory or the vm's, besides the entity writes qc makes. the bookkeeping
+ * those writes need is logged and done later by qcvm_join_worker(), on the
+ * thread that owns the vm.
+ */
+
+/* find the global that thinks set to their entity */
+static int32_t find_self(qcvm_t *qcvm)
+{
+	int32_t first = -1;
+	size_t i;
+
+	for (i = 0; i < qcvm->num_global_vars; i++)
+	{
+		if (DEF_TYPE(&qcvm->global_vars[i]) != QCVM_TYPE_ENTITY)
+			continue;
+
+		if (QCVM_STRCMP(str_ofs(qcvm, qcvm->global_vars[i].name), "self") == 0)
+			return qcvm->global_vars[i].ofs;
+
+		/* stripped progs have no names, but self always comes first */
+		if (first < 0)
+			first = qcvm->global_vars[i].ofs;
+	}
+
+	return first;
+}
+
+/* point a worker at the string heaps of its vm, which stay put during a batch */
+static void share_string_heaps(qcvm_t *worker, qcvm_t *qcvm)
+{
+	int i;
+
+	worker->zone_slabs = qcvm->zone_slabs;
+	worker->num_zone_slabs = qcvm->num_zone_slabs;
+	for (i = 0; i < 2; i++)
+	{
+		worker->external_strings[i] = qcvm->external_strings[i];
+		worker->num_external_strings[i] = qcvm->num_external_strings[i];
+	}
+	worker->strings_canonical = qcvm->strings_canonical;
+	worker->intern_table = qcvm->intern_table;
+	worker->intern_table_size = qcvm->intern_table_size;
+	worker->num_interned = qcvm->num_interned;
+}
+
+static void free_worker(qcvm_t *qcvm)
+{
+	struct qcvm_worker *worker = qcvm->worker;
+	int i;
+
+	if (!worker)
+		return;
+
+	/* none of these belong to the worker */
+	qcvm->zone_slabs = NULL;
+	qcvm->num_zone_slabs = 0;
+	for (i = 0; i < 2; i++)
+	{
+		qcvm->external_strings[i] = NULL;
+		qcvm->num_external_strings[i] = 0;
+	}
+	qcvm->strings_canonical = NULL;
+	qcvm->intern_table = NULL;
+	qcvm->intern_table_size = qcvm->num_interned = 0;
+
+	if (worker->writes)
+		qcvm->alloc_callback(qcvm, worker->writes, 0, qcvm->alloc_callback_user);
+	if (worker->base_globals)
+		qcvm->alloc_callback(qcvm, worker->base_globals, 0, qcvm->alloc_callback_user);
+	if (worker->global_flags)
+		qcvm->alloc_callback(qcvm, worker->global_flags, 0, qcvm->alloc_callback_user);
+	if (worker->touched_globals)
+		qcvm->alloc_callback(qcvm, worker->touched_globals, 0, qcvm->alloc_callback_user);
+	if (worker->words)
+		qcvm->alloc_callback(qcvm, worker->words, 0, qcvm->alloc_callback_user);
+	if (worker->word_slots)
+		qcvm->alloc_callback(qcvm, worker->word_slots, 0, qcvm->alloc_callback_user);
+	if (worker->tasks)
+		qcvm->alloc_callback(qcvm, worker->tasks, 0, qcvm->alloc_callback_user);
+	if (worker->log)
+		qcvm->alloc_callback(qcvm, worker->log, 0, qcvm->alloc_callback_user);
+	qcvm->alloc_callback(qcvm, worker, 0, qcvm->alloc_callback_user);
+	qcvm->worker = NULL;
+}
+
+/* log an entity write for qcvm_join_worker(), if the vm needs to hear about it */
+static int worker_write_barrier(qcvm_t *qcvm, size_t ofs, size_t len)
+{
+	struct qcvm_worker *worker = qcvm->worker;
+	int r;
+
+	if (!worker->parent->dirty_fields && !worker->parent->publisher && !worker->parent->pristine_bits && worker->parent->zone_gc_phase != ZONE_GC_MARK)
+		return QCVM_OK;
+
+	if ((r = grow_buffer(qcvm, (void **)&worker->writes, &worker->max_writes, worker->num_writes + 2, sizeof(uint32_t))) != QCVM_OK)
+		return r;
+
+	worker->writes[worker->num_writes++] = (uint32_t)ofs;
+	worker->writes[worker->num_writes++] = (uint32_t)len;
+
+	return QCVM_OK;
+}
+
+/*
+ * speculation
+ *
+ * a speculative worker runs every think against the state the batch started
+ * with, and never writes to entities. each think logs the globals and entity
+ * words it read before writing them, with the values it saw, and the final
+ * value of everything it wrote. qcvm_commit_thinks() then goes through the
+ * batch in order: a think whose reads all still match what's committed would
+ * do exactly the same thing if it ran now, so its writes are applied as is.
+ * any other think is run again on the vm itself.
+ */
+
+#define SPEC_READ (1)
+#define SPEC_WRITTEN (2)
+#define SPEC_GLOBAL (0x80000000u)
+
+static void spec_touch_global(struct qcvm_worker *worker, uint32_t g, uint8_t flag)
+{
+	if (!worker->global_flags[g])
+		worker->touched_globals[worker->num_touched_globals++] = g;
+	worker->global_flags[g] |= flag;
+}
+
+static void spec_read_globals(qcvm_t *qcvm, uint32_t g, uint32_t n)
+{
+	uint32_t i;
+
+	if (g >= qcvm->num_globals)
+		return;
+	if (n > qcvm->num_globals - g)
+		n = (uint32_t)qcvm->num_globals - g;
+
+	for (i = g; i < g + n; i++)
+		if (!(qcvm->worker->global_flags[i] & (SPEC_READ | SPEC_WRITTEN)))
+			spec_touch_global(qcvm->worker, i, SPEC_READ);
+}
+
+static void spec_write_globals(qcvm_t *qcvm, uint32_t g, uint32_t n)
+{
+	uint32_t i;
+
+	if (g >= qcvm->num_globals)
+		return;
+	if (n > qcvm->num_globals - g)
+		n = (uint32_t)qcvm->num_globals - g;
+
+	for (i = g; i < g + n; i++)
+		if (!(qcvm->worker->global_flags[i] & SPEC_WRITTEN))
+			spec_touch_global(qcvm->worker, i, SPEC_WRITTEN);
+}
+
+/* rebuild the hash of touched entity words with room for twice as many */
+static int spec_grow_word_slots(qcvm_t *qcvm)
+{
+	struct qcvm_worker *worker = qcvm->worker;
+	uint32_t size, h, i, *slots;
+
+	size = worker->num_word_slots ? worker->num_word_slots * 2 : 256;
+	if ((slots = qcvm->alloc_callback(qcvm, NULL, size * sizeof(uint32_t), qcvm->alloc_callback_user)) == NULL)
+		return QCVM_OUT_OF_MEMORY;
+
+	for (i = 0; i < size; i++)
+		slots[i] = 0;
+
+	for (i = 0; i < worker->num_words; i++)
+	{
+		for (h = (worker->words[i].word * 2654435761u) & (size - 1); slots[h]; h = (h + 1) & (size - 1));
+		slots[h] = i + 1;
+		worker->words[i].slot = h;
+	}
+
+	if (worker->word_slots)
+		qcvm->alloc_callback(qcvm, worker->word_slots, 0, qcvm->alloc_callback_user);
+	worker->word_slots = slots;
+	worker->num_word_slots = size;
+
+	return QCVM_OK;
+}
+
+/* find the log entry of an entity word, starting one with its committed value if there isn't one */
+static struct qcvm_spec_word *spec_word(qcvm_t *qcvm, size_t word)
+{
+	struct qcvm_worker *worker = qcvm->worker;
+	struct qcvm_spec_word *entry;
+	uint32_t h, mask;
+
+	if (word >= qcvm->len_entities / 4)
+		return NULL;
+
+	if ((worker->num_words + 1) * 2 > worker->num_word_slots && spec_grow_word_slots(qcvm) != QCVM_OK)
+		return NULL;
+
+	mask = worker->num_word_slots - 1;
+	for (h = ((uint32_t)word * 2654435761u) & mask; worker->word_slots[h]; h = (h + 1) & mask)
+		if (worker->words[worker->word_slots[h] - 1].word == word)
+			return &worker->words[worker->word_slots[h] - 1];
+
+	if (grow_buffer(qcvm, (void **)&worker->words, &worker->max_words, worker->num_words + 1, sizeof(struct qcvm_spec_word)) != QCVM_OK)
+		return NULL;
+
+	entry = &worker->words[worker->num_words++];
+	entry->word = (uint32_t)word;
+	entry->slot = h;
+	entry->first = entry->value = ((uint32_t *)qcvm->entities)[word];
+	entry->flags = 0;
+	worker->word_slots[h] = (uint32_t)worker->num_words;
+
+	return entry;
+}
+
+static int speculate_statement(qcvm_t *qcvm, int *handled)
+{
+	struct qcvm_statement *st = qcvm->current_statement;
+	struct qcvm_spec_word *entry;
+	size_t word;
+	int i, n;
+
+	*handled = 0;
+
+	if (st->opcode >= NUM_OPCODES)
+		return QCVM_OK;
+
+	/* reads come first, as the result can overwrite an operand */
+	for (i = 0; i < 3; i++)
+	{
+		if (opcode_access[st->opcode][i] == ACCESS_READ)
+			spec_read_globals(qcvm, (uint16_t)st->vars[i], 1);
+		else if (opcode_access[st->opcode][i] == ACCESS_READ_VECTOR)
+			spec_read_globals(qcvm, (uint16_t)st->vars[i], 3);
+	}
+
+	for (i = 0; i < 3; i++)
+	{
+		if (opcode_access[st->opcode][i] == ACCESS_WRITE)
+			spec_write_globals(qcvm, (uint16_t)st->vars[i], 1);
+		else if (opcode_access[st->opcode][i] == ACCESS_WRITE_VECTOR)
+			spec_write_globals(qcvm, (uint16_t)st->vars[i], 3);
+	}
+
+	switch (st->opcode)
+	{
+		case OPCODE_RETURN:
+		case OPCODE_DONE:
+			spec_write_globals(qcvm, OFS_RETURN, 3);
+			return QCVM_OK;
+
+		case OPCODE_LOAD_F:
+		case OPCODE_LOAD_V:
+		case OPCODE_LOAD_S:
+		case OPCODE_LOAD_ENT:
+		case OPCODE_LOAD_FLD:
+		case OPCODE_LOAD_FNC:
+			word = (size_t)qcvm->eval[0]->e * qcvm->header.num_entity_fields + (uint32_t)qcvm->eval[1]->i;
+			n = st->opcode == OPCODE_LOAD_V ? 3 : 1;
+			for (i = 0; i < n; i++)
+			{
+				if ((entry = spec_word(qcvm, word + i)) == NULL)
+					return QCVM_ARGUMENT_OUT_OF_RANGE;
+				if (!(entry->flags & SPEC_WRITTEN))
+					entry->flags |= SPEC_READ;
+				((uint32_t *)qcvm->eval[2])[i] = entry->value;
+			}
+			*handled = 1;
+			return QCVM_OK;
+
+		case OPCODE_STOREP_F:
+		case OPCODE_STOREP_V:
+		case OPCODE_STOREP_S:
+		case OPCODE_STOREP_ENT:
+		case OPCODE_STOREP_FLD:
+		case OPCODE_STOREP_FNC:
+			if (qcvm->eval[1]->i < 0 || qcvm->eval[1]->i & 3)
+				return QCVM_ARGUMENT_OUT_OF_RANGE;
+			word = (size_t)qcvm->eval[1]->i / 4;
+			n = st->opcode == OPCODE_STOREP_V ? 3 : 1;
+			for (i = 0; i < n; i++)
+			{
+				if ((entry = spec_word(qcvm, word + i)) == NULL)
+					return QCVM_ARGUMENT_OUT_OF_RANGE;
+				entry->flags |= SPEC_WRITTEN;
+				entry->value = ((uint32_t *)qcvm->eval[0])[i];
+			}
+			*handled = 1;
+			return QCVM_OK;
+	}
+
+	return QCVM_OK;
+}
+
+/* set up a worker for a speculative batch */
+static int spec_begin(qcvm_t *worker)
+{
+	struct qcvm_worker *w = worker->worker;
+	size_t i;
+
+	if (!w->base_globals)
+	{
+		w->base_globals = worker->alloc_callback(worker, NULL, worker->num_globals * sizeof(union qcvm_global), worker->alloc_callback_user);
+		w->global_flags = worker->alloc_callback(worker, NULL, worker->num_globals, worker->alloc_callback_user);
+		w->touched_globals = worker->alloc_callback(worker, NULL, worker->num_globals * sizeof(uint32_t), worker->alloc_callback_user);
+		if (!w->base_globals || !w->global_flags || !w->touched_globals)
+			return QCVM_OUT_OF_MEMORY;
+
+		for (i = 0; i < worker->num_globals; i++)
+			w->global_flags[i] = 0;
+	}
+
+	QCVM_MEMCPY(w->base_globals, worker->globals, worker->num_globals * sizeof(union qcvm_global));
+
+	return QCVM_OK;
+}
+
+/* log what a speculative think did, and put the worker back the way the batch started */
+static int spec_finish(qcvm_t *worker, uint32_t think, int result)
+{
+	struct qcvm_worker *w = worker->worker;
+	struct qcvm_spec_task *task;
+	size_t i, need;
+	uint32_t g;
+	int r;
+
+	/* without a log, the think is just run again */
+	need = w->num_log + (w->num_touched_globals + w->num_words) * 4;
+	if (result == QCVM_OK && grow_buffer(worker, (void **)&w->log, &w->max_log, need, sizeof(uint32_t)) != QCVM_OK)
+		result = QCVM_OUT_OF_MEMORY;
+
+	if ((r = grow_buffer(worker, (void **)&w->tasks, &w->max_tasks, w->num_tasks + 1, sizeof(struct qcvm_spec_task))) == QCVM_OK)
+	{
+		task = &w->tasks[w->num_tasks++];
+		task->think = think;
+		task->result = result;
+		task->log = (uint32_t)w->num_log;
+		task->num_reads = task->num_writes = 0;
+
+		/* reads first, then writes */
+		if (result == QCVM_OK)
+		{
+			for (i = 0; i < w->num_touched_globals; i++)
+			{
+				g = w->touched_globals[i];
+				if (w->global_flags[g] & SPEC_READ)
+				{
+					w->log[w->num_log++] = g | SPEC_GLOBAL;
+					w->log[w->num_log++] = w->base_globals[g].ui;
+					task->num_reads++;
+				}
+			}
+			for (i = 0; i < w->num_words; i++)
+			{
+				if (w->words[i].flags & SPEC_READ)
+				{
+					w->log[w->num_log++] = w->words[i].word;
+					w->log[w->num_log++] = w->words[i].first;
+					task->num_reads++;
+				}
+			}
+			for (i = 0; i < w->num_touched_globals; i++)
+			{
+				g = w->touched_globals[i];
+				if (w->global_flags[g] & SPEC_WRITTEN)
+				{
+					w->log[w->num_log++] = g | SPEC_GLOBAL;
+					w->log[w->num_log++] = worker->globals[g].ui;
+					task->num_writes++;
+				}
+			}
+			for (i = 0; i < w->num_words; i++)
+			{
+				if (w->words[i].flags & SPEC_WRITTEN)
+				{
+					w->log[w->num_log++] = w->words[i].word;
+					w->log[w->num_log++] = w->words[i].value;
+					task->num_writes++;
+				}
+			}
+		}
+	}
+
+	/* undo everything for the next think */
+	for (i = 0; i < w->num_touched_globals; i++)
+	{
+		g = w->touched_globals[i];
+		worker->globals[g] = w->base_globals[g];
+		w->global_flags[g] = 0;
+	}
+	w->num_touched_globals = 0;
+
+	for (i = 0; i < w->num_words; i++)
+		w->word_slots[w->words[i].slot] = 0;
+	w->num_words = 0;
+
+	return r;
+}
+
+/* run a think speculatively, logging it whether it worked or not */
+static int spec_run_think(qcvm_t *worker, struct qcvm_function *func, const struct qcvm_think *think, uint32_t index)
+{
+	struct qcvm_worker *w = worker->worker;
+	int32_t stack_depth = worker->stack_depth;
+	int32_t local_stack_used = worker->local_stack_used;
+	struct qcvm_stack xstack = worker->xstack;
+	int32_t block = worker->current_tempstrings_block;
+	size_t used = worker->tempstrings_used;
+	int r = QCVM_INVALID_FUNCTION;
+
+	if (func)
+	{
+		spec_write_globals(worker, (uint32_t)w->self, 1);
+		worker->globals[w->self].ui = think->entity;
+
+		w->speculating = 1;
+		r = run_function(worker, func);
+		w->speculating = 0;
+	}
+
+	/* whatever it didn't finish gets done again on the vm */
+	if (r != QCVM_OK)
+	{
+		worker->stack_depth = stack_depth;
+		worker->local_stack_used = local_stack_used;
+		worker->xstack = xstack;
+	}
+
+	/* its tempstrings wouldn't mean anything to the vm either */
+	if (worker->current_tempstrings_block != block || worker->tempstrings_used != used)
+	{
+		worker->current_tempstrings_block = block;
+		worker->tempstrings_used = used;
+		if (r == QCVM_OK)
+			r = QCVM_NO_TEMPSTRINGS;
+	}
+
+	return spec_finish(worker, index, r);
+}
+
+int qcvm_init_worker(qcvm_t *qcvm, qcvm_t *worker)
+{
+	int32_t self;
+	size_t i;
+
+	if (!qcvm || !worker)
+		return QCVM_NULL_POINTER;
+
+	if (qcvm->worker)
+		return QCVM_WORKER_UNSUPPORTED;
+
+	if (!qcvm->globals || !qcvm->functions)
+		return QCVM_INVALID_PROGS;
+
+	if ((self = find_self(qcvm)) < 0)
+		return QCVM_INVALID_PROGS;
+
+	if (!qcvm->alloc_callback)
+		return QCVM_OUT_OF_MEMORY;
+
+	/* configuration */
+	worker->len_progs = qcvm->len_progs;
+	worker->progs = qcvm->progs;
+	worker->readonly_progs = 1;
+	worker->len_shared_image = qcvm->len_shared_image;
+	worker->shared_image = qcvm->shared_image;
+	worker->len_entities = qcvm->len_entities;
+	worker->entities = qcvm->entities;
+	worker->state_callback = qcvm->state_callback;
+	worker->state_callback_user = qcvm->state_callback_user;
+	worker->num_builtins = qcvm->num_builtins;
+	worker->builtins = qcvm->builtins;
+	worker->len_tempstrings = 0;
+	worker->tempstrings = NULL;
+	worker->alloc_callback = qcvm->alloc_callback;
+	worker->alloc_callback_user = qcvm->alloc_callback_user;
+	worker->lock_callback = qcvm->lock_callback;
+	worker->lock_callback_user = qcvm->lock_callback_user;
+
+	/* the parts of the progs that are only ever read */
+	worker->header = qcvm->header;
+	worker->num_statements = qcvm->num_statements;
+	worker->statements = qcvm->statements;
+	worker->num_functions = qcvm->num_functions;
+	worker->len_strings = qcvm->len_strings;
+	worker->strings = qcvm->strings;
+	worker->num_field_vars = qcvm->num_field_vars;
+	worker->field_vars = qcvm->field_vars;
+	worker->num_global_vars = qcvm->num_global_vars;
+	worker->global_vars = qcvm->global_vars;
+	worker->num_globals = qcvm->num_globals;
+
+	/* the parts that are written to while running */
+	worker->worker = qcvm->alloc_callback(qcvm, NULL, sizeof(struct qcvm_worker), qcvm->alloc_callback_user);
+	worker->functions_copy = qcvm->alloc_callback(qcvm, NULL, qcvm->num_functions * sizeof(struct qcvm_function), qcvm->alloc_callback_user);
+	worker->globals_copy = qcvm->alloc_callback(qcvm, NULL, qcvm->num_globals * sizeof(union qcvm_global), qcvm->alloc_callback_user);
+	if (!worker->worker || !worker->functions_copy || !worker->globals_copy)
+	{
+		if (worker->worker)
+			qcvm->alloc_callback(qcvm, worker->worker, 0, qcvm->alloc_callback_user);
+		worker->worker = NULL;
+		free_progs_copies(worker);
+		return QCVM_OUT_OF_MEMORY;
+	}
+
+	worker->worker->parent = qcvm;
+	worker->worker->self = self;
+	worker->worker->flags = 0;
+	worker->worker->writes = NULL;
+	worker->worker->num_writes = worker->worker->max_writes = 0;
+	worker->worker->num_thinks = worker->worker->num_serialized = 0;
+	worker->worker->fork = 0;
+	worker->worker->speculating = 0;
+	worker->worker->base_globals = NULL;
+	worker->worker->global_flags = NULL;
+	worker->worker->touched_globals = NULL;
+	worker->worker->num_touched_globals = 0;
+	worker->worker->words = NULL;
+	worker->worker->num_words = worker->worker->max_words = 0;
+	worker->worker->word_slots = NULL;
+	worker->worker->num_word_slots = 0;
+	worker->worker->tasks = NULL;
+	worker->worker->num_tasks = worker->worker->max_tasks = worker->worker->commit_cursor = 0;
+	worker->worker->log = NULL;
+	worker->worker->num_log = worker->worker->max_log = 0;
+
+	QCVM_MEMCPY(worker->functions_copy, qcvm->functions, qcvm->num_functions * sizeof(struct qcvm_function));
+	for (i = 0; i < qcvm->num_functions; i++)
+		worker->functions_copy[i].profile = 0;
+	QCVM_MEMCPY(worker->globals_copy, qcvm->globals, qcvm->num_globals * sizeof(union qcvm_global));
+	worker->functions = worker->functions_copy;
+	worker->globals = worker->globals_copy;
+
+	share_string_heaps(worker, qcvm);
+
+	/* tempstrings of its own */
+	worker->num_tempstrings_blocks = 0;
+	worker->tempstrings_high_water = 0;
+	worker->tempstrings_epoch = 0;
+	qcvm_tempstrings_begin_frame(worker);
+
+	worker->stack_depth = worker->local_stack_used = 0;
+
+	return QCVM_OK;
+}
+
+/* the qc function a think calls, or null if it isn't one */
+static struct qcvm_function *think_function(qcvm_t *qcvm, const struct qcvm_think *think)
+{
+	if (think->function < 1 || (size_t)think->function >= qcvm->num_functions)
+		return NULL;
+
+	if (qcvm->functions[think->function].first_statement < 1)
+		return NULL;
+
+	return &qcvm->functions[think->function];
+}
+
+int qcvm_run_thinks(qcvm_t *worker, const struct qcvm_think *thinks, size_t num_thinks, uint32_t worker_index, uint32_t num_workers, int flags)
+{
+	struct qcvm_function *func;
+	size_t i, first, last;
+	int32_t self;
+	int r;
+
+	if (!worker || (!thinks && num_thinks))
+		return QCVM_NULL_POINTER;
+
+	if (!num_workers || worker_index >= num_workers)
+		return QCVM_ARGUMENT_OUT_OF_RANGE;
+
+	if (worker->worker)
+	{
+		qcvm_t *qcvm = worker->worker->parent;
+
+		/* a fork keeps its own globals, which this would throw away */
+		if (worker->worker->fork)
+			return QCVM_WORKER_UNSUPPORTED;
+
+		/* serializing builtins needs the host's lock */
+		if ((flags & QCVM_THINK_SERIALIZE_BUILTINS) && !worker->lock_callback)
+			return QCVM_NULL_POINTER;
+
+		/* those need to see entity pages before they're written, but speculative workers don't write any */
+		if (!(flags & QCVM_THINK_SPECULATE) && (qcvm->num_snapshots || qcvm->checkpoint))
+			return QCVM_WORKER_BLOCKED;
+
+		QCVM_MEMCPY(worker->globals, qcvm->globals, qcvm->num_globals * sizeof(union qcvm_global));
+		share_string_heaps(worker, qcvm);
+
+		worker->worker->flags = flags;
+		worker->worker->num_tasks = worker->worker->num_log = 0;
+		self = worker->worker->self;
+
+		if ((flags & QCVM_THINK_SPECULATE) && (r = spec_begin(worker)) != QCVM_OK)
+			return r;
+	}
+	else if ((self = find_self(worker)) < 0)
+	{
+		return QCVM_INVALID_PROGS;
+	}
+
+	/* an even slice, or every think whose entity maps to this worker */
+	if (flags & QCVM_THINK_BY_ENTITY)
+	{
+		first = 0;
+		last = num_thinks;
+	}
+	else
+	{
+		first = num_thinks * worker_index / num_workers;
+		last = num_thinks * (worker_index + 1) / num_workers;
+	}
+
+	for (i = first; i < last; i++)
+	{
+		if ((flags & QCVM_THINK_BY_ENTITY) && thinks[i].entity % num_workers != worker_index)
+			continue;
+
+		func = think_function(worker, &thinks[i]);
+
+		if (worker->worker && (flags & QCVM_THINK_SPECULATE))
+		{
+			if ((r = spec_run_think(worker, func, &thinks[i], (uint32_t)i)) != QCVM_OK)
+				return r;
+		}
+		else
+		{
+			if (!func)
+				return QCVM_INVALID_FUNCTION;
+
+			worker->globals[self].ui = thinks[i].entity;
+
+			if ((r = run_function(worker, func)) != QCVM_OK)
+				return r;
+		}
+
+		if (worker->worker)
+			worker->worker->num_thinks++;
+	}
+
+	return QCVM_OK;
+}
+
+int qcvm_join_worker(qcvm_t *worker)
+{
+	qcvm_t *qcvm;
+	size_t i, ofs, len, w;
+
+	if (!worker)
+		return QCVM_NULL_POINTER;
+
+	/* a vm running its own thinks has nothing to merge */
+	if (!worker->worker)
+		return QCVM_OK;
+
+	qcvm = worker->worker->parent;
+
+	for (i = 0; i < worker->worker->num_writes; i += 2)
+	{
+		ofs = worker->worker->writes[i];
+		len = worker->worker->writes[i + 1];
+
+		if (ofs >= qcvm->len_entities)
+			continue;
+		if (len > qcvm->len_entities - ofs)
+			len = qcvm->len_entities - ofs;
+
+		if (qcvm->dirty_fields)
+			mark_dirty_fields(qcvm, ofs, len);
+
+		if (qcvm->publisher)
+			mark_published_pages(qcvm, ofs, len);
+
+		if (qcvm->pristine_bits)
+			mark_pristine_pages(qcvm, ofs, len);
+
+		/* anything that could be a zone string it stored has to survive this cycle */
+		if (qcvm->zone_gc_phase == ZONE_GC_MARK)
+			for (w = ofs / 4; w < (ofs + len) / 4; w++)
+				mark_zone_string(qcvm, ((int32_t *)qcvm->entities)[w]);
+	}
+	worker->worker->num_writes = 0;
+
+	for (i = 0; i < worker->num_functions; i++)
+	{
+		qcvm->functions[i].profile += worker->functions[i].profile;
+		worker->functions[i].profile = 0;
+	}
+
+	return QCVM_OK;
+}
+
+int qcvm_query_worker_info(qcvm_t *worker, size_t *num_thinks, size_t *num_serialized)
+{
+	if (!worker)
+		return QCVM_NULL_POINTER;
+
+	if (!worker->worker)
+		return QCVM_WORKER_UNSUPPORTED;
+
+	if (num_thinks)
+		*num_thinks = worker->worker->num_thinks;
+
+	if (num_serialized)
+		*num_serialized = worker->worker->num_serialized;
+
+	return QCVM_OK;
+}
+
+/* check that everything a think read is still what it saw */
+static int spec_still_valid(qcvm_t *qcvm, const struct qcvm_worker *worker, const struct qcvm_spec_task *task)
+{
+	const uint32_t *log = &worker->log[task->log];
+	uint32_t i, ofs;
+
+	for (i = 0; i < task->num_reads; i++, log += 2)
+	{
+		ofs = log[0] & ~SPEC_GLOBAL;
+
+		if (log[0] & SPEC_GLOBAL)
+		{
+			if (qcvm->globals[ofs].ui != log[1])
+				return 0;
+		}
+		else if (((uint32_t *)qcvm->entities)[ofs] != log[1])
+		{
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/* apply everything a think wrote */
+static int spec_apply(qcvm_t *qcvm, const struct qcvm_worker *worker, const struct qcvm_spec_task *task)
+{
+	const uint32_t *log = &worker->log[task->log + task->num_reads * 2];
+	uint32_t i, ofs;
+	int r;
+
+	for (i = 0; i < task->num_writes; i++, log += 2)
+	{
+		ofs = log[0] & ~SPEC_GLOBAL;
+
+		if (log[0] & SPEC_GLOBAL)
+		{
+			qcvm->globals[ofs].ui = log[1];
+			continue;
+		}
+
+		if (HAS_WRITE_BARRIER(qcvm) && (r = entity_write_barrier(qcvm, (size_t)ofs * 4, 4)) != QCVM_OK)
+			return r;
+
+		/* there's no telling which words were strings anymore */
+		if (qcvm->zone_gc_phase == ZONE_GC_MARK)
+			mark_zone_string(qcvm, (int32_t)log[1]);
+
+		((uint32_t *)qcvm->entities)[ofs] = log[1];
+	}
+
+	return QCVM_OK;
+}
+
+/* the worker think i was given to, k being the one think i - 1 was given to */
+static uint32_t think_worker(const struct qcvm_think *thinks, size_t i, size_t num_thinks, uint32_t k, uint32_t num_workers, int flags)
+{
+	if (flags & QCVM_THINK_BY_ENTITY)
+		return thinks[i].entity % num_workers;
+
+	while (k + 1 < num_workers && i >= num_thinks * (k + 1) / num_workers)
+		k++;
+
+	return k;
+}
+
+/* check that the workers logged exactly this batch, in order */
+static int spec_batch_matches(qcvm_t **workers, uint32_t num_workers, const struct qcvm_think *thinks, size_t num_thinks, int flags)
+{
+	struct qcvm_worker *worker;
+	uint32_t w, k;
+	size_t i;
+
+	for (w = 0; w < num_workers; w++)
+	{
+		worker = workers[w]->worker;
+		if (!(worker->flags & QCVM_THINK_SPECULATE) || (worker->flags & QCVM_THINK_BY_ENTITY) != (flags & QCVM_THINK_BY_ENTITY))
+			return 0;
+		worker->commit_cursor = 0;
+	}
+
+	for (i = 0, k = 0; i < num_thinks; i++)
+	{
+		k = think_worker(thinks, i, num_thinks, k, num_workers, flags);
+		worker = workers[k]->worker;
+		if (worker->commit_cursor >= worker->num_tasks || worker->tasks[worker->commit_cursor].think != i)
+			return 0;
+		worker->commit_cursor++;
+	}
+
+	for (w = 0; w < num_workers; w++)
+	{
+		worker = workers[w]->worker;
+		if (worker->commit_cursor != worker->num_tasks)
+			return 0;
+		worker->commit_cursor = 0;
+	}
+
+	return 1;
+}
+
+int qcvm_commit_thinks(qcvm_t *qcvm, qcvm_t **workers, uint32_t num_workers, const struct qcvm_think *thinks, size_t num_thinks, int flags, size_t *num_rerun)
+{
+	struct qcvm_function *func;
+	struct qcvm_worker *worker;
+	struct qcvm_spec_task *task;
+	uint32_t w, k;
+	size_t i, rerun;
+	int32_t self;
+	int r;
+
+	if (!qcvm || !workers || (!thinks && num_thinks))
+		return QCVM_NULL_POINTER;
+
+	if (qcvm->worker)
+		return QCVM_WORKER_UNSUPPORTED;
+
+	if (!num_workers)
+		return QCVM_ARGUMENT_OUT_OF_RANGE;
+
+	for (w = 0; w < num_workers; w++)
+	{
+		if (!workers[w])
+			return QCVM_NULL_POINTER;
+		if (!workers[w]->worker || workers[w]->worker->parent != qcvm || workers[w]->worker->fork)
+			return QCVM_WORKER_UNSUPPORTED;
+	}
+
+	if ((self = find_self(qcvm)) < 0)
+		return QCVM_INVALID_PROGS;
+
+	/* don't touch the vm unless the whole batch can be committed */
+	if (!spec_batch_matches(workers, num_workers, thinks, num_thinks, flags))
+		return QCVM_ARGUMENT_OUT_OF_RANGE;
+
+	r = QCVM_OK;
+	rerun = 0;
+	k = 0;
+	for (i = 0; i < num_thinks; i++)
+	{
+		k = think_worker(thinks, i, num_thinks, k, num_workers, flags);
+		worker = workers[k]->worker;
+		task = &worker->tasks[worker->commit_cursor++];
+
+		if (task->result == QCVM_OK && spec_still_valid(qcvm, worker, task))
+		{
+			if ((r = spec_apply(qcvm, worker, task)) != QCVM_OK)
+				break;
+			continue;
+		}
+
+		/* it saw something an earlier think changed, so do it over for real */
+		rerun++;
+		if ((func = think_function(qcvm, &thinks[i])) == NULL)
+		{
+			r = QCVM_INVALID_FUNCTION;
+			break;
+		}
+
+		qcvm->globals[self].ui = thinks[i].entity;
+
+		if ((r = run_function(qcvm, func)) != QCVM_OK)
+			break;
+	}
+
+	for (w = 0; w < num_workers; w++)
+		workers[w]->worker->num_tasks = workers[w]->worker->num_log = 0;
+
+	if (num_rerun)
+		*num_rerun = rerun;
+
+	return r;
+}
+
+/*
+ * function analysis
+ *
+ * qcvm_analyze_functions() walks the code of each function once, following
+ * jumps from its first statement, and notes the globals its operands read
+ * and write, the functions it calls and anything that would let it see or
+ * change what another think is doing. a call through a global that nothing
+ * ever writes can only go to one place, so what the callee does is folded
+ * into the caller, over and over until nothing changes. any other call could
+ * go anywhere. all of this errs on the side of calling a function unsafe;
+ * those are still handled by speculation or by running them on the vm.
+ */
+
+#define BIT_TEST(m, i) (((m)[(i) / 32] >> ((i) % 32)) & 1)
+#define BIT_SET(m, i) ((m)[(i) / 32] |= 1u << ((i) % 32))
+#define BIT_CLEAR(m, i) ((m)[(i) / 32] &= ~(1u << ((i) % 32)))
+
+/* a direct call from one qc function to another */
+struct qcvm_call_edge {
+	uint32_t caller;
+	uint32_t callee;
+	uint32_t statement;
+};
+
+/* what the walk needs besides the results */
+struct qcvm_analysis_scratch {
+	int32_t self;
+	uint32_t *shared;
+	uint32_t *written;
+	uint32_t *visited;
+	uint32_t *pointers;
+	uint32_t *clobbered;
+	uint32_t *queue;
+	struct qcvm_call_edge *edges;
+	size_t num_edges;
+	size_t max_edges;
+};
+
+static uint32_t *alloc_bitmap(qcvm_t *qcvm, size_t words)
+{
+	uint32_t *bitmap;
+	size_t i;
+
+	if ((bitmap = qcvm->alloc_callback(qcvm, NULL, (words + 1) * sizeof(uint32_t), qcvm->alloc_callback_user)) == NULL)
+		return NULL;
+
+	for (i = 0; i < words; i++)
+		bitmap[i] = 0;
+
+	return bitmap;
+}
+
+static void free_analysis(qcvm_t *qcvm)
+{
+	struct qcvm_analysis *a = qcvm->analysis;
+
+	if (!a)
+		return;
+
+	if (a->summaries)
+		qcvm->alloc_callback(qcvm, a->summaries, 0, qcvm->alloc_callback_user);
+	if (a->reads)
+		qcvm->alloc_callback(qcvm, a->reads, 0, qcvm->alloc_callback_user);
+	if (a->writes)
+		qcvm->alloc_callback(qcvm, a->writes, 0, qcvm->alloc_callback_user);
+	if (a->calls)
+		qcvm->alloc_callback(qcvm, a->calls, 0, qcvm->alloc_callback_user);
+	if (a->entity_marks)
+		qcvm->alloc_callback(qcvm, a->entity_marks, 0, qcvm->alloc_callback_user);
+	qcvm->alloc_callback(qcvm, a, 0, qcvm->alloc_callback_user);
+	qcvm->analysis = NULL;
+}
+
+/* the builtin a function stands for, if it's been registered */
+static struct qcvm_builtin *function_builtin(qcvm_t *qcvm, struct qcvm_function *func)
+{
+	const char *name;
+	size_t i;
+
+	if (func->first_statement < 0)
+	{
+		i = (size_t)(-1 * func->first_statement) - 1;
+		return i < qcvm->num_builtins ? &qcvm->builtins[i] : NULL;
+	}
+
+	name = str_ofs(qcvm, func->ofs_name);
+	for (i = 0; i < qcvm->num_builtins; i++)
+		if (QCVM_STRCMP(name, qcvm->builtins[i].name) == 0)
+			return &qcvm->builtins[i];
+
+	return NULL;
+}
+
+/* only the first reason found is kept */
+static void set_unsafe(struct qcvm_function_summary *summary, int reason, uint32_t statement, uint32_t callee)
+{
+	if (summary->reason != QCVM_SAFE)
+		return;
+
+	summary->reason = reason;
+	summary->statement = statement;
+	summary->callee = callee;
+}
+
+/* mark the globals qc outside of a function's own frame can see */
+static void find_shared_globals(qcvm_t *qcvm, uint32_t *shared)
+{
+	struct qcvm_function *func;
+	const char *name;
+	int has_names = 0;
+	size_t i, g, n;
+
+	for (i = 0; i < qcvm->num_global_vars && !has_names; i++)
+		if ((name = str_ofs(qcvm, qcvm->global_vars[i].name)) != NULL && *name)
+			has_names = 1;
+
+	/* temporaries and immediates have no names, but stripped progs have none at all */
+	if (has_names)
+	{
+		for (i = 0; i < qcvm->num_global_vars; i++)
+		{
+			if ((name = str_ofs(qcvm, qcvm->global_vars[i].name)) == NULL || !*name)
+				continue;
+
+			n = DEF_TYPE(&qcvm->global_vars[i]) == QCVM_TYPE_VECTOR ? 3 : 1;
+			for (g = qcvm->global_vars[i].ofs; g < qcvm->global_vars[i].ofs + n && g < qcvm->num_globals; g++)
+				BIT_SET(shared, g);
+		}
+	}
+	else
+	{
+		for (g = 0; g < qcvm->num_globals; g++)
+			BIT_SET(shared, g);
+	}
+
+	/* the return value, parms and every function's locals belong to whoever is running */
+	for (g = 0; g < OFS_RESERVED && g < qcvm->num_globals; g++)
+		BIT_CLEAR(shared, g);
+
+	for (i = 1; i < qcvm->num_functions; i++)
+	{
+		func = &qcvm->functions[i];
+		if (func->first_statement < 1 || func->first_parm < 0 || func->num_locals < 0)
+			continue;
+
+		for (g = (size_t)func->first_parm; g < (size_t)func->first_parm + (size_t)func->num_locals && g < qcvm->num_globals; g++)
+			BIT_CLEAR(shared, g);
+	}
+}
+
+/* queue a statement for the walk if it hasn't been yet */
+static int walk_to(qcvm_t *qcvm, struct qcvm_analysis_scratch *w, size_t *num_queue, uint32_t statement)
+{
+	if (statement >= qcvm->num_statements)
+		return 0;
+
+	if (!BIT_TEST(w->visited, statement))
+	{
+		BIT_SET(w->visited, statement);
+		w->queue[(*num_queue)++] = statement;
+	}
+
+	return 1;
+}
+
+static int walk_function(qcvm_t *qcvm, struct qcvm_analysis *a, struct qcvm_analysis_scratch *w, uint32_t f)
+{
+	struct qcvm_function_summary *summary = &a->summaries[f];
+	uint32_t *reads = &a->reads[(size_t)f * a->global_words];
+	uint32_t *writes = &a->writes[(size_t)f * a->global_words];
+	uint32_t *calls = &a->calls[(size_t)f * a->function_words];
+	struct qcvm_statement *statement;
+	uint32_t i, j, g, x, n, callee;
+	size_t k, num_queue = 0;
+	struct qcvm_builtin *builtin;
+	uint8_t access;
+	int r;
+
+	if (!walk_to(qcvm, w, &num_queue, (uint32_t)qcvm->functions[f].first_statement))
+	{
+		set_unsafe(summary, QCVM_UNSAFE_INVALID, 0, 0);
+		return QCVM_OK;
+	}
+
+	for (k = 0; k < num_queue; k++)
+	{
+		i = w->queue[k];
+		statement = &qcvm->statements[i];
+
+		if (statement->opcode >= NUM_OPCODES)
+		{
+			set_unsafe(summary, QCVM_UNSAFE_INVALID, i, 0);
+			continue;
+		}
+
+		/* globals the operands touch */
+		for (j = 0; j < 3; j++)
+		{
+			if ((access = opcode_access[statement->opcode][j]) == ACCESS_NONE)
+				continue;
+
+			g = (uint16_t)statement->vars[j];
+			n = access == ACCESS_READ_VECTOR || access == ACCESS_WRITE_VECTOR ? 3 : 1;
+			if ((size_t)g + n > qcvm->num_globals)
+			{
+				set_unsafe(summary, QCVM_UNSAFE_INVALID, i, 0);
+				continue;
+			}
+
+			for (x = g; x < g + n; x++)
+			{
+				if (access == ACCESS_READ || access == ACCESS_READ_VECTOR)
+				{
+					BIT_SET(reads, x);
+					continue;
+				}
+
+				BIT_SET(writes, x);
+
+				if ((int32_t)x == w->self)
+					set_unsafe(summary, QCVM_UNSAFE_SELF, i, 0);
+				else if (BIT_TEST(w->shared, x))
+					set_unsafe(summary, QCVM_UNSAFE_GLOBAL, i, 0);
+
+				if (statement->opcode != OPCODE_ADDRESS)
+					BIT_SET(w->clobbered, x);
+			}
+		}
+
+		switch (statement->opcode)
+		{
+			case OPCODE_LOAD_F:
+			case OPCODE_LOAD_V:
+			case OPCODE_LOAD_S:
+			case OPCODE_LOAD_ENT:
+			case OPCODE_LOAD_FLD:
+			case OPCODE_LOAD_FNC:
+			case OPCODE_ADDRESS:
+			{
+				if ((int32_t)(uint16_t)statement->vars[0] != w->self)
+					set_unsafe(summary, QCVM_UNSAFE_ENTITY, i, 0);
+
+				if (statement->opcode == OPCODE_ADDRESS && (uint16_t)statement->vars[2] < qcvm->num_globals)
+					BIT_SET(w->pointers, (uint16_t)statement->vars[2]);
+
+				break;
+			}
+
+			case OPCODE_STATE:
+			{
+				set_unsafe(summary, QCVM_UNSAFE_STATE, i, 0);
+				break;
+			}
+
+			case OPCODE_CALL0:
+			case OPCODE_CALL1:
+			case OPCODE_CALL2:
+			case OPCODE_CALL3:
+			case OPCODE_CALL4:
+			case OPCODE_CALL5:
+			case OPCODE_CALL6:
+			case OPCODE_CALL7:
+			case OPCODE_CALL8:
+			{
+				g = (uint16_t)statement->vars[0];
+				if (g >= qcvm->num_globals)
+					break;
+
+				if (BIT_TEST(w->written, g))
+				{
+					set_unsafe(summary, QCVM_UNSAFE_INDIRECT_CALL, i, 0);
+					break;
+				}
+
+				callee = qcvm->globals[g].ui;
+				if (callee < 1 || callee >= qcvm->num_functions)
+				{
+					set_unsafe(summary, QCVM_UNSAFE_INVALID, i, 0);
+					break;
+				}
+
+				BIT_SET(calls, callee);
+
+				if (qcvm->functions[callee].first_statement < 1)
+				{
+					builtin = function_builtin(qcvm, &qcvm->functions[callee]);
+					if (!builtin || !(builtin->flags & QCVM_BUILTIN_THREAD_SAFE))
+						set_unsafe(summary, QCVM_UNSAFE_BUILTIN, i, callee);
+					break;
+				}
+
+				if ((r = grow_buffer(qcvm, (void **)&w->edges, &w->max_edges, w->num_edges + 1, sizeof(struct qcvm_call_edge))) != QCVM_OK)
+					return r;
+
+				w->edges[w->num_edges].caller = f;
+				w->edges[w->num_edges].callee = callee;
+				w->edges[w->num_edges].statement = i;
+				w->num_edges++;
+
+				break;
+			}
+
+			default:
+				break;
+		}
+
+		/* where it can go next */
+		switch (statement->opcode)
+		{
+			case OPCODE_DONE:
+			case OPCODE_RETURN:
+				break;
+
+			case OPCODE_GOTO:
+				if (!walk_to(qcvm, w, &num_queue, i + (uint32_t)(int32_t)statement->vars[0]))
+					set_unsafe(summary, QCVM_UNSAFE_INVALID, i, 0);
+				break;
+
+			case OPCODE_IF:
+			case OPCODE_IFNOT:
+				if (!walk_to(qcvm, w, &num_queue, i + (uint32_t)(int32_t)statement->vars[1]))
+					set_unsafe(summary, QCVM_UNSAFE_INVALID, i, 0);
+				/* fallthrough */
+
+			default:
+				if (!walk_to(qcvm, w, &num_queue, i + 1))
+					set_unsafe(summary, QCVM_UNSAFE_INVALID, i, 0);
+				break;
+		}
+	}
+
+	/* a pointer stored through has to come from taking the address of a field of self */
+	for (k = 0; k < num_queue; k++)
+	{
+		statement = &qcvm->statements[w->queue[k]];
+		if (statement->opcode < OPCODE_STOREP_F || statement->opcode > OPCODE_STOREP_FNC)
+			continue;
+
+		g = (uint16_t)statement->vars[1];
+		if (g >= qcvm->num_globals || !BIT_TEST(w->pointers, g) || BIT_TEST(w->clobbered, g))
+			set_unsafe(summary, QCVM_UNSAFE_POINTER, w->queue[k], 0);
+	}
+
+	/* leave the scratch clean for the next function */
+	for (k = 0; k < num_queue; k++)
+		BIT_CLEAR(w->visited, w->queue[k]);
+	for (k = 0; k < a->global_words; k++)
+		w->pointers[k] = w->clobbered[k] = 0;
+
+	return QCVM_OK;
+}
+
+/* or a callee's bitmap row into its caller's, and say if that added anything */
+static int merge_bitmap(uint32_t *dst, const uint32_t *src, size_t words)
+{
+	int changed = 0;
+	size_t i;
+
+	for (i = 0; i < words; i++)
+	{
+		if ((dst[i] | src[i]) != dst[i])
+		{
+			dst[i] |= src[i];
+			changed = 1;
+		}
+	}
+
+	return changed;
+}
+
+/* fold what every callee can do into its callers until nothing changes */
+static void fold_calls(struct qcvm_analysis *a, struct qcvm_analysis_scratch *w)
+{
+	struct qcvm_call_edge *edge;
+	size_t i, caller, callee;
+	int changed;
+
+	do {
+		changed = 0;
+
+		for (i = 0; i < w->num_edges; i++)
+		{
+			edge = &w->edges[i];
+			caller = edge->caller;
+			callee = edge->callee;
+
+			changed |= merge_bitmap(&a->reads[caller * a->global_words], &a->reads[callee * a->global_words], a->global_words);
+			changed |= merge_bitmap(&a->writes[caller * a->global_words], &a->writes[callee * a->global_words], a->global_words);
+			changed |= merge_bitmap(&a->calls[caller * a->function_words], &a->calls[callee * a->function_words], a->function_words);
+
+			if (a->summaries[callee].reason != QCVM_SAFE && a->summaries[caller].reason == QCVM_SAFE)
+			{
+				set_unsafe(&a->summaries[caller], QCVM_UNSAFE_CALL, edge->statement, edge->callee);
+				changed = 1;
+			}
+		}
+	} while (changed);
+}
+
+int qcvm_analyze_functions(qcvm_t *qcvm)
+{
+	struct qcvm_analysis_scratch w;
+	struct qcvm_statement *statement;
+	struct qcvm_builtin *builtin;
+	struct qcvm_analysis *a;
+	size_t i, j, n, g, num_entities;
+	uint8_t access;
+	int r;
+
+	if (!qcvm)
+		return QCVM_NULL_POINTER;
+
+	if (qcvm->worker)
+		return QCVM_WORKER_UNSUPPORTED;
+
+	if (!qcvm->alloc_callback)
+		return QCVM_OUT_OF_MEMORY;
+
+	free_analysis(qcvm);
+
+	if ((a = qcvm->alloc_callback(qcvm, NULL, sizeof(struct qcvm_analysis), qcvm->alloc_callback_user)) == NULL)
+		return QCVM_OUT_OF_MEMORY;
+
+	num_entities = qcvm->header.num_entity_fields ? qcvm->len_entities / (qcvm->header.num_entity_fields * 4) : 0;
+
+	a->global_words = (uint32_t)((qcvm->num_globals + 31) / 32);
+	a->function_words = (uint32_t)((qcvm->num_functions + 31) / 32);
+	a->num_entities = (uint32_t)num_entities;
+	a->summaries = qcvm->alloc_callback(qcvm, NULL, (qcvm->num_functions + 1) * sizeof(struct qcvm_function_summary), qcvm->alloc_callback_user);
+	a->reads = alloc_bitmap(qcvm, qcvm->num_functions * a->global_words);
+	a->writes = alloc_bitmap(qcvm, qcvm->num_functions * a->global_words);
+	a->calls = alloc_bitmap(qcvm, qcvm->num_functions * a->function_words);
+	a->entity_marks = alloc_bitmap(qcvm, (num_entities + 31) / 32);
+	qcvm->analysis = a;
+
+	w.self = find_self(qcvm);
+	w.shared = alloc_bitmap(qcvm, a->global_words);
+	w.written = alloc_bitmap(qcvm, a->global_words);
+	w.visited = alloc_bitmap(qcvm, (qcvm->num_statements + 31) / 32);
+	w.pointers = alloc_bitmap(qcvm, a->global_words);
+	w.clobbered = alloc_bitmap(qcvm, a->global_words);
+	w.queue = qcvm->alloc_callback(qcvm, NULL, (qcvm->num_statements + 1) * sizeof(uint32_t), qcvm->alloc_callback_user);
+	w.edges = NULL;
+	w.num_edges = w.max_edges = 0;
+
+	if (!a->summaries || !a->reads || !a->writes || !a->calls || !a->entity_marks || !w.shared || !w.written || !w.visited || !w.pointers || !w.clobbered || !w.queue)
+	{
+		r = QCVM_OUT_OF_MEMORY;
+		goto done;
+	}
+
+	find_shared_globals(qcvm, w.shared);
+
+	/* a global nothing writes keeps the value it was loaded with */
+	for (i = 0; i < qcvm->num_statements; i++)
+	{
+		statement = &qcvm->statements[i];
+		if (statement->opcode >= NUM_OPCODES)
+			continue;
+
+		for (j = 0; j < 3; j++)
+		{
+			access = opcode_access[statement->opcode][j];
+			if (access != ACCESS_WRITE && access != ACCESS_WRITE_VECTOR)
+				continue;
+
+			n = access == ACCESS_WRITE_VECTOR ? 3 : 1;
+			for (g = (uint16_t)statement->vars[j]; g < (size_t)(uint16_t)statement->vars[j] + n && g < qcvm->num_globals; g++)
+				BIT_SET(w.written, g);
+		}
+	}
+
+	for (i = 0; i < qcvm->num_functions; i++)
+	{
+		a->summaries[i].reason = QCVM_SAFE;
+		a->summaries[i].statement = 0;
+		a->summaries[i].callee = 0;
+
+		if (i == 0)
+		{
+			set_unsafe(&a->summaries[i], QCVM_UNSAFE_INVALID, 0, 0);
+		}
+		else if (qcvm->functions[i].first_statement < 1)
+		{
+			builtin = function_builtin(qcvm, &qcvm->functions[i]);
+			if (!builtin || !(builtin->flags & QCVM_BUILTIN_THREAD_SAFE))
+				set_unsafe(&a->summaries[i], QCVM_UNSAFE_BUILTIN, 0, (uint32_t)i);
+		}
+		else if ((r = walk_function(qcvm, a, &w, (uint32_t)i)) != QCVM_OK)
+		{
+			goto done;
+		}
+	}
+
+	fold_calls(a, &w);
+
+	r = QCVM_OK;
+
+done:
+	if (w.shared)
+		qcvm->alloc_callback(qcvm, w.shared, 0, qcvm->alloc_callback_user);
+	if (w.written)
+		qcvm->alloc_callback(qcvm, w.written, 0, qcvm->alloc_callback_user);
+	if (w.visited)
+		qcvm->alloc_callback(qcvm, w.visited, 0, qcvm->alloc_callback_user);
+	if (w.pointers)
+		qcvm->alloc_callback(qcvm, w.pointers, 0, qcvm->alloc_callback_user);
+	if (w.clobbered)
+		qcvm->alloc_callback(qcvm, w.clobbered, 0, qcvm->alloc_callback_user);
+	if (w.queue)
+		qcvm->alloc_callback(qcvm, w.queue, 0, qcvm->alloc_callback_user);
+	if (w.edges)
+		qcvm->alloc_callback(qcvm, w.edges, 0, qcvm->alloc_callback_user);
+
+	if (r != QCVM_OK)
+		free_analysis(qcvm);
+
+	return r;
+}
+
+int qcvm_query_function_safety(qcvm_t *qcvm, uint32_t function, int *reason, uint32_t *statement, uint32_t *callee)
+{
+	struct qcvm_function_summary *summary;
+
+	if (!qcvm)
+		return QCVM_NULL_POINTER;
+
+	if (!qcvm->analysis)
+		return QCVM_NOT_ANALYZED;
+
+	if (function >= qcvm->num_functions)
+		return QCVM_INVALID_FUNCTION;
+
+	summary = &qcvm->analysis->summaries[function];
+
+	if (reason)
+		*reason = summary->reason;
+
+	if (statement)
+		*statement = summary->statement;
+
+	if (callee)
+		*callee = summary->callee;
+
+	return QCVM_OK;
+}
+
+int qcvm_query_function_access(qcvm_t *qcvm, uint32_t function, const uint32_t **reads, const uint32_t **writes, const uint32_t **calls)
+{
+	struct qcvm_analysis *a;
+
+	if (!qcvm)
+		return QCVM_NULL_POINTER;
+
+	if ((a = qcvm->analysis) == NULL)
+		return QCVM_NOT_ANALYZED;
+
+	if (function >= qcvm->num_functions)
+		return QCVM_INVALID_FUNCTION;
+
+	if (reads)
+		*reads = &a->reads[(size_t)function * a->global_words];
+
+	if (writes)
+		*writes = &a->writes[(size_t)function * a->global_words];
+
+	if (calls)
+		*calls = &a->calls[(size_t)function * a->function_words];
+
+	return QCVM_OK;
+}
+
+int qcvm_schedule_thinks(qcvm_t *qcvm, const struct qcvm_think *thinks, size_t num_thinks, size_t *batch_len, int *parallel)
+{
+	struct qcvm_analysis *a;
+	size_t i, n;
+
+	if (!qcvm || !batch_len || (!thinks && num_thinks))
+		return QCVM_NULL_POINTER;
+
+	if ((a = qcvm->analysis) == NULL)
+		return QCVM_NOT_ANALYZED;
+
+	/* safe thinks on entities not already in the batch */
+	for (n = 0; n < num_thinks; n++)
+	{
+		if (!think_function(qcvm, &thinks[n]) || a->summaries[thinks[n].function].reason != QCVM_SAFE)
+			break;
+
+		if (thinks[n].entity >= a->num_entities || BIT_TEST(a->entity_marks, thinks[n].entity))
+			break;
+
+		BIT_SET(a->entity_marks, thinks[n].entity);
+	}
+
+	for (i = 0; i < n; i++)
+		BIT_CLEAR(a->entity_marks, thinks[i].entity);
+
+	*batch_len = n ? n : (num_thinks ? 1 : 0);
+
+	if (parallel)
+		*parallel = n > 0;
+
+	return QCVM_OK;
+}
+
+/*
+ * publishing
+ *
+ * qc always runs on the vm's own entities. besides those there's a ring of
+ * copies, each with a list of the pages written since it was last brought up
+ * to date. writes only go on a list for the current frame, which qcvm_publish()
+ * hands on to every copy before updating one of them, so the cost of a write
+ * stays the same however many copies there are, and the cost of a publish
+ * depends on how much changed rather than on how many entities there are.
+ */
+
+/* a published copy of the entities */
+struct qcvm_publish_buffer {
+	void *entities;
+	uint32_t epoch;
+	uint32_t *stale;
+	uint32_t *pages;
+	size_t num_pages;
+};
+
+struct qcvm_publisher {
+	struct qcvm_publish_buffer *buffers;
+	uint32_t num_buffers;
+	uint32_t current;
+	uint32_t epoch;
+	size_t num_pages;
+	size_t last_copied;
+	uint32_t *frame_bits;
+	uint32_t *frame_pages;
+	size_t num_frame_pages;
+};
+
+/* note pages that were written during this frame */
+static void mark_published_pages(qcvm_t *qcvm, size_t ofs, size_t len)
+{
+	struct qcvm_publisher *pub = qcvm->publisher;
+	size_t page, last;
+
+	if (!len || ofs >= qcvm->len_entities)
+		return;
+
+	page = ofs / SNAPSHOT_PAGE_SIZE;
+	last = (ofs + len - 1) / SNAPSHOT_PAGE_SIZE;
+	if (last >= pub->num_pages)
+		last = pub->num_pages - 1;
+
+	for (; page <= last; page++)
+	{
+		if (BIT_TEST(pub->frame_bits, page))
+			continue;
+
+		BIT_SET(pub->frame_bits, page);
+		pub->frame_pages[pub->num_frame_pages++] = (uint32_t)page;
+	}
+}
+
+static void free_publisher(qcvm_t *qcvm)
+{
+	struct qcvm_publisher *pub = qcvm->publisher;
+	uint32_t i;
+
+	if (!pub)
+		return;
+
+	if (pub->buffers)
+	{
+		for (i = 0; i < pub->num_buffers; i++)
+		{
+			if (pub->buffers[i].entities)
+				qcvm->alloc_callback(qcvm, pub->buffers[i].entities, 0, qcvm->alloc_callback_user);
+			if (pub->buffers[i].stale)
+				qcvm->alloc_callback(qcvm, pub->buffers[i].stale, 0, qcvm->alloc_callback_user);
+			if (pub->buffers[i].pages)
+				qcvm->alloc_callback(qcvm, pub->buffers[i].pages, 0, qcvm->alloc_callback_user);
+		}
+		qcvm->alloc_callback(qcvm, pub->buffers, 0, qcvm->alloc_callback_user);
+	}
+	if (pub->frame_bits)
+		qcvm->alloc_callback(qcvm, pub->frame_bits, 0, qcvm->alloc_callback_user);
+	if (pub->frame_pages)
+		qcvm->alloc_callback(qcvm, pub->frame_pages, 0, qcvm->alloc_callback_user);
+	qcvm->alloc_callback(qcvm, pub, 0, qcvm->alloc_callback_user);
+	qcvm->publisher = NULL;
+}
+
+int qcvm_enable_publishing(qcvm_t *qcvm, uint32_t num_buffers)
+{
+	struct qcvm_publisher *pub;
+	struct qcvm_publish_buffer *buffer;
+	size_t num_pages;
+	uint32_t i;
+
+	if (!qcvm)
+		return QCVM_NULL_POINTER;
+
+	if (qcvm->worker)
+		return QCVM_WORKER_UNSUPPORTED;
+
+	free_publisher(qcvm);
+
+	if (!num_buffers)
+		return QCVM_OK;
+
+	if (num_buffers < 2)
+		return QCVM_ARGUMENT_OUT_OF_RANGE;
+
+	if (!qcvm->entities || !qcvm->len_entities)
+		return QCVM_NO_ENTITIES;
+
+	if (!qcvm->alloc_callback)
+		return QCVM_OUT_OF_MEMORY;
+
+	if ((pub = qcvm->alloc_callback(qcvm, NULL, sizeof(struct qcvm_publisher), qcvm->alloc_callback_user)) == NULL)
+		return QCVM_OUT_OF_MEMORY;
+
+	num_pages = (qcvm->len_entities + SNAPSHOT_PAGE_SIZE - 1) / SNAPSHOT_PAGE_SIZE;
+
+	pub->num_buffers = num_buffers;
+	pub->current = num_buffers;
+	pub->epoch = 0;
+	pub->num_pages = num_pages;
+	pub->last_copied = 0;
+	pub->num_frame_pages = 0;
+	pub->buffers = qcvm->alloc_callback(qcvm, NULL, num_buffers * sizeof(struct qcvm_publish_buffer), qcvm->alloc_callback_user);
+	pub->frame_bits = alloc_bitmap(qcvm, (num_pages + 31) / 32);
+	pub->frame_pages = qcvm->alloc_callback(qcvm, NULL, num_pages * sizeof(uint32_t), qcvm->alloc_callback_user);
+	qcvm->publisher = pub;
+
+	if (!pub->buffers || !pub->frame_bits || !pub->frame_pages)
+	{
+		if (!pub->buffers)
+			pub->num_buffers = 0;
+		free_publisher(qcvm);
+		return QCVM_OUT_OF_MEMORY;
+	}
+
+	for (i = 0; i < num_buffers; i++)
+	{
+		buffer = &pub->buffers[i];
+		buffer->epoch = 0;
+		buffer->num_pages = 0;
+		buffer->entities = qcvm->alloc_callback(qcvm, NULL, qcvm->len_entities, qcvm->alloc_callback_user);
+		buffer->stale = alloc_bitmap(qcvm, (num_pages + 31) / 32);
+		buffer->pages = qcvm->alloc_callback(qcvm, NULL, num_pages * sizeof(uint32_t), qcvm->alloc_callback_user);
+
+		if (!buffer->entities || !buffer->stale || !buffer->pages)
+		{
+			pub->num_buffers = i + 1;
+			free_publisher(qcvm);
+			return QCVM_OUT_OF_MEMORY;
+		}
+
+		/* the only full copy there is */
+		QCVM_MEMCPY(buffer->entities, qcvm->entities, qcvm->len_entities);
+	}
+
+	return QCVM_OK;
+}
+
+int qcvm_publish(qcvm_t *qcvm, uint32_t oldest_read, const void **entities, uint32_t *epoch)
+{
+	struct qcvm_publisher *pub;
+	struct qcvm_publish_buffer *buffer;
+	size_t i, page, valid;
+	uint32_t b, target;
+
+	if (!qcvm)
+		return QCVM_NULL_POINTER;
+
+	if ((pub = qcvm->publisher) == NULL)
+		return QCVM_NOT_PUBLISHING;
+
+	if (qcvm->stack_depth > 0)
+		return QCVM_EXECUTION_IN_PROGRESS;
+
+	/* the oldest copy nobody is reading anymore */
+	target = pub->num_buffers;
+	for (b = 0; b < pub->num_buffers; b++)
+	{
+		if (b == pub->current || (pub->buffers[b].epoch && pub->buffers[b].epoch >= oldest_read))
+			continue;
+
+		if (target == pub->num_buffers || pub->buffers[b].epoch < pub->buffers[target].epoch)
+			target = b;
+	}
+
+	if (target == pub->num_buffers)
+		return QCVM_PUBLISH_BLOCKED;
+
+	/* every copy missed this frame's writes */
+	for (b = 0; b < pub->num_buffers; b++)
+	{
+		buffer = &pub->buffers[b];
+
+		for (i = 0; i < pub->num_frame_pages; i++)
+		{
+			page = pub->frame_pages[i];
+			if (BIT_TEST(buffer->stale, page))
+				continue;
+
+			BIT_SET(buffer->stale, page);
+			buffer->pages[buffer->num_pages++] = (uint32_t)page;
+		}
+	}
+
+	for (i = 0; i < pub->num_frame_pages; i++)
+		BIT_CLEAR(pub->frame_bits, pub->frame_pages[i]);
+	pub->num_frame_pages = 0;
+
+	/* bring the target up to date */
+	buffer = &pub->buffers[target];
+	for (i = 0; i < buffer->num_pages; i++)
+	{
+		page = buffer->pages[i];
+
+		valid = qcvm->len_entities - page * SNAPSHOT_PAGE_SIZE;
+		if (valid > SNAPSHOT_PAGE_SIZE)
+			valid = SNAPSHOT_PAGE_SIZE;
+
+		QCVM_MEMCPY((uint8_t *)buffer->entities + page * SNAPSHOT_PAGE_SIZE, (uint8_t *)qcvm->entities + page * SNAPSHOT_PAGE_SIZE, valid);
+		BIT_CLEAR(buffer->stale, page);
+	}
+
+	pub->last_copied = buffer->num_pages;
+	buffer->num_pages = 0;
+	buffer->epoch = ++pub->epoch;
+	pub->current = target;
+
+	if (entities)
+		*entities = buffer->entities;
+
+	if (epoch)
+		*epoch = buffer->epoch;
+
+	return QCVM_OK;
+}
+
+int qcvm_query_publish_info(qcvm_t *qcvm, uint32_t *epoch, size_t *num_pages)
+{
+	if (!qcvm)
+		return QCVM_NULL_POINTER;
+
+	if (!qcvm->publisher)
+		return QCVM_NOT_PUBLISHING;
+
+	if (epoch)
+		*epoch = qcvm->publisher->epoch;
+
+	if (num_pages)
+		*num_pages = qcvm->publisher->last_copied;
+
+	return QCVM_OK;
+}
+
+/*
+ * scheduler
+ *
+ * every core keeps its instances in a heap ordered by when their next tick
+ * is due, under a lock of its own. a core takes the top of its own heap when
+ * it's due, touching no other core's lock, or the most overdue top of any
+ * other heap when it isn't, and the instance stays with whichever core ticked
+ * it last. an instance is in no heap while it ticks, so no two threads can
+ * ever tick it at once, and whatever it holds is handed between cores by
+ * their locks. queries take every lock, in order. budgets are paid with credit:
+ * every due tick adds a budget's worth, up to one budget, and every tick
+ * costs the statements it ran. an instance in debt skips its ticks.
+ */
+
+struct qcvm_sched_core {
+	uint32_t *heap;
+	size_t num_heap;
+	uint64_t ticks;
+	uint64_t statements;
+	uint64_t busy;
+	uint64_t steals;
+};
+
+#define SCHED_LOCK(s, c) do { if ((s)->lock_callback) (s)->lock_callback((s), (c), 1, (s)->lock_callback_user); } while (0)
+#define SCHED_UNLOCK(s, c) do { if ((s)->lock_callback) (s)->lock_callback((s), (c), 0, (s)->lock_callback_user); } while (0)
+#define SCHED_DUE(s, i) ((s)->instances[(i)].next_tick)
+
+static void sched_push(qcvm_sched_t *sched, struct qcvm_sched_core *core, uint32_t instance)
+{
+	size_t i, parent;
+
+	i = core->num_heap++;
+	while (i > 0)
+	{
+		parent = (i - 1) / 2;
+		if (SCHED_DUE(sched, core->heap[parent]) <= SCHED_DUE(sched, instance))
+			break;
+		core->heap[i] = core->heap[parent];
+		i = parent;
+	}
+
+	core->heap[i] = instance;
+}
+
+static uint32_t sched_pop(qcvm_sched_t *sched, struct qcvm_sched_core *core)
+{
+	uint32_t top, last;
+	size_t i, child;
+
+	top = core->heap[0];
+	last = core->heap[--core->num_heap];
+
+	i = 0;
+	while ((child = i * 2 + 1) < core->num_heap)
+	{
+		if (child + 1 < core->num_heap && SCHED_DUE(sched, core->heap[child + 1]) < SCHED_DUE(sched, core->heap[child]))
+			child++;
+		if (SCHED_DUE(sched, last) <= SCHED_DUE(sched, core->heap[child]))
+			break;
+		core->heap[i] = core->heap[child];
+		i = child;
+	}
+
+	if (core->num_heap)
+		core->heap[i] = last;
+
+	return top;
+}
+
+/* take every core's lock, always in the same order */
+static void sched_lock_all(qcvm_sched_t *sched)
+{
+	uint32_t c;
+
+	for (c = 0; c < sched->num_cores; c++)
+		SCHED_LOCK(sched, c);
+}
+
+static void sched_unlock_all(qcvm_sched_t *sched)
+{
+	uint32_t c;
+
+	for (c = sched->num_cores; c-- > 0;)
+		SCHED_UNLOCK(sched, c);
+}
+
+int qcvm_sched_init(qcvm_sched_t *sched)
+{
+	struct qcvm_sched_instance *instance;
+	uint64_t now;
+	uint32_t c;
+	size_t i;
+
+	if (!sched || (!sched->instances && sched->num_instances))
+		return QCVM_NULL_POINTER;
+
+	if (!sched->tick_callback || !sched->clock_callback)
+		return QCVM_NULL_POINTER;
+
+	if (!sched->num_cores || sched->num_instances > UINT32_MAX)
+		return QCVM_ARGUMENT_OUT_OF_RANGE;
+
+	/* several threads can't share the heaps without it */
+	if (sched->num_cores > 1 && !sched->lock_callback)
+		return QCVM_NULL_POINTER;
+
+	if (!sched->alloc_callback)
+		return QCVM_OUT_OF_MEMORY;
+
+	if ((sched->cores = sched->alloc_callback(sched, NULL, sched->num_cores * sizeof(struct qcvm_sched_core), sched->alloc_callback_user)) == NULL)
+		return QCVM_OUT_OF_MEMORY;
+
+	/* any core might end up with every instance */
+	for (c = 0; c < sched->num_cores; c++)
+	{
+		sched->cores[c].num_heap = 0;
+		sched->cores[c].ticks = sched->cores[c].statements = 0;
+		sched->cores[c].busy = sched->cores[c].steals = 0;
+		sched->cores[c].heap = sched->alloc_callback(sched, NULL, (sched->num_instances + 1) * sizeof(uint32_t), sched->alloc_callback_user);
+		if (!sched->cores[c].heap)
+		{
+			sched->num_cores = c;
+			qcvm_sched_shutdown(sched);
+			return QCVM_OUT_OF_MEMORY;
+		}
+	}
+
+	now = sched->clock_callback(sched->clock_callback_user);
+
+	for (i = 0; i < sched->num_instances; i++)
+	{
+		instance = &sched->instances[i];
+		if (!instance->qcvm)
+		{
+			qcvm_sched_shutdown(sched);
+			return QCVM_NULL_POINTER;
+		}
+
+		instance->next_tick = now;
+		instance->credit = 0;
+		instance->core = (uint32_t)(i % sched->num_cores);
+		instance->ticks = instance->skipped = 0;
+		instance->statements = instance->busy = 0;
+
+		sched_push(sched, &sched->cores[instance->core], (uint32_t)i);
+	}
+
+	return QCVM_OK;
+}
+
+int qcvm_sched_shutdown(qcvm_sched_t *sched)
+{
+	uint32_t c;
+
+	if (!sched)
+		return QCVM_NULL_POINTER;
+
+	if (!sched->cores)
+		return QCVM_OK;
+
+	for (c = 0; c < sched->num_cores; c++)
+		if (sched->cores[c].heap)
+			sched->alloc_callback(sched, sched->cores[c].heap, 0, sched->alloc_callback_user);
+
+	sched->alloc_callback(sched, sched->cores, 0, sched->alloc_callback_user);
+	sched->cores = NULL;
+
+	return QCVM_OK;
+}
+
+int qcvm_sched_run(qcvm_sched_t *sched, uint32_t core, int *ran, uint64_t *next)
+{
+	struct qcvm_sched_instance *instance;
+	struct qcvm_sched_core *own, *from;
+	uint64_t now, start, statements, elapsed, due, earliest;
+	uint32_t c, i, victim;
+	int r, stolen;
+
+	if (!sched || !ran)
+		return QCVM_NULL_POINTER;
+
+	if (!sched->cores)
+		return QCVM_NULL_POINTER;
+
+	if (core >= sched->num_cores)
+		return QCVM_ARGUMENT_OUT_OF_RANGE;
+
+	*ran = 0;
+	own = &sched->cores[core];
+	i = UINT32_MAX;
+	stolen = 0;
+	earliest = UINT64_MAX;
+
+	now = sched->clock_callback(sched->clock_callback_user);
+
+	/* this core's own work first, which only needs its own lock */
+	SCHED_LOCK(sched, core);
+	if (own->num_heap)
+	{
+		if (SCHED_DUE(sched, own->heap[0]) <= now)
+			i = sched_pop(sched, own);
+		else
+			earliest = SCHED_DUE(sched, own->heap[0]);
+	}
+	SCHED_UNLOCK(sched, core);
+
+	/* then the most overdue work anywhere else */
+	if (i == UINT32_MAX)
+	{
+		victim = UINT32_MAX;
+		for (c = 0; c < sched->num_cores; c++)
+		{
+			if (c == core)
+				continue;
+
+			SCHED_LOCK(sched, c);
+			if (sched->cores[c].num_heap)
+			{
+				due = SCHED_DUE(sched, sched->cores[c].heap[0]);
+				if (due <= now && (victim == UINT32_MAX || due < SCHED_DUE(sched, sched->cores[victim].heap[0])))
+					victim = c;
+				if (due < earliest)
+					earliest = due;
+			}
+			SCHED_UNLOCK(sched, c);
+		}
+
+		if (victim != UINT32_MAX)
+		{
+			/* another core may have taken it in the meantime */
+			from = &sched->cores[victim];
+			SCHED_LOCK(sched, victim);
+			if (from->num_heap && SCHED_DUE(sched, from->heap[0]) <= now)
+			{
+				i = sched_pop(sched, from);
+				sched->instances[i].core = core;
+				stolen = 1;
+			}
+			SCHED_UNLOCK(sched, victim);
+
+			if (i == UINT32_MAX)
+				earliest = now;
+		}
+	}
+
+	if (i == UINT32_MAX)
+	{
+		/* nothing to do until the earliest tick anywhere */
+		if (next)
+			*next = earliest;
+		return QCVM_OK;
+	}
+
+	instance = &sched->instances[i];
+
+	/* pay into the instance's credit, and skip the tick if it's still in debt */
+	r = QCVM_OK;
+	statements = elapsed = 0;
+	if (instance->budget)
+	{
+		instance->credit += (int64_t)instance->budget;
+		if (instance->credit > (int64_t)instance->budget)
+			instance->credit = (int64_t)instance->budget;
+	}
+
+	if (instance->credit >= 0)
+	{
+		statements = instance->qcvm->statements_run;
+		start = sched->clock_callback(sched->clock_callback_user);
+
+		r = sched->tick_callback(instance->qcvm, now, sched->tick_callback_user);
+
+		elapsed = sched->clock_callback(sched->clock_callback_user) - start;
+		statements = instance->qcvm->statements_run - statements;
+
+		if (instance->budget)
+			instance->credit -= (int64_t)statements;
+
+		*ran = 1;
+	}
+
+	/* a late instance gets one tick now, not every one it missed */
+	instance->next_tick += instance->period;
+	if (instance->next_tick < now)
+		instance->next_tick = now;
+
+	SCHED_LOCK(sched, core);
+
+	if (stolen)
+		own->steals++;
+
+	if (*ran)
+	{
+		instance->ticks++;
+		instance->statements += statements;
+		instance->busy += elapsed;
+		own->ticks++;
+		own->statements += statements;
+		own->busy += elapsed;
+	}
+	else
+	{
+		instance->skipped++;
+	}
+
+	sched_push(sched, own, i);
+
+	SCHED_UNLOCK(sched, core);
+
+	if (next)
+		*next = now;
+
+	return r;
+}
+
+int qcvm_sched_query_instance(qcvm_sched_t *sched, size_t instance, uint64_t *ticks, uint64_t *skipped, uint64_t *statements, uint64_t *busy, uint32_t *core)
+{
+	struct qcvm_sched_instance *inst;
+
+	if (!sched)
+		return QCVM_NULL_POINTER;
+
+	if (instance >= sched->num_instances)
+		return QCVM_ARGUMENT_OUT_OF_RANGE;
+
+	inst = &sched->instances[instance];
+
+	sched_lock_all(sched);
+
+	if (ticks)
+		*ticks = inst->ticks;
+
+	if (skipped)
+		*skipped = inst->skipped;
+
+	if (statements)
+		*statements = inst->statements;
+
+	if (busy)
+		*busy = inst->busy;
+
+	if (core)
+		*core = inst->core;
+
+	sched_unlock_all(sched);
+
+	return QCVM_OK;
+}
+
+int qcvm_sched_query_core(qcvm_sched_t *sched, uint32_t core, uint64_t *ticks, uint64_t *statements, uint64_t *busy, uint64_t *steals, size_t *num_instances)
+{
+	struct qcvm_sched_core *c;
+	size_t i, n;
+
+	if (!sched || !sched->cores)
+		return QCVM_NULL_POINTER;
+
+	if (core >= sched->num_cores)
+		return QCVM_ARGUMENT_OUT_OF_RANGE;
+
+	c = &sched->cores[core];
+
+	/* instances move between cores under either core's lock */
+	sched_lock_all(sched);
+
+	if (ticks)
+		*ticks = c->ticks;
+
+	if (statements)
+		*statements = c->statements;
+
+	if (busy)
+		*busy = c->busy;
+
+	if (steals)
+		*steals = c->steals;
+
+	/* counting the ones ticking right now too */
+	if (num_instances)
+	{
+		for (i = n = 0; i < sched->num_instances; i++)
+			if (sched->instances[i].core == core)
+				n++;
+		*num_instances = n;
+	}
+
+	sched_unlock_all(sched);
+
+	return QCVM_OK;
+}
+
+/*
+ * pools
+ *
+ * a pristine vm keeps a full copy of its state, laid out like a snapshot
+ * that saved every page but kept out of the snapshot list. the write barrier
+ * and worker joins note every page written since, the same way published
+ * copies do, and a reset throws away whatever was in progress and copies
+ * back just those pages. free vms in a pool are chained through the vms
+ * themselves.
+ */
+
+/* note pages written since the vm was marked pristine */
+static void mark_pristine_pages(qcvm_t *qcvm, size_t ofs, size_t len)
+{
+	size_t page, last;
+
+	if (!len || ofs >= qcvm->len_entities)
+		return;
+
+	page = ofs / SNAPSHOT_PAGE_SIZE;
+	last = (ofs + len - 1) / SNAPSHOT_PAGE_SIZE;
+	if (last >= qcvm->pristine->num_pages)
+		last = qcvm->pristine->num_pages - 1;
+
+	for (; page <= last; page++)
+	{
+		if (BIT_TEST(qcvm->pristine_bits, page))
+			continue;
+
+		BIT_SET(qcvm->pristine_bits, page);
+		qcvm->pristine_pages[qcvm->num_pristine_pages++] = (uint32_t)page;
+	}
+}
+
+int qcvm_mark_pristine(qcvm_t *qcvm)
+{
+	struct qcvm_snapshot *snap;
+	size_t page, num_pages;
+	int r;
+
+	if (!qcvm)
+		return QCVM_NULL_POINTER;
+
+	if (qcvm->worker)
+		return QCVM_WORKER_UNSUPPORTED;
+
+	if (!qcvm->entities)
+		return QCVM_NO_ENTITIES;
+
+	if (qcvm->stack_depth > 0)
+		return QCVM_EXECUTION_IN_PROGRESS;
+
+	if (!qcvm->alloc_callback)
+		return QCVM_OUT_OF_MEMORY;
+
+	if (!qcvm->pristine)
+	{
+		if ((snap = qcvm->alloc_callback(qcvm, NULL, sizeof(struct qcvm_snapshot), qcvm->alloc_callback_user)) == NULL)
+			return QCVM_OUT_OF_MEMORY;
+		snap->globals = NULL;
+		snap->pages = NULL;
+		snap->page_data = NULL;
+		snap->max_pages = 0;
+		snap->tempstrings = NULL;
+		snap->max_tempstrings = 0;
+		qcvm->pristine = snap;
+	}
+
+	/* an id of zero means there's nothing to go back to yet */
+	snap = qcvm->pristine;
+	snap->id = 0;
+	snap->num_pages = 0;
+
+	/* nothing is written until the copy is done */
+	if (qcvm->pristine_bits)
+		qcvm->alloc_callback(qcvm, qcvm->pristine_bits, 0, qcvm->alloc_callback_user);
+	if (qcvm->pristine_pages)
+		qcvm->alloc_callback(qcvm, qcvm->pristine_pages, 0, qcvm->alloc_callback_user);
+	qcvm->pristine_bits = qcvm->pristine_pages = NULL;
+	qcvm->num_pristine_pages = 0;
+
+	if (!snap->globals)
+	{
+		snap->globals = qcvm->alloc_callback(qcvm, NULL, qcvm->num_globals * sizeof(union qcvm_global), qcvm->alloc_callback_user);
+		if (!snap->globals)
+			return QCVM_OUT_OF_MEMORY;
+	}
+
+	QCVM_MEMCPY(snap->globals, qcvm->globals, qcvm->num_globals * sizeof(union qcvm_global));
+
+	if ((r = save_snapshot_tempstrings(qcvm, snap)) != QCVM_OK)
+		return r;
+
+	num_pages = (qcvm->len_entities + SNAPSHOT_PAGE_SIZE - 1) / SNAPSHOT_PAGE_SIZE;
+	for (page = 0; page < num_pages; page++)
+		if ((r = save_page(qcvm, snap, page)) != QCVM_OK)
+			return r;
+
+	if ((qcvm->pristine_pages = qcvm->alloc_callback(qcvm, NULL, num_pages * sizeof(uint32_t), qcvm->alloc_callback_user)) == NULL)
+		return QCVM_OUT_OF_MEMORY;
+	if ((qcvm->pristine_bits = qcvm->alloc_callback(qcvm, NULL, (num_pages + 31) / 32 * sizeof(uint32_t), qcvm->alloc_callback_user)) == NULL)
+		return QCVM_OUT_OF_MEMORY;
+	for (page = 0; page < (num_pages + 31) / 32; page++)
+		qcvm->pristine_bits[page] = 0;
+
+	snap->id = 1;
+
+	return QCVM_OK;
+}
+
+int qcvm_reset(qcvm_t *qcvm)
+{
+	struct qcvm_snapshot *snap;
+	size_t ofs, valid, i;
+	uint32_t p;
+
+	if (!qcvm)
+		return QCVM_NULL_POINTER;
+
+	if (qcvm->worker)
+		return QCVM_WORKER_UNSUPPORTED;
+
+	if (!qcvm->pristine || !qcvm->pristine->id)
+		return QCVM_SNAPSHOT_NOT_FOUND;
+
+	snap = qcvm->pristine;
+
+	/* the host swapped the entities for a buffer of another size */
+	if ((size_t)snap->num_pages != (qcvm->len_entities + SNAPSHOT_PAGE_SIZE - 1) / SNAPSHOT_PAGE_SIZE)
+		return QCVM_ARGUMENT_OUT_OF_RANGE;
+
+	/* whatever was running is gone, with its locals */
+	qcvm->stack_depth = qcvm->local_stack_used = 0;
+	qcvm->exit_depth = 0;
+	qcvm->xstack.function = NULL;
+	qcvm->xstack.statement = 0;
+
+	/* and so is any history of it */
+	free_checkpoint(qcvm);
+	qcvm->num_snapshots = 0;
+
+	for (i = 0; i < qcvm->num_pristine_pages; i++)
+	{
+		p = qcvm->pristine_pages[i];
+		BIT_CLEAR(qcvm->pristine_bits, p);
+
+		ofs = (size_t)p * SNAPSHOT_PAGE_SIZE;
+		valid = qcvm->len_entities - ofs;
+		if (valid > SNAPSHOT_PAGE_SIZE)
+			valid = SNAPSHOT_PAGE_SIZE;
+
+		QCVM_MEMCPY((uint8_t *)qcvm->entities + ofs, &snap->page_data[ofs], valid);
+
+		if (qcvm->dirty_fields)
+			mark_dirty_fields(qcvm, ofs, valid);
+		if (qcvm->publisher)
+			mark_published_pages(qcvm, ofs, valid);
+	}
+	qcvm->num_pristine_pages = 0;
+
+	QCVM_MEMCPY(qcvm->globals, snap->globals, qcvm->num_globals * sizeof(union qcvm_global));
+
+	restore_snapshot_tempstrings(qcvm, snap);
+
+	/* entity memory just changed under the zone string collector */
+	if (qcvm->zone_gc_phase == ZONE_GC_MARK)
+		qcvm->zone_gc_phase = ZONE_GC_IDLE;
+
+	return QCVM_OK;
+}
+
+int qcvm_pool_init(qcvm_pool_t *pool)
+{
+	size_t i;
+	int r;
+
+	if (!pool || (!pool->instances && pool->num_instances))
+		return QCVM_NULL_POINTER;
+
+	pool->free = NULL;
+	pool->num_free = 0;
+
+	for (i = pool->num_instances; i-- > 0;)
+	{
+		if (!pool->instances[i])
+			return QCVM_NULL_POINTER;
+
+		if ((r = qcvm_mark_pristine(pool->instances[i])) != QCVM_OK)
+			return r;
+
+		pool->instances[i]->pool_next = pool->free;
+		pool->free = pool->instances[i];
+		pool->num_free++;
+	}
+
+	return QCVM_OK;
+}
+
+int qcvm_pool_acquire(qcvm_pool_t *pool, qcvm_t **qcvm)
+{
+	if (!pool || !qcvm)
+		return QCVM_NULL_POINTER;
+
+	if (!pool->free)
+		return QCVM_POOL_EMPTY;
+
+	*qcvm = pool->free;
+	pool->free = (*qcvm)->pool_next;
+	(*qcvm)->pool_next = NULL;
+	pool->num_free--;
+
+	return QCVM_OK;
+}
+
+int qcvm_pool_release(qcvm_pool_t *pool, qcvm_t *qcvm)
+{
+	int r;
+
+	if (!pool || !qcvm)
+		return QCVM_NULL_POINTER;
+
+	if ((r = qcvm_reset(qcvm)) != QCVM_OK)
+		return r;
+
+	qcvm->pool_next = pool->free;
+	pool->free = qcvm;
+	pool->num_free++;
+
+	return QCVM_OK;
+}
+
+int qcvm_pool_query_info(qcvm_pool_t *pool, size_t *num_free)
+{
+	if (!pool)
+		return QCVM_NULL_POINTER;
+
+	if (num_free)
+		*num_free = pool->num_free;
+
+	return QCVM_OK;
+}
+
+/*
+ * forks
+ *
+ * a fork is a worker that never stops speculating. its globals are a copy,
+ * and its entity accesses go through the same word log speculative thinks
+ * use, so the shared entities act as a copy-on-write base for it. committing
+ * a fork is committing that log as a single think.
+ */
+
+/* drop everything a fork did, and start it from the vm as it is now */
+static int rewind_fork(qcvm_t *qcvm, qcvm_t *fork)
+{
+	struct qcvm_worker *w = fork->worker;
+	size_t i;
+
+	for (i = 0; i < w->num_touched_globals; i++)
+		w->global_flags[w->touched_globals[i]] = 0;
+	w->num_touched_globals = 0;
+
+	for (i = 0; i < w->num_words; i++)
+		w->word_slots[w->words[i].slot] = 0;
+	w->num_words = 0;
+
+	w->num_tasks = w->num_log = 0;
+
+	QCVM_MEMCPY(fork->globals, qcvm->globals, qcvm->num_globals * sizeof(union qcvm_global));
+	share_string_heaps(fork, qcvm);
+
+	fork->stack_depth = fork->local_stack_used = 0;
+	fork->exit_depth = 0;
+	qcvm_tempstrings_begin_frame(fork);
+
+	w->speculating = 1;
+
+	return spec_begin(fork);
+}
+
+int qcvm_fork(qcvm_t *qcvm, qcvm_t *fork)
+{
+	int r;
+
+	if (!qcvm || !fork)
+		return QCVM_NULL_POINTER;
+
+	if (qcvm->worker)
+		return QCVM_WORKER_UNSUPPORTED;
+
+	if (!fork->worker || !fork->worker->fork || fork->worker->parent != qcvm)
+	{
+		if ((r = qcvm_init_worker(qcvm, fork)) != QCVM_OK)
+			return r;
+		fork->worker->fork = 1;
+	}
+
+	if ((r = rewind_fork(qcvm, fork)) != QCVM_OK)
+	{
+		qcvm_shutdown(fork);
+		return r;
+	}
+
+	return QCVM_OK;
+}
+
+int qcvm_commit_fork(qcvm_t *qcvm, qcvm_t *fork)
+{
+	struct qcvm_worker *w;
+	struct qcvm_spec_task *task;
+	int r;
+
+	if (!qcvm || !fork)
+		return QCVM_NULL_POINTER;
+
+	if (qcvm->worker || !fork->worker || !fork->worker->fork || fork->worker->parent != qcvm)
+		return QCVM_WORKER_UNSUPPORTED;
+
+	w = fork->worker;
 
-		default:
-		{
-			return QCVM_INVALID_OPCODE;
-		}
+	/* its tempstrings go away with it */
+	r = (fork->current_tempstrings_block || fork->tempstrings_used > 1) ? QCVM_NO_TEMPSTRINGS : QCVM_OK;
+
+	w->num_tasks = w->num_log = 0;
+	if ((r = spec_finish(fork, 0, r)) == QCVM_OK)
+	{
+		task = &w->tasks[0];
+		if (task->result != QCVM_OK)
+			r = task->result;
+		else if (!spec_still_valid(qcvm, w, task))
+			r = QCVM_FORK_CONFLICT;
+		else
+			r = spec_apply(qcvm, w, task);
 	}
 
-	return QCVM_OK;
+	rewind_fork(qcvm, fork);
+
+	return r;
 }
 
-int qcvm_run(qcvm_t *qcvm, const char *name)
+int qcvm_get_fork_fields(qcvm_t *fork, uint32_t e, uint32_t ofs, uint32_t count, uint32_t *fields)
 {
-	int r, running;
-	uint32_t i;
+	struct qcvm_worker *w;
+	size_t word;
+	uint32_t i, h, mask;
 
-	if (!qcvm || !name)
+	if (!fork || (!fields && count))
 		return QCVM_NULL_POINTER;
 
-	/* save exit depth */
-	qcvm->exit_depth = qcvm->stack_depth;
+	if (!fork->worker || !fork->worker->fork)
+		return QCVM_WORKER_UNSUPPORTED;
 
-	/* load function */
-	if ((r = qcvm_load(qcvm, name)) != QCVM_OK)
-		return r;
+	if (ofs > fork->header.num_entity_fields || count > fork->header.num_entity_fields - ofs)
+		return QCVM_ARGUMENT_OUT_OF_RANGE;
 
-	/* start stepping through function */
-	r = QCVM_OK;
-	running = 1;
-	while (running)
+	word = (size_t)e * fork->header.num_entity_fields + ofs;
+	if (word + count > fork->len_entities / 4)
+		return QCVM_ARGUMENT_OUT_OF_RANGE;
+
+	w = fork->worker;
+	mask = w->num_word_slots - 1;
+
+	for (i = 0; i < count; i++, word++)
 	{
-		r = qcvm_step(qcvm);
+		fields[i] = ((uint32_t *)fork->entities)[word];
 
-		switch (r)
+		/* the fork's own value, if it has touched this word */
+		if (w->num_word_slots)
 		{
-			/* step went ok, proceed to next */
-			case QCVM_OK:
-				break;
-
-			/* parse builtin call */
-			case QCVM_BUILTIN_CALL:
+			for (h = ((uint32_t)word * 2654435761u) & mask; w->word_slots[h]; h = (h + 1) & mask)
 			{
-				if (qcvm->next_function->first_statement == 0)
-				{
-					const char *name = str_ofs(qcvm, qcvm->next_function->ofs_name);
-
-					/* search for named builtin */
-					for (i = 0; i < qcvm->num_builtins; i++)
-					{
-						if (QCVM_STRCMP(name, qcvm->builtins[i].name) == 0)
-						{
-							qcvm->builtins[i].func(qcvm, qcvm->builtins[i].user);
-							qcvm->next_function->first_statement = -1 * (i + 1);
-							r = QCVM_OK;
-							break;
-						}
-					}
-				}
-				else if (qcvm->next_function->first_statement < 0)
+				if (w->words[w->word_slots[h] - 1].word == word)
 				{
-					/* get builtin by index */
-					int builtin = (-1 * qcvm->next_function->first_statement) - 1;
-
-					/* check bounds */
-					if (builtin < 0 || builtin >= (int)qcvm->num_builtins)
-					{
-						r = QCVM_BUILTIN_NOT_FOUND;
-					}
-					else
-					{
-						qcvm->builtins[builtin].func(qcvm, qcvm->builtins[builtin].user);
-						r = QCVM_OK;
-					}
-				}
-
-				/* its error */
-				if (r != QCVM_OK)
-					return r;
-				else
+					fields[i] = w->words[w->word_slots[h] - 1].value;
 					break;
+				}
 			}
-
-			/* parse state call */
-			case QCVM_STATE_CALL:
-				if (qcvm->state_callback)
-					if ((r = qcvm->state_callback(qcvm, qcvm->eval[0]->f, qcvm->eval[1]->func, qcvm->state_callback_user)) != QCVM_OK)
-						return r;
-				break;
-
-			/* execution finished */
-			case QCVM_EXECUTION_FINISHED:
-				return QCVM_OK;
-
-			/* something else happened */
-			default:
-				return r;
 		}
 	}
 
-	return r;
+	return QCVM_OK;
 }
 
-int qcvm_return_string(qcvm_t *qcvm, const char *s)
-{
-	char *tempstrings_end;
-	size_t len;
+/*
+ * channels
+ *
+ * every instance has a bounded queue that any thread can send to and only
+ * its own vm receives from. each slot has a sequence number telling whose
+ * turn it is: a sender claims the next position by bumping the tail, fills
+ * in the slot and hands it over by advancing the sequence, and the receiver
+ * hands it back a lap later. nothing waits on anything.
+ */
+
+/* compilers with the __atomic builtins define the memory orders as macros */
+#if defined(__ATOMIC_ACQUIRE) && defined(__ATOMIC_RELEASE)
+#define CHANNEL_ATOMICS 1
+#define ATOMIC_LOAD(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define ATOMIC_STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define ATOMIC_CAS(p, e, d) __atomic_compare_exchange_n((p), (e), (d), 1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+#define ATOMIC_ADD(p, n) __atomic_fetch_add((p), (n), __ATOMIC_RELAXED)
+#else
+#define CHANNEL_ATOMICS 0
+#define ATOMIC_LOAD(p) (*(p))
+#define ATOMIC_STORE(p, v) (*(p) = (v))
+#define ATOMIC_CAS(p, e, d) (*(p) == *(e) ? (*(p) = (d), 1) : (*(e) = *(p), 0))
+#define ATOMIC_ADD(p, n) (*(p) += (n))
+#endif
 
-	if (!qcvm)
-		return QCVM_NULL_POINTER;
+#define CHANNEL_LOCK(c) do { if (!CHANNEL_ATOMICS && (c)->lock_callback) (c)->lock_callback((c), 1, (c)->lock_callback_user); } while (0)
+#define CHANNEL_UNLOCK(c) do { if (!CHANNEL_ATOMICS && (c)->lock_callback) (c)->lock_callback((c), 0, (c)->lock_callback_user); } while (0)
 
-	if (!qcvm->tempstrings || !qcvm->tempstrings_ptr || qcvm->len_tempstrings <= 1)
-		return QCVM_NO_TEMPSTRINGS;
+struct qcvm_mailbox_slot {
+	uint32_t seq;
+	struct qcvm_message message;
+};
 
-	/* end of tempstrings buffer */
-	tempstrings_end = qcvm->tempstrings + qcvm->len_tempstrings;
+/* the senders' end and the receiver's end are kept on different cache lines */
+struct qcvm_mailbox {
+	struct qcvm_mailbox_slot *slots;
+	uint32_t mask;
+	uint32_t tail;
+	uint32_t dropped;
+	uint8_t pad[64];
+	uint32_t head;
+};
 
-	/* get string len */
-	len = QCVM_STRLEN(s);
+static int mailbox_push(qcvm_channel_t *channel, struct qcvm_mailbox *box, const struct qcvm_message *message)
+{
+	struct qcvm_mailbox_slot *slot;
+	uint32_t pos, seq;
 
-	/* check tempstrings bounds */
-	if (qcvm->tempstrings_ptr + len >= tempstrings_end)
-		qcvm->tempstrings_ptr = qcvm->tempstrings + 1;
+	CHANNEL_LOCK(channel);
 
-	/* return offset */
-	qcvm->globals[OFS_RETURN].i = -1 * (int32_t)(qcvm->tempstrings_ptr - qcvm->tempstrings);
-	qcvm->globals[OFS_RETURN + 1].i = 0;
-	qcvm->globals[OFS_RETURN + 2].i = 0;
+	pos = ATOMIC_LOAD(&box->tail);
+	for (;;)
+	{
+		slot = &box->slots[pos & box->mask];
+		seq = ATOMIC_LOAD(&slot->seq);
+
+		/* free for this lap, if no other sender gets to it first */
+		if (seq == pos)
+		{
+			if (ATOMIC_CAS(&box->tail, &pos, pos + 1))
+				break;
+		}
+		else if ((int32_t)(seq - pos) < 0)
+		{
+			/* the receiver hasn't got to it yet */
+			ATOMIC_ADD(&box->dropped, 1);
+			CHANNEL_UNLOCK(channel);
+			return QCVM_QUEUE_FULL;
+		}
+		else
+		{
+			pos = ATOMIC_LOAD(&box->tail);
+		}
+	}
 
-	/* bootleg strncpy */
-	while (*s != '\0' && qcvm->tempstrings_ptr < tempstrings_end)
-		*qcvm->tempstrings_ptr++ = *s++;
+	slot->message = *message;
+	ATOMIC_STORE(&slot->seq, pos + 1);
 
-	*qcvm->tempstrings_ptr = '\0';
+	CHANNEL_UNLOCK(channel);
 
 	return QCVM_OK;
 }
 
-int qcvm_return_float(qcvm_t *qcvm, float f)
+static int mailbox_pop(qcvm_channel_t *channel, struct qcvm_mailbox *box, struct qcvm_message *message)
 {
-	if (!qcvm)
-		return QCVM_NULL_POINTER;
+	struct qcvm_mailbox_slot *slot = &box->slots[box->head & box->mask];
 
-	qcvm->globals[OFS_RETURN].f = f;
-	qcvm->globals[OFS_RETURN + 1].f = 0;
-	qcvm->globals[OFS_RETURN + 2].f = 0;
+	CHANNEL_LOCK(channel);
 
-	return QCVM_OK;
-}
+	/* claimed but not filled in yet counts as empty */
+	if (ATOMIC_LOAD(&slot->seq) != box->head + 1)
+	{
+		CHANNEL_UNLOCK(channel);
+		return 0;
+	}
 
-int qcvm_return_vector(qcvm_t *qcvm, float x, float y, float z)
-{
-	if (!qcvm)
-		return QCVM_NULL_POINTER;
+	*message = slot->message;
+	ATOMIC_STORE(&slot->seq, box->head + box->mask + 1);
+	ATOMIC_STORE(&box->head, box->head + 1);
 
-	qcvm->globals[OFS_RETURN].f = x;
-	qcvm->globals[OFS_RETURN + 1].f = y;
-	qcvm->globals[OFS_RETURN + 2].f = z;
+	CHANNEL_UNLOCK(channel);
 
-	return QCVM_OK;
+	return 1;
 }
 
-int qcvm_return_entity(qcvm_t *qcvm, uint32_t e)
+int qcvm_channel_init(qcvm_channel_t *channel)
 {
-	if (!qcvm)
+	struct qcvm_mailbox *box;
+	uint32_t len, i;
+	size_t n;
+
+	if (!channel || (!channel->instances && channel->num_instances))
 		return QCVM_NULL_POINTER;
 
-	qcvm->globals[OFS_RETURN].ui = e;
-	qcvm->globals[OFS_RETURN + 1].ui = 0;
-	qcvm->globals[OFS_RETURN + 2].ui = 0;
+	if (!channel->alloc_callback)
+		return QCVM_OUT_OF_MEMORY;
 
-	return QCVM_OK;
-}
+	for (n = 0; n < channel->num_instances; n++)
+		if (!channel->instances[n])
+			return QCVM_NULL_POINTER;
 
-int qcvm_query_argument_count(qcvm_t *qcvm, int *argc)
-{
-	if (!qcvm)
+	/* without atomics the queues are only safe under the host's lock */
+	if (!CHANNEL_ATOMICS && !channel->lock_callback)
 		return QCVM_NULL_POINTER;
 
-	if (argc)
-		*argc = qcvm->current_argc;
+	for (len = 2; len < channel->queue_len && len < 0x80000000u; len *= 2);
 
-	return QCVM_OK;
-}
+	channel->mailboxes = NULL;
+	if (!channel->num_instances)
+		return QCVM_OK;
 
-int qcvm_get_return_float(qcvm_t *qcvm, float *f)
-{
-	if (!qcvm)
-		return QCVM_NULL_POINTER;
+	if ((channel->mailboxes = channel->alloc_callback(channel, NULL, channel->num_instances * sizeof(struct qcvm_mailbox), channel->alloc_callback_user)) == NULL)
+		return QCVM_OUT_OF_MEMORY;
 
-	if (f)
-		*f = qcvm->globals[OFS_RETURN].f;
+	for (n = 0; n < channel->num_instances; n++)
+		channel->mailboxes[n].slots = NULL;
+
+	for (n = 0; n < channel->num_instances; n++)
+	{
+		box = &channel->mailboxes[n];
+		if ((box->slots = channel->alloc_callback(channel, NULL, len * sizeof(struct qcvm_mailbox_slot), channel->alloc_callback_user)) == NULL)
+		{
+			qcvm_channel_shutdown(channel);
+			return QCVM_OUT_OF_MEMORY;
+		}
+
+		for (i = 0; i < len; i++)
+			box->slots[i].seq = i;
+		box->mask = len - 1;
+		box->tail = box->head = box->dropped = 0;
+
+		channel->instances[n]->channel = channel;
+		channel->instances[n]->channel_address = (uint32_t)n;
+	}
 
 	return QCVM_OK;
 }
 
-int qcvm_get_return_vector(qcvm_t *qcvm, float *x, float *y, float *z)
+int qcvm_channel_shutdown(qcvm_channel_t *channel)
 {
-	if (!qcvm)
+	size_t n;
+
+	if (!channel)
 		return QCVM_NULL_POINTER;
 
-	if (x)
-		*x = qcvm->globals[OFS_RETURN].f;
+	if (!channel->mailboxes)
+		return QCVM_OK;
 
-	if (y)
-		*y = qcvm->globals[OFS_RETURN + 1].f;
+	for (n = 0; n < channel->num_instances; n++)
+	{
+		if (channel->mailboxes[n].slots)
+			channel->alloc_callback(channel, channel->mailboxes[n].slots, 0, channel->alloc_callback_user);
 
-	if (z)
-		*z = qcvm->globals[OFS_RETURN + 2].f;
+		if (channel->instances[n] && channel->instances[n]->channel == channel)
+			channel->instances[n]->channel = NULL;
+	}
+
+	channel->alloc_callback(channel, channel->mailboxes, 0, channel->alloc_callback_user);
+	channel->mailboxes = NULL;
 
 	return QCVM_OK;
 }
 
-int qcvm_get_return_int(qcvm_t *qcvm, int *i)
+int qcvm_send_message(qcvm_channel_t *channel, uint32_t to, const struct qcvm_message *message)
 {
-	if (!qcvm)
+	if (!channel || !message)
 		return QCVM_NULL_POINTER;
 
-	if (i)
-		*i = qcvm->globals[OFS_RETURN].i;
+	if (!channel->mailboxes || to >= channel->num_instances)
+		return QCVM_ARGUMENT_OUT_OF_RANGE;
 
-	return QCVM_OK;
+	return mailbox_push(channel, &channel->mailboxes[to], message);
 }
 
-int qcvm_get_return_entity(qcvm_t *qcvm, uint32_t *e)
+int qcvm_dispatch_messages(qcvm_t *qcvm, const char *handler, size_t max, size_t *num_dispatched)
 {
-	if (!qcvm)
+	struct qcvm_mailbox *box;
+	struct qcvm_message message;
+	uint32_t func, pending, g;
+	size_t i, len;
+	int32_t handle;
+	char *buf;
+	int r;
+
+	if (num_dispatched)
+		*num_dispatched = 0;
+
+	if (!qcvm || !handler)
 		return QCVM_NULL_POINTER;
 
-	if (e)
-		*e = qcvm->globals[OFS_RETURN].ui;
+	if (!qcvm->channel || !qcvm->channel->mailboxes)
+		return QCVM_NOT_IN_CHANNEL;
 
-	return QCVM_OK;
+	if ((r = find_function(qcvm, handler, &func)) != QCVM_OK)
+		return r;
+
+	/* only what's waiting now, so a handler sending to its own vm can't keep it here */
+	box = &qcvm->channel->mailboxes[qcvm->channel_address];
+	pending = ATOMIC_LOAD(&box->tail) - box->head;
+	if (!max || max > pending)
+		max = pending;
+
+	for (i = 0; i < max && mailbox_pop(qcvm->channel, box, &message); i++)
+	{
+		for (g = OFS_PARM0; g < OFS_PARM6; g++)
+			qcvm->globals[g].i = 0;
+
+		qcvm->globals[OFS_PARM0].f = (float)message.from;
+		qcvm->globals[OFS_PARM1].f = message.tag;
+
+		switch (message.type)
+		{
+			case QCVM_MESSAGE_FLOAT:
+				qcvm->globals[OFS_PARM2].f = message.value.f;
+				break;
+
+			case QCVM_MESSAGE_VECTOR:
+				qcvm->globals[OFS_PARM3].f = message.value.v[0];
+				qcvm->globals[OFS_PARM3 + 1].f = message.value.v[1];
+				qcvm->globals[OFS_PARM3 + 2].f = message.value.v[2];
+				break;
+
+			case QCVM_MESSAGE_STRING:
+				message.value.s[QCVM_MESSAGE_STRING_SIZE - 1] = '\0';
+				len = QCVM_STRLEN(message.value.s);
+				if ((r = alloc_tempstring(qcvm, len, &buf, &handle)) != QCVM_OK)
+					break;
+				QCVM_MEMCPY(buf, message.value.s, len);
+				qcvm->globals[OFS_PARM4].i = handle;
+				break;
+
+			case QCVM_MESSAGE_ENTITY:
+				qcvm->globals[OFS_PARM5].ui = message.value.e;
+				break;
+		}
+
+		if (r != QCVM_OK || (r = run_function(qcvm, &qcvm->functions[func])) != QCVM_OK)
+			break;
+	}
+
+	/* a message that failed was still taken off the queue */
+	if (num_dispatched)
+		*num_dispatched = i < max && r != QCVM_OK ? i + 1 : i;
+
+	return r;
 }
 
-int qcvm_get_argument_string(qcvm_t *qcvm, int i, const char **s)
+int qcvm_query_channel_info(qcvm_channel_t *channel, uint32_t instance, size_t *num_queued, size_t *num_dropped)
 {
-	if (!qcvm)
+	struct qcvm_mailbox *box;
+
+	if (!channel)
 		return QCVM_NULL_POINTER;
 
-	if (i < 0 || i >= 8)
+	if (!channel->mailboxes || instance >= channel->num_instances)
 		return QCVM_ARGUMENT_OUT_OF_RANGE;
 
-	if (s)
-		*s = str_ofs(qcvm, qcvm->globals[OFS_PARM0 + (i * 3)].i);
+	box = &channel->mailboxes[instance];
+
+	if (num_queued)
+		*num_queued = ATOMIC_LOAD(&box->tail) - ATOMIC_LOAD(&box->head);
+
+	if (num_dropped)
+		*num_dropped = ATOMIC_LOAD(&box->dropped);
 
 	return QCVM_OK;
 }
 
-int qcvm_get_argument_float(qcvm_t *qcvm, int i, float *f)
+/* send a message for qc, telling it whether it went */
+static int send_for_qc(qcvm_t *qcvm, struct qcvm_message *message)
 {
-	if (!qcvm)
-		return QCVM_NULL_POINTER;
+	qcvm_t *sender = qcvm->worker ? qcvm->worker->parent : qcvm;
+	float to = qcvm->globals[OFS_PARM0].f;
 
-	if (i < 0 || i >= 8)
-		return QCVM_ARGUMENT_OUT_OF_RANGE;
+	if (!sender->channel || !sender->channel->mailboxes)
+		return qcvm_return_float(qcvm, 0);
 
-	if (f)
-		*f = qcvm->globals[OFS_PARM0 + (i * 3)].f;
+	if (!(to >= 0 && to < (float)sender->channel->num_instances))
+		return qcvm_return_float(qcvm, 0);
 
-	return QCVM_OK;
+	message->from = sender->channel_address;
+	message->tag = qcvm->globals[OFS_PARM1].f;
+
+	return qcvm_return_float(qcvm, mailbox_push(sender->channel, &sender->channel->mailboxes[(uint32_t)to], message) == QCVM_OK);
 }
 
-int qcvm_get_argument_int(qcvm_t *qcvm, int i, int *n)
+int qcvm_builtin_send_float(qcvm_t *qcvm, void *user)
 {
+	struct qcvm_message message;
+
+	(void)user;
+
 	if (!qcvm)
 		return QCVM_NULL_POINTER;
 
-	if (i < 0 || i >= 8)
-		return QCVM_ARGUMENT_OUT_OF_RANGE;
-
-	if (n)
-		*n = qcvm->globals[OFS_PARM0 + (i * 3)].i;
+	message.type = QCVM_MESSAGE_FLOAT;
+	message.value.f = qcvm->globals[OFS_PARM2].f;
 
-	return QCVM_OK;
+	return send_for_qc(qcvm, &message);
 }
 
-int qcvm_get_argument_vector(qcvm_t *qcvm, int i, float *x, float *y, float *z)
+int qcvm_builtin_send_vector(qcvm_t *qcvm, void *user)
 {
+	struct qcvm_message message;
+
+	(void)user;
+
 	if (!qcvm)
 		return QCVM_NULL_POINTER;
 
-	if (i < 0 || i >= 8)
-		return QCVM_ARGUMENT_OUT_OF_RANGE;
+	message.type = QCVM_MESSAGE_VECTOR;
+	message.value.v[0] = qcvm->globals[OFS_PARM2].f;
+	message.value.v[1] = qcvm->globals[OFS_PARM2 + 1].f;
+	message.value.v[2] = qcvm->globals[OFS_PARM2 + 2].f;
 
-	if (x)
-		*x = qcvm->globals[OFS_PARM0 + (i * 3)].f;
+	return send_for_qc(qcvm, &message);
+}
 
-	if (y)
-		*y = qcvm->globals[OFS_PARM0 + (i * 3) + 1].f;
+int qcvm_builtin_send_string(qcvm_t *qcvm, void *user)
+{
+	struct qcvm_message message;
+	const char *s;
+	size_t len;
 
-	if (z)
-		*z = qcvm->globals[OFS_PARM0 + (i * 3) + 2].f;
+	(void)user;
 
-	return QCVM_OK;
+	if (!qcvm)
+		return QCVM_NULL_POINTER;
+
+	/* the string goes in the message, as its handle would mean nothing to the receiver */
+	s = str_ofs_len(qcvm, qcvm->globals[OFS_PARM2].i, &len);
+	if (!s || len >= QCVM_MESSAGE_STRING_SIZE)
+		return qcvm_return_float(qcvm, 0);
+
+	message.type = QCVM_MESSAGE_STRING;
+	QCVM_MEMCPY(message.value.s, s, len);
+	message.value.s[len] = '\0';
+
+	return send_for_qc(qcvm, &message);
 }
 
-int qcvm_get_argument_entity(qcvm_t *qcvm, int i, uint32_t *e)
+int qcvm_builtin_send_entity(qcvm_t *qcvm, void *user)
 {
+	struct qcvm_message message;
+
+	(void)user;
+
 	if (!qcvm)
 		return QCVM_NULL_POINTER;
 
-	if (i < 0 || i >= 8)
-		return QCVM_ARGUMENT_OUT_OF_RANGE;
-
-	if (e)
-		*e = qcvm->globals[OFS_PARM0 + (i * 3)].ui;
+	message.type = QCVM_MESSAGE_ENTITY;
+	message.value.e = qcvm->globals[OFS_PARM2].ui;
 
-	return QCVM_OK;
+	return send_for_qc(qcvm, &message);
 }